@@ -0,0 +1,83 @@
+#include "framebufferpool.h"
+
+#include <algorithm>
+
+struct FrameBufferPool::Block {
+    std::weak_ptr<State> owner;
+    std::size_t size{};
+    std::unique_ptr<uint8_t[]> data;
+};
+
+struct FrameBufferPool::State {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Block>> freeBlocks;
+    std::size_t maxFreeBlocks{};
+};
+
+void FrameBufferPool::AreaBufferDeleter::operator()(int16_t*) const {
+    if(block) {
+        FrameBufferPool::_releaseBlock(block);
+    }
+}
+
+FrameBufferPool::FrameBufferPool(std::size_t maxFreeBlocks)
+    : _state(std::make_shared<State>())
+{
+    _state->maxFreeBlocks = maxFreeBlocks;
+}
+
+FrameBufferPool::~FrameBufferPool() = default;
+
+FrameBufferPool::Block* FrameBufferPool::_acquireBlock(std::size_t nBytes) {
+    {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        auto& freeBlocks = _state->freeBlocks;
+        // smallest free block that fits, but don't burn a block much bigger than needed
+        auto best = freeBlocks.end();
+        for(auto it = freeBlocks.begin(); it != freeBlocks.end(); ++it) {
+            if((*it)->size >= nBytes && (*it)->size <= 2 * nBytes
+                    && (best == freeBlocks.end() || (*it)->size < (*best)->size)) {
+                best = it;
+            }
+        }
+        if(best != freeBlocks.end()) {
+            auto* block = best->release();
+            freeBlocks.erase(best);
+            return block;
+        }
+    }
+    auto* block = new Block;
+    block->owner = _state;
+    block->size = nBytes;
+    block->data = std::make_unique<uint8_t[]>(nBytes);
+    return block;
+}
+
+void FrameBufferPool::_releaseBlock(Block* block) {
+    std::unique_ptr<Block> owned(block);
+    auto state = block->owner.lock();
+    if(!state) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if(state->freeBlocks.size() < state->maxFreeBlocks) {
+        state->freeBlocks.push_back(std::move(owned));
+    }
+}
+
+void FrameBufferPool::_releaseImageBlock(void* block) {
+    _releaseBlock(static_cast<Block*>(block));
+}
+
+FrameBufferPool::AreaBuffer FrameBufferPool::acquireAreaBuffer(std::size_t nElements) {
+    auto* block = _acquireBlock(nElements * sizeof(int16_t));
+    auto* data = reinterpret_cast<int16_t*>(block->data.get());
+    return AreaBuffer(data, AreaBufferDeleter{block});
+}
+
+QImage FrameBufferPool::acquireImage(int width, int height, QImage::Format format) {
+    const int bitsPerPixel = QImage::toPixelFormat(format).bitsPerPixel();
+    const int bytesPerLine = ((width * bitsPerPixel + 31) / 32) * 4;
+    auto* block = _acquireBlock(static_cast<std::size_t>(bytesPerLine) * height);
+    return QImage(block->data.get(), width, height, bytesPerLine, format, &FrameBufferPool::_releaseImageBlock, block);
+}
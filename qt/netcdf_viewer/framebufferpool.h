@@ -0,0 +1,44 @@
+#ifndef FRAMEBUFFERPOOL_H
+#define FRAMEBUFFERPOOL_H
+
+#include <QImage>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Recycles the per-frame storage of the viewer: the int16 area buffers read from the NetCDF file
+// and the pixel memory of the QImages rendered from them. Images wrap pool memory and hand it back
+// when their last copy goes away, so continuous panning runs without fresh allocations.
+// Blocks still alive when the pool is destroyed are simply freed on release.
+class FrameBufferPool
+{
+public:
+    struct Block;
+
+    struct AreaBufferDeleter {
+        Block* block = nullptr;
+        void operator()(int16_t*) const;
+    };
+    using AreaBuffer = std::unique_ptr<int16_t[], AreaBufferDeleter>;
+
+    explicit FrameBufferPool(std::size_t maxFreeBlocks = 8);
+    ~FrameBufferPool();
+
+    FrameBufferPool(const FrameBufferPool&) = delete;
+    FrameBufferPool& operator=(const FrameBufferPool&) = delete;
+
+    AreaBuffer acquireAreaBuffer(std::size_t nElements);
+    QImage acquireImage(int width, int height, QImage::Format format);
+
+private:
+    struct State;
+    Block* _acquireBlock(std::size_t nBytes);
+    static void _releaseBlock(Block* block);
+    static void _releaseImageBlock(void* block);
+
+    std::shared_ptr<State> _state;
+};
+
+#endif // FRAMEBUFFERPOOL_H
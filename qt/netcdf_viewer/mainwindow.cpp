@@ -5,8 +5,14 @@
 #include <iostream>
 #include <algorithm>
 #include <QImage>
+#include <QElapsedTimer>
+#include <QShortcut>
 #include <cmath>
 
+#include "colors.h"
+#include "instrumentation.h"
+#include "reproject.h"
+
 
 
 MainWindow::MainWindow(QWidget *parent)
@@ -14,30 +20,31 @@ MainWindow::MainWindow(QWidget *parent)
     , ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
-    ui->graphicsView->setScene(&_scene);
 
 //    GPS hunGps1{48.64698758285766, 14.999676527732783};
 //    GPS hunGps2{45.50885749858355, 23.417102803214963};
 //    GPS hunGps1{44.6, 15.5};
 
-    createOverviewData();
-
-    connect(ui->graphicsView, SIGNAL(mouse_clicked(int, int)), this, SLOT(on_graphicsview_mouse_clicked(int,int)));
+    connect(ui->rasterView, SIGNAL(mouse_clicked(int, int)), this, SLOT(on_rasterview_mouse_clicked(int,int)));
+    connect(ui->rasterView, SIGNAL(wheel_zoomed(double)), this, SLOT(on_rasterview_wheel_zoomed(double)));
+    connect(new QShortcut(QKeySequence(Qt::Key_F3), this), &QShortcut::activated, this, &MainWindow::toggleFrameStats);
+    connect(new QShortcut(QKeySequence(Qt::Key_F4), this), &QShortcut::activated, this, &MainWindow::toggleWebMercator);
 
     GPS hunGps1{47.162, 19.503};
     ui->latitudeSlider->setValue(hunGps1.lat()*1000);
     ui->longitudeSlider->setValue(hunGps1.lon()*1000);
 
     update();
+    startOverviewLoading();
 }
 
 bool MainWindow::shouldShowEdges() const {
     return ui->edges->isChecked();
 }
 
-void MainWindow::on_graphicsview_mouse_clicked(int x, int y) {
+void MainWindow::on_rasterview_mouse_clicked(int x, int y) {
 //    std::cout << "mouse click pos: " << x << ", " << y << std::endl;
-    if(_areaMode) {
+    if(_areaMode || !_overviewData) {
         return;
     }
     auto xx = static_cast<double>(x);
@@ -50,254 +57,204 @@ void MainWindow::on_graphicsview_mouse_clicked(int x, int y) {
     update();
 }
 
-void MainWindow::createOverviewData() {
-    std::ifstream ifs(_overviewFilename, std::ios::binary);
-    if(!ifs.is_open()) {
-        std::cout << "couldn't open file" << std::endl;
-        return;
-    }
-
-    _overviewData.resize(_overviewWidth * _overviewHeight);
-    ifs.read((char*)_overviewData.data(), _overviewData.size() * sizeof(int16_t));
-}
-
-uint8_t MainWindow::heightToGray(int16_t height, int16_t min, int16_t max) {
-    double t = static_cast<double>(height - min) / (max - min);
-    t = std::clamp(t, 0.0, 1.0);
-    auto value = static_cast<uint8_t>(0.5 + t * 255);
-    return value;
+void MainWindow::startOverviewLoading() {
+    ui->statusbar->showMessage("loading overview...");
+    _overviewLoader = std::thread([this, ncFilename = _ncFilename, factor = _overviewFactor]() {
+        std::shared_ptr<Overview> inMemory;
+        QString error;
+        try {
+            auto ncFile = NcFile::openForRead(ncFilename.c_str());
+            if(!ncFile.overview() || ncFile.overview()->factor != factor) {
+                ThreadPool pool;
+                auto overview = std::make_shared<Overview>(build_overview(ncFile, factor, pool, &_cancelOverviewLoading));
+                if(!store_overview(ncFile, *overview)) {
+                    // e.g. a read-only data directory: use it for this session only
+                    inMemory = std::move(overview);
+                }
+            }
+        } catch(const std::exception& e) {
+            error = e.what();
+        }
+        QMetaObject::invokeMethod(this, [this, inMemory, error]() { onOverviewLoaded(inMemory, error); }, Qt::QueuedConnection);
+    });
 }
 
-QColor MainWindow::heightToColor(int16_t height, int16_t min, int16_t max) {
-    //double blueLimit = _blueLimit;
-    double blueLimit = 0.0;
-    double greenFieldLimit = _greenLimit;
-    double brownFieldLimit = _brownLimit;
-    if(height < blueLimit) {
-        double t = (height - min) / (blueLimit - (double)min);
-        auto val = std::clamp(static_cast<int>(t*255), 0, 255);
-        return QColor(0,0, val);
-    }
-    if(height < greenFieldLimit) {
-        double t = (height - blueLimit) / (greenFieldLimit - blueLimit);
-        t = 0.5 + 0.5 * t;
-        auto val = std::clamp(static_cast<int>(t*255), 0, 255);
-        return QColor(0, val, 0);
-    }
-    if( height < brownFieldLimit) {
-        double t = (height - greenFieldLimit) / (brownFieldLimit - greenFieldLimit);
-        t = 0.2 + 0.5 * t;
-        auto val = std::clamp(static_cast<int>(t*255), 0, 255);
-        return QColor(val, val/4, val/4);
+void MainWindow::onOverviewLoaded(std::shared_ptr<Overview> inMemory, QString error) {
+    if(!error.isEmpty()) {
+        ui->statusbar->showMessage("couldn't load overview: " + error);
+        return;
     }
-
-    double t = (height - brownFieldLimit) / (max - brownFieldLimit);
-    t = 0.5 + 0.5 * t;
-    auto val = std::clamp(static_cast<int>(t*255), 0, 255);
-    return QColor(val, val, val);
-}
-
-QImage MainWindow::createAreaImageGray() {
-
-    GPS gpsCenter{ui->latitudeSlider->value() / 1000.0, ui->longitudeSlider->value() / 1000.0};
-
-    const int w = _areaImageWidth;
-    const int h = _areaImageHeight;
-
-    auto areaData = getDataForCenter(gpsCenter, w, h);
-    return createGrayImageFromAreaData(areaData);
-}
-
-QImage MainWindow::createOverviewImageGray() {
-    QImage img(_overviewWidth, _overviewHeight, QImage::Format_Grayscale8);
-    uint8_t* row = img.bits();
-    size_t bytesPerLine = img.bytesPerLine();
-
-    size_t srcRowSize = _overviewWidth;
-    const int16_t* srcRow = _overviewData.data() + srcRowSize * (_overviewHeight - 1);
-
-    int16_t height_min = ui->heightMin->value();
-    int16_t height_max = ui->heightMax->value();
-
-    for(int y = 0; y < _overviewHeight; ++y, row += bytesPerLine, srcRow -= srcRowSize) {
-        for(int x = 0; x < _overviewWidth; ++x) {
-            auto value = heightToGray(srcRow[x], height_min, height_max);
-            row[x] = value;
+    if(inMemory) {
+        _overviewMemory = std::move(inMemory);
+        _overviewWidth = _overviewMemory->width;
+        _overviewHeight = _overviewMemory->height;
+        _overviewData = _overviewMemory->data.data();
+    } else {
+        auto metadata = NcFileMetadata::load(_ncFilename);
+        if(!metadata || !metadata->overview) {
+            ui->statusbar->showMessage("couldn't load overview");
+            return;
         }
+        _overviewFile.setFileName(QString::fromStdString(NcFileMetadata::overviewPath(_ncFilename)));
+        if(!_overviewFile.open(QIODevice::ReadOnly)) {
+            ui->statusbar->showMessage("couldn't open overview cache");
+            return;
+        }
+        auto* mapped = _overviewFile.map(0, _overviewFile.size());
+        if(!mapped) {
+            ui->statusbar->showMessage("couldn't map overview cache");
+            return;
+        }
+        _overviewWidth = metadata->overview->width;
+        _overviewHeight = metadata->overview->height;
+        _overviewData = reinterpret_cast<const int16_t*>(mapped);
     }
-    return img;
-}
-
-QImage MainWindow::createAreaImageColor() {
-    GPS gpsCenter{ui->latitudeSlider->value() / 1000.0, ui->longitudeSlider->value() / 1000.0};
-    const int w = _areaImageWidth;
-    const int h = _areaImageHeight;
-    return createColorImageFromAreaData(getDataForCenter(gpsCenter, w, h));
+    if(!_levelOfDetail.empty()) {
+        _levelOfDetail.addLevel(makeOverviewLevel());
+    }
+    // overview samples are factor grid cells apart in both directions
+    auto overviewGrid = TerrainGrid::global(_overviewWidth, _overviewHeight);
+    _overviewShade = hillshade_raster(_overviewData, overviewGrid, &_workers);
+    const double originCol = (_overviewFactor - 1) / 2.0;
+    _shadeLevelOfDetail.addLevel(std::make_unique<MemoryLevel>(_overviewShade.data(), _overviewWidth, _overviewHeight,
+                                                               _overviewFactor, 0.0, originCol));
+    update();
 }
 
-QImage MainWindow::createOverviewImageColor() {
-    QImage img(_overviewWidth, _overviewHeight, QImage::Format_RGB888);
-    uint8_t* row = img.bits();
-    size_t bytesPerLine = img.bytesPerLine();
-
-    size_t srcRowSize = _overviewWidth;
-    const int16_t* srcRow = _overviewData.data() + srcRowSize * (_overviewHeight - 1);
-
-    int16_t height_min = ui->heightMin->value();
-    int16_t height_max = ui->heightMax->value();
-
-    for(int y = 0; y < _overviewHeight; ++y, row += bytesPerLine, srcRow -= srcRowSize) {
-        for(int x = 0; x < _overviewWidth; ++x) {
-            auto value = heightToColor(srcRow[x], height_min, height_max);
-            row[3*x] = value.red();
-            row[3*x+1] = value.green();
-            row[3*x+2] = value.blue();
-        }
-    }
-    return img;
+std::unique_ptr<ElevationLevel> MainWindow::makeOverviewLevel() const {
+    // every factor-th row, columns averaged over factor cells
+    const double originCol = (_overviewFactor - 1) / 2.0;
+    return std::make_unique<MemoryLevel>(_overviewData, _overviewWidth, _overviewHeight, _overviewFactor, 0.0, originCol);
 }
 
-AreaData MainWindow::getDataForCenter(GPS gpsCenter, int width, int height) {
+AreaData MainWindow::getDataForCenter(GPS gpsCenter, int width, int height, double gridCellsPerPixel) {
     AreaData result;
     result.width = width;
     result.height= height;
 
     auto& ncFile = getNcFile();
-    auto varId = ncFile.getVarIdByName(_elevationVarName.c_str());
+    auto& levelOfDetail = getLevelOfDetail();
 
     auto dataCols = ncFile.dims().at(0);
     auto dataRows = ncFile.dims().at(1);
 
-    double stepPerDegree = dataCols / 360.0;
-    GpsToOffsetConverter converter(stepPerDegree, dataRows/2, dataCols/2);
+    auto converter = GpsToOffsetConverter::forGrid(dataCols, dataRows);
 
     auto offsetCenter = converter.convert(gpsCenter);
     auto offset = offsetCenter; // south-west corner
-    offset.latLon[0] -= height/2;
-    offset.latLon[1] -= width/2;
+    offset.latLon[0] -= std::min<size_t>(offset.latLon[0], height/2 * gridCellsPerPixel);
+    offset.latLon[1] -= std::min<size_t>(offset.latLon[1], width/2 * gridCellsPerPixel);
     result.southWestOffset = offset;
 
-    size_t offsets[] = {offset.latLon[0], offset.latLon[1]};
-    size_t counts[] = {(size_t)height, (size_t)width};
-
-    auto bufSize = counts[0] * counts[1];
-    result.data = std::make_unique<int16_t[]>(bufSize);
-    ncFile.getInt64Data(result.data.get(), varId, offsets, counts);
-
-    return result;
-}
-
-QImage MainWindow::createColorImageFromAreaData(const AreaData& areaData) {
-    const int w = areaData.width;
-    const int h = areaData.height;
-    QImage img(w, h, QImage::Format_RGB888);
-    uint8_t* row = img.bits();
-    size_t bytesPerLine = img.bytesPerLine();
-
-    int16_t height_min = ui->heightMin->value();
-    int16_t height_max = ui->heightMax->value();
-
-    auto srcLinestep = w;
-    auto* srcRow = areaData.data.get() + srcLinestep * (areaData.height - 1);
-
-    for(int y = 0; y < h; ++y, row += bytesPerLine, srcRow -= srcLinestep) {
-        for(int x = 0; x < w; ++x) {
-            int16_t srcVal = srcRow[x];
-            auto value = heightToColor(srcVal, height_min, height_max);
-            row[3*x] = value.red();
-            row[3*x+1] = value.green();
-            row[3*x+2] = value.blue();
+    result.data = _framePool.acquireAreaBuffer(static_cast<size_t>(width) * height);
+    if(_webMercator) {
+        // square Mercator pixels as wide as gridCellsPerPixel cells; rows south to north like render()
+        const double pixelSize = gridCellsPerPixel * webMercator::worldSize / static_cast<double>(dataCols);
+        const double yBottom = webMercator::yFromLat(gpsCenter.lat()) - 0.5 * height * pixelSize;
+        const double xLeft = webMercator::xFromLon(gpsCenter.lon()) - 0.5 * width * pixelSize;
+        auto rowMap = mercatorRowMap(converter, yBottom, -pixelSize, height);
+        auto colMap = mercatorColMap(converter, xLeft, pixelSize, width);
+        levelOfDetail.renderMapped(rowMap, colMap, gridCellsPerPixel, result.data.get(), &_workers);
+        if(auto* shadeLevels = getShadeLevelOfDetail(gridCellsPerPixel)) {
+            result.shade.resize(static_cast<size_t>(width) * height);
+            shadeLevels->renderMapped(rowMap, colMap, gridCellsPerPixel, result.shade.data(), &_workers);
         }
+        return result;
     }
 
-
-
-    if(shouldShowEdges()) {
-        auto meterPerPixel = 40'000'000.0 / 86'400.0; // on equator
-        double maxGrad = 0.025;
-        auto maxHeightDiff = meterPerPixel * maxGrad;
-        auto* imgData = img.bits();
-        auto* srcData = areaData.data.get();
-        auto imgLinestep = img.bytesPerLine();
-        for(int y = 1; y < h-1; ++y) {
-            for(int x = 1; x < w-1; ++x) {
-                auto srcOffset = y*srcLinestep + x;
-                auto dx = std::abs(srcData[srcOffset + 1] - srcData[srcOffset]);
-                auto dy = std::abs(srcData[srcOffset + srcLinestep] - srcData[srcOffset]);
-                auto maxDelta = std::max(dx, dy);
-
-                auto dstPixOffset = (h-1-y) * imgLinestep + 3*x;
-                auto oldVal = imgData[dstPixOffset];
-                imgData[dstPixOffset] = std::clamp(oldVal + (int)(maxDelta * 10.0), 0, 255);
-                /*if(maxDelta > maxHeightDiff) {
-                    imgData[y * imgLinestep + 3 * x] = 255;
-                }*/
-            }
-        }
+    ViewWindow view;
+    view.centerRow = static_cast<double>(offsetCenter.latLon[0]);
+    view.centerCol = static_cast<double>(offsetCenter.latLon[1]);
+    view.gridCellsPerPixel = gridCellsPerPixel;
+    view.width = width;
+    view.height = height;
+    levelOfDetail.render(view, result.data.get(), &_workers);
+    if(auto* shadeLevels = getShadeLevelOfDetail(gridCellsPerPixel)) {
+        result.shade.resize(static_cast<size_t>(width) * height);
+        shadeLevels->render(view, result.shade.data(), &_workers);
     }
 
-
-    return img;
+    return result;
 }
 
-QImage MainWindow::createGrayImageFromAreaData(const AreaData& areaData) {
-    auto w = areaData.width;
-    auto h = areaData.height;
-    QImage img(w, h, QImage::Format_Grayscale8);
-    uint8_t* row = img.bits();
-    size_t bytesPerLine = img.bytesPerLine();
-
-    int16_t height_min = ui->heightMin->value();
-    int16_t height_max = ui->heightMax->value();
-
-    auto srcLinestep = w;
-    auto* srcRow = areaData.data.get() + srcLinestep * (areaData.height - 1);
-
-    for(int y = 0; y < h; ++y, row += bytesPerLine, srcRow -= srcLinestep) {
-        for(int x = 0; x < w; ++x) {
-            int16_t srcVal = srcRow[x];
-            auto value = heightToGray(srcVal, height_min, height_max);
-            row[x] = value;
+const LevelOfDetail* MainWindow::getShadeLevelOfDetail(double gridCellsPerPixel) {
+    if(!_shadeTilesChecked) {
+        _shadeTilesChecked = true;
+        try {
+            _shadeLevelOfDetail.addLevel(std::make_unique<TileStoreLevel>(hillshadePath(_ncFilename)));
+        } catch(const std::exception&) {
+            // not computed for this file, the overview's hillshade is still there once loaded
         }
     }
-
-
-
-    if(shouldShowEdges()) {
-        auto meterPerPixel = 40'000'000.0 / 86'400.0; // on equator
-        double maxGrad = 0.025;
-        auto maxHeightDiff = meterPerPixel * maxGrad;
-        auto* imgData = img.bits();
-        auto* srcData = areaData.data.get();
-        auto imgLinestep = img.bytesPerLine();
-        for(int y = 1; y < h-1; ++y) {
-            for(int x = 1; x < w-1; ++x) {
-                auto srcOffset = y*srcLinestep + x;
-                auto dx = std::abs(srcData[srcOffset + 1] - srcData[srcOffset]);
-                auto dy = std::abs(srcData[srcOffset + srcLinestep] - srcData[srcOffset]);
-                auto maxDelta = std::max(dx, dy);
-                auto dstPixOffset = (h-1-y) * imgLinestep + x;
-                auto oldVal = imgData[dstPixOffset];
-                imgData[dstPixOffset] = std::clamp(oldVal + (int)(maxDelta * 3.0), 0, 255);
-//                if(maxDelta > maxHeightDiff) {
-//                    imgData[y * imgLinestep + x] = 255;
-//                }
-            }
+    if(_shadeLevelOfDetail.empty()) {
+        return nullptr;
+    }
+    // a level much finer than the view would read too many samples per frame
+    const auto factor = static_cast<double>(_shadeLevelOfDetail.levelFor(gridCellsPerPixel).factor());
+    return gridCellsPerPixel <= 4.0 * factor ? &_shadeLevelOfDetail : nullptr;
+}
+
+LevelOfDetail& MainWindow::getLevelOfDetail() {
+    if(_levelOfDetail.empty()) {
+        auto& ncFile = getNcFile();
+        auto varId = ncFile.getVarIdByName(_elevationVarName.c_str());
+        auto dataCols = ncFile.dims().at(0);
+        auto dataRows = ncFile.dims().at(1);
+        _levelOfDetail.addStridedLevels(ncFile, varId, dataCols, dataRows, 32);
+        if(_overviewData) {
+            _levelOfDetail.addLevel(makeOverviewLevel());
         }
     }
-
-
-
-
-    return img;
+    return _levelOfDetail;
 }
 
 QImage MainWindow::createAreaImage() {
-    return ui->colorMap->isChecked() ? createAreaImageColor() : createAreaImageGray();
+    GPS gpsCenter{ui->latitudeSlider->value() / 1000.0, ui->longitudeSlider->value() / 1000.0};
+    const int w = _areaImageWidth;
+    const int h = _areaImageHeight;
+    auto areaData = getDataForCenter(gpsCenter, w, h, _zoom);
+    const int16_t* shade = areaData.shade.empty() ? nullptr : areaData.shade.data();
+    return colorizeHeights(areaData.data.get(), shade, w, h, shouldShowEdges());
 }
 
 QImage MainWindow::createOverviewImage() {
-    return ui->colorMap->isChecked() ? createOverviewImageColor() : createOverviewImageGray();
+    return colorizeHeights(_overviewData, nullptr, _overviewWidth, _overviewHeight, false);
+}
+
+QImage MainWindow::colorizeHeights(const int16_t* heights, const int16_t* shade, int width, int height, bool edges) {
+    const bool color = ui->colorMap->isChecked();
+    QImage img = _framePool.acquireImage(width, height, color ? QImage::Format_RGB888 : QImage::Format_Grayscale8);
+    const int16_t heightMin = ui->heightMin->value();
+    const int16_t heightMax = ui->heightMax->value();
+
+    RenderOptions options;
+    options.format = color ? PixelFormat::Rgb888 : PixelFormat::Gray8;
+    options.overlay = !edges ? PixelOverlay::None : (shade ? PixelOverlay::Shade : PixelOverlay::Edges);
+    options.flipRows = true;
+    options.edgeGain = color ? 10 : 3;
+    options.shade = shade;
+    options.flatShade = terrainFlatShade;
+
+    NCD_TRACE_SCOPE("colorize");
+    NCD_COUNT(PixelsShaded, static_cast<uint64_t>(width) * height);
+    if(color) {
+        render_heights(heights, width, height, getColorTable(heightMin, heightMax), options, img.bits(), img.bytesPerLine(), &_workers);
+    } else {
+        render_heights(heights, width, height, GrayRamp{heightMin, heightMax}, options, img.bits(), img.bytesPerLine(), &_workers);
+    }
+    return img;
+}
+
+const ColorTable& MainWindow::getColorTable(int16_t heightMin, int16_t heightMax) {
+    const std::array<int, 4> key = {heightMin, heightMax, _greenLimit, _brownLimit};
+    if(_colorTable.empty() || key != _colorTableKey) {
+        NCD_TRACE_SCOPE("color_table");
+        _colorTable = ColorTable::build([&](int16_t height) {
+            return heightToBandedRgb(height, heightMin, heightMax, _greenLimit, _brownLimit);
+        }, &_workers);
+        _colorTableKey = key;
+    }
+    return _colorTable;
 }
 
 
@@ -309,39 +266,103 @@ Offset2D MainWindow::getOverviewOffsetFromGps(const GPS& gps) const {
 
 void MainWindow::update() {
     GPS gpsCenter{ui->latitudeSlider->value() / 1000.0, ui->longitudeSlider->value() / 1000.0};
-    ui->statusbar->showMessage(QString("%1 %2").arg(gpsCenter.lat()).arg(gpsCenter.lon()));
-    if(_areaMode) {
-        updateArea();
+    ui->statusbar->showMessage(QString("%1 %2 zoom 1:%3").arg(gpsCenter.lat()).arg(gpsCenter.lon()).arg(_zoom, 0, 'g', 3));
+
+    QElapsedTimer frameTimer;
+    frameTimer.start();
+    const auto statsBefore = instrumentation::snapshot();
+    {
+        NCD_TRACE_SCOPE("frame");
+        if(_areaMode) {
+            updateArea();
+        } else {
+            updateWorld();
+        }
+    }
+    if(_showFrameStats) {
+        showFrameStats(frameTimer.nsecsElapsed(), instrumentation::difference(instrumentation::snapshot(), statsBefore));
+    }
+}
+
+void MainWindow::toggleFrameStats() {
+    _showFrameStats = !_showFrameStats;
+    if(_showFrameStats) {
+        update();
     } else {
-        updateWorld();
+        ui->rasterView->setOverlayText(QString());
     }
 }
 
-void MainWindow::updateWorld() {
-    _scene.clear();
+void MainWindow::toggleWebMercator() {
+    _webMercator = !_webMercator;
+    update();
+}
+
+void MainWindow::showFrameStats(qint64 frameNs, const instrumentation::Snapshot& frameStats) {
+    QString text = QString("frame %1 ms").arg(frameNs / 1e6, 0, 'f', 2);
+    // the blit happens in the following paint event, it shows up in the next frame's numbers
+    for(const auto& stage : frameStats.stages) {
+        if(stage.count > 0) {
+            text += QString("\n%1 %2 ms").arg(stage.name).arg(stage.totalNs / 1e6, 0, 'f', 2);
+        }
+    }
+    if(instrumentation::enabled()) {
+        text += QString("\n%1 KiB read, %2 chunks, %3 px shaded")
+                .arg(frameStats.counter(instrumentation::Counter::BytesRead) / 1024)
+                .arg(frameStats.counter(instrumentation::Counter::ChunksTouched))
+                .arg(frameStats.counter(instrumentation::Counter::PixelsShaded));
+    }
+    ui->rasterView->setOverlayText(text);
+}
 
-    auto img = createOverviewImage();
+OverviewImageKey MainWindow::currentOverviewImageKey() const {
+    OverviewImageKey key;
+    key.colorMap = ui->colorMap->isChecked();
+    key.heightMin = ui->heightMin->value();
+    key.heightMax = ui->heightMax->value();
+    key.greenLimit = _greenLimit;
+    key.brownLimit = _brownLimit;
+    return key;
+}
 
-    _scene.addPixmap(QPixmap::fromImage(img));
+void MainWindow::updateWorld() {
+    if(!_overviewData) {
+        ui->statusbar->showMessage("loading overview...");
+        ui->rasterView->setImage(QImage());
+        return;
+    }
+    auto key = currentOverviewImageKey();
+    if(_overviewImage.isNull() || key != _overviewImageKey) {
+        _overviewImage = createOverviewImage();
+        _overviewImageKey = key;
+    }
+    ui->rasterView->setImage(_overviewImage);
+    updateMarker();
+}
 
+void MainWindow::updateMarker() {
+    if(_areaMode || !_overviewData) {
+        ui->rasterView->setMarker(std::nullopt);
+        return;
+    }
     GPS gpsCenter{ui->latitudeSlider->value() / 1000.0, ui->longitudeSlider->value() / 1000.0};
     auto targetOffset = getOverviewOffsetFromGps(gpsCenter);
-    double radius = 20.0;
-    auto targetX = targetOffset.latLon[1];
-    auto targetY = (_overviewHeight-1) - targetOffset.latLon[0];
-    _scene.addEllipse(targetX-radius, targetY-radius, radius*2.0, radius*2.0, QPen(QColor(255,0,0)));
+    auto targetX = static_cast<double>(targetOffset.latLon[1]);
+    auto targetY = static_cast<double>((_overviewHeight-1) - targetOffset.latLon[0]);
+    ui->rasterView->setMarker(QPointF(targetX, targetY));
 }
 
 void MainWindow::updateArea() {
-    _scene.clear();
-
-    auto img = createAreaImage();
-
-    _scene.addPixmap(QPixmap::fromImage(img));
+    ui->rasterView->setMarker(std::nullopt);
+    ui->rasterView->setImage(createAreaImage());
 }
 
 MainWindow::~MainWindow()
 {
+    _cancelOverviewLoading = true;
+    if(_overviewLoader.joinable()) {
+        _overviewLoader.join();
+    }
     delete ui;
 }
 
@@ -367,10 +388,21 @@ void MainWindow::on_heightMax_sliderReleased()
 void MainWindow::on_areaMode_toggled(bool checked)
 {
     _areaMode = checked;
+    ui->rasterView->setWheelZoomEnabled(_areaMode);
     update();
 }
 
 
+void MainWindow::on_rasterview_wheel_zoomed(double steps)
+{
+    // four wheel notches per octave
+    _zoom = std::clamp(_zoom * std::pow(2.0, -steps / 4.0), _minZoom, _maxZoom);
+    if(_areaMode) {
+        update();
+    }
+}
+
+
 void MainWindow::on_longitudeSlider_sliderReleased()
 {
     update();
@@ -386,7 +418,7 @@ void MainWindow::on_latitudeSlider_sliderReleased()
 void MainWindow::on_longitudeSlider_valueChanged(int value)
 {
     if(!_areaMode) {
-        updateWorld();
+        updateMarker();
     }
 }
 
@@ -394,7 +426,7 @@ void MainWindow::on_longitudeSlider_valueChanged(int value)
 void MainWindow::on_latitudeSlider_valueChanged(int value)
 {
     if(!_areaMode) {
-        updateWorld();
+        updateMarker();
     }
 }
 
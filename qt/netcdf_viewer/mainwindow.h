@@ -2,10 +2,24 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
-#include <QGraphicsScene>
-#include <mygraphicsview.h>
+#include <QFile>
+#include <QImage>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
 #include <vector>
 
+#include "framebufferpool.h"
+#include "rasterview.h"
+
+#include "LevelOfDetail.h"
+#include "ThreadPool.h"
+#include "instrumentation.h"
+#include "overview.h"
+#include "render_kernel.h"
+#include "terrain_derivatives.h"
+
 #include "NcFile.h"
 #include "gps.h"
 
@@ -13,11 +27,28 @@ QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
 QT_END_NAMESPACE
 
+// Everything the colorized overview depends on; the cached overview image is rebuilt only when it changes
+struct OverviewImageKey {
+    bool colorMap = false;
+    int heightMin{};
+    int heightMax{};
+    int greenLimit{};
+    int brownLimit{};
+
+    bool operator==(const OverviewImageKey& rhs) const {
+        return colorMap == rhs.colorMap && heightMin == rhs.heightMin && heightMax == rhs.heightMax
+                && greenLimit == rhs.greenLimit && brownLimit == rhs.brownLimit;
+    }
+    bool operator!=(const OverviewImageKey& rhs) const { return !(*this == rhs); }
+};
+
 struct AreaData {
     Offset2D southWestOffset;
     int width{};
     int height{};
-    std::unique_ptr<int16_t[]> data;
+    FrameBufferPool::AreaBuffer data;
+    // precomputed hillshade of the same pixels; empty if there is none close to this zoom
+    std::vector<int16_t> shade;
 };
 
 class MainWindow : public QMainWindow
@@ -28,28 +59,37 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
-    void createOverviewData();
+    // Maps the overview cached next to the NetCDF file, building it on a background thread if it's missing
+    void startOverviewLoading();
+    void onOverviewLoaded(std::shared_ptr<Overview> inMemory, QString error);
+    std::unique_ptr<ElevationLevel> makeOverviewLevel() const;
     void update();
     void updateArea();
     void updateWorld();
+    void updateMarker();
+    // F3: per-frame timings over the view; stage timings need NETCDF_DANI_ENABLE_STATS
+    void toggleFrameStats();
+    void showFrameStats(qint64 frameNs, const instrumentation::Snapshot& frameStats);
+    // F4: area mode in Web Mercator instead of the grid's plate carrée
+    void toggleWebMercator();
 
-    uint8_t heightToGray(int16_t height, int16_t min = -12000, int16_t max = 9000);
-    QColor heightToColor(int16_t height, int16_t min = -12000, int16_t max = 9000);
     QImage createAreaImage();
     QImage createOverviewImage();
-
-    QImage createAreaImageGray();
-    QImage createOverviewImageGray();
-    QImage createAreaImageColor();
-    QImage createOverviewImageColor();
-
-    AreaData getDataForCenter(GPS gpsCenter, int width, int height);
+    OverviewImageKey currentOverviewImageKey() const;
+    // Gray or banded color by the colorMap checkbox; heights south to north. shade may be null,
+    // with edges it replaces the per-frame edge overlay.
+    QImage colorizeHeights(const int16_t* heights, const int16_t* shade, int width, int height, bool edges);
+    // The banded colormap of the current sliders, rebuilt when they change
+    const ColorTable& getColorTable(int16_t heightMin, int16_t heightMax);
+
+    // gridCellsPerPixel: 1 is the native resolution, larger values zoom out
+    AreaData getDataForCenter(GPS gpsCenter, int width, int height, double gridCellsPerPixel = 1.0);
+    LevelOfDetail& getLevelOfDetail();
+    // Precomputed hillshade levels; null if none is within 4x of gridCellsPerPixel
+    const LevelOfDetail* getShadeLevelOfDetail(double gridCellsPerPixel);
 
     Offset2D getOverviewOffsetFromGps(const GPS& gps) const;
 
-    QImage createGrayImageFromAreaData(const AreaData& areaData);
-    QImage createColorImageFromAreaData(const AreaData& areaData);
-
     NcFile& getNcFile() /*const*/ {
         if(!_ncFile.has_value()) {
             _ncFile = NcFile::openForRead(_ncFilename.c_str());
@@ -82,30 +122,53 @@ private slots:
 
     void on_brownLimit_valueChanged(int value);
 
-    void on_graphicsview_mouse_clicked(int x, int y);
+    void on_rasterview_mouse_clicked(int x, int y);
+
+    void on_rasterview_wheel_zoomed(double steps);
 
     void on_edges_toggled(bool checked);
 
 private:
     Ui::MainWindow *ui;
 
-    QGraphicsScene _scene;
-    std::vector<int16_t> _overviewData;
-    size_t _overviewWidth = 2160;
-    size_t _overviewHeight = 1080;
-    const std::string _overviewFilename = "C:\\dani\\github\\netcdf-dani\\out16_40_753_2021.raw";
+    FrameBufferPool _framePool;
+    QImage _overviewImage;
+    OverviewImageKey _overviewImageKey;
+    // mapped from the overview cache, or _overviewMemory if the cache couldn't be written; null while loading
+    const int16_t* _overviewData = nullptr;
+    QFile _overviewFile;
+    std::shared_ptr<Overview> _overviewMemory;
+    size_t _overviewWidth = 0;
+    size_t _overviewHeight = 0;
+    const size_t _overviewFactor = 40;
+    std::thread _overviewLoader;
+    std::atomic<bool> _cancelOverviewLoading{false};
 
     bool _areaMode = false;
     const int _areaImageWidth = 1920;
     const int _areaImageHeight = 1080;
+    double _zoom = 1.0; // grid cells per screen pixel in area mode
+    const double _minZoom = 1.0 / 8.0;
+    const double _maxZoom = 64.0;
+
+    bool _showFrameStats = false;
+    bool _webMercator = false;
 
     int _greenLimit = 2000;
     int _brownLimit = 4000;
+    ColorTable _colorTable;
+    std::array<int, 4> _colorTableKey{}; // heightMin, heightMax, _greenLimit, _brownLimit
 
     const std::string _ncFilename = "D:\\data\\geo\\gebco_2023\\GEBCO_2023.nc";
     const std::string _elevationVarName = "elevation";
 
     std::optional<NcFile> _ncFile;
+    LevelOfDetail _levelOfDetail; // refers to _ncFile and _overviewData
+    // the hillshade tile store next to the NetCDF file (see compute_terrain_derivatives) and the overview's hillshade
+    LevelOfDetail _shadeLevelOfDetail;
+    bool _shadeTilesChecked = false;
+    std::vector<int16_t> _overviewShade;
+    ThreadPool _workers;
 };
 
 #endif // MAINWINDOW_H
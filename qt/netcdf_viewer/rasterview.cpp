@@ -0,0 +1,132 @@
+#include "rasterview.h"
+
+#include <QMouseEvent>
+#include <QPainter>
+#include <QScrollBar>
+#include <QWheelEvent>
+
+#include <algorithm>
+
+#include "instrumentation.h"
+
+RasterView::RasterView(QWidget* parent)
+    : QAbstractScrollArea(parent)
+{
+    viewport()->setAttribute(Qt::WA_OpaquePaintEvent);
+}
+
+void RasterView::setImage(QImage image) {
+    if(image.cacheKey() == _image.cacheKey()) {
+        return;
+    }
+    const bool sizeChanged = image.size() != _image.size();
+    _image = std::move(image);
+    if(sizeChanged) {
+        _updateScrollBars();
+    }
+    viewport()->update();
+}
+
+void RasterView::setMarker(std::optional<QPointF> center, double radius) {
+    if(center == _markerCenter && radius == _markerRadius) {
+        return;
+    }
+    viewport()->update(_markerViewportRect());
+    _markerCenter = center;
+    _markerRadius = radius;
+    viewport()->update(_markerViewportRect());
+}
+
+void RasterView::setOverlayText(const QString& text) {
+    if(text == _overlayText) {
+        return;
+    }
+    viewport()->update(_overlayViewportRect());
+    _overlayText = text;
+    viewport()->update(_overlayViewportRect());
+}
+
+QRect RasterView::_overlayViewportRect() const {
+    if(_overlayText.isEmpty()) {
+        return QRect();
+    }
+    const QRect textRect = fontMetrics().boundingRect(QRect(0, 0, viewport()->width(), viewport()->height()),
+                                                      Qt::AlignLeft | Qt::AlignTop, _overlayText);
+    return textRect.translated(4, 4).adjusted(-4, -4, 4, 4);
+}
+
+QPoint RasterView::_imageOrigin() const {
+    // centered while smaller than the viewport, scrolled otherwise
+    const QSize viewportSize = viewport()->size();
+    int x = _image.width() < viewportSize.width() ? (viewportSize.width() - _image.width()) / 2 : -horizontalScrollBar()->value();
+    int y = _image.height() < viewportSize.height() ? (viewportSize.height() - _image.height()) / 2 : -verticalScrollBar()->value();
+    return QPoint(x, y);
+}
+
+QRect RasterView::_markerViewportRect() const {
+    if(!_markerCenter) {
+        return QRect();
+    }
+    const QPointF center = *_markerCenter + _imageOrigin();
+    const double extent = _markerRadius + 2.0; // pen width and antialiasing
+    return QRectF(center.x() - extent, center.y() - extent, 2.0 * extent, 2.0 * extent).toAlignedRect();
+}
+
+void RasterView::_updateScrollBars() {
+    const QSize viewportSize = viewport()->size();
+    horizontalScrollBar()->setPageStep(viewportSize.width());
+    verticalScrollBar()->setPageStep(viewportSize.height());
+    horizontalScrollBar()->setRange(0, std::max(0, _image.width() - viewportSize.width()));
+    verticalScrollBar()->setRange(0, std::max(0, _image.height() - viewportSize.height()));
+}
+
+void RasterView::paintEvent(QPaintEvent* e) {
+    NCD_TRACE_SCOPE("blit");
+    QPainter painter(viewport());
+    const QRect dirty = e->rect();
+    const QPoint origin = _imageOrigin();
+    const QRect imageRect(origin, _image.size());
+
+    painter.fillRect(dirty, palette().window());
+    const QRect imagePart = dirty.intersected(imageRect);
+    if(!imagePart.isEmpty()) {
+        painter.drawImage(imagePart.topLeft(), _image, imagePart.translated(-origin));
+    }
+
+    if(_markerCenter && dirty.intersects(_markerViewportRect())) {
+        painter.setRenderHint(QPainter::Antialiasing);
+        painter.setPen(QPen(QColor(255, 0, 0)));
+        painter.setBrush(Qt::NoBrush);
+        painter.drawEllipse(*_markerCenter + origin, _markerRadius, _markerRadius);
+    }
+
+    const QRect overlayRect = _overlayViewportRect();
+    if(!overlayRect.isEmpty() && dirty.intersects(overlayRect)) {
+        painter.fillRect(overlayRect, QColor(0, 0, 0, 160));
+        painter.setPen(Qt::white);
+        painter.drawText(overlayRect.adjusted(4, 4, -4, -4), Qt::AlignLeft | Qt::AlignTop, _overlayText);
+    }
+}
+
+void RasterView::mousePressEvent(QMouseEvent* e) {
+    const QPoint pos = e->pos() - _imageOrigin();
+    emit mouse_clicked(pos.x(), pos.y());
+}
+
+void RasterView::wheelEvent(QWheelEvent* e) {
+    if(!_wheelZoomEnabled) {
+        QAbstractScrollArea::wheelEvent(e);
+        return;
+    }
+    emit wheel_zoomed(e->angleDelta().y() / 120.0);
+    e->accept();
+}
+
+void RasterView::resizeEvent(QResizeEvent* e) {
+    QAbstractScrollArea::resizeEvent(e);
+    _updateScrollBars();
+}
+
+void RasterView::scrollContentsBy(int dx, int dy) {
+    viewport()->scroll(dx, dy);
+}
@@ -0,0 +1,57 @@
+#ifndef RASTERVIEW_H
+#define RASTERVIEW_H
+
+#include <QAbstractScrollArea>
+#include <QImage>
+#include <QString>
+
+#include <optional>
+
+// Scrollable 1:1 view of a QImage with a circle marker overlay.
+// The image is blitted straight from its QImage in paintEvent; moving the marker
+// only repaints the marker's old and new rectangles.
+class RasterView : public QAbstractScrollArea
+{
+    Q_OBJECT
+public:
+    explicit RasterView(QWidget* parent = nullptr);
+
+    void setImage(QImage image);
+    const QImage& image() const { return _image; }
+
+    // Marker center in image coordinates; std::nullopt hides it
+    void setMarker(std::optional<QPointF> center, double radius = 20.0);
+
+    // Text drawn over the top-left corner of the viewport, e.g. frame timings; empty hides it
+    void setOverlayText(const QString& text);
+
+    // The wheel zooms (emits wheel_zoomed) instead of scrolling
+    void setWheelZoomEnabled(bool enabled) { _wheelZoomEnabled = enabled; }
+
+signals:
+    void mouse_clicked(int x, int y);
+    // steps: wheel notches, positive away from the user
+    void wheel_zoomed(double steps);
+
+protected:
+    void paintEvent(QPaintEvent* e) override;
+    void mousePressEvent(QMouseEvent* e) override;
+    void wheelEvent(QWheelEvent* e) override;
+    void resizeEvent(QResizeEvent* e) override;
+    void scrollContentsBy(int dx, int dy) override;
+
+private:
+    QPoint _imageOrigin() const;
+    QRect _markerViewportRect() const;
+    QRect _overlayViewportRect() const;
+    void _updateScrollBars();
+
+private:
+    QImage _image;
+    std::optional<QPointF> _markerCenter;
+    double _markerRadius = 20.0;
+    bool _wheelZoomEnabled = false;
+    QString _overlayText;
+};
+
+#endif // RASTERVIEW_H
@@ -0,0 +1,569 @@
+#ifndef NETCDF_DANI_ASYNCFILEREADER_H
+#define NETCDF_DANI_ASYNCFILEREADER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(NETCDF_DANI_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define NETCDF_DANI_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "BoundedQueue.h"
+#include "ThreadPool.h"
+#include "instrumentation.h"
+
+// Batched asynchronous reads of one file: io_uring with registered buffers and O_DIRECT where the kernel
+// has it, otherwise a pool of blocking positional reads. Either way up to queueDepth reads are in flight
+// and every completed read goes to a handler, on the caller's workers if it passes them.
+
+struct AsyncReadRequest {
+    uint64_t offset{};
+    std::size_t size{};
+};
+
+struct AsyncReaderOptions {
+    unsigned queueDepth = 64;     // reads in flight, also the number of buffers
+    bool useIoUring = true;       // false: the blocking fallback
+    bool directIo = true;         // O_DIRECT for io_uring, if the file system supports it
+    std::size_t fallbackThreads = 8;
+};
+
+// Called once per request in completion order; data is valid until it returns
+using AsyncReadHandler = std::function<void(std::size_t requestIx, const uint8_t* data, std::size_t size)>;
+
+namespace async_read_detail {
+
+// O_DIRECT needs offsets, sizes and buffers aligned to the logical block size; 4 KiB covers all of them
+constexpr std::size_t alignment = 4096;
+
+inline uint64_t alignDown(uint64_t value) { return value & ~uint64_t{alignment - 1}; }
+inline uint64_t alignUp(uint64_t value) { return alignDown(value + alignment - 1); }
+
+#ifdef NETCDF_DANI_HAS_IO_URING
+
+// A submission and a completion ring over the raw syscalls; used by one thread at a time
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        _fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if(_fd < 0) {
+            throw std::runtime_error("io_uring_setup failed");
+        }
+        _sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(singleMmap) {
+            _sqSize = _cqSize = std::max(_sqSize, _cqSize);
+        }
+        _sqRing = mmap(nullptr, _sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        _cqRing = singleMmap ? _sqRing : mmap(nullptr, _cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = static_cast<io_uring_sqe*>(mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES));
+        if(_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED) {
+            _unmap();
+            close(_fd);
+            throw std::runtime_error("io_uring mmap failed");
+        }
+        auto* sq = static_cast<uint8_t*>(_sqRing);
+        _sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        _sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        _sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        _sqEntries = params.sq_entries;
+        auto* cq = static_cast<uint8_t*>(_cqRing);
+        _cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        _cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        if(!_supportsReads()) {
+            _unmap();
+            close(_fd);
+            throw std::runtime_error("io_uring without IORING_OP_READ");
+        }
+    }
+
+    ~IoUring() {
+        _unmap();
+        close(_fd);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    unsigned entries() const { return _sqEntries; }
+
+    // Pins the buffers for IORING_OP_READ_FIXED; false if the kernel refuses (e.g. RLIMIT_MEMLOCK)
+    bool registerBuffers(const std::vector<iovec>& buffers) {
+        syscall(__NR_io_uring_register, _fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        return syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+    }
+
+    // Queues a read; bufferIx >= 0 reads into that registered buffer. The caller keeps at most entries() queued.
+    void queueRead(int fd, void* dst, unsigned size, uint64_t offset, int bufferIx, uint64_t userData) {
+        const unsigned tail = *_sqTail;
+        const unsigned ix = tail & _sqMask;
+        io_uring_sqe& sqe = _sqes[ix];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = bufferIx >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(dst);
+        sqe.len = size;
+        sqe.off = offset;
+        sqe.buf_index = static_cast<uint16_t>(std::max(bufferIx, 0));
+        sqe.user_data = userData;
+        _sqArray[ix] = ix;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++_queued;
+    }
+
+    // Submits the queued reads in one syscall and waits for at least minComplete completions
+    void submitAndWait(unsigned minComplete) {
+        while(true) {
+            const auto submitted = syscall(__NR_io_uring_enter, _fd, _queued, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if(submitted >= 0) {
+                _queued -= static_cast<unsigned>(submitted);
+                if(_queued == 0 || minComplete == 0) {
+                    return;
+                }
+                continue;
+            }
+            if(errno != EINTR) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+        }
+    }
+
+    // Calls f(userData, result) for every completion available
+    template<typename F>
+    void reap(F&& f) {
+        unsigned head = *_cqHead;
+        const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head) {
+            const io_uring_cqe& cqe = _cqes[head & _cqMask];
+            f(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+private:
+    // IORING_OP_READ and the probe came with Linux 5.6; 5.1 to 5.5 set the ring up but fail every such
+    // read with -EINVAL, so those fall back to the pread pool
+    bool _supportsReads() const {
+        constexpr unsigned nOps = 64;
+        std::vector<uint64_t> storage((sizeof(io_uring_probe) + nOps * sizeof(io_uring_probe_op) + 7) / 8, 0);
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if(syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, nOps) < 0) {
+            return false;
+        }
+        auto supported = [probe](unsigned op) { return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED); };
+        return supported(IORING_OP_READ) && supported(IORING_OP_READ_FIXED);
+    }
+
+    void _unmap() {
+        if(_sqes && _sqes != MAP_FAILED) {
+            munmap(_sqes, _sqesSize);
+        }
+        if(_cqRing && _cqRing != MAP_FAILED && _cqRing != _sqRing) {
+            munmap(_cqRing, _cqSize);
+        }
+        if(_sqRing && _sqRing != MAP_FAILED) {
+            munmap(_sqRing, _sqSize);
+        }
+    }
+
+private:
+    int _fd = -1;
+    void* _sqRing = nullptr;
+    void* _cqRing = nullptr;
+    io_uring_sqe* _sqes = nullptr;
+    std::size_t _sqSize{};
+    std::size_t _cqSize{};
+    std::size_t _sqesSize{};
+    unsigned* _sqTail = nullptr;
+    unsigned* _sqArray = nullptr;
+    unsigned _sqMask{};
+    unsigned _sqEntries{};
+    unsigned* _cqHead = nullptr;
+    unsigned* _cqTail = nullptr;
+    unsigned _cqMask{};
+    io_uring_cqe* _cqes = nullptr;
+    unsigned _queued{};
+};
+
+#endif
+
+} // namespace async_read_detail
+
+class AsyncFileReader {
+public:
+    explicit AsyncFileReader(const std::string& filename, AsyncReaderOptions options = {})
+            : _filename(filename), _options(options) {
+        _options.queueDepth = std::max(_options.queueDepth, 1u);
+#ifdef NETCDF_DANI_HAS_IO_URING
+        if(_options.useIoUring) {
+            try {
+                _ring = std::make_unique<async_read_detail::IoUring>(_options.queueDepth);
+                _options.queueDepth = std::min(_options.queueDepth, _ring->entries());
+            } catch(const std::exception&) {
+                _ring.reset(); // no io_uring in this kernel or sandbox
+            }
+        }
+        if(_ring && _options.directIo) {
+            _fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+            _direct = _fd >= 0;
+        }
+#endif
+#ifdef _WIN32
+        _file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(_file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+#else
+        if(_fd < 0) {
+            // tmpfs and some network file systems refuse O_DIRECT
+            _fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        if(_fd < 0) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+#endif
+        if(!usesIoUring()) {
+            _ioPool = std::make_unique<ThreadPool>(_options.fallbackThreads);
+        }
+    }
+
+    ~AsyncFileReader() {
+        _ioPool.reset();
+#ifdef NETCDF_DANI_HAS_IO_URING
+        _ring.reset();
+#endif
+#ifdef _WIN32
+        CloseHandle(_file);
+#else
+        close(_fd);
+#endif
+    }
+
+    AsyncFileReader(const AsyncFileReader&) = delete;
+    AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+    const std::string& filename() const { return _filename; }
+    bool usesIoUring() const {
+#ifdef NETCDF_DANI_HAS_IO_URING
+        return _ring != nullptr;
+#else
+        return false;
+#endif
+    }
+    bool usesDirectIo() const { return _direct; }
+
+    // Reads all requests and calls onComplete for each, on the workers if given (not from one of their own
+    // tasks). Returns once every handler returned; throws the first read or handler error. One batch at a time.
+    void readBatch(const std::vector<AsyncReadRequest>& requests, const AsyncReadHandler& onComplete, ThreadPool* workers = nullptr) {
+        std::lock_guard<std::mutex> batchLock(_batchMutex);
+        _readBatch(requests, onComplete, workers);
+    }
+
+    // readBatch, or false right away if another batch is running
+    bool tryReadBatch(const std::vector<AsyncReadRequest>& requests, const AsyncReadHandler& onComplete, ThreadPool* workers = nullptr) {
+        std::unique_lock<std::mutex> batchLock(_batchMutex, std::try_to_lock);
+        if(!batchLock.owns_lock()) {
+            return false;
+        }
+        _readBatch(requests, onComplete, workers);
+        return true;
+    }
+
+private:
+    struct Completion {
+        unsigned slot{};
+        int64_t result{}; // bytes read, or -errno
+    };
+
+    void _readBatch(const std::vector<AsyncReadRequest>& requests, const AsyncReadHandler& onComplete, ThreadPool* workers) {
+        if(requests.empty()) {
+            return;
+        }
+        NCD_TRACE_SCOPE("async_read_batch");
+        std::size_t maxSpan = 0;
+        for(const auto& request : requests) {
+            maxSpan = std::max(maxSpan, _span(request));
+        }
+        _reserveBuffers(maxSpan);
+
+        _error = nullptr;
+        _freeSlots.clear();
+        for(unsigned slot = 0; slot < _options.queueDepth; ++slot) {
+            _freeSlots.push_back(slot);
+        }
+        _slotRequest.assign(_options.queueDepth, 0);
+        _handlersRunning = 0;
+
+        std::size_t next = 0;
+        std::size_t readsInFlight = 0;
+        while(next < requests.size() || readsInFlight > 0) {
+            // start reads into every free buffer
+            while(next < requests.size() && !_failed()) {
+                const auto slot = _takeSlot();
+                if(slot < 0) {
+                    break;
+                }
+                _slotRequest[slot] = next;
+                _startRead(static_cast<unsigned>(slot), requests[next++]);
+                ++readsInFlight;
+            }
+            if(readsInFlight == 0) {
+                if(_failed()) {
+                    break;
+                }
+                // all buffers are with the handlers
+                std::unique_lock<std::mutex> lock(_mutex);
+                _slotFreed.wait(lock, [this]() { return !_freeSlots.empty(); });
+                continue;
+            }
+            _waitForCompletions([&](unsigned slot, int64_t result) {
+                --readsInFlight;
+                const auto requestIx = _slotRequest[slot];
+                const auto& request = requests[requestIx];
+                try {
+                    _finishRead(slot, request, result);
+                } catch(...) {
+                    _fail(std::current_exception());
+                    _releaseSlot(slot);
+                    return;
+                }
+                _dispatch(slot, requestIx, request, onComplete, workers);
+            });
+        }
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _handlersDone.wait(lock, [this]() { return _handlersRunning == 0; });
+        }
+        if(_error) {
+            std::rethrow_exception(_error);
+        }
+    }
+
+    // Bytes read for a request: the aligned span around it
+    static std::size_t _span(const AsyncReadRequest& request) {
+        using namespace async_read_detail;
+        return static_cast<std::size_t>(alignUp(request.offset + request.size) - alignDown(request.offset));
+    }
+
+    void _reserveBuffers(std::size_t span) {
+        using namespace async_read_detail;
+        span = std::max<std::size_t>(alignUp(span), alignment);
+        if(span <= _slotBytes) {
+            return;
+        }
+        _slotBytes = span;
+        _storage.assign(_slotBytes * _options.queueDepth + alignment, 0);
+        const auto address = reinterpret_cast<uintptr_t>(_storage.data());
+        _buffers = reinterpret_cast<uint8_t*>((address + alignment - 1) & ~uintptr_t{alignment - 1});
+#ifdef NETCDF_DANI_HAS_IO_URING
+        if(_ring) {
+            std::vector<iovec> buffers(_options.queueDepth);
+            for(unsigned slot = 0; slot < _options.queueDepth; ++slot) {
+                buffers[slot].iov_base = _slot(slot);
+                buffers[slot].iov_len = _slotBytes;
+            }
+            _fixedBuffers = _ring->registerBuffers(buffers);
+        }
+#endif
+    }
+
+    uint8_t* _slot(unsigned slot) const { return _buffers + std::size_t{slot} * _slotBytes; }
+
+    int _takeSlot() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_freeSlots.empty()) {
+            return -1;
+        }
+        const auto slot = _freeSlots.back();
+        _freeSlots.pop_back();
+        return static_cast<int>(slot);
+    }
+
+    void _releaseSlot(unsigned slot) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _freeSlots.push_back(slot);
+        }
+        _slotFreed.notify_all();
+    }
+
+    bool _failed() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _error != nullptr;
+    }
+
+    void _fail(std::exception_ptr error) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_error) {
+            _error = error;
+        }
+    }
+
+    void _startRead(unsigned slot, const AsyncReadRequest& request) {
+        using namespace async_read_detail;
+        const auto offset = alignDown(request.offset);
+        const auto size = _span(request);
+#ifdef NETCDF_DANI_HAS_IO_URING
+        if(_ring) {
+            _ring->queueRead(_fd, _slot(slot), static_cast<unsigned>(size), offset, _fixedBuffers ? static_cast<int>(slot) : -1, slot);
+            return;
+        }
+#endif
+        _ioPool->submit([this, slot, offset, size]() {
+            _completions.push(Completion{slot, _readAt(_slot(slot), size, offset)});
+        });
+    }
+
+    template<typename F>
+    void _waitForCompletions(F&& onCompletion) {
+#ifdef NETCDF_DANI_HAS_IO_URING
+        if(_ring) {
+            _ring->submitAndWait(1);
+            _ring->reap([&](uint64_t slot, int32_t result) { onCompletion(static_cast<unsigned>(slot), result); });
+            return;
+        }
+#endif
+        auto completion = _completions.pop();
+        onCompletion(completion->slot, completion->result);
+    }
+
+    // Checks the read and finishes a short one (end of file, or a partial read) with blocking reads
+    void _finishRead(unsigned slot, const AsyncReadRequest& request, int64_t result) {
+        using namespace async_read_detail;
+        const auto offset = alignDown(request.offset);
+        const auto needed = request.offset + request.size - offset;
+        if(result < 0) {
+            throw std::runtime_error("AsyncFileReader: read failed: " + _filename + ": " + std::strerror(static_cast<int>(-result)));
+        }
+        auto done = static_cast<uint64_t>(result);
+        while(done < needed) {
+            // O_DIRECT reads resume at an aligned offset
+            const auto resume = _direct ? alignDown(done) : done;
+            const auto more = _readAt(_slot(slot) + resume, static_cast<std::size_t>(alignUp(needed) - resume), offset + resume);
+            if(more < 0) {
+                throw std::runtime_error("AsyncFileReader: read failed: " + _filename + ": " + std::strerror(static_cast<int>(-more)));
+            }
+            if(resume + static_cast<uint64_t>(more) <= done) {
+                throw std::runtime_error("AsyncFileReader: read past the end of " + _filename);
+            }
+            done = resume + static_cast<uint64_t>(more);
+        }
+    }
+
+    void _dispatch(unsigned slot, std::size_t requestIx, const AsyncReadRequest& request, const AsyncReadHandler& onComplete, ThreadPool* workers) {
+        const uint8_t* data = _slot(slot) + (request.offset - async_read_detail::alignDown(request.offset));
+        const auto size = request.size;
+        auto handle = [this, slot, requestIx, data, size, &onComplete]() {
+            try {
+                if(!_failed()) {
+                    onComplete(requestIx, data, size);
+                }
+            } catch(...) {
+                _fail(std::current_exception());
+            }
+            _releaseSlot(slot);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                --_handlersRunning;
+            }
+            _handlersDone.notify_all();
+        };
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_handlersRunning;
+        }
+        if(workers) {
+            workers->submit(handle);
+        } else {
+            handle();
+        }
+    }
+
+    // One blocking positional read; bytes read or -errno
+    int64_t _readAt(uint8_t* dst, std::size_t size, uint64_t offset) const {
+#ifdef _WIN32
+        OVERLAPPED overlapped{};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD read = 0;
+        if(!ReadFile(_file, dst, static_cast<DWORD>(size), &read, &overlapped) && GetLastError() != ERROR_HANDLE_EOF) {
+            return -EIO;
+        }
+        return read;
+#else
+        std::size_t done = 0;
+        while(done < size) {
+            const auto n = pread(_fd, dst + done, size - done, static_cast<off_t>(offset + done));
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            if(n < 0) {
+                return -errno;
+            }
+            if(n == 0) {
+                break;
+            }
+            done += static_cast<std::size_t>(n);
+        }
+        return static_cast<int64_t>(done);
+#endif
+    }
+
+private:
+    std::string _filename;
+    AsyncReaderOptions _options;
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+#else
+    int _fd = -1;
+#endif
+    bool _direct = false;
+#ifdef NETCDF_DANI_HAS_IO_URING
+    std::unique_ptr<async_read_detail::IoUring> _ring;
+#endif
+    bool _fixedBuffers = false;
+    std::unique_ptr<ThreadPool> _ioPool;
+    BoundedQueue<Completion> _completions{_options.queueDepth}; // fallback reads in flight fit without blocking
+
+    std::mutex _batchMutex;
+    std::vector<uint8_t> _storage;
+    uint8_t* _buffers = nullptr;
+    std::size_t _slotBytes{};
+
+    std::mutex _mutex;
+    std::condition_variable _slotFreed;
+    std::condition_variable _handlersDone;
+    std::vector<unsigned> _freeSlots;
+    std::vector<std::size_t> _slotRequest;
+    std::size_t _handlersRunning{};
+    std::exception_ptr _error;
+};
+
+#endif //NETCDF_DANI_ASYNCFILEREADER_H
@@ -0,0 +1,68 @@
+#ifndef NETCDF_DANI_BOUNDEDQUEUE_H
+#define NETCDF_DANI_BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Multi-producer multi-consumer FIFO with a fixed capacity: push() blocks while the queue is full,
+// which throttles a fast producer to the pace of its slowest consumer.
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity) : _capacity(capacity ? capacity : 1) {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Returns false (and drops the item) if the queue was closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notFull.wait(lock, [this]() { return _closed || _items.size() < _capacity; });
+        if(_closed) {
+            return false;
+        }
+        _items.push_back(std::move(item));
+        lock.unlock();
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available; std::nullopt once the queue is closed and drained
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notEmpty.wait(lock, [this]() { return _closed || !_items.empty(); });
+        if(_items.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(_items.front());
+        _items.pop_front();
+        lock.unlock();
+        _notFull.notify_one();
+        return item;
+    }
+
+    // No more pushes; consumers still get the queued items
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+
+    std::size_t capacity() const { return _capacity; }
+
+private:
+    const std::size_t _capacity;
+    std::mutex _mutex;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+    std::deque<T> _items;
+    bool _closed = false;
+};
+
+#endif //NETCDF_DANI_BOUNDEDQUEUE_H
@@ -0,0 +1,290 @@
+#ifndef NETCDF_DANI_GEOTIFFWRITER_H
+#define NETCDF_DANI_GEOTIFFWRITER_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "zlib.h"
+#include "instrumentation.h"
+
+// Georeferenced raster layout. The affine transform maps pixel (col, row) to
+// (originLon + col * pixelSizeLon, originLat - row * pixelSizeLat); row 0 is the northern edge.
+struct GeoTiffLayout {
+    std::size_t width{};
+    std::size_t height{};
+    std::size_t tileSize = 256;      // multiple of 16
+    uint16_t samplesPerPixel = 1;
+    uint16_t bitsPerSample = 16;
+    bool signedSamples = true;
+    bool deflate = true;             // horizontal predictor + zlib
+    double originLon{};
+    double originLat{};
+    double pixelSizeLon{};
+    double pixelSizeLat{};
+    uint16_t epsg = 4326;            // geographic CRS; a projected one can be set by later stages
+    bool projected = false;
+    std::optional<double> noData;
+
+    std::size_t bytesPerPixel() const { return samplesPerPixel * (bitsPerSample / 8); }
+    std::size_t tileBytes() const { return tileSize * tileSize * bytesPerPixel(); }
+    std::size_t tilesAcross() const { return (width + tileSize - 1) / tileSize; }
+    std::size_t tilesDown() const { return (height + tileSize - 1) / tileSize; }
+};
+
+// Writes a tiled (Big)GeoTIFF. Tiles can be encoded concurrently with encodeTile()
+// and are appended to the file in whatever order writeTile() is called; the IFD goes at the end.
+class GeoTiffWriter {
+public:
+    GeoTiffWriter(const std::string& filename, const GeoTiffLayout& layout)
+            : _layout(layout)
+            , _ofs(filename, std::ios::binary) {
+        if(!_ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+        if(layout.tileSize == 0 || layout.tileSize % 16 != 0) {
+            throw std::runtime_error("GeoTiffWriter: tile size has to be a multiple of 16");
+        }
+        auto nTiles = layout.tilesAcross() * layout.tilesDown();
+        _tileOffsets.resize(nTiles);
+        _tileByteCounts.resize(nTiles);
+        // classic TIFF offsets are 32 bit, switch to BigTIFF well before an uncompressed image could overflow them
+        _bigTiff = nTiles * layout.tileBytes() > (std::size_t{3} << 30);
+        _writeHeader();
+    }
+
+    ~GeoTiffWriter() {
+        try {
+            finish();
+        } catch(...) {
+        }
+    }
+
+    GeoTiffWriter(const GeoTiffWriter&) = delete;
+    GeoTiffWriter& operator=(const GeoTiffWriter&) = delete;
+
+    const GeoTiffLayout& layout() const { return _layout; }
+
+    // Encodes one tileSize*tileSize pixel tile (rows north to south, pixels interleaved, 16 bit samples in
+    // host byte order). Thread-safe.
+    std::vector<uint8_t> encodeTile(std::vector<uint8_t> tilePixels) const {
+        NCD_TRACE_SCOPE("tiff_encode");
+        if(tilePixels.size() != _layout.tileBytes()) {
+            throw std::runtime_error("GeoTiffWriter: bad tile size");
+        }
+        if(_layout.deflate) {
+            _applyPredictor(tilePixels);
+        }
+        if(_layout.bitsPerSample == 16 && !_hostLittleEndian()) {
+            for(std::size_t ix = 0; ix + 1 < tilePixels.size(); ix += 2) {
+                std::swap(tilePixels[ix], tilePixels[ix + 1]);
+            }
+        }
+        if(!_layout.deflate) {
+            return tilePixels;
+        }
+        uLongf compressedSize = compressBound(static_cast<uLong>(tilePixels.size()));
+        std::vector<uint8_t> compressed(compressedSize);
+        if(compress2(compressed.data(), &compressedSize, tilePixels.data(), static_cast<uLong>(tilePixels.size()), 6) != Z_OK) {
+            throw std::runtime_error("GeoTiffWriter: deflate failed");
+        }
+        compressed.resize(compressedSize);
+        return compressed;
+    }
+
+    void writeTile(std::size_t tileX, std::size_t tileY, const std::vector<uint8_t>& encoded) {
+        auto tileIx = tileY * _layout.tilesAcross() + tileX;
+        _tileOffsets.at(tileIx) = static_cast<uint64_t>(_ofs.tellp());
+        _tileByteCounts.at(tileIx) = encoded.size();
+        _ofs.write((const char*)encoded.data(), encoded.size());
+        if(!_bigTiff && static_cast<uint64_t>(_ofs.tellp()) > 0xFFFFFFF0ull) {
+            throw std::runtime_error("GeoTiffWriter: classic TIFF size limit exceeded");
+        }
+    }
+
+    void finish() {
+        if(_finished) {
+            return;
+        }
+        _finished = true;
+        _writeIfd();
+        _ofs.flush();
+    }
+
+private:
+    enum TiffType : uint16_t { ASCII = 2, SHORT = 3, LONG = 4, DOUBLE = 12, LONG8 = 16 };
+
+    struct Entry {
+        uint16_t tag{};
+        uint16_t type{};
+        uint64_t count{};
+        std::vector<uint8_t> bytes;
+    };
+
+    static bool _hostLittleEndian() {
+        const uint16_t one = 1;
+        uint8_t first{};
+        std::memcpy(&first, &one, 1);
+        return first == 1;
+    }
+
+    // byte by byte, so the file matches its "II" header on any host
+    static void _putUInt(std::vector<uint8_t>& out, uint64_t value, std::size_t nBytes) {
+        for(std::size_t ix = 0; ix < nBytes; ++ix) {
+            out.push_back(static_cast<uint8_t>((value >> (8 * ix)) & 0xff));
+        }
+    }
+
+    template<typename T>
+    static Entry _entry(uint16_t tag, uint16_t type, const std::vector<T>& values) {
+        Entry entry{tag, type, values.size(), {}};
+        entry.bytes.reserve(values.size() * sizeof(T));
+        for(const auto& value : values) {
+            uint64_t bits{};
+            if constexpr(std::is_floating_point_v<T>) {
+                static_assert(sizeof(T) == sizeof(uint64_t), "double values only");
+                std::memcpy(&bits, &value, sizeof(bits));
+            } else {
+                bits = static_cast<std::make_unsigned_t<T>>(value);
+            }
+            _putUInt(entry.bytes, bits, sizeof(T));
+        }
+        return entry;
+    }
+
+    void _applyPredictor(std::vector<uint8_t>& tile) const {
+        const auto spp = _layout.samplesPerPixel;
+        const auto rowSamples = _layout.tileSize * spp;
+        if(_layout.bitsPerSample == 16) {
+            auto* samples = reinterpret_cast<uint16_t*>(tile.data());
+            for(std::size_t y = 0; y < _layout.tileSize; ++y) {
+                auto* row = samples + y * rowSamples;
+                for(std::size_t ix = rowSamples - 1; ix >= spp; --ix) {
+                    row[ix] = static_cast<uint16_t>(row[ix] - row[ix - spp]);
+                }
+            }
+        } else {
+            for(std::size_t y = 0; y < _layout.tileSize; ++y) {
+                auto* row = tile.data() + y * rowSamples;
+                for(std::size_t ix = rowSamples - 1; ix >= spp; --ix) {
+                    row[ix] = static_cast<uint8_t>(row[ix] - row[ix - spp]);
+                }
+            }
+        }
+    }
+
+    void _writeHeader() {
+        if(_bigTiff) {
+            const uint8_t header[16] = {'I', 'I', 43, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            _ofs.write((const char*)header, sizeof(header));
+        } else {
+            const uint8_t header[8] = {'I', 'I', 42, 0, 0, 0, 0, 0};
+            _ofs.write((const char*)header, sizeof(header));
+        }
+    }
+
+    std::vector<Entry> _entries() const {
+        const auto& l = _layout;
+        std::vector<Entry> entries;
+        auto shorts = [](std::vector<uint16_t> v) { return v; };
+        auto longs = [](std::vector<uint32_t> v) { return v; };
+        entries.push_back(_entry(256, LONG, longs({static_cast<uint32_t>(l.width)})));
+        entries.push_back(_entry(257, LONG, longs({static_cast<uint32_t>(l.height)})));
+        entries.push_back(_entry(258, SHORT, std::vector<uint16_t>(l.samplesPerPixel, l.bitsPerSample)));
+        entries.push_back(_entry(259, SHORT, shorts({static_cast<uint16_t>(l.deflate ? 8 : 1)})));
+        entries.push_back(_entry(262, SHORT, shorts({static_cast<uint16_t>(l.samplesPerPixel == 3 ? 2 : 1)})));
+        entries.push_back(_entry(277, SHORT, shorts({l.samplesPerPixel})));
+        entries.push_back(_entry(284, SHORT, shorts({1})));
+        entries.push_back(_entry(317, SHORT, shorts({static_cast<uint16_t>(l.deflate ? 2 : 1)})));
+        entries.push_back(_entry(322, LONG, longs({static_cast<uint32_t>(l.tileSize)})));
+        entries.push_back(_entry(323, LONG, longs({static_cast<uint32_t>(l.tileSize)})));
+        if(_bigTiff) {
+            entries.push_back(_entry(324, LONG8, _tileOffsets));
+            entries.push_back(_entry(325, LONG8, _tileByteCounts));
+        } else {
+            entries.push_back(_entry(324, LONG, std::vector<uint32_t>(_tileOffsets.begin(), _tileOffsets.end())));
+            entries.push_back(_entry(325, LONG, std::vector<uint32_t>(_tileByteCounts.begin(), _tileByteCounts.end())));
+        }
+        entries.push_back(_entry(339, SHORT, std::vector<uint16_t>(l.samplesPerPixel, l.signedSamples ? 2 : 1)));
+        entries.push_back(_entry(33550, DOUBLE, std::vector<double>{l.pixelSizeLon, l.pixelSizeLat, 0.0}));
+        entries.push_back(_entry(33922, DOUBLE, std::vector<double>{0.0, 0.0, 0.0, l.originLon, l.originLat, 0.0}));
+        // GeoKeyDirectory: model type, raster type PixelIsArea, CRS
+        entries.push_back(_entry(34735, SHORT, shorts({
+                1, 1, 0, 3,
+                1024, 0, 1, static_cast<uint16_t>(l.projected ? 1 : 2),
+                1025, 0, 1, 1,
+                static_cast<uint16_t>(l.projected ? 3072 : 2048), 0, 1, l.epsg})));
+        if(l.noData) {
+            auto text = std::to_string(static_cast<long long>(*l.noData));
+            std::vector<char> chars(text.begin(), text.end());
+            chars.push_back('\0');
+            entries.push_back(_entry(42113, ASCII, chars));
+        }
+        return entries;
+    }
+
+    void _writeIfd() {
+        auto entries = _entries();
+        const std::size_t inlineSize = _bigTiff ? 8 : 4;
+        auto writeUInt = [this](uint64_t value, std::size_t nBytes) {
+            std::vector<uint8_t> bytes;
+            _putUInt(bytes, value, nBytes);
+            _ofs.write((const char*)bytes.data(), bytes.size());
+        };
+        auto align = [this]() {
+            if(_ofs.tellp() % 2) {
+                _ofs.put('\0');
+            }
+        };
+
+        // out-of-line values first, then the directory referencing them
+        std::vector<uint64_t> valueOffsets(entries.size());
+        for(std::size_t ix = 0; ix < entries.size(); ++ix) {
+            if(entries[ix].bytes.size() > inlineSize) {
+                align();
+                valueOffsets[ix] = static_cast<uint64_t>(_ofs.tellp());
+                _ofs.write((const char*)entries[ix].bytes.data(), entries[ix].bytes.size());
+            }
+        }
+        align();
+        auto ifdOffset = static_cast<uint64_t>(_ofs.tellp());
+        if(!_bigTiff && ifdOffset > 0xFFFFFFF0ull) {
+            throw std::runtime_error("GeoTiffWriter: classic TIFF size limit exceeded");
+        }
+        writeUInt(entries.size(), _bigTiff ? 8 : 2);
+        for(std::size_t ix = 0; ix < entries.size(); ++ix) {
+            const auto& entry = entries[ix];
+            writeUInt(entry.tag, 2);
+            writeUInt(entry.type, 2);
+            writeUInt(entry.count, _bigTiff ? 8 : 4);
+            if(entry.bytes.size() > inlineSize) {
+                writeUInt(valueOffsets[ix], inlineSize);
+            } else {
+                std::vector<uint8_t> value(inlineSize, 0);
+                std::memcpy(value.data(), entry.bytes.data(), entry.bytes.size());
+                _ofs.write((const char*)value.data(), value.size());
+            }
+        }
+        writeUInt(0, inlineSize); // no next IFD
+
+        _ofs.seekp(_bigTiff ? 8 : 4);
+        writeUInt(ifdOffset, inlineSize);
+        _ofs.seekp(0, std::ios::end);
+    }
+
+private:
+    GeoTiffLayout _layout;
+    std::ofstream _ofs;
+    bool _bigTiff = false;
+    bool _finished = false;
+    std::vector<uint64_t> _tileOffsets;
+    std::vector<uint64_t> _tileByteCounts;
+};
+
+#endif //NETCDF_DANI_GEOTIFFWRITER_H
@@ -0,0 +1,119 @@
+#ifndef NETCDF_DANI_GRIDPIPELINE_H
+#define NETCDF_DANI_GRIDPIPELINE_H
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "instrumentation.h"
+
+// A consumer of the full grid, fed row blocks south to north by GridPipeline. Each sink runs on
+// its own thread and sees its blocks one at a time, in order. Blocks are shared with the other sinks
+// and immutable; a sink may keep one alive past consume(), e.g. for work it handed to a pool.
+class GridSink {
+public:
+    virtual ~GridSink() = default;
+
+    virtual std::string name() const = 0;
+    virtual void begin(std::size_t /*width*/, std::size_t /*height*/) {}
+    virtual void consume(const std::shared_ptr<const RowBlock>& block) = 0;
+    // Called after the last block, unless the run failed
+    virtual void finish() {}
+};
+
+struct GridPipelineOptions {
+    std::size_t minBlockRows = 256;
+    // blocks queued per sink; the reader waits when the slowest sink falls this far behind
+    std::size_t queueDepth = 2;
+};
+
+// One chunk-aligned streaming read of a 2D variable fanned out to any number of sinks, so a set of
+// products costs a single decompression pass. At most (queueDepth + 2) blocks per sink are alive.
+class GridPipeline {
+public:
+    explicit GridPipeline(const NcFile& ncFile, const char* varName = "elevation", GridPipelineOptions options = {})
+            : _reader(ncFile, varName, options.minBlockRows)
+            , _options(options) {}
+
+    const RowBlockReader& reader() const { return _reader; }
+
+    void addSink(GridSink& sink) { _sinks.push_back(&sink); }
+
+    // Throws the first sink's (or the reader's) exception after all threads stopped
+    void run() {
+        using BlockQueue = BoundedQueue<std::shared_ptr<const RowBlock>>;
+        std::vector<std::unique_ptr<BlockQueue>> queues;
+        std::vector<std::exception_ptr> errors(_sinks.size());
+        std::vector<std::thread> threads;
+        std::atomic<bool> aborted{false};
+        for(std::size_t sinkIx = 0; sinkIx < _sinks.size(); ++sinkIx) {
+            queues.push_back(std::make_unique<BlockQueue>(_options.queueDepth));
+        }
+        for(std::size_t sinkIx = 0; sinkIx < _sinks.size(); ++sinkIx) {
+            threads.emplace_back([this, sinkIx, &queues, &errors, &aborted]() {
+                auto& sink = *_sinks[sinkIx];
+                auto& queue = *queues[sinkIx];
+                try {
+                    sink.begin(_reader.width(), _reader.height());
+                    while(auto block = queue.pop()) {
+                        sink.consume(*block);
+                    }
+                    if(!aborted) {
+                        sink.finish();
+                    }
+                } catch(...) {
+                    errors[sinkIx] = std::current_exception();
+                    // a failed sink must not stall the reader
+                    queue.close();
+                    while(queue.pop()) {
+                    }
+                }
+            });
+        }
+
+        std::exception_ptr readError;
+        try {
+            for(std::size_t blockIx = 0; blockIx < _reader.nBlocks(); ++blockIx) {
+                std::shared_ptr<const RowBlock> block;
+                {
+                    NCD_TRACE_SCOPE("pipeline_read");
+                    block = std::make_shared<const RowBlock>(_reader.readBlock(blockIx));
+                }
+                for(auto& queue : queues) {
+                    queue->push(block);
+                }
+            }
+        } catch(...) {
+            readError = std::current_exception();
+            aborted = true;
+        }
+        for(auto& queue : queues) {
+            queue->close();
+        }
+        for(auto& thread : threads) {
+            thread.join();
+        }
+        if(readError) {
+            std::rethrow_exception(readError);
+        }
+        for(auto& error : errors) {
+            if(error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+private:
+    RowBlockReader _reader;
+    GridPipelineOptions _options;
+    std::vector<GridSink*> _sinks;
+};
+
+#endif //NETCDF_DANI_GRIDPIPELINE_H
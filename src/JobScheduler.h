@@ -0,0 +1,277 @@
+#ifndef NETCDF_DANI_JOBSCHEDULER_H
+#define NETCDF_DANI_JOBSCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "crop_export.h"
+#include "instrumentation.h"
+
+// Bytes that may be held by in-flight buffers, shared by every scheduler that runs against it.
+// acquire() blocks until enough is free; a request larger than the whole budget waits until
+// nothing else is held and then runs alone.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(std::size_t bytes) : _bytes(bytes) {}
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // Releases its bytes when destroyed
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(MemoryBudget* budget, std::size_t bytes) : _budget(budget), _bytes(bytes) {}
+        Lease(Lease&& other) noexcept : _budget(std::exchange(other._budget, nullptr)), _bytes(other._bytes) {}
+        Lease& operator=(Lease&& other) noexcept {
+            if(this != &other) {
+                reset();
+                _budget = std::exchange(other._budget, nullptr);
+                _bytes = other._bytes;
+            }
+            return *this;
+        }
+        ~Lease() { reset(); }
+
+        void reset() {
+            if(_budget) {
+                _budget->_release(_bytes);
+                _budget = nullptr;
+            }
+        }
+        std::size_t bytes() const { return _budget ? _bytes : 0; }
+
+    private:
+        MemoryBudget* _budget = nullptr;
+        std::size_t _bytes{};
+    };
+
+    Lease acquire(std::size_t bytes) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _released.wait(lock, [&]() { return _inUse == 0 || _inUse + bytes <= _bytes; });
+        _inUse += bytes;
+        _peak = std::max(_peak, _inUse);
+        return Lease(this, bytes);
+    }
+
+    std::size_t bytes() const { return _bytes; }
+    std::size_t inUse() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _inUse;
+    }
+    std::size_t peak() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _peak;
+    }
+
+private:
+    void _release(std::size_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _inUse -= bytes;
+        }
+        _released.notify_all();
+    }
+
+private:
+    const std::size_t _bytes;
+    mutable std::mutex _mutex;
+    std::condition_variable _released;
+    std::size_t _inUse{};
+    std::size_t _peak{};
+};
+
+// One piece of a job: rows [firstRow, firstRow + nRows) of the columns [colBegin, colBegin + nCols)
+struct GridBand {
+    std::size_t pass{};  // column strip
+    std::size_t index{}; // band within the pass, south to north
+    std::size_t firstRow{};
+    std::size_t nRows{};
+    std::size_t colBegin{};
+    std::size_t nCols{};
+    // the band's heights plus up to haloRows() rows on each side, as far as the grid goes; width is nCols
+    RowBlock heights;
+    // whatever process() produces for commit()
+    std::vector<uint8_t> output;
+};
+
+// A computation over a rectangle of the grid that can be done band by band, e.g. a crop, a downsample,
+// terrain derivatives or an export. process() runs on the pool, commit() in band order on the scheduler's thread.
+class GridJob {
+public:
+    virtual ~GridJob() = default;
+
+    virtual std::string name() const = 0;
+    // Everything a band holds per cell while in flight: the int16 heights, scratch and output
+    virtual std::size_t bytesPerCell() const = 0;
+    virtual std::size_t haloRows() const { return 0; }
+    virtual void begin(const CropGrid& /*region*/) {}
+    virtual void process(GridBand& band) = 0;
+    virtual void commit(GridBand& band) = 0;
+    // Called after the last band, unless the run failed
+    virtual void finish() {}
+};
+
+struct JobSchedulerOptions {
+    // bands read ahead of the one being committed, beyond one per worker
+    std::size_t readAhead = 2;
+    std::size_t maxBandRows = 4096;
+};
+
+// Runs grid jobs in bands sized so that all bands in flight fit the memory budget. A reader thread reads
+// the bands (leasing their memory first, so it waits when the budget is spent) and hands them to the
+// pool through a bounded queue; this thread commits them in order. I/O, compute and output overlap.
+// If a single row of the region doesn't fit, the region is split into column strips run one after the
+// other, so a large job takes more passes instead of more memory.
+class JobScheduler {
+public:
+    JobScheduler(const NcFile& ncFile, ThreadPool& pool, MemoryBudget& budget, JobSchedulerOptions options = {})
+            : _ncFile(ncFile), _reader(ncFile), _pool(pool), _budget(budget), _options(options) {}
+
+    // Bands kept in flight: one per worker plus the read-ahead
+    std::size_t bandsInFlight() const { return _pool.size() + _options.readAhead; }
+
+    struct Plan {
+        std::size_t stripCols{}; // columns per pass
+        std::size_t bandRows{};
+        std::size_t passes{};
+    };
+
+    Plan plan(const GridJob& job, const CropGrid& region) const {
+        const auto cellBytes = std::max<std::size_t>(job.bytesPerCell(), 1);
+        const auto bandBytes = std::max<std::size_t>(_budget.bytes() / bandsInFlight(), 1);
+        Plan plan;
+        // the narrowest band still has its halo rows
+        const auto minRows = 1 + 2 * job.haloRows();
+        plan.stripCols = std::clamp<std::size_t>(bandBytes / (minRows * cellBytes), 1, std::max<std::size_t>(region.cols(), 1));
+        plan.passes = (region.cols() + plan.stripCols - 1) / plan.stripCols;
+        const auto rowsInBudget = bandBytes / (plan.stripCols * cellBytes);
+        plan.bandRows = std::clamp<std::size_t>(rowsInBudget > 2 * job.haloRows() ? rowsInBudget - 2 * job.haloRows() : 1,
+                                                1, _options.maxBandRows);
+        // whole chunks where the budget allows; bands start on multiples of bandRows (see _runPass), so
+        // apart from halo rows no chunk is decompressed twice
+        if(plan.bandRows >= _reader.chunkRows()) {
+            plan.bandRows -= plan.bandRows % _reader.chunkRows();
+        }
+        return plan;
+    }
+
+    // Throws the first exception of the reader, process() or commit(), after the threads stopped
+    void run(GridJob& job, const CropGrid& region) {
+        if(region.rows() == 0 || region.cols() == 0) {
+            return;
+        }
+        const auto jobPlan = plan(job, region);
+        job.begin(region);
+        for(std::size_t pass = 0; pass < jobPlan.passes; ++pass) {
+            const auto colBegin = region.colBegin + pass * jobPlan.stripCols;
+            const auto nCols = std::min(jobPlan.stripCols, region.colEnd - colBegin);
+            _runPass(job, region, jobPlan, pass, colBegin, nCols);
+        }
+        job.finish();
+    }
+
+private:
+    struct InFlightBand {
+        std::shared_future<void> processed;
+        std::shared_ptr<GridBand> band; // shared with the task, which may outlive a dropped item
+        MemoryBudget::Lease lease;
+    };
+
+    void _runPass(GridJob& job, const CropGrid& region, const Plan& jobPlan, std::size_t pass, std::size_t colBegin, std::size_t nCols) {
+        const auto halo = job.haloRows();
+        // bands on the grid of bandRows, so on chunk boundaries; the first and last may be shorter
+        const auto firstSlot = region.rowBegin / jobPlan.bandRows;
+        const auto nBands = (region.rowEnd - 1) / jobPlan.bandRows - firstSlot + 1;
+        BoundedQueue<InFlightBand> queue(_options.readAhead + _pool.size());
+        std::atomic<bool> aborted{false};
+        std::exception_ptr readError;
+
+        std::thread reader([&]() {
+            try {
+                for(std::size_t bandIx = 0; bandIx < nBands && !aborted; ++bandIx) {
+                    auto band = std::make_shared<GridBand>();
+                    band->pass = pass;
+                    band->index = bandIx;
+                    band->firstRow = std::max(region.rowBegin, (firstSlot + bandIx) * jobPlan.bandRows);
+                    band->nRows = std::min(region.rowEnd, (firstSlot + bandIx + 1) * jobPlan.bandRows) - band->firstRow;
+                    band->colBegin = colBegin;
+                    band->nCols = nCols;
+                    const auto readBegin = band->firstRow - std::min(halo, band->firstRow);
+                    const auto readEnd = std::min(band->firstRow + band->nRows + halo, _reader.height());
+                    auto lease = _budget.acquire((band->nRows + 2 * halo) * nCols * std::max<std::size_t>(job.bytesPerCell(), 1));
+                    if(aborted) {
+                        break;
+                    }
+                    {
+                        NCD_TRACE_SCOPE("job_read");
+                        band->heights.firstRow = readBegin;
+                        band->heights.nRows = readEnd - readBegin;
+                        band->heights.width = nCols;
+                        band->heights.data.resize(band->heights.nRows * nCols);
+                        std::size_t offset[2] = {readBegin, colBegin};
+                        std::size_t count[2] = {band->heights.nRows, nCols};
+                        _ncFile.getInt64Data(band->heights.data.data(), _reader.varId(), offset, count);
+                    }
+                    std::shared_future<void> processed = _pool.submit([&job, band]() { job.process(*band); });
+                    if(!queue.push(InFlightBand{processed, std::move(band), std::move(lease)})) {
+                        // closed after a failure: the task still references the job
+                        processed.wait();
+                        break;
+                    }
+                }
+            } catch(...) {
+                readError = std::current_exception();
+            }
+            queue.close();
+        });
+
+        std::exception_ptr error;
+        while(auto inFlight = queue.pop()) {
+            if(error) {
+                // draining after a failure: the band may still be on a worker
+                inFlight->processed.wait();
+                continue;
+            }
+            try {
+                inFlight->processed.get();
+                NCD_TRACE_SCOPE("job_commit");
+                job.commit(*inFlight->band);
+            } catch(...) {
+                error = std::current_exception();
+                aborted = true;
+                queue.close();
+            }
+        }
+        reader.join();
+        if(error) {
+            std::rethrow_exception(error);
+        }
+        if(readError) {
+            std::rethrow_exception(readError);
+        }
+    }
+
+private:
+    const NcFile& _ncFile;
+    RowBlockReader _reader;
+    ThreadPool& _pool;
+    MemoryBudget& _budget;
+    JobSchedulerOptions _options;
+};
+
+#endif //NETCDF_DANI_JOBSCHEDULER_H
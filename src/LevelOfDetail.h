@@ -0,0 +1,223 @@
+#ifndef NETCDF_DANI_LEVELOFDETAIL_H
+#define NETCDF_DANI_LEVELOFDETAIL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "NcFile.h"
+#include "ThreadPool.h"
+#include "TileStore.h"
+#include "instrumentation.h"
+#include "resample.h"
+
+// A decimated version of the elevation grid: sample (i, j) of the level stands for grid position
+// (originRow + i * factor, originCol + j * factor). Rows run south to north like in the file.
+class ElevationLevel {
+public:
+    virtual ~ElevationLevel() = default;
+
+    virtual std::size_t factor() const = 0;
+    virtual std::size_t width() const = 0;
+    virtual std::size_t height() const = 0;
+    virtual double originRow() const { return 0.0; }
+    virtual double originCol() const { return 0.0; }
+    // rows x cols samples starting at level sample (row, col), already clamped by the caller; levels that
+    // decode may spread the work over the pool
+    virtual void read(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols, int16_t* dst,
+                      ThreadPool* pool) const = 0;
+};
+
+// Every factor-th sample of the NetCDF variable, read with strided hyperslabs
+class StridedNcLevel : public ElevationLevel {
+public:
+    StridedNcLevel(const NcFile& ncFile, int varId, std::size_t gridWidth, std::size_t gridHeight, std::size_t factor)
+            : _ncFile(ncFile)
+            , _varId(varId)
+            , _factor(factor)
+            , _width((gridWidth + factor - 1) / factor)
+            , _height((gridHeight + factor - 1) / factor) {}
+
+    std::size_t factor() const override { return _factor; }
+    std::size_t width() const override { return _width; }
+    std::size_t height() const override { return _height; }
+
+    void read(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols, int16_t* dst, ThreadPool*) const override {
+        std::size_t offset[2] = {row * _factor, col * _factor};
+        std::size_t count[2] = {rows, cols};
+        if(_factor == 1) {
+            _ncFile.getInt64Data(dst, _varId, offset, count);
+            return;
+        }
+        std::ptrdiff_t stride[2] = {static_cast<std::ptrdiff_t>(_factor), static_cast<std::ptrdiff_t>(_factor)};
+        _ncFile.getInt16DataStrided(dst, _varId, offset, count, stride);
+    }
+
+private:
+    const NcFile& _ncFile;
+    int _varId{};
+    std::size_t _factor{};
+    std::size_t _width{};
+    std::size_t _height{};
+};
+
+// A pre-decimated level already in memory, e.g. the viewer's overview or a pyramid level
+class MemoryLevel : public ElevationLevel {
+public:
+    MemoryLevel(const int16_t* data, std::size_t width, std::size_t height, std::size_t factor,
+                double originRow = 0.0, double originCol = 0.0)
+            : _data(data), _width(width), _height(height), _factor(factor), _originRow(originRow), _originCol(originCol) {}
+
+    std::size_t factor() const override { return _factor; }
+    std::size_t width() const override { return _width; }
+    std::size_t height() const override { return _height; }
+    double originRow() const override { return _originRow; }
+    double originCol() const override { return _originCol; }
+
+    void read(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols, int16_t* dst, ThreadPool*) const override {
+        for(std::size_t y = 0; y < rows; ++y) {
+            const int16_t* src = _data + (row + y) * _width + col;
+            std::copy(src, src + cols, dst + y * cols);
+        }
+    }
+
+private:
+    const int16_t* _data;
+    std::size_t _width{};
+    std::size_t _height{};
+    std::size_t _factor{};
+    double _originRow{};
+    double _originCol{};
+};
+
+// An int16 tile store at the grid's resolution, e.g. a precomputed hillshade
+class TileStoreLevel : public ElevationLevel {
+public:
+    explicit TileStoreLevel(const std::string& filename) : _reader(filename) {}
+
+    std::size_t factor() const override { return 1; }
+    std::size_t width() const override { return _reader.layout().width; }
+    std::size_t height() const override { return _reader.layout().height; }
+
+    void read(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols, int16_t* dst, ThreadPool* pool) const override {
+        std::size_t offset[2] = {row, col};
+        std::size_t count[2] = {rows, cols};
+        _reader.readRegion(dst, offset, count, pool);
+    }
+
+private:
+    TileStoreReader _reader;
+};
+
+// A view onto the grid: center in grid coordinates, gridCellsPerPixel > 1 zooms out
+struct ViewWindow {
+    double centerRow{};
+    double centerCol{};
+    double gridCellsPerPixel = 1.0;
+    std::size_t width{};
+    std::size_t height{};
+};
+
+// Renders views at any scale from the closest available level: the coarsest level that is not coarser
+// than the view, so a frame reads between 1 and 4 source samples per output pixel at any zoom.
+class LevelOfDetail {
+public:
+    void addLevel(std::unique_ptr<ElevationLevel> level) {
+        _levels.push_back(std::move(level));
+        std::sort(_levels.begin(), _levels.end(), [](const auto& a, const auto& b) { return a->factor() < b->factor(); });
+    }
+
+    // Levels 1, 2, 4, ... maxFactor of the variable, read with strided NetCDF reads
+    void addStridedLevels(const NcFile& ncFile, int varId, std::size_t gridWidth, std::size_t gridHeight, std::size_t maxFactor) {
+        for(std::size_t factor = 1; factor <= maxFactor; factor *= 2) {
+            addLevel(std::make_unique<StridedNcLevel>(ncFile, varId, gridWidth, gridHeight, factor));
+        }
+    }
+
+    bool empty() const { return _levels.empty(); }
+
+    const ElevationLevel& levelFor(double gridCellsPerPixel) const {
+        if(_levels.empty()) {
+            throw std::runtime_error("LevelOfDetail: no levels");
+        }
+        const ElevationLevel* best = _levels.front().get();
+        for(const auto& level : _levels) {
+            if(static_cast<double>(level->factor()) <= gridCellsPerPixel) {
+                best = level.get();
+            }
+        }
+        return *best;
+    }
+
+    // Fills dst with view.height rows of view.width samples, south to north. Returns the number of source samples read.
+    std::size_t render(const ViewWindow& view, int16_t* dst, ThreadPool* pool = nullptr) const {
+        const auto& level = levelFor(view.gridCellsPerPixel);
+        const double factor = static_cast<double>(level.factor());
+        const double step = view.gridCellsPerPixel / factor;
+
+        // level coordinates of output pixel (0, 0) and of the last pixel
+        const double x0 = (view.centerCol - 0.5 * (view.width - 1.0) * view.gridCellsPerPixel - level.originCol()) / factor;
+        const double y0 = (view.centerRow - 0.5 * (view.height - 1.0) * view.gridCellsPerPixel - level.originRow()) / factor;
+        const double x1 = x0 + (view.width - 1.0) * step;
+        const double y1 = y0 + (view.height - 1.0) * step;
+
+        const std::size_t colBegin = _clampIndex(std::floor(x0), level.width());
+        const std::size_t colEnd = _clampIndex(std::floor(x1) + 1.0, level.width()) + 1;
+        const std::size_t rowBegin = _clampIndex(std::floor(y0), level.height());
+        const std::size_t rowEnd = _clampIndex(std::floor(y1) + 1.0, level.height()) + 1;
+        const std::size_t cols = colEnd - colBegin;
+        const std::size_t rows = rowEnd - rowBegin;
+
+        // per-thread scratch buffer: no allocation per frame once warmed up, and render() stays reentrant
+        thread_local std::vector<int16_t> window;
+        window.resize(rows * cols);
+        NCD_TRACE_SCOPE("lod_render");
+        level.read(rowBegin, colBegin, rows, cols, window.data(), pool);
+        resample_bilinear(window.data(), cols, rows, x0 - colBegin, y0 - rowBegin, step, step,
+                          dst, view.width, view.height, pool);
+        return rows * cols;
+    }
+
+    // Fills dst with rowMap.size() rows of colMap.size() samples, pixel (y, x) sampling grid position
+    // (rowMap[y], colMap[x]): the lookup tables of a reprojection (reproject.h). Rows come in rowMap's order.
+    // gridCellsPerPixel picks the level, for Mercator the horizontal scale. Returns the number of source samples read.
+    std::size_t renderMapped(const std::vector<double>& rowMap, const std::vector<double>& colMap, double gridCellsPerPixel,
+                             int16_t* dst, ThreadPool* pool = nullptr) const {
+        if(rowMap.empty() || colMap.empty()) {
+            return 0;
+        }
+        const auto& level = levelFor(gridCellsPerPixel);
+        const double factor = static_cast<double>(level.factor());
+        const auto rowRange = std::minmax_element(rowMap.begin(), rowMap.end());
+        const auto colRange = std::minmax_element(colMap.begin(), colMap.end());
+
+        const std::size_t colBegin = _clampIndex(std::floor((*colRange.first - level.originCol()) / factor), level.width());
+        const std::size_t colEnd = _clampIndex(std::floor((*colRange.second - level.originCol()) / factor) + 1.0, level.width()) + 1;
+        const std::size_t rowBegin = _clampIndex(std::floor((*rowRange.first - level.originRow()) / factor), level.height());
+        const std::size_t rowEnd = _clampIndex(std::floor((*rowRange.second - level.originRow()) / factor) + 1.0, level.height()) + 1;
+        const std::size_t cols = colEnd - colBegin;
+        const std::size_t rows = rowEnd - rowBegin;
+
+        thread_local std::vector<int16_t> window;
+        window.resize(rows * cols);
+        NCD_TRACE_SCOPE("lod_render");
+        level.read(rowBegin, colBegin, rows, cols, window.data(), pool);
+        const ResampleAxis xAxis(colMap.data(), colMap.size(), level.originCol() + colBegin * factor, factor, cols);
+        const ResampleAxis yAxis(rowMap.data(), rowMap.size(), level.originRow() + rowBegin * factor, factor, rows);
+        resample_bilinear(window.data(), cols, rows, xAxis, yAxis, dst, pool);
+        return rows * cols;
+    }
+
+private:
+    static std::size_t _clampIndex(double coord, std::size_t size) {
+        return static_cast<std::size_t>(std::clamp(coord, 0.0, static_cast<double>(size - 1)));
+    }
+
+private:
+    std::vector<std::unique_ptr<ElevationLevel>> _levels;
+};
+
+#endif //NETCDF_DANI_LEVELOFDETAIL_H
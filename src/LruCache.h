@@ -0,0 +1,98 @@
+#ifndef NETCDF_DANI_LRUCACHE_H
+#define NETCDF_DANI_LRUCACHE_H
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+// Thread-safe least-recently-used cache bounded by the total cost of its values
+// (1 per entry unless a cost function is given, e.g. the byte size of encoded tiles).
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+public:
+    using CostFunction = std::function<std::size_t(const Value&)>;
+
+    explicit LruCache(std::size_t capacity, CostFunction cost = [](const Value&) { return std::size_t{1}; })
+            : _capacity(capacity), _cost(std::move(cost)) {}
+
+    LruCache(const LruCache&) = delete;
+    LruCache& operator=(const LruCache&) = delete;
+
+    std::optional<Value> get(const Key& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if(it == _index.end()) {
+            ++_misses;
+            return std::nullopt;
+        }
+        ++_hits;
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return it->second->value;
+    }
+
+    void put(const Key& key, Value value) {
+        const auto cost = _cost(value);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(auto it = _index.find(key); it != _index.end()) {
+            _totalCost -= it->second->cost;
+            _entries.erase(it->second);
+            _index.erase(it);
+        }
+        if(cost > _capacity) {
+            return;
+        }
+        _entries.push_front(Entry{key, std::move(value), cost});
+        _index.emplace(key, _entries.begin());
+        _totalCost += cost;
+        while(_totalCost > _capacity) {
+            auto& last = _entries.back();
+            _totalCost -= last.cost;
+            _index.erase(last.key);
+            _entries.pop_back();
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.clear();
+        _index.clear();
+        _totalCost = 0;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _entries.size();
+    }
+
+    std::size_t totalCost() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _totalCost;
+    }
+
+    std::pair<std::size_t, std::size_t> hitsAndMisses() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return {_hits, _misses};
+    }
+
+private:
+    struct Entry {
+        Key key;
+        Value value;
+        std::size_t cost{};
+    };
+
+    const std::size_t _capacity;
+    CostFunction _cost;
+    mutable std::mutex _mutex;
+    std::list<Entry> _entries; // most recently used first
+    std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> _index;
+    std::size_t _totalCost = 0;
+    std::size_t _hits = 0;
+    std::size_t _misses = 0;
+};
+
+#endif //NETCDF_DANI_LRUCACHE_H
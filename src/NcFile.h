@@ -1,11 +1,18 @@
 #ifndef NETCDF_DANI_NCFILE_H
 #define NETCDF_DANI_NCFILE_H
 
+#include <algorithm>
 #include <vector>
 #include <optional>
 #include <stdexcept>
+#include <mutex>
+#include <string>
+#include <cstddef>
+#include <cstdint>
 
 #include "netcdf.h"
+#include "NcMetadata.h"
+#include "instrumentation.h"
 
 class NcHandle {
 public:
@@ -32,12 +39,6 @@ public:
     std::optional<int> _ncid{};
 };
 
-inline NcHandle::~NcHandle() {
-    if(_ncid) {
-        nc_close(*_ncid);
-    }
-}
-
 class NcFile {
 public:
     NcFile(const NcFile&) = delete;
@@ -45,17 +46,21 @@ public:
     NcFile(NcFile&& other) noexcept = default;
     NcFile& operator=(NcFile&& other) noexcept = default;
 
-    static NcFile openForRead(const char* filename);
+    // With useMetadataCache the dimensions, variables and chunking come from the file's sidecar
+    // (NcMetadata.h) when it is still valid; otherwise they are inquired once and the sidecar is written.
+    // Without it only the dimensions are inquired up front, variables are discovered on first use.
+    static NcFile openForRead(const char* filename, bool useMetadataCache = true);
 
     int fileFormat() const;
 
     int nativeHandle() { return _ncHandle._ncid.value(); }
+    const std::string& filename() const { return _filename; }
 
-    std::size_t nDims() const { return _dims.size(); }
-    const std::vector<std::size_t>& dims() const { return _dims; }
-    const std::vector<std::string>& dimNames() const { return _dimNames; }
+    std::size_t nDims() const { return _metadata.dims.size(); }
+    const std::vector<std::size_t>& dims() const { return _metadata.dims; }
+    const std::vector<std::string>& dimNames() const { return _metadata.dimNames; }
 
-    std::size_t nVariables() const { return _variableNames.size(); }
+    std::size_t nVariables() const { return _variables().size(); }
 
     struct VariableInfo {
         int ix{};
@@ -65,95 +70,224 @@ public:
     };
 
     VariableInfo getVariableInfo(int varIx) const {
+        const auto& var = _variables().at(varIx);
         VariableInfo info;
         info.ix = varIx;
-        info.name = _variableNames.at(varIx);
-        info.type = _variableTypes.at(varIx);
-        info.dims = _variableDimIds.at(varIx);
+        info.name = var.name;
+        info.type = var.type;
+        info.dims = var.dimIds;
         return info;
     }
 
     int getVarIdByName(const char* varName) const;
     void getInt64Data(int16_t* dst, int varId, std::size_t* offset, std::size_t* count) const;
+    // Coordinate variables (lat, lon) and other floating point data, converted to double
+    void getDoubleData(double* dst, int varId, const std::size_t* offset, const std::size_t* count) const;
+    // Every stride[i]-th element along each dimension, starting at offset
+    void getInt16DataStrided(int16_t* dst, int varId, const std::size_t* offset, const std::size_t* count, const std::ptrdiff_t* stride) const;
+    // Chunk shape of a variable, one entry per variable dimension; empty for contiguous storage
+    std::vector<std::size_t> getChunkSizes(int varId) const { return _variables().at(varId).chunkSizes; }
+
+    // Min/max of a variable, if some full scan recorded it (see setValueRange)
+    std::optional<ValueRange> valueRange(int varId) const { return _variables().at(varId).range; }
+    void setValueRange(int varId, ValueRange range) {
+        _variables();
+        _metadata.variables.at(varId).range = range;
+    }
+    const std::optional<OverviewMetadata>& overview() const { return _metadata.overview; }
+    void setOverview(std::optional<OverviewMetadata> overview) { _metadata.overview = overview; }
+    // Persists the metadata including ranges/overview set since opening; false if the sidecar can't be written
+    bool saveMetadata() const;
+
+    // netCDF-C (and the HDF5 library below it) is not thread-safe, every call into it has to hold this
+    static std::mutex& libraryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
 
 private:
     explicit NcFile(int ncid) : _ncHandle(ncid) {}
     static void _throwOnError(int status) {if(status != NC_NOERR) throw std::runtime_error("nc error"); }
+    // stats only: chunks intersected by a hyperslab read, caller holds the library mutex
+    std::size_t _countChunksTouched(int varId, const std::size_t* offset, const std::size_t* count, const std::ptrdiff_t* stride) const;
     void _initDimensions();
-    void _initVariableInfo();
+    const std::vector<NcVariableMetadata>& _variables() const;
+    void _discoverVariables() const;
 
 private:
     NcHandle _ncHandle;
-    std::vector<std::size_t> _dims;
-    std::vector<std::string> _dimNames;
-
-    std::vector<std::string> _variableNames;
-    std::vector<nc_type> _variableTypes;
-    std::vector<std::vector<int>> _variableDimIds;
+    std::string _filename;
+    // variables are filled in by _discoverVariables() on first use unless they came from the sidecar
+    mutable NcFileMetadata _metadata;
+    mutable bool _variablesKnown = false;
 };
 
+// Closing is a library call like any other; the last reference to a shared file (e.g. a mosaic handle
+// evicted while reads still use it) may be dropped on any thread
+inline NcHandle::~NcHandle() {
+    if(_ncid) {
+        std::lock_guard<std::mutex> lock(NcFile::libraryMutex());
+        nc_close(*_ncid);
+    }
+}
+
 inline int NcFile::getVarIdByName(const char* varName) const {
+    std::lock_guard<std::mutex> lock(libraryMutex());
     int varId = 0;
     _throwOnError(nc_inq_varid(*_ncHandle._ncid, varName, &varId));
     return varId;
 }
 
 inline void NcFile::getInt64Data(int16_t* dst, int varId, std::size_t* offset, std::size_t* count) const {
+    std::lock_guard<std::mutex> lock(libraryMutex());
+    NCD_TRACE_SCOPE("nc_read");
     _throwOnError(nc_get_vara_short(_ncHandle.handle(), varId, offset, count, dst));
+#if NETCDF_DANI_STATS
+    _discoverVariables();
+    std::size_t nValues = 1;
+    for(std::size_t dimIx = 0; dimIx < _metadata.variables.at(varId).dimIds.size(); ++dimIx) {
+        nValues *= count[dimIx];
+    }
+    NCD_COUNT(BytesRead, nValues * sizeof(int16_t));
+    NCD_COUNT(ChunksTouched, _countChunksTouched(varId, offset, count, nullptr));
+#endif
+}
+
+inline void NcFile::getDoubleData(double* dst, int varId, const std::size_t* offset, const std::size_t* count) const {
+    std::lock_guard<std::mutex> lock(libraryMutex());
+    NCD_TRACE_SCOPE("nc_read");
+    _throwOnError(nc_get_vara_double(_ncHandle.handle(), varId, offset, count, dst));
+}
+
+inline void NcFile::getInt16DataStrided(int16_t* dst, int varId, const std::size_t* offset, const std::size_t* count, const std::ptrdiff_t* stride) const {
+    std::lock_guard<std::mutex> lock(libraryMutex());
+    NCD_TRACE_SCOPE("nc_read_strided");
+    _throwOnError(nc_get_vars_short(_ncHandle.handle(), varId, offset, count, stride, dst));
+#if NETCDF_DANI_STATS
+    _discoverVariables();
+    std::size_t nValues = 1;
+    for(std::size_t dimIx = 0; dimIx < _metadata.variables.at(varId).dimIds.size(); ++dimIx) {
+        nValues *= count[dimIx];
+    }
+    NCD_COUNT(BytesRead, nValues * sizeof(int16_t));
+    NCD_COUNT(ChunksTouched, _countChunksTouched(varId, offset, count, stride));
+#endif
+}
+
+inline std::size_t NcFile::_countChunksTouched(int varId, const std::size_t* offset, const std::size_t* count, const std::ptrdiff_t* stride) const {
+    const auto& chunkSizes = _metadata.variables.at(varId).chunkSizes;
+    const std::size_t ndims = chunkSizes.size();
+    if(ndims == 0) {
+        return 0;
+    }
+    std::size_t nChunks = 1;
+    for(std::size_t dimIx = 0; dimIx < ndims; ++dimIx) {
+        if(count[dimIx] == 0) {
+            return 0;
+        }
+        const std::size_t step = stride ? static_cast<std::size_t>(stride[dimIx]) : 1;
+        const std::size_t first = offset[dimIx];
+        const std::size_t last = offset[dimIx] + (count[dimIx] - 1) * step;
+        const std::size_t span = last / chunkSizes[dimIx] - first / chunkSizes[dimIx] + 1;
+        // a stride longer than a chunk skips the chunks in between
+        nChunks *= step > chunkSizes[dimIx] ? std::min(span, count[dimIx]) : span;
+    }
+    return nChunks;
 }
 
 inline void NcFile::_initDimensions() {
     int ndims = 0;
     _throwOnError(nc_inq_ndims(_ncHandle.handle(), &ndims));
-    _dims.resize(ndims);
-    _dimNames.resize(ndims);
+    _metadata.dims.resize(ndims);
+    _metadata.dimNames.resize(ndims);
     for(int dimIx = 0; dimIx < ndims; ++dimIx) {
         char dimname[NC_MAX_NAME + 1];
         size_t dimlen{};
         _throwOnError(nc_inq_dim(_ncHandle.handle(), dimIx, dimname, &dimlen));
-        _dims[dimIx] = dimlen;
-        _dimNames[dimIx] = std::string(dimname);
+        _metadata.dims[dimIx] = dimlen;
+        _metadata.dimNames[dimIx] = std::string(dimname);
     }
 }
 
-inline void NcFile::_initVariableInfo() {
+inline const std::vector<NcVariableMetadata>& NcFile::_variables() const {
+    std::lock_guard<std::mutex> lock(libraryMutex());
+    _discoverVariables();
+    return _metadata.variables;
+}
+
+inline bool NcFile::saveMetadata() const {
+    _variables();
+    if(!NcFileMetadata::fileStamp(_filename, _metadata.fileSize, _metadata.fileTime)) {
+        return false;
+    }
+    return _metadata.save(_filename);
+}
+
+// Caller holds the library mutex
+inline void NcFile::_discoverVariables() const {
+    if(_variablesKnown) {
+        return;
+    }
     int nvars = 0;
     _throwOnError(nc_inq_nvars(_ncHandle.handle(), &nvars));
-    _variableNames.resize(nvars);
-    _variableTypes.resize(nvars);
-    _variableDimIds.resize(nvars);
-    // Get variable information
+    std::vector<NcVariableMetadata> variables(nvars);
     for(int varix = 0; varix < nvars; varix++) {
         char varname[NC_MAX_NAME + 1];
         nc_type xtype;
         int ndims = 0;
         int dimids[NC_MAX_VAR_DIMS];
         _throwOnError(nc_inq_var(_ncHandle.handle(), varix, varname, &xtype, &ndims, dimids, NULL));
-        _variableNames[varix] = std::string(varname);
-        _variableTypes[varix] = xtype;
+        auto& var = variables[varix];
+        var.name = std::string(varname);
+        var.type = xtype;
+        var.dimIds.assign(dimids, dimids + ndims);
 
-        _variableDimIds[varix].resize(ndims);
-        for(int dimIx = 0; dimIx < ndims; ++dimIx) {
-            _variableDimIds[varix][dimIx] = dimids[dimIx];
+        int storage = 0;
+        std::vector<std::size_t> chunkSizes(ndims);
+        _throwOnError(nc_inq_var_chunking(_ncHandle.handle(), varix, &storage, chunkSizes.data()));
+        if(storage == NC_CHUNKED) {
+            var.chunkSizes = std::move(chunkSizes);
         }
     }
+    _metadata.variables = std::move(variables);
+    _variablesKnown = true;
 }
 
 inline int NcFile::fileFormat() const {
+    std::lock_guard<std::mutex> lock(libraryMutex());
     int format = 0;
     _throwOnError(nc_inq_format(_ncHandle.handle(), &format));
     return format;
 }
 
-inline NcFile NcFile::openForRead(const char* filename) {
+inline NcFile NcFile::openForRead(const char* filename, bool useMetadataCache) {
+    std::lock_guard<std::mutex> lock(libraryMutex());
     int ncid = 0;
     int status = nc_open(filename, NC_NOWRITE, &ncid);
     if(status != NC_NOERR) {
         throw std::runtime_error("Open error");
     }
     auto file = NcFile(ncid);
-    file._initDimensions();
-    file._initVariableInfo();
+    try {
+        file._filename = filename;
+        if(useMetadataCache) {
+            if(auto cached = NcFileMetadata::load(file._filename)) {
+                file._metadata = std::move(*cached);
+                file._variablesKnown = true;
+                return file;
+            }
+        }
+        file._initDimensions();
+        if(useMetadataCache && NcFileMetadata::fileStamp(file._filename, file._metadata.fileSize, file._metadata.fileTime)) {
+            file._discoverVariables();
+            file._metadata.save(file._filename);
+        }
+    } catch(...) {
+        // the lock is held, so close here rather than in the handle's destructor
+        file._ncHandle._ncid.reset();
+        nc_close(ncid);
+        throw;
+    }
     return file;
 }
 
@@ -0,0 +1,233 @@
+#ifndef NETCDF_DANI_NCMETADATA_H
+#define NETCDF_DANI_NCMETADATA_H
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Metadata of a NetCDF file persisted in a sidecar text file next to it ("<file>.meta"), so opening
+// the file again needs no nc_inq_* walk and expensive statistics survive between runs. The sidecar
+// is only trusted while the NetCDF file's size and modification time match the recorded ones.
+
+struct ValueRange {
+    double min{};
+    double max{};
+};
+
+struct NcVariableMetadata {
+    std::string name;
+    int type{};
+    std::vector<int> dimIds;
+    std::vector<std::size_t> chunkSizes; // empty for contiguous storage
+    std::optional<ValueRange> range;
+};
+
+// A decimated copy of the elevation grid cached next to the file, see overview.h
+struct OverviewMetadata {
+    std::size_t factor{};
+    std::size_t width{};
+    std::size_t height{};
+};
+
+struct NcFileMetadata {
+    static constexpr int formatVersion = 1;
+
+    uint64_t fileSize{};
+    int64_t fileTime{};
+    std::vector<std::size_t> dims;
+    std::vector<std::string> dimNames;
+    std::vector<NcVariableMetadata> variables;
+    std::optional<OverviewMetadata> overview;
+
+    static std::string sidecarPath(const std::string& ncFilename) { return ncFilename + ".meta"; }
+    // raw int16 samples, rows south to north
+    static std::string overviewPath(const std::string& ncFilename) { return ncFilename + ".overview.raw"; }
+
+    // A temporary file next to path, unique per process and thread, for writing and renaming over path
+    static std::string tempPath(const std::string& path) {
+#ifdef _WIN32
+        const auto pid = _getpid();
+#else
+        const auto pid = getpid();
+#endif
+        return path + ".tmp." + std::to_string(pid) + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    }
+
+    static bool fileStamp(const std::string& filename, uint64_t& size, int64_t& time) {
+        std::error_code ec;
+        size = std::filesystem::file_size(filename, ec);
+        if(ec) {
+            return false;
+        }
+        auto writeTime = std::filesystem::last_write_time(filename, ec);
+        if(ec) {
+            return false;
+        }
+        time = static_cast<int64_t>(writeTime.time_since_epoch().count());
+        return true;
+    }
+
+    // The sidecar of ncFilename, if there is one and it still describes the file
+    static std::optional<NcFileMetadata> load(const std::string& ncFilename) {
+        uint64_t size = 0;
+        int64_t time = 0;
+        if(!fileStamp(ncFilename, size, time)) {
+            return std::nullopt;
+        }
+        std::ifstream ifs(sidecarPath(ncFilename));
+        if(!ifs.is_open()) {
+            return std::nullopt;
+        }
+        NcFileMetadata metadata;
+        if(!metadata._parse(ifs) || metadata.fileSize != size || metadata.fileTime != time) {
+            return std::nullopt;
+        }
+        if(metadata.overview) {
+            std::error_code ec;
+            auto overviewSize = std::filesystem::file_size(overviewPath(ncFilename), ec);
+            if(ec || overviewSize != metadata.overview->width * metadata.overview->height * sizeof(int16_t)) {
+                metadata.overview.reset();
+            }
+        }
+        return metadata;
+    }
+
+    // Written to a temporary file of this thread and renamed over the old sidecar, so readers never see a
+    // partial one and concurrent saves don't write into each other's file.
+    // Returns false if the directory is not writable; the sidecar is an optimization only.
+    bool save(const std::string& ncFilename) const {
+        const auto path = sidecarPath(ncFilename);
+        const auto tmpPath = tempPath(path);
+        {
+            std::ofstream ofs(tmpPath);
+            if(!ofs.is_open()) {
+                return false;
+            }
+            _write(ofs);
+            if(!ofs) {
+                ofs.close();
+                std::error_code ec;
+                std::filesystem::remove(tmpPath, ec);
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, path, ec);
+        if(ec) {
+            std::filesystem::remove(tmpPath, ec);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // Line based; names go last on their line so they may contain spaces
+    void _write(std::ostream& os) const {
+        os.precision(std::numeric_limits<double>::max_digits10);
+        os << "netcdf-dani-meta " << formatVersion << "\n";
+        os << "file " << fileSize << " " << fileTime << "\n";
+        os << "dims " << dims.size() << "\n";
+        for(std::size_t dimIx = 0; dimIx < dims.size(); ++dimIx) {
+            os << "dim " << dims[dimIx] << " " << dimNames[dimIx] << "\n";
+        }
+        os << "vars " << variables.size() << "\n";
+        for(const auto& var : variables) {
+            os << "var " << var.type << " " << var.dimIds.size();
+            for(auto dimId : var.dimIds) {
+                os << " " << dimId;
+            }
+            os << " " << var.chunkSizes.size();
+            for(auto chunkSize : var.chunkSizes) {
+                os << " " << chunkSize;
+            }
+            if(var.range) {
+                os << " 1 " << var.range->min << " " << var.range->max;
+            } else {
+                os << " 0";
+            }
+            os << " " << var.name << "\n";
+        }
+        if(overview) {
+            os << "overview " << overview->factor << " " << overview->width << " " << overview->height << "\n";
+        }
+    }
+
+    bool _parse(std::istream& is) {
+        std::string tag;
+        int version = 0;
+        std::size_t nDims = 0;
+        if(!(is >> tag >> version) || tag != "netcdf-dani-meta" || version != formatVersion) {
+            return false;
+        }
+        if(!(is >> tag >> fileSize >> fileTime) || tag != "file") {
+            return false;
+        }
+        if(!(is >> tag >> nDims) || tag != "dims") {
+            return false;
+        }
+        dims.resize(nDims);
+        dimNames.resize(nDims);
+        for(std::size_t dimIx = 0; dimIx < nDims; ++dimIx) {
+            if(!(is >> tag >> dims[dimIx]) || tag != "dim") {
+                return false;
+            }
+            is.get();
+            std::getline(is, dimNames[dimIx]);
+        }
+        std::size_t nVars = 0;
+        if(!(is >> tag >> nVars) || tag != "vars") {
+            return false;
+        }
+        variables.resize(nVars);
+        for(auto& var : variables) {
+            std::size_t nVarDims = 0;
+            std::size_t nChunkSizes = 0;
+            int hasRange = 0;
+            if(!(is >> tag >> var.type >> nVarDims) || tag != "var") {
+                return false;
+            }
+            var.dimIds.resize(nVarDims);
+            for(auto& dimId : var.dimIds) {
+                is >> dimId;
+            }
+            is >> nChunkSizes;
+            var.chunkSizes.resize(nChunkSizes);
+            for(auto& chunkSize : var.chunkSizes) {
+                is >> chunkSize;
+            }
+            is >> hasRange;
+            if(hasRange) {
+                ValueRange range;
+                is >> range.min >> range.max;
+                var.range = range;
+            }
+            is.get();
+            std::getline(is, var.name);
+            if(!is) {
+                return false;
+            }
+        }
+        if(is >> tag && tag == "overview") {
+            OverviewMetadata overviewMetadata;
+            if(is >> overviewMetadata.factor >> overviewMetadata.width >> overviewMetadata.height) {
+                overview = overviewMetadata;
+            }
+        }
+        return true;
+    }
+};
+
+#endif //NETCDF_DANI_NCMETADATA_H
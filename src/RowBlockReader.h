@@ -0,0 +1,86 @@
+#ifndef NETCDF_DANI_ROWBLOCKREADER_H
+#define NETCDF_DANI_ROWBLOCKREADER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "NcFile.h"
+
+// A horizontal band of full-width rows of a 2D (lat, lon) variable.
+// Rows are stored south to north, in file order.
+struct RowBlock {
+    std::size_t firstRow{};
+    std::size_t nRows{};
+    std::size_t width{};
+    std::vector<int16_t> data;
+
+    const int16_t* row(std::size_t localRowIx) const { return data.data() + localRowIx * width; }
+    int16_t* row(std::size_t localRowIx) { return data.data() + localRowIx * width; }
+    std::size_t endRow() const { return firstRow + nRows; }
+};
+
+// Streams a 2D int16 variable (elevation by default) in row blocks whose height is
+// a multiple of the variable's chunk height, so every chunk is decompressed only once.
+class RowBlockReader {
+public:
+    explicit RowBlockReader(const NcFile& ncFile, const char* varName = "elevation", std::size_t minBlockRows = 256)
+            : _ncFile(ncFile)
+            , _varId(ncFile.getVarIdByName(varName)) {
+        auto varInfo = ncFile.getVariableInfo(_varId);
+        if(varInfo.dims.size() != 2) {
+            throw std::runtime_error("RowBlockReader: 2D variable expected");
+        }
+        _height = ncFile.dims().at(varInfo.dims[0]);
+        _width = ncFile.dims().at(varInfo.dims[1]);
+
+        auto chunkSizes = ncFile.getChunkSizes(_varId);
+        _chunkRows = chunkSizes.empty() ? 1 : std::max<std::size_t>(1, chunkSizes[0]);
+        _blockRows = ((std::max<std::size_t>(1, minBlockRows) + _chunkRows - 1) / _chunkRows) * _chunkRows;
+    }
+
+    std::size_t width() const { return _width; }
+    std::size_t height() const { return _height; }
+    std::size_t chunkRows() const { return _chunkRows; }
+    std::size_t blockRows() const { return _blockRows; }
+    std::size_t nBlocks() const { return (_height + _blockRows - 1) / _blockRows; }
+    int varId() const { return _varId; }
+    const NcFile& ncFile() const { return _ncFile; }
+
+    // Reads rows [firstRow, firstRow + nRows), clamped to the grid, reusing the block's storage.
+    void readInto(RowBlock& block, std::size_t firstRow, std::size_t nRows) const {
+        firstRow = std::min(firstRow, _height);
+        nRows = std::min(nRows, _height - firstRow);
+        block.firstRow = firstRow;
+        block.nRows = nRows;
+        block.width = _width;
+        block.data.resize(nRows * _width);
+        if(nRows == 0) {
+            return;
+        }
+        std::size_t offset[2] = {firstRow, 0};
+        std::size_t count[2] = {nRows, _width};
+        _ncFile.getInt64Data(block.data.data(), _varId, offset, count);
+    }
+
+    RowBlock read(std::size_t firstRow, std::size_t nRows) const {
+        RowBlock block;
+        readInto(block, firstRow, nRows);
+        return block;
+    }
+
+    // Block blockIx of the chunk-aligned partitioning, extended by haloRows rows on its northern side
+    RowBlock readBlock(std::size_t blockIx, std::size_t haloRows = 0) const {
+        return read(blockIx * _blockRows, _blockRows + haloRows);
+    }
+
+private:
+    const NcFile& _ncFile;
+    int _varId{};
+    std::size_t _width{};
+    std::size_t _height{};
+    std::size_t _chunkRows{1};
+    std::size_t _blockRows{1};
+};
+
+#endif //NETCDF_DANI_ROWBLOCKREADER_H
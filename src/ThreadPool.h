@@ -0,0 +1,115 @@
+#ifndef NETCDF_DANI_THREADPOOL_H
+#define NETCDF_DANI_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t nThreads = defaultThreadCount()) {
+        nThreads = std::max<std::size_t>(1, nThreads);
+        _workers.reserve(nThreads);
+        for(std::size_t ix = 0; ix < nThreads; ++ix) {
+            _workers.emplace_back([this]() { _workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _cv.notify_all();
+        for(auto& worker : _workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static std::size_t defaultThreadCount() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::size_t size() const { return _workers.size(); }
+
+    template<typename F>
+    auto submit(F&& func) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        using Result = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.emplace_back([task]() { (*task)(); });
+        }
+        _cv.notify_one();
+        return future;
+    }
+
+    // Calls func(begin, end) on consecutive ranges of [0, n) and waits for all of them.
+    // Ranges are handed out dynamically, so uneven work balances itself across the workers.
+    // Must not be called from one of this pool's own workers.
+    template<typename F>
+    void parallelFor(std::size_t n, std::size_t grainSize, F&& func) {
+        if(n == 0) {
+            return;
+        }
+        grainSize = std::max<std::size_t>(1, grainSize);
+        auto next = std::make_shared<std::atomic<std::size_t>>(0);
+        auto runRanges = [next, n, grainSize, &func]() {
+            for(;;) {
+                auto begin = next->fetch_add(grainSize);
+                if(begin >= n) {
+                    return;
+                }
+                func(begin, std::min(n, begin + grainSize));
+            }
+        };
+        auto nTasks = std::min(size(), (n + grainSize - 1) / grainSize);
+        std::vector<std::future<void>> futures;
+        futures.reserve(nTasks);
+        for(std::size_t ix = 0; ix < nTasks; ++ix) {
+            futures.push_back(submit(runRanges));
+        }
+        for(auto& future : futures) {
+            future.get();
+        }
+    }
+
+private:
+    void _workerLoop() {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+                if(_tasks.empty()) {
+                    return;
+                }
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+private:
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stopping = false;
+};
+
+#endif //NETCDF_DANI_THREADPOOL_H
@@ -0,0 +1,50 @@
+#ifndef NETCDF_DANI_TILEPERIMETER_H
+#define NETCDF_DANI_TILEPERIMETER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+// Indexing of the cells on the edges of a w x h tile: the south row, the north row, then the west and
+// east columns between them. Tiled algorithms that merge tiles through their borders keep state for
+// these cells only.
+
+constexpr uint32_t notOnPerimeter = std::numeric_limits<uint32_t>::max();
+
+inline std::size_t perimeterSize(std::size_t w, std::size_t h) {
+    return h == 1 ? w : (w == 1 ? h : 2 * w + 2 * (h - 2));
+}
+
+inline uint32_t perimeterIndex(std::size_t x, std::size_t y, std::size_t w, std::size_t h) {
+    if(y == 0) {
+        return static_cast<uint32_t>(x);
+    }
+    if(y == h - 1) {
+        return static_cast<uint32_t>(w + x);
+    }
+    if(x == 0) {
+        return static_cast<uint32_t>(2 * w + y - 1);
+    }
+    if(x == w - 1) {
+        return static_cast<uint32_t>(2 * w + (h - 2) + y - 1);
+    }
+    return notOnPerimeter;
+}
+
+// Inverse of perimeterIndex: (x, y) of perimeter cell ix
+inline std::pair<std::size_t, std::size_t> perimeterCell(std::size_t ix, std::size_t w, std::size_t h) {
+    if(h == 1) {
+        return {ix, 0};
+    }
+    if(ix < w) {
+        return {ix, 0};
+    }
+    if(ix < 2 * w) {
+        return {ix - w, h - 1};
+    }
+    ix -= 2 * w;
+    return ix < h - 2 ? std::pair<std::size_t, std::size_t>{0, ix + 1} : std::pair<std::size_t, std::size_t>{w - 1, ix - (h - 2) + 1};
+}
+
+#endif //NETCDF_DANI_TILEPERIMETER_H
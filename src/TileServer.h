@@ -0,0 +1,517 @@
+#ifndef NETCDF_DANI_TILESERVER_H
+#define NETCDF_DANI_TILESERVER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "LevelOfDetail.h"
+#include "LruCache.h"
+#include "NcFile.h"
+#include "ThreadPool.h"
+#include "colors.h"
+#include "instrumentation.h"
+#include "png.h"
+#include "render_kernel.h"
+#include "reproject.h"
+
+enum class TileFormat {
+    BandedPng,     // /{z}/{x}/{y}.png, the viewer's colormap
+    HsvPng,        // /hsv/{z}/{x}/{y}.png, heightToRgb
+    TerrainRgbPng, // /terrain-rgb/{z}/{x}/{y}.png, Mapbox Terrain-RGB
+    RawInt16,      // /raw/{z}/{x}/{y}.bin, little-endian int16 rows, north to south
+};
+
+enum class TileScheme {
+    WebMercator, // standard XYZ: 2^z x 2^z tiles up to +-85.05 degrees latitude
+    Geographic,  // the grid's own plate carrée: 2^(z+1) x 2^z tiles
+};
+
+struct TileKey {
+    int z{};
+    uint32_t x{};
+    uint32_t y{};
+    TileFormat format = TileFormat::BandedPng;
+
+    bool operator==(const TileKey& other) const {
+        return z == other.z && x == other.x && y == other.y && format == other.format;
+    }
+};
+
+struct TileKeyHash {
+    std::size_t operator()(const TileKey& key) const {
+        uint64_t h = (static_cast<uint64_t>(key.z) << 58) ^ (static_cast<uint64_t>(key.x) << 29) ^ key.y;
+        return std::hash<uint64_t>()(h * 4 + static_cast<uint64_t>(key.format));
+    }
+};
+
+struct TileServerOptions {
+    uint16_t port = 8080; // 0 picks a free port, see TileServer::port()
+    TileScheme scheme = TileScheme::WebMercator;
+    std::size_t tileSize = 256;
+    int maxZoom = -1; // -1: two levels past full grid resolution
+    std::size_t cacheBytes = 256u << 20;
+    std::size_t renderThreads = ThreadPool::defaultThreadCount();
+    // connections are kept alive, each occupies one io thread while open
+    std::size_t ioThreads = 16;
+    int idleTimeoutMs = 5000;
+    // colormap parameters, like the viewer's
+    int16_t minHeight = -12000;
+    int16_t maxHeight = 9000;
+    double greenFieldLimit = 2000.0;
+    double brownFieldLimit = 4000.0;
+};
+
+// Parses "/{z}/{x}/{y}.png", "/hsv/...png", "/terrain-rgb/...png" and "/raw/...bin"; query strings are ignored
+inline std::optional<TileKey> parseTilePath(std::string path) {
+    path = path.substr(0, path.find('?'));
+    TileKey key;
+    const char* extension = ".png";
+    for(const auto& [prefix, format] : {std::pair<std::string, TileFormat>{"/hsv/", TileFormat::HsvPng},
+                                        {"/terrain-rgb/", TileFormat::TerrainRgbPng},
+                                        {"/raw/", TileFormat::RawInt16}}) {
+        if(path.compare(0, prefix.size(), prefix) == 0) {
+            key.format = format;
+            path.erase(0, prefix.size() - 1);
+            break;
+        }
+    }
+    if(key.format == TileFormat::RawInt16) {
+        extension = ".bin";
+    }
+    int z = 0;
+    unsigned long x = 0;
+    unsigned long y = 0;
+    char ext[8] = {};
+    int consumed = 0;
+    if(std::sscanf(path.c_str(), "/%d/%lu/%lu%7s%n", &z, &x, &y, ext, &consumed) != 4
+       || static_cast<std::size_t>(consumed) != path.size() || std::strcmp(ext, extension) != 0) {
+        return std::nullopt;
+    }
+    key.z = z;
+    key.x = static_cast<uint32_t>(x);
+    key.y = static_cast<uint32_t>(y);
+    return key;
+}
+
+// Serves the elevation grid as web map tiles on the loopback interface, tile (0, 0) being the north-west
+// corner. Web Mercator tiles are reprojected through cached per-tile-row/column lookup tables.
+// Tiles are rendered on demand from the level-of-detail pyramid (strided NetCDF reads plus the cached
+// overview), encoded once and kept in an LRU; concurrent requests for the same tile share one render.
+class TileServer {
+public:
+    using TileData = std::shared_ptr<const std::string>;
+
+    explicit TileServer(const NcFile& ncFile, TileServerOptions options = {})
+            : _ncFile(ncFile)
+            , _options(options)
+            , _cache(options.cacheBytes, [](const TileData& tile) { return tile->size() + 64; })
+            , _renderPool(options.renderThreads) {
+        const int varId = ncFile.getVarIdByName("elevation");
+        const auto varInfo = ncFile.getVariableInfo(varId);
+        _gridHeight = ncFile.dims().at(varInfo.dims[0]);
+        _gridWidth = ncFile.dims().at(varInfo.dims[1]);
+        _levelOfDetail.addStridedLevels(ncFile, varId, _gridWidth, _gridHeight, 32);
+        _tileMaps = std::make_unique<MercatorTileMaps>(GpsToOffsetConverter::forGrid(_gridWidth, _gridHeight), _options.tileSize);
+        _loadOverview();
+        _bandedColors = ColorTable::build([this](int16_t height) {
+            return heightToBandedRgb(height, _options.minHeight, _options.maxHeight, _options.greenFieldLimit, _options.brownFieldLimit);
+        }, &_renderPool);
+        _hsvColors = ColorTable::build([this](int16_t height) { return heightToRgb(height, _options.maxHeight, _options.minHeight); },
+                                       &_renderPool);
+        _terrainRgbColors = ColorTable::build([](int16_t height) { return heightToTerrainRgb(height); }, &_renderPool);
+        if(_options.maxZoom < 0) {
+            _options.maxZoom = 2;
+            while(_gridCellsPerPixel(_options.maxZoom - 2) > 1.0 && _options.maxZoom < 30) {
+                ++_options.maxZoom;
+            }
+        }
+    }
+
+    ~TileServer() { stop(); }
+
+    TileServer(const TileServer&) = delete;
+    TileServer& operator=(const TileServer&) = delete;
+
+    // Binds 127.0.0.1:port and starts accepting connections; throws if the port is taken
+    void start() {
+        if(_acceptThread.joinable()) {
+            return;
+        }
+#ifdef _WIN32
+        WSADATA wsaData;
+        if(WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            throw std::runtime_error("TileServer: WSAStartup failed");
+        }
+#endif
+        _listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(_listenSocket == _invalidSocket) {
+            throw std::runtime_error("TileServer: can't create socket");
+        }
+        int reuse = 1;
+        setsockopt(_listenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(_options.port);
+        if(bind(_listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(_listenSocket, 128) != 0) {
+            _closeSocket(_listenSocket);
+            _listenSocket = _invalidSocket;
+            throw std::runtime_error("TileServer: can't listen on port " + std::to_string(_options.port));
+        }
+        socklen_t addressSize = sizeof(address);
+        getsockname(_listenSocket, reinterpret_cast<sockaddr*>(&address), &addressSize);
+        _port = ntohs(address.sin_port);
+
+        _stopping = false;
+        _ioPool = std::make_unique<ThreadPool>(_options.ioThreads);
+        _acceptThread = std::thread([this]() { _acceptLoop(); });
+    }
+
+    // Closes the listening socket and all open connections, waits for in-progress requests
+    void stop() {
+        if(!_acceptThread.joinable()) {
+            return;
+        }
+        _stopping = true;
+        _acceptThread.join();
+        {
+            std::lock_guard<std::mutex> lock(_connectionsMutex);
+            for(auto connection : _connections) {
+                shutdown(connection, _shutdownBoth);
+            }
+        }
+        _ioPool.reset();
+        _closeSocket(_listenSocket);
+        _listenSocket = _invalidSocket;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    uint16_t port() const { return _port; }
+    int maxZoom() const { return _options.maxZoom; }
+    std::size_t tilesAcross(int z) const { return _options.scheme == TileScheme::Geographic ? std::size_t{2} << z : std::size_t{1} << z; }
+    std::size_t tilesDown(int z) const { return std::size_t{1} << z; }
+
+    bool isValid(const TileKey& key) const {
+        return key.z >= 0 && key.z <= _options.maxZoom && key.x < tilesAcross(key.z) && key.y < tilesDown(key.z);
+    }
+
+    // The encoded tile, from the cache or rendered now. Throws for invalid keys.
+    TileData tile(const TileKey& key) {
+        if(!isValid(key)) {
+            throw std::out_of_range("TileServer: no such tile");
+        }
+        if(auto cached = _cache.get(key)) {
+            return *cached;
+        }
+        std::shared_future<TileData> future;
+        {
+            std::lock_guard<std::mutex> lock(_inFlightMutex);
+            auto it = _inFlight.find(key);
+            if(it != _inFlight.end()) {
+                future = it->second;
+            } else {
+                // the render that just missed us may have finished in between
+                if(auto cached = _cache.get(key)) {
+                    return *cached;
+                }
+                // the task can't erase its entry before we inserted it, it needs this lock
+                future = _renderPool.submit([this, key]() {
+                    TileData data;
+                    try {
+                        data = std::make_shared<const std::string>(renderTile(key));
+                        _cache.put(key, data);
+                    } catch(...) {
+                        std::lock_guard<std::mutex> lock(_inFlightMutex);
+                        _inFlight.erase(key);
+                        throw;
+                    }
+                    std::lock_guard<std::mutex> lock(_inFlightMutex);
+                    _inFlight.erase(key);
+                    return data;
+                }).share();
+                _inFlight.emplace(key, future);
+            }
+        }
+        return future.get();
+    }
+
+    // Renders and encodes a tile without touching the cache
+    std::string renderTile(const TileKey& key) const {
+        const auto size = _options.tileSize;
+        const double gridCellsPerPixel = _gridCellsPerPixel(key.z);
+        thread_local std::vector<int16_t> heights;
+        heights.resize(size * size);
+        // Mercator tiles come north to south, geographic ones south to north
+        const bool southUp = _options.scheme == TileScheme::Geographic;
+        if(southUp) {
+            NCD_TRACE_SCOPE("tile_render");
+            ViewWindow view;
+            view.width = size;
+            view.height = size;
+            view.gridCellsPerPixel = gridCellsPerPixel;
+            view.centerCol = (key.x + 0.5) * size * gridCellsPerPixel - 0.5;
+            view.centerRow = static_cast<double>(_gridHeight) - (key.y + 0.5) * size * gridCellsPerPixel - 0.5;
+            _levelOfDetail.render(view, heights.data());
+        } else {
+            auto rows = _tileMaps->rows(key.z, key.y);
+            auto cols = _tileMaps->cols(key.z, key.x);
+            NCD_TRACE_SCOPE("tile_render");
+            _levelOfDetail.renderMapped(*rows, *cols, gridCellsPerPixel, heights.data());
+        }
+        auto sourceRow = [&](std::size_t y) { return heights.data() + (southUp ? size - 1 - y : y) * size; };
+
+        NCD_TRACE_SCOPE("tile_encode");
+        if(key.format == TileFormat::RawInt16) {
+            std::string raw(size * size * sizeof(int16_t), '\0');
+            for(std::size_t y = 0; y < size; ++y) {
+                const int16_t* src = sourceRow(y);
+                for(std::size_t x = 0; x < size; ++x) {
+                    const auto value = static_cast<uint16_t>(src[x]);
+                    raw[(y * size + x) * 2] = static_cast<char>(value & 0xff);
+                    raw[(y * size + x) * 2 + 1] = static_cast<char>(value >> 8);
+                }
+            }
+            return raw;
+        }
+
+        thread_local std::vector<uint8_t> rgb;
+        rgb.resize(size * size * 3);
+        RenderOptions options;
+        options.format = PixelFormat::Rgb888;
+        options.flipRows = southUp;
+        const auto& colors = key.format == TileFormat::HsvPng ? _hsvColors
+                             : key.format == TileFormat::TerrainRgbPng ? _terrainRgbColors : _bandedColors;
+        // already on a render worker, so no row parallelism here
+        render_heights(heights.data(), size, size, colors, options, rgb.data(), size * 3);
+        NCD_COUNT(PixelsShaded, size * size);
+        auto png = encodePng(rgb.data(), size, size, 3);
+        return std::string(png.begin(), png.end());
+    }
+
+    std::pair<std::size_t, std::size_t> cacheHitsAndMisses() const { return _cache.hitsAndMisses(); }
+
+private:
+#ifdef _WIN32
+    using Socket = SOCKET;
+    static constexpr Socket _invalidSocket = INVALID_SOCKET;
+    static constexpr int _shutdownBoth = SD_BOTH;
+    static void _closeSocket(Socket socket) { if(socket != _invalidSocket) closesocket(socket); }
+    static int _poll(pollfd* fds, int timeoutMs) { return WSAPoll(fds, 1, timeoutMs); }
+#else
+    using Socket = int;
+    static constexpr Socket _invalidSocket = -1;
+    static constexpr int _shutdownBoth = SHUT_RDWR;
+    static void _closeSocket(Socket socket) { if(socket != _invalidSocket) close(socket); }
+    static int _poll(pollfd* fds, int timeoutMs) { return poll(fds, 1, timeoutMs); }
+#endif
+
+    double _gridCellsPerPixel(int z) const {
+        return static_cast<double>(_gridWidth) / (static_cast<double>(_options.tileSize) * static_cast<double>(tilesAcross(z)));
+    }
+
+    // The sidecar's overview (see ensure_cached_overview) makes the low zooms memory-only
+    void _loadOverview() {
+        const auto& overview = _ncFile.overview();
+        if(!overview) {
+            return;
+        }
+        std::ifstream ifs(NcFileMetadata::overviewPath(_ncFile.filename()), std::ios::binary);
+        _overviewData.resize(overview->width * overview->height);
+        if(!ifs.read(reinterpret_cast<char*>(_overviewData.data()), _overviewData.size() * sizeof(int16_t))) {
+            _overviewData.clear();
+            return;
+        }
+        // every factor-th row, columns averaged over factor cells
+        const double originCol = (overview->factor - 1) / 2.0;
+        _levelOfDetail.addLevel(std::make_unique<MemoryLevel>(_overviewData.data(), overview->width, overview->height,
+                                                              overview->factor, 0.0, originCol));
+    }
+
+    void _acceptLoop() {
+        while(!_stopping) {
+            pollfd listenFd{};
+            listenFd.fd = _listenSocket;
+            listenFd.events = POLLIN;
+            if(_poll(&listenFd, 100) <= 0) {
+                continue;
+            }
+            Socket connection = accept(_listenSocket, nullptr, nullptr);
+            if(connection == _invalidSocket) {
+                continue;
+            }
+            int noDelay = 1;
+            setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+            {
+                std::lock_guard<std::mutex> lock(_connectionsMutex);
+                _connections.insert(connection);
+            }
+            _ioPool->submit([this, connection]() {
+                try {
+                    _serveConnection(connection);
+                } catch(...) {
+                }
+                {
+                    std::lock_guard<std::mutex> lock(_connectionsMutex);
+                    _connections.erase(connection);
+                }
+                _closeSocket(connection);
+            });
+        }
+    }
+
+    // HTTP/1.1 GET with keep-alive; anything unexpected closes the connection
+    void _serveConnection(Socket connection) {
+        std::string buffer;
+        char chunk[4096];
+        for(;;) {
+            std::size_t headerEnd;
+            while((headerEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+                if(_stopping || buffer.size() > 16384) {
+                    return;
+                }
+                pollfd connectionFd{};
+                connectionFd.fd = connection;
+                connectionFd.events = POLLIN;
+                if(_poll(&connectionFd, _options.idleTimeoutMs) <= 0) {
+                    return;
+                }
+                const auto received = recv(connection, chunk, sizeof(chunk), 0);
+                if(received <= 0) {
+                    return;
+                }
+                buffer.append(chunk, static_cast<std::size_t>(received));
+            }
+            const std::string request = buffer.substr(0, headerEnd);
+            buffer.erase(0, headerEnd + 4);
+
+            const auto methodEnd = request.find(' ');
+            const auto pathEnd = request.find(' ', methodEnd + 1);
+            if(methodEnd == std::string::npos || pathEnd == std::string::npos) {
+                return;
+            }
+            const auto method = request.substr(0, methodEnd);
+            const auto path = request.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+            std::string lowerRequest = request;
+            std::transform(lowerRequest.begin(), lowerRequest.end(), lowerRequest.begin(), [](unsigned char c) { return std::tolower(c); });
+            const bool keepAlive = lowerRequest.find("connection: close") == std::string::npos
+                                   && request.compare(pathEnd + 1, 8, "HTTP/1.0") != 0;
+
+            if(!_respond(connection, method, path, keepAlive) || !keepAlive) {
+                return;
+            }
+        }
+    }
+
+    bool _respond(Socket connection, const std::string& method, const std::string& path, bool keepAlive) {
+        int status = 200;
+        const char* contentType = "image/png";
+        TileData body;
+        auto key = parseTilePath(path);
+        if(method != "GET" && method != "HEAD") {
+            status = 405;
+        } else if(!key || !isValid(*key)) {
+            status = 404;
+        } else {
+            try {
+                body = tile(*key);
+                if(key->format == TileFormat::RawInt16) {
+                    contentType = "application/octet-stream";
+                }
+            } catch(const std::exception&) {
+                status = 500;
+            }
+        }
+        const char* reason = status == 200 ? "OK" : status == 404 ? "Not Found" : status == 405 ? "Method Not Allowed" : "Internal Server Error";
+        const std::size_t contentLength = body ? body->size() : 0;
+
+        std::string header = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n";
+        if(status == 200) {
+            header += std::string("Content-Type: ") + contentType + "\r\nCache-Control: max-age=3600\r\n";
+        }
+        header += "Content-Length: " + std::to_string(contentLength) + "\r\n"
+                  "Access-Control-Allow-Origin: *\r\n"
+                  "Connection: " + (keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+        if(!_sendAll(connection, header.data(), header.size())) {
+            return false;
+        }
+        return method == "HEAD" || !body || _sendAll(connection, body->data(), body->size());
+    }
+
+    static bool _sendAll(Socket connection, const char* data, std::size_t size) {
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        while(size > 0) {
+            const auto sent = send(connection, data, static_cast<int>(std::min<std::size_t>(size, 1 << 30)), flags);
+            if(sent <= 0) {
+                return false;
+            }
+            data += sent;
+            size -= static_cast<std::size_t>(sent);
+        }
+        return true;
+    }
+
+private:
+    const NcFile& _ncFile;
+    TileServerOptions _options;
+    std::size_t _gridWidth{};
+    std::size_t _gridHeight{};
+    LevelOfDetail _levelOfDetail;
+    std::vector<int16_t> _overviewData;
+    std::unique_ptr<MercatorTileMaps> _tileMaps;
+    // the colormaps of the png formats, fixed by the options
+    ColorTable _bandedColors;
+    ColorTable _hsvColors;
+    ColorTable _terrainRgbColors;
+
+    LruCache<TileKey, TileData, TileKeyHash> _cache;
+    std::mutex _inFlightMutex;
+    std::unordered_map<TileKey, std::shared_future<TileData>, TileKeyHash> _inFlight;
+
+    ThreadPool _renderPool;
+    std::unique_ptr<ThreadPool> _ioPool;
+    std::thread _acceptThread;
+    std::atomic<bool> _stopping{false};
+    Socket _listenSocket = _invalidSocket;
+    uint16_t _port{};
+    std::mutex _connectionsMutex;
+    std::set<Socket> _connections;
+};
+
+#endif //NETCDF_DANI_TILESERVER_H
@@ -0,0 +1,373 @@
+#ifndef NETCDF_DANI_TILESTORE_H
+#define NETCDF_DANI_TILESTORE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "AsyncFileReader.h"
+#include "ThreadPool.h"
+#include "terrain_codec.h"
+
+// A 2D raster split into square tiles that are stored independently, so any region can be read
+// without touching the rest of the file. Int16 tiles are compressed with the terrain codec,
+// Float32 tiles are stored raw. Rows are in file order (south to north), like the NetCDF grid.
+//
+// File: 64 byte header, the tiles in the order they were written, then the tile index
+// (u64 offset, u64 size per tile, row-major; size 0 for a tile that was never written).
+
+enum class TileSampleType : uint8_t {
+    Int16 = 0,
+    Float32 = 1,
+};
+
+struct TileStoreLayout {
+    std::size_t width{};
+    std::size_t height{};
+    std::size_t tileSize = 256;
+    TileSampleType sampleType = TileSampleType::Int16;
+    // physical value = stored value * scale + offset, e.g. for quantized derived products
+    double scale = 1.0;
+    double offset = 0.0;
+
+    std::size_t tilesAcross() const { return (width + tileSize - 1) / tileSize; }
+    std::size_t tilesDown() const { return (height + tileSize - 1) / tileSize; }
+    std::size_t nTiles() const { return tilesAcross() * tilesDown(); }
+    std::size_t bytesPerSample() const { return sampleType == TileSampleType::Int16 ? 2 : 4; }
+    // edge tiles are clipped to the raster
+    std::size_t tileWidth(std::size_t tileX) const { return std::min(tileSize, width - tileX * tileSize); }
+    std::size_t tileHeight(std::size_t tileY) const { return std::min(tileSize, height - tileY * tileSize); }
+};
+
+namespace tile_store_detail {
+
+constexpr uint32_t magic = 0x5354434e; // "NCTS"
+constexpr uint32_t version = 1;
+constexpr std::size_t headerSize = 64;
+
+template<typename T>
+void put(uint8_t* dst, T value) {
+    std::memcpy(dst, &value, sizeof(T));
+}
+
+template<typename T>
+T get(const uint8_t* src) {
+    T value;
+    std::memcpy(&value, src, sizeof(T));
+    return value;
+}
+
+} // namespace tile_store_detail
+
+// Tiles can be encoded concurrently with encodeTile() and written in any order; the index goes at the end.
+class TileStoreWriter {
+public:
+    TileStoreWriter(const std::string& filename, const TileStoreLayout& layout)
+            : _layout(layout)
+            , _ofs(filename, std::ios::binary)
+            , _index(2 * layout.nTiles(), 0) {
+        if(!_ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+        if(layout.tileSize == 0 || layout.width == 0 || layout.height == 0) {
+            throw std::runtime_error("TileStoreWriter: empty layout");
+        }
+        _writeHeader(0);
+    }
+
+    ~TileStoreWriter() {
+        try {
+            finish();
+        } catch(...) {
+        }
+    }
+
+    TileStoreWriter(const TileStoreWriter&) = delete;
+    TileStoreWriter& operator=(const TileStoreWriter&) = delete;
+
+    const TileStoreLayout& layout() const { return _layout; }
+
+    // samples: tileWidth(tileX) * tileHeight(tileY) values of the layout's sample type, rows consecutive. Thread-safe.
+    std::vector<uint8_t> encodeTile(std::size_t tileX, std::size_t tileY, const void* samples) const {
+        const auto w = _layout.tileWidth(tileX);
+        const auto h = _layout.tileHeight(tileY);
+        if(_layout.sampleType == TileSampleType::Int16) {
+            return encodeTerrain(static_cast<const int16_t*>(samples), w, h);
+        }
+        const auto* bytes = static_cast<const uint8_t*>(samples);
+        return std::vector<uint8_t>(bytes, bytes + w * h * _layout.bytesPerSample());
+    }
+
+    void writeTile(std::size_t tileX, std::size_t tileY, const std::vector<uint8_t>& encoded) {
+        const auto tileIx = tileY * _layout.tilesAcross() + tileX;
+        if(tileX >= _layout.tilesAcross() || tileIx >= _layout.nTiles()) {
+            throw std::runtime_error("TileStoreWriter: tile out of range");
+        }
+        _index[2 * tileIx] = static_cast<uint64_t>(_ofs.tellp());
+        _index[2 * tileIx + 1] = encoded.size();
+        _ofs.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+    }
+
+    void finish() {
+        if(_finished) {
+            return;
+        }
+        _finished = true;
+        const auto indexOffset = static_cast<uint64_t>(_ofs.tellp());
+        _ofs.write(reinterpret_cast<const char*>(_index.data()), _index.size() * sizeof(uint64_t));
+        _ofs.seekp(0);
+        _writeHeader(indexOffset);
+        _ofs.flush();
+        if(!_ofs) {
+            throw std::runtime_error("TileStoreWriter: write failed");
+        }
+    }
+
+private:
+    void _writeHeader(uint64_t indexOffset) {
+        using namespace tile_store_detail;
+        uint8_t header[headerSize] = {};
+        put<uint32_t>(header, magic);
+        put<uint32_t>(header + 4, version);
+        put<uint64_t>(header + 8, _layout.width);
+        put<uint64_t>(header + 16, _layout.height);
+        put<uint32_t>(header + 24, static_cast<uint32_t>(_layout.tileSize));
+        put<uint8_t>(header + 28, static_cast<uint8_t>(_layout.sampleType));
+        put<double>(header + 32, _layout.scale);
+        put<double>(header + 40, _layout.offset);
+        put<uint64_t>(header + 48, indexOffset);
+        _ofs.write(reinterpret_cast<const char*>(header), headerSize);
+    }
+
+private:
+    TileStoreLayout _layout;
+    std::ofstream _ofs;
+    std::vector<uint64_t> _index; // offset, size per tile
+    bool _finished = false;
+};
+
+// Random access to a tile store; all methods are thread-safe
+class TileStoreReader {
+public:
+    explicit TileStoreReader(const std::string& filename)
+            : _filename(filename)
+            , _ifs(filename, std::ios::binary) {
+        using namespace tile_store_detail;
+        if(!_ifs.is_open()) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+        uint8_t header[headerSize] = {};
+        _ifs.read(reinterpret_cast<char*>(header), headerSize);
+        if(!_ifs || get<uint32_t>(header) != magic || get<uint32_t>(header + 4) != version) {
+            throw std::runtime_error("TileStoreReader: not a tile store: " + filename);
+        }
+        _layout.width = get<uint64_t>(header + 8);
+        _layout.height = get<uint64_t>(header + 16);
+        _layout.tileSize = get<uint32_t>(header + 24);
+        _layout.sampleType = static_cast<TileSampleType>(get<uint8_t>(header + 28));
+        _layout.scale = get<double>(header + 32);
+        _layout.offset = get<double>(header + 40);
+        const auto indexOffset = get<uint64_t>(header + 48);
+        if(indexOffset == 0 || _layout.tileSize == 0) {
+            throw std::runtime_error("TileStoreReader: unfinished tile store: " + filename);
+        }
+        _index.resize(2 * _layout.nTiles());
+        _ifs.seekg(static_cast<std::streamoff>(indexOffset));
+        _ifs.read(reinterpret_cast<char*>(_index.data()), _index.size() * sizeof(uint64_t));
+        if(!_ifs) {
+            throw std::runtime_error("TileStoreReader: truncated index: " + filename);
+        }
+    }
+
+    const TileStoreLayout& layout() const { return _layout; }
+    const std::string& filename() const { return _filename; }
+
+    bool hasTile(std::size_t tileX, std::size_t tileY) const { return _index.at(2 * _tileIx(tileX, tileY) + 1) != 0; }
+    // where the tile's bytes are in the file, for readers that do their own I/O
+    uint64_t tileOffset(std::size_t tileX, std::size_t tileY) const { return _index.at(2 * _tileIx(tileX, tileY)); }
+    uint64_t tileByteSize(std::size_t tileX, std::size_t tileY) const { return _index.at(2 * _tileIx(tileX, tileY) + 1); }
+
+    std::vector<uint8_t> readEncodedTile(std::size_t tileX, std::size_t tileY) const {
+        const auto tileIx = _tileIx(tileX, tileY);
+        std::vector<uint8_t> encoded(_index.at(2 * tileIx + 1));
+        if(encoded.empty()) {
+            return encoded;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _ifs.seekg(static_cast<std::streamoff>(_index[2 * tileIx]));
+        _ifs.read(reinterpret_cast<char*>(encoded.data()), encoded.size());
+        if(!_ifs) {
+            _ifs.clear();
+            throw std::runtime_error("TileStoreReader: read failed: " + _filename);
+        }
+        return encoded;
+    }
+
+    // Decodes into tileWidth * tileHeight samples of the store's type; missing tiles decode to zeros
+    void decodeTile(std::size_t tileX, std::size_t tileY, const uint8_t* encoded, std::size_t size, void* dst) const {
+        const auto w = _layout.tileWidth(tileX);
+        const auto h = _layout.tileHeight(tileY);
+        if(size == 0) {
+            std::memset(dst, 0, w * h * _layout.bytesPerSample());
+            return;
+        }
+        if(_layout.sampleType == TileSampleType::Int16) {
+            decodeTerrain(encoded, size, static_cast<int16_t*>(dst), w, h);
+            return;
+        }
+        if(size != w * h * _layout.bytesPerSample()) {
+            throw std::runtime_error("TileStoreReader: bad tile size");
+        }
+        std::memcpy(dst, encoded, size);
+    }
+
+    void decodeTile(std::size_t tileX, std::size_t tileY, const std::vector<uint8_t>& encoded, void* dst) const {
+        decodeTile(tileX, tileY, encoded.data(), encoded.size(), dst);
+    }
+
+    void readTile(std::size_t tileX, std::size_t tileY, void* dst) const {
+        decodeTile(tileX, tileY, readEncodedTile(tileX, tileY), dst);
+    }
+
+    // Reads the tiles (tileX, tileY) with one batch of asynchronous reads and calls onTile(tileX, tileY, decoded)
+    // for each in completion order, on the workers if given; decoded is valid during the call. Batches run one
+    // at a time; with wait false this returns false instead of waiting for another caller's batch.
+    template<typename F>
+    bool readTiles(const std::vector<std::pair<std::size_t, std::size_t>>& tiles, F&& onTile, ThreadPool* workers = nullptr,
+                   bool wait = true) const {
+        std::vector<AsyncReadRequest> requests;
+        std::vector<std::size_t> requestTile;
+        std::vector<std::size_t> missingTiles;
+        for(std::size_t ix = 0; ix < tiles.size(); ++ix) {
+            const auto tileIx = _tileIx(tiles[ix].first, tiles[ix].second);
+            if(_index[2 * tileIx + 1] == 0) {
+                missingTiles.push_back(ix);
+                continue;
+            }
+            requests.push_back(AsyncReadRequest{_index[2 * tileIx], static_cast<std::size_t>(_index[2 * tileIx + 1])});
+            requestTile.push_back(ix);
+        }
+        auto decodeAndHandle = [&](std::size_t ix, const uint8_t* encoded, std::size_t size) {
+            thread_local std::vector<uint8_t> decoded;
+            decoded.resize(_layout.tileSize * _layout.tileSize * _layout.bytesPerSample());
+            const auto [tileX, tileY] = tiles[ix];
+            decodeTile(tileX, tileY, encoded, size, decoded.data());
+            onTile(tileX, tileY, static_cast<const void*>(decoded.data()));
+        };
+        auto& io = _asyncReader();
+        AsyncReadHandler handler = [&](std::size_t requestIx, const uint8_t* encoded, std::size_t size) {
+            decodeAndHandle(requestTile[requestIx], encoded, size);
+        };
+        if(wait) {
+            io.readBatch(requests, handler, workers);
+        } else if(!io.tryReadBatch(requests, handler, workers)) {
+            return false;
+        }
+        for(const auto ix : missingTiles) {
+            decodeAndHandle(ix, nullptr, 0);
+        }
+        return true;
+    }
+
+    // count[0] rows by count[1] columns starting at (offset[0], offset[1]), like NcFile::getInt64Data.
+    // int16_t needs an Int16 store and gives the stored values; float gives physical values of either type.
+    // Tiles are decoded on the workers if given.
+    template<typename T>
+    void readRegion(T* dst, const std::size_t* offset, const std::size_t* count, ThreadPool* workers = nullptr) const {
+        static_assert(std::is_same_v<T, int16_t> || std::is_same_v<T, float>, "int16_t or float");
+        if(std::is_same_v<T, int16_t> && _layout.sampleType != TileSampleType::Int16) {
+            throw std::runtime_error("TileStoreReader: int16 region from a float store");
+        }
+        if(offset[0] + count[0] > _layout.height || offset[1] + count[1] > _layout.width) {
+            throw std::runtime_error("TileStoreReader: region out of range");
+        }
+        if(count[0] == 0 || count[1] == 0) {
+            return;
+        }
+        const auto ts = _layout.tileSize;
+        std::vector<std::pair<std::size_t, std::size_t>> tiles;
+        for(auto tileY = offset[0] / ts; tileY <= (offset[0] + count[0] - 1) / ts; ++tileY) {
+            for(auto tileX = offset[1] / ts; tileX <= (offset[1] + count[1] - 1) / ts; ++tileX) {
+                tiles.emplace_back(tileX, tileY);
+            }
+        }
+        // regions of several tiles are one batch of reads, unless another caller's batch is running
+        auto copy = [&](std::size_t tileX, std::size_t tileY, const void* tile) {
+            _copyFromTile(tileX, tileY, static_cast<const uint8_t*>(tile), dst, offset, count);
+        };
+        if(tiles.size() > 1 && readTiles(tiles, copy, workers, false)) {
+            return;
+        }
+        thread_local std::vector<uint8_t> tile;
+        tile.resize(ts * ts * _layout.bytesPerSample());
+        for(const auto& [tileX, tileY] : tiles) {
+            readTile(tileX, tileY, tile.data());
+            _copyFromTile(tileX, tileY, tile.data(), dst, offset, count);
+        }
+    }
+
+private:
+    // Copies the part of a decoded tile that falls into the region, converting as readRegion does
+    template<typename T>
+    void _copyFromTile(std::size_t tileX, std::size_t tileY, const uint8_t* tile, T* dst, const std::size_t* offset, const std::size_t* count) const {
+        const auto ts = _layout.tileSize;
+        const auto tileW = _layout.tileWidth(tileX);
+        const auto rowBegin = std::max(offset[0], tileY * ts);
+        const auto rowEnd = std::min(offset[0] + count[0], tileY * ts + _layout.tileHeight(tileY));
+        const auto colBegin = std::max(offset[1], tileX * ts);
+        const auto colEnd = std::min(offset[1] + count[1], tileX * ts + tileW);
+        for(auto row = rowBegin; row < rowEnd; ++row) {
+            const auto srcIx = (row - tileY * ts) * tileW + (colBegin - tileX * ts);
+            T* out = dst + (row - offset[0]) * count[1] + (colBegin - offset[1]);
+            const auto n = colEnd - colBegin;
+            if(_layout.sampleType == TileSampleType::Int16) {
+                const auto* src = reinterpret_cast<const int16_t*>(tile) + srcIx;
+                if constexpr(std::is_same_v<T, int16_t>) {
+                    std::copy(src, src + n, out);
+                } else {
+                    for(std::size_t ix = 0; ix < n; ++ix) {
+                        out[ix] = static_cast<float>(src[ix] * _layout.scale + _layout.offset);
+                    }
+                }
+            } else if constexpr(std::is_same_v<T, float>) {
+                const auto* src = reinterpret_cast<const float*>(tile) + srcIx;
+                for(std::size_t ix = 0; ix < n; ++ix) {
+                    out[ix] = static_cast<float>(src[ix] * _layout.scale + _layout.offset);
+                }
+            }
+        }
+    }
+
+    AsyncFileReader& _asyncReader() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_async) {
+            _async = std::make_unique<AsyncFileReader>(_filename);
+        }
+        return *_async;
+    }
+
+    std::size_t _tileIx(std::size_t tileX, std::size_t tileY) const {
+        if(tileX >= _layout.tilesAcross() || tileY >= _layout.tilesDown()) {
+            throw std::runtime_error("TileStoreReader: tile out of range");
+        }
+        return tileY * _layout.tilesAcross() + tileX;
+    }
+
+private:
+    std::string _filename;
+    TileStoreLayout _layout;
+    mutable std::mutex _mutex;
+    mutable std::ifstream _ifs;
+    mutable std::unique_ptr<AsyncFileReader> _async; // batch reads, opened by the first one
+    std::vector<uint64_t> _index; // offset, size per tile
+};
+
+#endif //NETCDF_DANI_TILESTORE_H
@@ -0,0 +1,52 @@
+#ifndef NETCDF_DANI_UNIONFIND_H
+#define NETCDF_DANI_UNIONFIND_H
+
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+// Disjoint sets over 0..n-1 with path halving and union by size
+class UnionFind {
+public:
+    explicit UnionFind(std::size_t n = 0) { reset(n); }
+
+    void reset(std::size_t n) {
+        _parent.resize(n);
+        std::iota(_parent.begin(), _parent.end(), uint32_t{0});
+        _size.assign(n, 1);
+    }
+
+    std::size_t size() const { return _parent.size(); }
+
+    uint32_t find(uint32_t x) {
+        while(_parent[x] != x) {
+            _parent[x] = _parent[_parent[x]];
+            x = _parent[x];
+        }
+        return x;
+    }
+
+    // Merges the sets of a and b, returns the root of the merged set
+    uint32_t unite(uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        if(a == b) {
+            return a;
+        }
+        if(_size[a] < _size[b]) {
+            std::swap(a, b);
+        }
+        _parent[b] = a;
+        _size[a] += _size[b];
+        return a;
+    }
+
+    uint32_t setSize(uint32_t x) { return _size[find(x)]; }
+
+private:
+    std::vector<uint32_t> _parent;
+    std::vector<uint32_t> _size;
+};
+
+#endif //NETCDF_DANI_UNIONFIND_H
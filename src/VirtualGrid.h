@@ -0,0 +1,273 @@
+#ifndef NETCDF_DANI_VIRTUALGRID_H
+#define NETCDF_DANI_VIRTUALGRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "LruCache.h"
+#include "NcFile.h"
+#include "ThreadPool.h"
+#include "gps.h"
+#include "instrumentation.h"
+#include "resample.h"
+
+// Geographic extent (cell edges, degrees) and size of a 2D (lat, lon) grid file
+struct GridExtent {
+    double south{};
+    double north{};
+    double west{};
+    double east{};
+    std::size_t width{};
+    std::size_t height{};
+    bool northUp = false; // row 0 is the northern edge; GEBCO stores rows south to north
+
+    double cellsPerDegreeLat() const { return static_cast<double>(height) / (north - south); }
+    double cellsPerDegreeLon() const { return static_cast<double>(width) / (east - west); }
+
+    // From the lat/lon coordinate variables (cell centers) of the variable's dimensions
+    static GridExtent ofFile(const NcFile& ncFile, const char* varName = "elevation") {
+        auto varInfo = ncFile.getVariableInfo(ncFile.getVarIdByName(varName));
+        if(varInfo.dims.size() != 2) {
+            throw std::runtime_error("GridExtent: 2D variable expected");
+        }
+        GridExtent extent;
+        extent.height = ncFile.dims().at(varInfo.dims[0]);
+        extent.width = ncFile.dims().at(varInfo.dims[1]);
+        auto coordinateRange = [&ncFile](int dimId, std::size_t n, double& low, double& high) {
+            const auto& name = ncFile.dimNames().at(dimId);
+            const int coordId = ncFile.getVarIdByName(name.c_str());
+            double first = 0.0;
+            double last = 0.0;
+            std::size_t offset = 0;
+            std::size_t count = 1;
+            ncFile.getDoubleData(&first, coordId, &offset, &count);
+            offset = n - 1;
+            ncFile.getDoubleData(&last, coordId, &offset, &count);
+            const double halfCell = n > 1 ? 0.5 * std::abs(last - first) / static_cast<double>(n - 1) : 0.5;
+            low = std::min(first, last) - halfCell;
+            high = std::max(first, last) + halfCell;
+            return last < first;
+        };
+        extent.northUp = coordinateRange(varInfo.dims[0], extent.height, extent.south, extent.north);
+        coordinateRange(varInfo.dims[1], extent.width, extent.west, extent.east);
+        return extent;
+    }
+};
+
+// One global grid at a fixed resolution composited from many NetCDF files, e.g. the GEBCO sub-tiles
+// plus regional high-resolution grids. Requests go to the files overlapping them, which are read
+// (and resampled to the mosaic resolution if needed) in parallel and painted in priority order:
+// higher priority wins, equal priorities in the order the files were added. Files are opened on
+// first use and at most maxOpenFiles handles stay open. Extents must not cross the antimeridian.
+class VirtualGrid {
+public:
+    explicit VirtualGrid(double cellsPerDegree, std::size_t maxOpenFiles = 8, std::string varName = "elevation")
+            : _cellsPerDegree(cellsPerDegree)
+            , _varName(std::move(varName))
+            , _handles(std::max<std::size_t>(1, maxOpenFiles)) {}
+
+    VirtualGrid(const VirtualGrid&) = delete;
+    VirtualGrid& operator=(const VirtualGrid&) = delete;
+
+    // Opens the file once to read its extent; returns the file's index
+    std::size_t addFile(const std::string& filename, int priority = 0) {
+        const auto fileIx = _files.size();
+        _files.push_back(FileEntry{filename, {}, priority});
+        try {
+            _files.back().extent = GridExtent::ofFile(*_open(fileIx), _varName.c_str());
+        } catch(...) {
+            _files.pop_back();
+            throw;
+        }
+        return fileIx;
+    }
+
+    // Extent known up front, the file is not touched until a read needs it
+    std::size_t addFile(const std::string& filename, const GridExtent& extent, int priority = 0) {
+        _files.push_back(FileEntry{filename, extent, priority});
+        return _files.size() - 1;
+    }
+
+    std::size_t nFiles() const { return _files.size(); }
+    const std::string& filename(std::size_t fileIx) const { return _files.at(fileIx).filename; }
+    const GridExtent& extent(std::size_t fileIx) const { return _files.at(fileIx).extent; }
+
+    double cellsPerDegree() const { return _cellsPerDegree; }
+    std::size_t width() const { return static_cast<std::size_t>(std::lround(360.0 * _cellsPerDegree)); }
+    std::size_t height() const { return static_cast<std::size_t>(std::lround(180.0 * _cellsPerDegree)); }
+    GpsToOffsetConverter converter() const { return GpsToOffsetConverter::forGrid(width(), height()); }
+
+    // Files with cells in rows [row, row + rows) x cols [col, col + cols), in painting order
+    std::vector<std::size_t> filesFor(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols) const {
+        std::vector<std::size_t> files;
+        for(std::size_t fileIx = 0; fileIx < _files.size(); ++fileIx) {
+            const auto cover = _coverage(_files[fileIx].extent, row, col, rows, cols);
+            if(cover.rowBegin < cover.rowEnd && cover.colBegin < cover.colEnd) {
+                files.push_back(fileIx);
+            }
+        }
+        std::stable_sort(files.begin(), files.end(), [this](auto a, auto b) { return _files[a].priority < _files[b].priority; });
+        return files;
+    }
+
+    // rows x cols cells of the mosaic starting at (row, col), south to north like the files; cells no file
+    // covers are set to fill. With a pool the files are read concurrently; not from one of its workers.
+    void read(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols, int16_t* dst,
+              ThreadPool* pool = nullptr, int16_t fill = 0) const {
+        std::fill(dst, dst + rows * cols, fill);
+        const auto files = filesFor(row, col, rows, cols);
+        std::vector<Piece> pieces(files.size());
+        if(pool && files.size() > 1) {
+            std::vector<std::future<void>> futures;
+            try {
+                for(std::size_t pieceIx = 0; pieceIx < files.size(); ++pieceIx) {
+                    futures.push_back(pool->submit([&, pieceIx]() { pieces[pieceIx] = _readPiece(files[pieceIx], row, col, rows, cols); }));
+                }
+                for(auto& future : futures) {
+                    future.get();
+                }
+            } catch(...) {
+                // the queued reads reference this frame
+                for(auto& future : futures) {
+                    future.wait();
+                }
+                throw;
+            }
+        } else {
+            for(std::size_t pieceIx = 0; pieceIx < files.size(); ++pieceIx) {
+                pieces[pieceIx] = _readPiece(files[pieceIx], row, col, rows, cols);
+            }
+        }
+        for(const auto& piece : pieces) {
+            const auto pieceCols = piece.cover.colEnd - piece.cover.colBegin;
+            for(auto y = piece.cover.rowBegin; y < piece.cover.rowEnd; ++y) {
+                const int16_t* src = piece.data.data() + (y - piece.cover.rowBegin) * pieceCols;
+                std::copy(src, src + pieceCols, dst + (y - row) * cols + (piece.cover.colBegin - col));
+            }
+        }
+    }
+
+    // The mosaic cells covered by a GPS area, south to north; southWest receives the cell offset of dst[0]
+    Size2D readArea(const GpsArea& area, std::vector<int16_t>& dst, Offset2D* southWest = nullptr,
+                    ThreadPool* pool = nullptr, int16_t fill = 0) const {
+        const auto conv = converter();
+        auto offsetMin = conv.convert(area.min);
+        auto offsetMax = conv.convert(area.max);
+        const auto rowBegin = std::min(offsetMin.latLon[0], height());
+        const auto rowEnd = std::clamp(offsetMax.latLon[0], rowBegin, height());
+        const auto colBegin = std::min(offsetMin.latLon[1], width());
+        const auto colEnd = std::clamp(offsetMax.latLon[1], colBegin, width());
+        Size2D size{{rowEnd - rowBegin, colEnd - colBegin}};
+        dst.resize(size.latLon[0] * size.latLon[1]);
+        if(southWest) {
+            *southWest = Offset2D{{rowBegin, colBegin}};
+        }
+        if(!dst.empty()) {
+            read(rowBegin, colBegin, size.latLon[0], size.latLon[1], dst.data(), pool, fill);
+        }
+        return size;
+    }
+
+private:
+    struct FileEntry {
+        std::string filename;
+        GridExtent extent;
+        int priority{};
+    };
+
+    // mosaic cells whose centers lie inside a file
+    struct Coverage {
+        std::size_t rowBegin{};
+        std::size_t rowEnd{};
+        std::size_t colBegin{};
+        std::size_t colEnd{};
+    };
+
+    struct Piece {
+        Coverage cover;
+        std::vector<int16_t> data;
+    };
+
+    Coverage _coverage(const GridExtent& extent, std::size_t row, std::size_t col, std::size_t rows, std::size_t cols) const {
+        // cell i covers [i, i + 1) / cellsPerDegree from the south-west corner of the world, its center is at i + 0.5
+        auto firstCenterAtOrAfter = [this](double degrees, std::size_t begin, std::size_t end) {
+            const double ix = std::ceil(degrees * _cellsPerDegree - 0.5);
+            return static_cast<std::size_t>(std::clamp(ix, static_cast<double>(begin), static_cast<double>(end)));
+        };
+        Coverage cover;
+        cover.rowBegin = firstCenterAtOrAfter(extent.south + 90.0, row, row + rows);
+        cover.rowEnd = firstCenterAtOrAfter(extent.north + 90.0, row, row + rows);
+        cover.colBegin = firstCenterAtOrAfter(extent.west + 180.0, col, col + cols);
+        cover.colEnd = firstCenterAtOrAfter(extent.east + 180.0, col, col + cols);
+        return cover;
+    }
+
+    std::shared_ptr<const NcFile> _open(std::size_t fileIx) const {
+        std::lock_guard<std::mutex> lock(_openMutex);
+        if(auto handle = _handles.get(fileIx)) {
+            return *handle;
+        }
+        // an evicted handle closes once the reads still using it are done
+        auto handle = std::make_shared<const NcFile>(NcFile::openForRead(_files[fileIx].filename.c_str()));
+        _handles.put(fileIx, handle);
+        return handle;
+    }
+
+    // The file's part of the request at the mosaic resolution: a bilinear gather through per-row and
+    // per-column file coordinates, exact copies when the grids coincide
+    Piece _readPiece(std::size_t fileIx, std::size_t row, std::size_t col, std::size_t rows, std::size_t cols) const {
+        NCD_TRACE_SCOPE("mosaic_read");
+        const auto& extent = _files[fileIx].extent;
+        Piece piece;
+        piece.cover = _coverage(extent, row, col, rows, cols);
+        const auto pieceRows = piece.cover.rowEnd - piece.cover.rowBegin;
+        const auto pieceCols = piece.cover.colEnd - piece.cover.colBegin;
+
+        std::vector<double> rowMap(pieceRows);
+        for(std::size_t y = 0; y < pieceRows; ++y) {
+            const double lat = (static_cast<double>(piece.cover.rowBegin + y) + 0.5) / _cellsPerDegree - 90.0;
+            rowMap[y] = (extent.northUp ? extent.north - lat : lat - extent.south) * extent.cellsPerDegreeLat() - 0.5;
+        }
+        std::vector<double> colMap(pieceCols);
+        for(std::size_t x = 0; x < pieceCols; ++x) {
+            const double lon = (static_cast<double>(piece.cover.colBegin + x) + 0.5) / _cellsPerDegree - 180.0;
+            colMap[x] = (lon - extent.west) * extent.cellsPerDegreeLon() - 0.5;
+        }
+        auto window = [](const std::vector<double>& map, std::size_t size) {
+            const auto range = std::minmax_element(map.begin(), map.end());
+            const auto begin = static_cast<std::size_t>(std::clamp(std::floor(*range.first), 0.0, size - 1.0));
+            const auto end = static_cast<std::size_t>(std::clamp(std::floor(*range.second) + 2.0, begin + 1.0, static_cast<double>(size)));
+            return std::make_pair(begin, end);
+        };
+        const auto [fileRowBegin, fileRowEnd] = window(rowMap, extent.height);
+        const auto [fileColBegin, fileColEnd] = window(colMap, extent.width);
+
+        auto ncFile = _open(fileIx);
+        std::vector<int16_t> source((fileRowEnd - fileRowBegin) * (fileColEnd - fileColBegin));
+        std::size_t offset[2] = {fileRowBegin, fileColBegin};
+        std::size_t count[2] = {fileRowEnd - fileRowBegin, fileColEnd - fileColBegin};
+        ncFile->getInt64Data(source.data(), ncFile->getVarIdByName(_varName.c_str()), offset, count);
+
+        piece.data.resize(pieceRows * pieceCols);
+        const ResampleAxis xAxis(colMap.data(), pieceCols, static_cast<double>(fileColBegin), 1.0, count[1]);
+        const ResampleAxis yAxis(rowMap.data(), pieceRows, static_cast<double>(fileRowBegin), 1.0, count[0]);
+        resample_bilinear(source.data(), count[1], count[0], xAxis, yAxis, piece.data.data());
+        return piece;
+    }
+
+private:
+    double _cellsPerDegree{};
+    std::string _varName;
+    std::vector<FileEntry> _files;
+    mutable std::mutex _openMutex;
+    mutable LruCache<std::size_t, std::shared_ptr<const NcFile>> _handles;
+};
+
+#endif //NETCDF_DANI_VIRTUALGRID_H
@@ -5,6 +5,18 @@
 
 #include "NcFile.h"
 
+// Transposes a row into 16 bit planes: bit b of column c ends up as bit (c % 16) of dst[b * (width/16) + c/16].
+// dst has to hold width elements and be zeroed; width a multiple of 16.
+inline void bitPartitionRow(const int16_t* src, std::size_t width, int16_t* dst) {
+    for(std::size_t colIx = 0; colIx < width; ++colIx) {
+        for(int srcBitPos=0; srcBitPos < 16; ++srcBitPos) {
+            bool bitOn = (src[colIx] & (1 << srcBitPos)) != 0;
+            auto dstElemIx = srcBitPos * (width/16) + (colIx/16);
+            dst[dstElemIx] |= (1 << (colIx % 16)) * bitOn;
+        }
+    }
+}
+
 inline void transform_to_bitpartitioned_raw(NcFile& ncFile) {
     auto dimlen = ncFile.dims();
     int elevation_var_id = ncFile.getVarIdByName("elevation");
@@ -48,13 +60,7 @@ inline void transform_to_bitpartitioned_raw(NcFile& ncFile) {
         size_t start[2] = {(size_t)rowIx, 0};
         std::fill(rowBufBitPartitioned.begin(), rowBufBitPartitioned.end(), 0);
         ncFile.getInt64Data(rowBuf.data(), elevation_var_id, start, count);
-        for(int colIx = 0; colIx < dimlen[0]; ++colIx) {
-            for(int srcBitPos=0; srcBitPos < 16; ++srcBitPos) {
-                bool bitOn = (rowBuf[colIx] & (1 << srcBitPos)) != 0;
-                auto dstElemIx = srcBitPos * (width/16) + (colIx/16);
-                rowBufBitPartitioned[dstElemIx] |= (1 << (colIx % 16)) * bitOn;
-            }
-        }
+        bitPartitionRow(rowBuf.data(), width, rowBufBitPartitioned.data());
 
         if(popCountVec(rowBuf) != popCountVec(rowBufBitPartitioned)) {
             /*std::ofstream ofs_src("D:/popcnt_dbg_src.raw", std::ios::binary);
@@ -1,8 +1,13 @@
 #ifndef NETCDF_DANI_COLORS_H
 #define NETCDF_DANI_COLORS_H
 
+#include <array>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
 
-std::array<uint8_t, 3> HSVtoRGB(float H, float S,float V){
+
+inline std::array<uint8_t, 3> HSVtoRGB(float H, float S,float V){
     if(H>360 || H<0 || S>100 || S<0 || V>100 || V<0){
         return {};
     }
@@ -36,5 +41,62 @@ std::array<uint8_t, 3> HSVtoRGB(float H, float S,float V){
     return {(uint8_t)R, (uint8_t)G, (uint8_t)B};
 }
 
+inline std::array<uint8_t, 3> heightToRgb(int64_t height, int16_t max = 9000, int16_t min = -12000) {
+    auto range = max - min;
+    double t = 0.0;
+    double V = 100.0;
+    t = height / static_cast<double>(range);
+    if(height < 0) {
+        V = std::abs(height / (double)min) * 100.0;
+    } else {
+//        t = (height+min) / static_cast<double>(range);
+        t = (height-min) / static_cast<double>(max);
+        t = std::clamp(t, 0.0, 1.0);
+        V = 100.0 * (0.5 + 0.5 * (height / (double)max));
+    }
+    auto H = 240.0 + 90.0 * t;
+    return HSVtoRGB(H, 100.0f, V);
+}
+
+// The viewer's land/sea colormap: blue below sea level, then green, brown and gray bands
+inline std::array<uint8_t, 3> heightToBandedRgb(int16_t height, int16_t min = -12000, int16_t max = 9000,
+                                                 double greenFieldLimit = 2000.0, double brownFieldLimit = 4000.0) {
+    double blueLimit = 0.0;
+    if(height < blueLimit) {
+        double t = (height - min) / (blueLimit - (double)min);
+        auto val = std::clamp(static_cast<int>(t*255), 0, 255);
+        return {0, 0, (uint8_t)val};
+    }
+    if(height < greenFieldLimit) {
+        double t = (height - blueLimit) / (greenFieldLimit - blueLimit);
+        t = 0.5 + 0.5 * t;
+        auto val = std::clamp(static_cast<int>(t*255), 0, 255);
+        return {0, (uint8_t)val, 0};
+    }
+    if(height < brownFieldLimit) {
+        double t = (height - greenFieldLimit) / (brownFieldLimit - greenFieldLimit);
+        t = 0.2 + 0.5 * t;
+        auto val = std::clamp(static_cast<int>(t*255), 0, 255);
+        return {(uint8_t)val, (uint8_t)(val/4), (uint8_t)(val/4)};
+    }
+
+    double t = (height - brownFieldLimit) / (max - brownFieldLimit);
+    t = 0.5 + 0.5 * t;
+    auto val = std::clamp(static_cast<int>(t*255), 0, 255);
+    return {(uint8_t)val, (uint8_t)val, (uint8_t)val};
+}
+
+inline uint8_t heightToGray(int16_t height, int16_t min = -12000, int16_t max = 9000) {
+    double t = max == min ? (height > min ? 1.0 : 0.0) : static_cast<double>(height - min) / (max - min);
+    t = std::clamp(t, 0.0, 1.0);
+    return static_cast<uint8_t>(0.5 + t * 255);
+}
+
+// Mapbox Terrain-RGB: height = -10000 + (R * 65536 + G * 256 + B) * 0.1
+inline std::array<uint8_t, 3> heightToTerrainRgb(double height) {
+    auto value = static_cast<uint32_t>(std::clamp(std::lround((height + 10000.0) * 10.0), 0l, 0xFFFFFFl));
+    return {(uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+}
+
 
 #endif //NETCDF_DANI_COLORS_H
@@ -0,0 +1,542 @@
+#ifndef NETCDF_DANI_CONTOUR_H
+#define NETCDF_DANI_CONTOUR_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "gps.h"
+#include "instrumentation.h"
+
+// Marching-squares isolines over the elevation grid.
+//
+// The grid is traced in horizontal bands (chunk-aligned row blocks plus one halo row) on a thread pool.
+// Segment endpoints are identified by the grid edge they lie on, so pieces traced by different bands
+// are stitched together exactly where they share an edge on the seam row. Closed rings and lines that
+// cannot be continued anymore are streamed to a PolylineSink, only the lines crossing the current
+// band seam are kept in memory.
+
+struct Polyline {
+    double level{};
+    bool closed = false;
+    std::vector<GPS> points;
+};
+
+class PolylineSink {
+public:
+    virtual ~PolylineSink() = default;
+    virtual void write(const Polyline& polyline) = 0;
+    virtual void finish() {}
+};
+
+// Point in grid coordinates: {row, col}, fractional along the edge it lies on
+using GridPoint = std::array<double, 2>;
+
+struct ContourChain {
+    std::uint32_t levelIx{};
+    std::uint64_t frontKey{};
+    std::uint64_t backKey{};
+    bool closed = false;
+    std::deque<GridPoint> points;
+};
+
+// Grid edge identifiers. Horizontal edge (r, c) connects samples (r, c) and (r, c+1),
+// vertical edge (r, c) connects samples (r, c) and (r+1, c).
+struct ContourEdgeKeys {
+    std::uint64_t width{};
+    std::uint64_t height{};
+
+    std::uint64_t horizontal(std::uint32_t levelIx, std::uint64_t r, std::uint64_t c) const {
+        return (((levelIx * height + r) * width + c) << 1);
+    }
+    std::uint64_t vertical(std::uint32_t levelIx, std::uint64_t r, std::uint64_t c) const {
+        return (((levelIx * height + r) * width + c) << 1) | 1u;
+    }
+    bool isHorizontalOnRow(std::uint64_t key, std::uint64_t r) const {
+        return (key & 1u) == 0 && ((key >> 1) / width) % height == r;
+    }
+};
+
+// Joins chains that share an endpoint edge. Chains that close into a ring are handed out immediately.
+class ContourStitcher {
+public:
+    void addSegment(std::uint32_t levelIx, std::uint64_t keyA, const GridPoint& pA, std::uint64_t keyB, const GridPoint& pB,
+                    std::vector<ContourChain>& closedOut) {
+        auto itA = _endpoints.find(keyA);
+        auto itB = _endpoints.find(keyB);
+        if(itA == _endpoints.end() && itB == _endpoints.end()) {
+            auto slot = _allocate();
+            auto& chain = _chains[slot];
+            chain.levelIx = levelIx;
+            chain.frontKey = keyA;
+            chain.backKey = keyB;
+            chain.points = {pA, pB};
+            _endpoints[keyA] = slot;
+            _endpoints[keyB] = slot;
+            return;
+        }
+        if(itA != _endpoints.end() && itB != _endpoints.end()) {
+            auto slotA = itA->second;
+            auto slotB = itB->second;
+            _endpoints.erase(itA);
+            _endpoints.erase(itB);
+            if(slotA == slotB) {
+                auto& chain = _chains[slotA];
+                chain.points.push_back(chain.points.front());
+                chain.frontKey = chain.backKey = keyA;
+                chain.closed = true;
+                closedOut.push_back(std::move(chain));
+                _release(slotA);
+                return;
+            }
+            _orientBackTo(_chains[slotA], keyA);
+            _orientFrontTo(_chains[slotB], keyB);
+            _appendChain(slotA, slotB, false);
+            _endpoints[_chains[slotA].backKey] = slotA;
+            return;
+        }
+        bool extendA = itA != _endpoints.end();
+        auto it = extendA ? itA : itB;
+        auto slot = it->second;
+        auto& chain = _chains[slot];
+        auto sharedKey = extendA ? keyA : keyB;
+        auto newKey = extendA ? keyB : keyA;
+        const auto& newPoint = extendA ? pB : pA;
+        _endpoints.erase(it);
+        if(chain.backKey == sharedKey) {
+            chain.points.push_back(newPoint);
+            chain.backKey = newKey;
+        } else {
+            chain.points.push_front(newPoint);
+            chain.frontKey = newKey;
+        }
+        _endpoints[newKey] = slot;
+    }
+
+    void addChain(ContourChain&& chain, std::vector<ContourChain>& closedOut) {
+        if(chain.closed) {
+            closedOut.push_back(std::move(chain));
+            return;
+        }
+        auto slot = _allocate();
+        _chains[slot] = std::move(chain);
+        _link(slot, closedOut);
+    }
+
+    // Removes and returns the open chains for which shouldRelease(chain) is true
+    template<typename Predicate>
+    void releaseOpen(Predicate&& shouldRelease, std::vector<ContourChain>& out) {
+        for(std::size_t slot = 0; slot < _chains.size(); ++slot) {
+            if(!_inUse[slot] || !shouldRelease(_chains[slot])) {
+                continue;
+            }
+            _endpoints.erase(_chains[slot].frontKey);
+            _endpoints.erase(_chains[slot].backKey);
+            out.push_back(std::move(_chains[slot]));
+            _release(slot);
+        }
+    }
+
+    std::size_t nOpen() const { return _chains.size() - _freeSlots.size(); }
+
+private:
+    std::size_t _allocate() {
+        if(!_freeSlots.empty()) {
+            auto slot = _freeSlots.back();
+            _freeSlots.pop_back();
+            _inUse[slot] = true;
+            _chains[slot] = ContourChain{};
+            return slot;
+        }
+        _chains.emplace_back();
+        _inUse.push_back(true);
+        return _chains.size() - 1;
+    }
+
+    void _release(std::size_t slot) {
+        _chains[slot] = ContourChain{};
+        _inUse[slot] = false;
+        _freeSlots.push_back(slot);
+    }
+
+    static void _reverse(ContourChain& chain) {
+        std::reverse(chain.points.begin(), chain.points.end());
+        std::swap(chain.frontKey, chain.backKey);
+    }
+    static void _orientBackTo(ContourChain& chain, std::uint64_t key) {
+        if(chain.backKey != key) { _reverse(chain); }
+    }
+    static void _orientFrontTo(ContourChain& chain, std::uint64_t key) {
+        if(chain.frontKey != key) { _reverse(chain); }
+    }
+
+    // Appends chain `slotB` to chain `slotA`. With sharedPoint the back of A and the front of B are
+    // the same edge, otherwise a segment connects them. Endpoint registration is left to the caller.
+    void _appendChain(std::size_t slotA, std::size_t slotB, bool sharedPoint) {
+        auto& a = _chains[slotA];
+        auto& b = _chains[slotB];
+        a.points.insert(a.points.end(), sharedPoint ? std::next(b.points.begin()) : b.points.begin(), b.points.end());
+        a.backKey = b.backKey;
+        _release(slotB);
+    }
+
+    // Merges the (unregistered) chain in `slot` with the open chains touching its endpoints
+    void _link(std::size_t slot, std::vector<ContourChain>& closedOut) {
+        bool merged = true;
+        while(merged && _chains[slot].frontKey != _chains[slot].backKey) {
+            merged = false;
+            for(auto key : {_chains[slot].frontKey, _chains[slot].backKey}) {
+                auto it = _endpoints.find(key);
+                if(it == _endpoints.end()) {
+                    continue;
+                }
+                auto other = it->second;
+                _endpoints.erase(_chains[other].frontKey);
+                _endpoints.erase(_chains[other].backKey);
+                _orientBackTo(_chains[other], key);
+                _orientFrontTo(_chains[slot], key);
+                _appendChain(other, slot, true);
+                slot = other;
+                merged = true;
+                break;
+            }
+        }
+        auto& chain = _chains[slot];
+        if(chain.frontKey == chain.backKey) {
+            chain.closed = true;
+            closedOut.push_back(std::move(chain));
+            _release(slot);
+            return;
+        }
+        _endpoints[chain.frontKey] = slot;
+        _endpoints[chain.backKey] = slot;
+    }
+
+private:
+    std::vector<ContourChain> _chains;
+    std::vector<bool> _inUse;
+    std::vector<std::size_t> _freeSlots;
+    std::unordered_map<std::uint64_t, std::size_t> _endpoints;
+};
+
+struct ContourBandResult {
+    std::size_t firstCellRow{};
+    std::size_t endCellRow{};
+    std::vector<ContourChain> chains; // closed rings and open lines, already stitched inside the band
+};
+
+// Traces the cells of rows [firstRow, firstRow + nRows - 1); the last row of `rows` is the halo
+// shared with the next band. gridHeight/width are the dimensions of the whole grid, used for edge keys.
+inline ContourBandResult traceContourBand(const int16_t* rows, std::size_t nRows, std::size_t width, std::size_t firstRow,
+                                          std::size_t gridHeight, const std::vector<double>& levels, bool wrapLongitude) {
+    NCD_TRACE_SCOPE("contour_band");
+    ContourBandResult result;
+    result.firstCellRow = firstRow;
+    result.endCellRow = firstRow + (nRows > 0 ? nRows - 1 : 0);
+    if(nRows < 2 || width < 2) {
+        return result;
+    }
+
+    const ContourEdgeKeys keys{width, gridHeight};
+    const std::size_t nCellCols = wrapLongitude ? width : width - 1;
+    ContourStitcher stitcher;
+    std::vector<uint8_t> aboveLower(width);
+    std::vector<uint8_t> aboveUpper(width);
+
+    for(std::uint32_t levelIx = 0; levelIx < levels.size(); ++levelIx) {
+        const double level = levels[levelIx];
+        for(std::size_t x = 0; x < width; ++x) {
+            aboveUpper[x] = rows[x] >= level;
+        }
+        for(std::size_t y = 0; y + 1 < nRows; ++y) {
+            const int16_t* lower = rows + y * width;
+            const int16_t* upper = lower + width;
+            std::swap(aboveLower, aboveUpper);
+            for(std::size_t x = 0; x < width; ++x) {
+                aboveUpper[x] = upper[x] >= level;
+            }
+            const std::uint64_t r = firstRow + y;
+
+            for(std::size_t c = 0; c < nCellCols; ++c) {
+                const std::size_t c1 = (c + 1 == width) ? 0 : c + 1;
+                const int caseIx = aboveLower[c] | (aboveLower[c1] << 1) | (aboveUpper[c1] << 2) | (aboveUpper[c] << 3);
+                if(caseIx == 0 || caseIx == 15) {
+                    continue;
+                }
+                const double v00 = lower[c];
+                const double v01 = lower[c1];
+                const double v11 = upper[c1];
+                const double v10 = upper[c];
+
+                // 0: bottom, 1: right, 2: top, 3: left
+                auto edgeKey = [&](int edge) -> std::uint64_t {
+                    switch(edge) {
+                        case 0: return keys.horizontal(levelIx, r, c);
+                        case 1: return keys.vertical(levelIx, r, c1);
+                        case 2: return keys.horizontal(levelIx, r + 1, c);
+                        default: return keys.vertical(levelIx, r, c);
+                    }
+                };
+                auto edgePoint = [&](int edge) -> GridPoint {
+                    auto rr = static_cast<double>(r);
+                    auto cc = static_cast<double>(c);
+                    switch(edge) {
+                        case 0: return {rr, cc + (level - v00) / (v01 - v00)};
+                        case 1: return {rr + (level - v01) / (v11 - v01), static_cast<double>(c1)};
+                        case 2: return {rr + 1.0, cc + (level - v10) / (v11 - v10)};
+                        default: return {rr + (level - v00) / (v10 - v00), cc};
+                    }
+                };
+                auto addSegment = [&](int edgeA, int edgeB) {
+                    stitcher.addSegment(levelIx, edgeKey(edgeA), edgePoint(edgeA), edgeKey(edgeB), edgePoint(edgeB), result.chains);
+                };
+
+                if(caseIx == 5 || caseIx == 10) {
+                    // saddle, resolved by the cell center value
+                    const bool centerAbove = (v00 + v01 + v11 + v10) * 0.25 >= level;
+                    if((caseIx == 5) == centerAbove) {
+                        addSegment(0, 1);
+                        addSegment(2, 3);
+                    } else {
+                        addSegment(0, 3);
+                        addSegment(1, 2);
+                    }
+                    continue;
+                }
+                int edges[2];
+                int nEdges = 0;
+                const bool corners[4] = {aboveLower[c] != 0, aboveLower[c1] != 0, aboveUpper[c1] != 0, aboveUpper[c] != 0};
+                for(int edge = 0; edge < 4; ++edge) {
+                    if(corners[edge] != corners[(edge + 1) % 4]) {
+                        edges[nEdges++] = edge;
+                    }
+                }
+                addSegment(edges[0], edges[1]);
+            }
+        }
+    }
+
+    std::vector<ContourChain> open;
+    stitcher.releaseOpen([](const ContourChain&) { return true; }, open);
+    for(auto& chain : open) {
+        result.chains.push_back(std::move(chain));
+    }
+    return result;
+}
+
+// Stitches band results, handed over in south to north order, and streams finished lines to a sink.
+class ContourAssembler {
+public:
+    ContourAssembler(std::size_t width, std::size_t height, std::vector<double> levels, PolylineSink& sink)
+            : _keys{width, height}
+            , _converter(GpsToOffsetConverter::forGrid(width, height))
+            , _levels(std::move(levels))
+            , _sink(sink) {}
+
+    void addBand(ContourBandResult&& band) {
+        std::vector<ContourChain> done;
+        for(auto& chain : band.chains) {
+            _stitcher.addChain(std::move(chain), done);
+        }
+        // everything not ending on the next seam is complete
+        const auto seamRow = band.endCellRow;
+        _stitcher.releaseOpen([this, seamRow](const ContourChain& chain) {
+            return !_keys.isHorizontalOnRow(chain.frontKey, seamRow) && !_keys.isHorizontalOnRow(chain.backKey, seamRow);
+        }, done);
+        _emit(done);
+    }
+
+    void finish() {
+        std::vector<ContourChain> rest;
+        _stitcher.releaseOpen([](const ContourChain&) { return true; }, rest);
+        _emit(rest);
+        _sink.finish();
+    }
+
+private:
+    void _emit(std::vector<ContourChain>& chains) {
+        Polyline polyline;
+        for(auto& chain : chains) {
+            polyline.level = _levels.at(chain.levelIx);
+            polyline.closed = chain.closed;
+            polyline.points.clear();
+            polyline.points.reserve(chain.points.size());
+            for(const auto& p : chain.points) {
+                // samples are cell centers
+                auto gps = _converter.convertBack(p[0] + 0.5, p[1] + 0.5);
+                if(!polyline.points.empty()) {
+                    const auto& prev = polyline.points.back();
+                    if(prev.lat() == gps.lat() && prev.lon() == gps.lon()) {
+                        continue; // level hit a sample exactly, both edges meet there
+                    }
+                    // lines wrapping around the antimeridian continue past +-180 instead of jumping
+                    while(gps.lon() - prev.lon() > 180.0) { gps.lon() -= 360.0; }
+                    while(gps.lon() - prev.lon() < -180.0) { gps.lon() += 360.0; }
+                }
+                polyline.points.push_back(gps);
+            }
+            _sink.write(polyline);
+        }
+        chains.clear();
+    }
+
+private:
+    ContourEdgeKeys _keys;
+    GpsToOffsetConverter _converter;
+    std::vector<double> _levels;
+    PolylineSink& _sink;
+    ContourStitcher _stitcher;
+};
+
+struct ContourOptions {
+    std::vector<double> levels{0.0};
+    std::size_t minBandRows = 256;
+    std::size_t maxBandsInFlight = 0; // 0: two per worker
+    // Trace the cells between the last and the first column too, joining lines across the antimeridian
+    bool wrapLongitude = false;
+};
+
+// Extracts isolines of the elevation variable over the whole grid in bounded memory:
+// at most maxBandsInFlight bands of (band rows + 1) * width samples are alive at once.
+inline void extract_contours(const NcFile& ncFile, const ContourOptions& options, PolylineSink& sink, ThreadPool& pool) {
+    RowBlockReader reader(ncFile, "elevation", options.minBandRows);
+    const auto width = reader.width();
+    const auto height = reader.height();
+    const auto bandRows = reader.blockRows();
+    const auto nBands = reader.nBlocks();
+    const auto maxInFlight = options.maxBandsInFlight ? options.maxBandsInFlight : 2 * pool.size();
+
+    ContourAssembler assembler(width, height, options.levels, sink);
+    std::deque<std::future<ContourBandResult>> inFlight;
+    std::size_t nextBand = 0;
+    try {
+        while(nextBand < nBands || !inFlight.empty()) {
+            while(nextBand < nBands && inFlight.size() < maxInFlight) {
+                auto bandIx = nextBand++;
+                inFlight.push_back(pool.submit([&reader, &options, bandIx, bandRows, width, height]() {
+                    auto block = reader.read(bandIx * bandRows, bandRows + 1);
+                    return traceContourBand(block.data.data(), block.nRows, width, block.firstRow, height,
+                                            options.levels, options.wrapLongitude);
+                }));
+            }
+            assembler.addBand(inFlight.front().get());
+            inFlight.pop_front();
+        }
+    } catch(...) {
+        // the queued bands reference this frame
+        for(auto& band : inFlight) {
+            band.wait();
+        }
+        throw;
+    }
+    assembler.finish();
+}
+
+class GeoJsonPolylineWriter : public PolylineSink {
+public:
+    explicit GeoJsonPolylineWriter(const std::string& filename)
+            : _ofs(filename) {
+        if(!_ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+        _ofs << std::setprecision(9);
+        _ofs << "{\"type\":\"FeatureCollection\",\"features\":[";
+    }
+
+    ~GeoJsonPolylineWriter() override {
+        finish();
+    }
+
+    void write(const Polyline& polyline) override {
+        _ofs << (_nFeatures++ == 0 ? "\n" : ",\n");
+        _ofs << "{\"type\":\"Feature\",\"properties\":{\"level\":" << polyline.level << ",\"closed\":"
+             << (polyline.closed ? "true" : "false") << "},\"geometry\":{\"type\":\"LineString\",\"coordinates\":[";
+        bool isFirst = true;
+        for(const auto& p : polyline.points) {
+            if(!isFirst) _ofs << ",";
+            isFirst = false;
+            _ofs << "[" << p.lon() << "," << p.lat() << "]";
+        }
+        _ofs << "]}}";
+    }
+
+    void finish() override {
+        if(_finished) {
+            return;
+        }
+        _finished = true;
+        _ofs << "\n]}\n";
+        _ofs.flush();
+    }
+
+private:
+    std::ofstream _ofs;
+    std::size_t _nFeatures = 0;
+    bool _finished = false;
+};
+
+// Compact binary polylines: "NCPL", uint32 version, then records of
+// float32 level, uint8 closed, uint32 nPoints, nPoints * {float32 lon, float32 lat}, all little endian.
+class BinaryPolylineWriter : public PolylineSink {
+public:
+    explicit BinaryPolylineWriter(const std::string& filename)
+            : _ofs(filename, std::ios::binary) {
+        if(!_ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + filename);
+        }
+        _buf.insert(_buf.end(), {'N', 'C', 'P', 'L'});
+        _putU32(1); // version
+        _flushBuf();
+    }
+
+    void write(const Polyline& polyline) override {
+        _putF32(static_cast<float>(polyline.level));
+        _buf.push_back(polyline.closed ? 1 : 0);
+        _putU32(static_cast<std::uint32_t>(polyline.points.size()));
+        for(const auto& point : polyline.points) {
+            _putF32(static_cast<float>(point.lon()));
+            _putF32(static_cast<float>(point.lat()));
+        }
+        _flushBuf();
+    }
+
+    void finish() override {
+        _ofs.flush();
+    }
+
+private:
+    // byte by byte, so the file is little endian on any host
+    void _putU32(std::uint32_t value) {
+        for(int shift = 0; shift < 32; shift += 8) {
+            _buf.push_back(static_cast<char>((value >> shift) & 0xff));
+        }
+    }
+
+    void _putF32(float value) {
+        std::uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        _putU32(bits);
+    }
+
+    void _flushBuf() {
+        _ofs.write(_buf.data(), static_cast<std::streamsize>(_buf.size()));
+        _buf.clear();
+    }
+
+private:
+    std::ofstream _ofs;
+    std::vector<char> _buf;
+};
+
+#endif //NETCDF_DANI_CONTOUR_H
@@ -0,0 +1,366 @@
+#ifndef NETCDF_DANI_CROP_EXPORT_H
+#define NETCDF_DANI_CROP_EXPORT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "GeoTiffWriter.h"
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "colors.h"
+#include "gps.h"
+#include "instrumentation.h"
+#include "render_kernel.h"
+#include "reproject.h"
+#include "resample.h"
+
+enum class CropProduct {
+    Elevation16, // signed heights in meters
+    Gray8,       // upper byte of the height biased to unsigned
+    Rgb8,        // heightToRgb colormap
+};
+
+enum class CropProjection {
+    Geographic,  // the grid's plate carrée, EPSG:4326
+    WebMercator, // EPSG:3857, bilinearly resampled, square pixels of one grid cell at the equator
+};
+
+struct CropOutput {
+    std::string filename;
+    CropProduct product = CropProduct::Elevation16;
+    bool deflate = true;
+    int16_t colorMin = -500;
+    int16_t colorMax = 1800;
+};
+
+struct CropGrid {
+    std::size_t rowBegin{};
+    std::size_t rowEnd{};
+    std::size_t colBegin{};
+    std::size_t colEnd{};
+
+    std::size_t rows() const { return rowEnd - rowBegin; }
+    std::size_t cols() const { return colEnd - colBegin; }
+};
+
+// Grid cells covered by a GPS area, clamped to the grid
+inline CropGrid cropGridForArea(const GpsToOffsetConverter& converter, std::size_t width, std::size_t height, const GpsArea& area) {
+    auto offsetMin = converter.convert(area.min);
+    auto offsetMax = converter.convert(area.max);
+    CropGrid grid;
+    grid.rowBegin = std::min(offsetMin.latLon[0], height);
+    grid.rowEnd = std::clamp(offsetMax.latLon[0], grid.rowBegin, height);
+    grid.colBegin = std::min(offsetMin.latLon[1], width);
+    grid.colEnd = std::clamp(offsetMax.latLon[1], grid.colBegin, width);
+    return grid;
+}
+
+// Output raster of a crop: the grid cells themselves, or the lookup tables of their reprojection
+struct CropRaster {
+    std::size_t width{};
+    std::size_t height{};
+    CropProjection projection = CropProjection::Geographic;
+    std::vector<double> rowMap; // WebMercator: grid row of each output row, north to south
+    std::vector<double> colMap; // WebMercator: grid column of each output column
+    double originX{};           // WebMercator: north-west corner in meters
+    double originY{};
+    double pixelSize{};
+};
+
+inline CropRaster cropRaster(const GpsToOffsetConverter& converter, const CropGrid& grid, CropProjection projection) {
+    CropRaster raster;
+    raster.projection = projection;
+    raster.width = grid.cols();
+    raster.height = grid.rows();
+    if(projection == CropProjection::Geographic) {
+        return raster;
+    }
+    auto northWest = converter.convertBack(static_cast<double>(grid.rowEnd), static_cast<double>(grid.colBegin));
+    auto southEast = converter.convertBack(static_cast<double>(grid.rowBegin), static_cast<double>(grid.colEnd));
+    raster.pixelSize = webMercator::worldSize / (360.0 * converter.stepPerDegree());
+    raster.originX = webMercator::xFromLon(northWest.lon());
+    raster.originY = webMercator::yFromLat(northWest.lat());
+    const double bottomY = webMercator::yFromLat(southEast.lat());
+    raster.height = static_cast<std::size_t>(std::ceil((raster.originY - bottomY) / raster.pixelSize));
+    raster.rowMap = mercatorRowMap(converter, raster.originY, raster.pixelSize, raster.height);
+    raster.colMap = mercatorColMap(converter, raster.originX, raster.pixelSize, raster.width);
+    return raster;
+}
+
+inline GeoTiffLayout cropLayout(const GpsToOffsetConverter& converter, const CropGrid& grid, const CropOutput& output, std::size_t tileSize,
+                                const CropRaster* raster = nullptr) {
+    GeoTiffLayout layout;
+    layout.width = raster ? raster->width : grid.cols();
+    layout.height = raster ? raster->height : grid.rows();
+    layout.tileSize = tileSize;
+    layout.deflate = output.deflate;
+    switch(output.product) {
+        case CropProduct::Elevation16:
+            layout.samplesPerPixel = 1;
+            layout.bitsPerSample = 16;
+            layout.signedSamples = true;
+            break;
+        case CropProduct::Gray8:
+            layout.samplesPerPixel = 1;
+            layout.bitsPerSample = 8;
+            layout.signedSamples = false;
+            break;
+        case CropProduct::Rgb8:
+            layout.samplesPerPixel = 3;
+            layout.bitsPerSample = 8;
+            layout.signedSamples = false;
+            break;
+    }
+    // the north-western corner of the crop: row rowEnd is the first row north of it
+    auto northWest = converter.convertBack(static_cast<double>(grid.rowEnd), static_cast<double>(grid.colBegin));
+    layout.originLon = northWest.lon();
+    layout.originLat = northWest.lat();
+    layout.pixelSizeLon = 1.0 / converter.stepPerDegree();
+    layout.pixelSizeLat = 1.0 / converter.stepPerDegree();
+    if(raster && raster->projection == CropProjection::WebMercator) {
+        layout.originLon = raster->originX;
+        layout.originLat = raster->originY;
+        layout.pixelSizeLon = raster->pixelSize;
+        layout.pixelSizeLat = raster->pixelSize;
+        layout.epsg = 3857;
+        layout.projected = true;
+    }
+    return layout;
+}
+
+// The Rgb8 product's colormap
+inline ColorTable cropColorTable(const CropOutput& output, ThreadPool* pool = nullptr) {
+    return ColorTable::build([&output](int16_t height) { return heightToRgb(height, output.colorMax, output.colorMin); }, pool);
+}
+
+// Converts the heights of one tile (already flipped to north-up, zero padded) into output pixels;
+// colors is cropColorTable(output) for Rgb8
+inline std::vector<uint8_t> convertCropTile(const std::vector<int16_t>& heights, const CropOutput& output, std::size_t nPixels,
+                                            const ColorTable& colors = {}) {
+    NCD_TRACE_SCOPE("crop_convert");
+    NCD_COUNT(PixelsShaded, nPixels);
+    switch(output.product) {
+        case CropProduct::Elevation16: {
+            std::vector<uint8_t> pixels(nPixels * sizeof(int16_t));
+            std::memcpy(pixels.data(), heights.data(), pixels.size());
+            return pixels;
+        }
+        case CropProduct::Gray8: {
+            std::vector<uint8_t> pixels(nPixels);
+            for(std::size_t ix = 0; ix < nPixels; ++ix) {
+                int val = heights[ix] + std::abs(std::numeric_limits<int16_t>::min());
+                pixels[ix] = static_cast<uint8_t>(val >> 8);
+            }
+            return pixels;
+        }
+        case CropProduct::Rgb8: {
+            std::vector<uint8_t> pixels(nPixels * 3);
+            RenderOptions options;
+            options.format = PixelFormat::Rgb888;
+            render_heights(heights.data(), nPixels, 1, colors.empty() ? cropColorTable(output) : colors, options, pixels.data(), nPixels * 3);
+            return pixels;
+        }
+    }
+    return {};
+}
+
+// Streams the crop of `area` into tiled, georeferenced GeoTIFFs, one per output, from a single read.
+// Each band of tileSize rows is encoded on the pool; at most maxBandsInFlight bands are alive at once,
+// so memory stays flat regardless of the crop size. Source rows come from chunk-aligned blocks shared by
+// the bands that overlap them. Web Mercator output takes, per band, the grid rows its row map spans and
+// gathers through the precomputed tables.
+inline void export_crop(const NcFile& ncFile, const GpsArea& area, const std::vector<CropOutput>& outputs,
+                        ThreadPool& pool, CropProjection projection = CropProjection::Geographic,
+                        std::size_t tileSize = 256, std::size_t maxBandsInFlight = 0) {
+    RowBlockReader reader(ncFile);
+    auto converter = GpsToOffsetConverter::forGrid(reader.width(), reader.height());
+    auto grid = cropGridForArea(converter, reader.width(), reader.height(), area);
+    std::cout << "area size: " << grid.rows() << "*" << grid.cols() << std::endl;
+    if(grid.rows() == 0 || grid.cols() == 0) {
+        return;
+    }
+
+    const auto raster = cropRaster(converter, grid, projection);
+    std::vector<std::unique_ptr<GeoTiffWriter>> writers;
+    std::vector<ColorTable> colors(outputs.size());
+    for(std::size_t outputIx = 0; outputIx < outputs.size(); ++outputIx) {
+        const auto& output = outputs[outputIx];
+        writers.push_back(std::make_unique<GeoTiffWriter>(output.filename, cropLayout(converter, grid, output, tileSize, &raster)));
+        if(output.product == CropProduct::Rgb8) {
+            colors[outputIx] = cropColorTable(output, &pool);
+        }
+    }
+    const auto tilesAcross = (raster.width + tileSize - 1) / tileSize;
+    const auto tilesDown = (raster.height + tileSize - 1) / tileSize;
+    if(maxBandsInFlight == 0) {
+        maxBandsInFlight = pool.size() + 1;
+    }
+
+    // encoded[outputIx][tileX]
+    using EncodedBand = std::vector<std::vector<std::vector<uint8_t>>>;
+    const bool geographic = raster.projection == CropProjection::Geographic;
+    // grid rows [first, second) each band of the output needs
+    std::vector<std::pair<std::size_t, std::size_t>> bandSource(tilesDown);
+    for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+        const auto firstRow = tileY * tileSize;
+        const auto bandRows = std::min(tileSize, raster.height - firstRow);
+        if(geographic) {
+            // output row 0 is the northern edge, the file stores rows south to north
+            bandSource[tileY] = {grid.rowEnd - firstRow - bandRows, grid.rowEnd - firstRow};
+            continue;
+        }
+        const auto rowRange = std::minmax_element(raster.rowMap.begin() + firstRow, raster.rowMap.begin() + firstRow + bandRows);
+        bandSource[tileY] = {static_cast<std::size_t>(std::clamp(std::floor(*rowRange.first), 0.0, reader.height() - 1.0)),
+                             std::min(reader.height(), static_cast<std::size_t>(std::max(0.0, std::floor(*rowRange.second))) + 2)};
+    }
+    const auto srcColEnd = geographic ? grid.colEnd : std::min(reader.width(), grid.colEnd + 1);
+    const auto srcCols = srcColEnd - grid.colBegin;
+
+    // Source rows are read in blocks of whole chunks, at least a band tall, so no chunk is decompressed
+    // twice: the first band that needs a block reads it, the others wait for it, and the block is dropped
+    // once the last band using it is done.
+    const RowBlockReader blockReader(ncFile, "elevation", tileSize);
+    const auto blockRows = blockReader.blockRows();
+    struct SourceBlock {
+        std::shared_future<std::vector<int16_t>> rows;
+        std::size_t bands{}; // bands still to use it
+    };
+    std::map<std::size_t, SourceBlock> blocks;
+    std::mutex blocksMutex;
+    for(const auto& [srcBegin, srcEnd] : bandSource) {
+        for(auto blockIx = srcBegin / blockRows; blockIx <= (srcEnd - 1) / blockRows; ++blockIx) {
+            ++blocks[blockIx].bands;
+        }
+    }
+    const auto srcRowMin = std::min_element(bandSource.begin(), bandSource.end())->first;
+    const auto srcRowMax = std::max_element(bandSource.begin(), bandSource.end(),
+                                            [](const auto& a, const auto& b) { return a.second < b.second; })->second;
+    // rows [max(first, srcRowMin), min(end, srcRowMax)) of the block
+    auto sourceBlock = [&](std::size_t blockIx) {
+        std::promise<std::vector<int16_t>> read;
+        {
+            std::lock_guard<std::mutex> lock(blocksMutex);
+            auto& block = blocks.at(blockIx);
+            if(block.rows.valid()) {
+                return block.rows;
+            }
+            block.rows = read.get_future().share();
+        }
+        try {
+            NCD_TRACE_SCOPE("crop_read");
+            const auto rowBegin = std::max(blockIx * blockRows, srcRowMin);
+            const auto rowEnd = std::min((blockIx + 1) * blockRows, srcRowMax);
+            std::vector<int16_t> rows((rowEnd - rowBegin) * srcCols);
+            std::size_t offset[2] = {rowBegin, grid.colBegin};
+            std::size_t count[2] = {rowEnd - rowBegin, srcCols};
+            ncFile.getInt64Data(rows.data(), reader.varId(), offset, count);
+            read.set_value(std::move(rows));
+        } catch(...) {
+            read.set_exception(std::current_exception());
+        }
+        std::lock_guard<std::mutex> lock(blocksMutex);
+        return blocks.at(blockIx).rows;
+    };
+    // grid rows [srcBegin, srcEnd) of the source columns, south to north
+    auto readSource = [&](std::size_t srcBegin, std::size_t srcEnd) {
+        std::vector<int16_t> rows((srcEnd - srcBegin) * srcCols);
+        for(auto blockIx = srcBegin / blockRows; blockIx <= (srcEnd - 1) / blockRows; ++blockIx) {
+            const auto block = sourceBlock(blockIx);
+            const auto& blockData = block.get();
+            const auto blockBegin = std::max(blockIx * blockRows, srcRowMin);
+            const auto copyBegin = std::max(srcBegin, blockBegin);
+            const auto copyEnd = std::min(srcEnd, (blockIx + 1) * blockRows);
+            std::copy(blockData.begin() + static_cast<std::ptrdiff_t>((copyBegin - blockBegin) * srcCols),
+                      blockData.begin() + static_cast<std::ptrdiff_t>((copyEnd - blockBegin) * srcCols),
+                      rows.begin() + static_cast<std::ptrdiff_t>((copyBegin - srcBegin) * srcCols));
+        }
+        std::lock_guard<std::mutex> lock(blocksMutex);
+        for(auto blockIx = srcBegin / blockRows; blockIx <= (srcEnd - 1) / blockRows; ++blockIx) {
+            if(--blocks.at(blockIx).bands == 0) {
+                blocks.erase(blockIx);
+            }
+        }
+        return rows;
+    };
+
+    // rows [tileY * tileSize, ...) of the output, north-up
+    auto readBand = [&](std::size_t tileY) {
+        const auto firstRow = tileY * tileSize;
+        const auto bandRows = std::min(tileSize, raster.height - firstRow);
+        const auto [srcRowBegin, srcRowEnd] = bandSource[tileY];
+        const auto rows = readSource(srcRowBegin, srcRowEnd);
+        std::vector<int16_t> band(bandRows * raster.width);
+        if(geographic) {
+            for(std::size_t y = 0; y < bandRows; ++y) {
+                const int16_t* src = rows.data() + (bandRows - 1 - y) * grid.cols();
+                std::copy(src, src + grid.cols(), band.data() + y * grid.cols());
+            }
+            return band;
+        }
+        const ResampleAxis xAxis(raster.colMap.data(), raster.width, static_cast<double>(grid.colBegin), 1.0, srcCols);
+        const ResampleAxis yAxis(raster.rowMap.data() + firstRow, bandRows, static_cast<double>(srcRowBegin), 1.0, srcRowEnd - srcRowBegin);
+        resample_bilinear(rows.data(), srcCols, srcRowEnd - srcRowBegin, xAxis, yAxis, band.data());
+        return band;
+    };
+
+    auto processBand = [&](std::size_t tileY) {
+        const auto band = readBand(tileY);
+        const auto bandRows = band.size() / raster.width;
+
+        EncodedBand encoded(outputs.size(), std::vector<std::vector<uint8_t>>(tilesAcross));
+        std::vector<int16_t> tileHeights(tileSize * tileSize);
+        for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+            std::fill(tileHeights.begin(), tileHeights.end(), 0);
+            const auto colBegin = tileX * tileSize;
+            const auto nCols = std::min(tileSize, raster.width - colBegin);
+            for(std::size_t y = 0; y < bandRows; ++y) {
+                const int16_t* src = band.data() + y * raster.width + colBegin;
+                std::copy(src, src + nCols, tileHeights.data() + y * tileSize);
+            }
+            for(std::size_t outputIx = 0; outputIx < outputs.size(); ++outputIx) {
+                auto pixels = convertCropTile(tileHeights, outputs[outputIx], tileHeights.size(), colors[outputIx]);
+                encoded[outputIx][tileX] = writers[outputIx]->encodeTile(std::move(pixels));
+            }
+        }
+        return encoded;
+    };
+
+    std::deque<std::future<EncodedBand>> inFlight;
+    std::size_t nextBand = 0;
+    try {
+        for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+            while(nextBand < tilesDown && inFlight.size() < maxBandsInFlight) {
+                inFlight.push_back(pool.submit([&processBand, bandIx = nextBand++]() { return processBand(bandIx); }));
+            }
+            auto encoded = inFlight.front().get();
+            inFlight.pop_front();
+            for(std::size_t outputIx = 0; outputIx < outputs.size(); ++outputIx) {
+                for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+                    writers[outputIx]->writeTile(tileX, tileY, encoded[outputIx][tileX]);
+                }
+            }
+        }
+    } catch(...) {
+        // the queued bands reference this frame
+        for(auto& band : inFlight) {
+            band.wait();
+        }
+        throw;
+    }
+    for(auto& writer : writers) {
+        writer->finish();
+    }
+}
+
+#endif //NETCDF_DANI_CROP_EXPORT_H
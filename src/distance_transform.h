@@ -0,0 +1,274 @@
+#ifndef NETCDF_DANI_DISTANCE_TRANSFORM_H
+#define NETCDF_DANI_DISTANCE_TRANSFORM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "TileStore.h"
+#include "gps.h"
+#include "instrumentation.h"
+
+// Exact separable Euclidean distance transform (Felzenszwalb & Huttenlocher) and the distance of every
+// grid cell to the 0 m coastline.
+//
+// The row pass gives each cell the squared distance to the nearest coast cell in its row, with the
+// cell width of that row's latitude; the column pass takes the lower envelope of the parabolas
+// rowPass(r') + (dy * (r - r'))^2 down each column. So east-west offsets are measured at the latitude
+// of the coast cell, which is exact for the locally flat earth and close to the great circle distance
+// away from the poles.
+
+// Squared distances along one line of n samples spaced `spacing` apart:
+// d[q] = min over p of f[p] + (spacing * (q - p))^2. Infinite f values are not features.
+inline void distance_transform_1d(const float* f, std::size_t n, double spacing, float* d) {
+    thread_local std::vector<std::size_t> vertices; // parabolas of the lower envelope
+    thread_local std::vector<double> bounds;        // where each one starts
+    vertices.resize(n);
+    bounds.resize(n + 1);
+    const double s2 = spacing * spacing;
+    std::size_t k = 0;
+    bool empty = true;
+    for(std::size_t q = 0; q < n; ++q) {
+        if(!std::isfinite(f[q])) {
+            continue;
+        }
+        const double fq = f[q] + s2 * static_cast<double>(q) * static_cast<double>(q);
+        if(empty) {
+            vertices[0] = q;
+            bounds[0] = -std::numeric_limits<double>::infinity();
+            bounds[1] = std::numeric_limits<double>::infinity();
+            empty = false;
+            continue;
+        }
+        auto intersection = [&](std::size_t v) {
+            const double fv = f[v] + s2 * static_cast<double>(v) * static_cast<double>(v);
+            return (fq - fv) / (2.0 * s2 * static_cast<double>(q - v));
+        };
+        // bounds[0] is -inf, so this stops at the first parabola
+        double s = intersection(vertices[k]);
+        while(s <= bounds[k]) {
+            --k;
+            s = intersection(vertices[k]);
+        }
+        ++k;
+        vertices[k] = q;
+        bounds[k] = s;
+        bounds[k + 1] = std::numeric_limits<double>::infinity();
+    }
+    if(empty) {
+        std::fill(d, d + n, std::numeric_limits<float>::infinity());
+        return;
+    }
+    k = 0;
+    for(std::size_t q = 0; q < n; ++q) {
+        while(bounds[k + 1] < static_cast<double>(q)) {
+            ++k;
+        }
+        const double offset = static_cast<double>(q) - static_cast<double>(vertices[k]);
+        d[q] = static_cast<float>(s2 * offset * offset + f[vertices[k]]);
+    }
+}
+
+// Squared distance to the nearest feature in a row of width cells `spacing` apart, around the globe
+// if wrap; infinite if the row has no feature
+inline void nearest_feature_1d(const uint8_t* feature, std::size_t width, double spacing, bool wrap, float* d) {
+    constexpr auto none = std::numeric_limits<int64_t>::max() / 4;
+    const auto n = static_cast<int64_t>(width);
+    int64_t last = -none;
+    int64_t first = none;
+    for(int64_t x = 0; x < n; ++x) {
+        if(feature[x]) {
+            first = std::min(first, x);
+            last = x;
+        }
+    }
+    if(first == none) {
+        std::fill(d, d + width, std::numeric_limits<float>::infinity());
+        return;
+    }
+    // the nearest feature to the west, then to the east
+    int64_t west = wrap ? last - n : -none;
+    for(int64_t x = 0; x < n; ++x) {
+        west = feature[x] ? x : west;
+        d[x] = static_cast<float>(x - west);
+    }
+    int64_t east = wrap ? first + n : none;
+    for(int64_t x = n - 1; x >= 0; --x) {
+        east = feature[x] ? x : east;
+        const double cells = std::min<double>(d[x], static_cast<double>(east - x));
+        d[x] = static_cast<float>(cells * cells * spacing * spacing);
+    }
+}
+
+struct DistanceToCoastOptions {
+    std::size_t tileSize = 256;
+    // row pass output, 4 bytes per cell, removed when done; default: the output file + ".rowpass"
+    std::string tempFile;
+    std::size_t maxInFlight = 0; // bands or column strips, 0: pool size + 1
+};
+
+// Signed distance in meters from every cell center to the nearest coast cell center, positive on land
+// (>= 0 m), negative at sea, written as a Float32 tile store (read with TileStoreReader::readRegion).
+// Coast cells are the cells with a 4-neighbor on the other side of 0 m.
+//
+// Out of core: the row pass streams bands of rows and writes transposed tiles to the temp file so that
+// every strip of tileSize columns is one contiguous run; the column pass then reads strip by strip.
+// Memory stays a few strips or bands per worker.
+inline void compute_distance_to_coast(const NcFile& ncFile, const std::string& filename, ThreadPool& pool,
+                                      const DistanceToCoastOptions& options = {}) {
+    RowBlockReader reader(ncFile);
+    const auto width = reader.width();
+    const auto height = reader.height();
+    const auto tileSize = options.tileSize;
+    const auto cellsPerDegree = static_cast<double>(width) / 360.0;
+    const double dyMeters = metersPerDegreeLat() / cellsPerDegree;
+    const auto converter = GpsToOffsetConverter::forGrid(width, height);
+
+    TileStoreLayout layout;
+    layout.width = width;
+    layout.height = height;
+    layout.tileSize = tileSize;
+    layout.sampleType = TileSampleType::Float32;
+    TileStoreWriter writer(filename, layout);
+    const auto tilesAcross = layout.tilesAcross();
+    const auto tilesDown = layout.tilesDown();
+    const auto maxInFlight = options.maxInFlight == 0 ? pool.size() + 1 : options.maxInFlight;
+    const auto tempFile = options.tempFile.empty() ? filename + ".rowpass" : options.tempFile;
+    // tile (tileX, tileY) of the row pass, column-major, in slot tileX * tilesDown + tileY
+    const auto slotFloats = tileSize * tileSize;
+    auto slotOffset = [&](std::size_t tileX, std::size_t tileY) {
+        return static_cast<std::streamoff>((tileX * tilesDown + tileY) * slotFloats * sizeof(float));
+    };
+
+    // Runs process(ix) on the pool for ix < n, at most maxInFlight at a time, and consume(ix, result) here in order
+    auto forEach = [&](std::size_t n, auto&& process, auto&& consume) {
+        using Result = decltype(process(std::size_t{}));
+        std::deque<std::future<Result>> inFlight;
+        std::size_t next = 0;
+        try {
+            for(std::size_t ix = 0; ix < n; ++ix) {
+                while(next < n && inFlight.size() < maxInFlight) {
+                    inFlight.push_back(pool.submit([&process, jx = next++]() { return process(jx); }));
+                }
+                auto result = inFlight.front().get();
+                inFlight.pop_front();
+                consume(ix, std::move(result));
+            }
+        } catch(...) {
+            // the queued tasks reference this frame
+            for(auto& task : inFlight) {
+                task.wait();
+            }
+            throw;
+        }
+    };
+
+    try {
+        // row pass: squared horizontal distance, the sign bit set at sea
+        {
+            std::ofstream temp(tempFile, std::ios::binary | std::ios::trunc);
+            if(!temp.is_open()) {
+                throw std::runtime_error("couldn't open " + tempFile);
+            }
+            forEach(tilesDown, [&](std::size_t tileY) {
+                NCD_TRACE_SCOPE("coast_row_pass");
+                const auto firstRow = tileY * tileSize;
+                const auto nRows = layout.tileHeight(tileY);
+                const auto haloFirstRow = firstRow == 0 ? 0 : firstRow - 1;
+                const auto block = reader.read(haloFirstRow, firstRow + nRows + 1 - haloFirstRow);
+                auto isLand = [&](std::size_t row, std::size_t col) {
+                    row = std::clamp(row, block.firstRow, block.endRow() - 1);
+                    return block.row(row - block.firstRow)[col] >= 0;
+                };
+                std::vector<float> slots(tilesAcross * slotFloats);
+                std::vector<uint8_t> coast(width);
+                std::vector<float> rowDistance(width);
+                for(std::size_t y = 0; y < nRows; ++y) {
+                    const auto row = firstRow + y;
+                    for(std::size_t col = 0; col < width; ++col) {
+                        const bool land = isLand(row, col);
+                        coast[col] = isLand(row == 0 ? 0 : row - 1, col) != land || isLand(row + 1, col) != land
+                                     || isLand(row, col == 0 ? width - 1 : col - 1) != land
+                                     || isLand(row, col + 1 == width ? 0 : col + 1) != land;
+                    }
+                    const double lat = converter.convertBack(static_cast<double>(row) + 0.5, 0.0).lat();
+                    nearest_feature_1d(coast.data(), width, metersPerDegreeLon(lat) / cellsPerDegree, true, rowDistance.data());
+                    for(std::size_t col = 0; col < width; ++col) {
+                        const float value = isLand(row, col) ? rowDistance[col] : -rowDistance[col];
+                        slots[(col / tileSize) * slotFloats + (col % tileSize) * tileSize + y] = value;
+                    }
+                }
+                return slots;
+            }, [&](std::size_t tileY, std::vector<float> slots) {
+                for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+                    temp.seekp(slotOffset(tileX, tileY));
+                    temp.write(reinterpret_cast<const char*>(slots.data() + tileX * slotFloats), slotFloats * sizeof(float));
+                }
+            });
+            temp.close();
+            if(!temp) {
+                throw std::runtime_error("write failed: " + tempFile);
+            }
+        }
+
+        // column pass: one strip of columns at a time, the output tiles of the whole strip
+        forEach(tilesAcross, [&](std::size_t tileX) {
+            NCD_TRACE_SCOPE("coast_column_pass");
+            std::vector<float> strip(tilesDown * slotFloats);
+            {
+                std::ifstream temp(tempFile, std::ios::binary);
+                temp.seekg(slotOffset(tileX, 0));
+                temp.read(reinterpret_cast<char*>(strip.data()), strip.size() * sizeof(float));
+                if(!temp) {
+                    throw std::runtime_error("read failed: " + tempFile);
+                }
+            }
+            const auto tileW = layout.tileWidth(tileX);
+            std::vector<float> column(height);
+            std::vector<float> distance(height);
+            std::vector<std::vector<float>> tiles(tilesDown);
+            for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+                tiles[tileY].resize(tileW * layout.tileHeight(tileY));
+            }
+            for(std::size_t x = 0; x < tileW; ++x) {
+                for(std::size_t row = 0; row < height; ++row) {
+                    column[row] = std::abs(strip[(row / tileSize) * slotFloats + x * tileSize + row % tileSize]);
+                }
+                distance_transform_1d(column.data(), height, dyMeters, distance.data());
+                for(std::size_t row = 0; row < height; ++row) {
+                    const bool sea = std::signbit(strip[(row / tileSize) * slotFloats + x * tileSize + row % tileSize]);
+                    const float meters = std::sqrt(distance[row]);
+                    tiles[row / tileSize][(row % tileSize) * tileW + x] = sea ? -meters : meters;
+                }
+            }
+            std::vector<std::vector<uint8_t>> encoded(tilesDown);
+            for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+                encoded[tileY] = writer.encodeTile(tileX, tileY, tiles[tileY].data());
+            }
+            return encoded;
+        }, [&](std::size_t tileX, std::vector<std::vector<uint8_t>> encoded) {
+            for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+                writer.writeTile(tileX, tileY, encoded[tileY]);
+            }
+        });
+        writer.finish();
+    } catch(...) {
+        std::remove(tempFile.c_str());
+        throw;
+    }
+    std::remove(tempFile.c_str());
+}
+
+#endif //NETCDF_DANI_DISTANCE_TRANSFORM_H
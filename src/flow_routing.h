@@ -0,0 +1,915 @@
+#ifndef NETCDF_DANI_FLOW_ROUTING_H
+#define NETCDF_DANI_FLOW_ROUTING_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "TilePerimeter.h"
+#include "TileStore.h"
+#include "UnionFind.h"
+#include "crop_export.h"
+#include "gps.h"
+#include "instrumentation.h"
+
+// D8 flow directions and flow accumulation over a region, with depressions filled by priority-flood so that
+// every cell drains to the sea or off the region.
+//
+// Cells below seaBelow and the cells on the region's border are outlets; for the full grid width the east and
+// west borders wrap around instead. The filled height of a cell is the lowest water level at which it drains:
+// the minimum over paths to an outlet of the highest cell on the path. A cell drains to its steepest lower
+// 8-neighbor on the filled surface, with ground distances at the cell's latitude. Cells of flats (no lower
+// neighbor, e.g. filled depressions) drain towards the nearest cell of the flat that has one. Ties go to the
+// first neighbor in the order of the direction codes.
+//
+// Tiled, with state kept only for the tile perimeters (Barnes, "Parallel priority-flood depression filling
+// for trillion cell digital elevation models", and "Parallel non-divergent flow accumulation"):
+//  1. Each tile is flooded from its perimeter and its sea cells; every perimeter cell labels the cells it
+//     reaches first, and the lowest spill height between each pair of labels is kept. A Kruskal merge of
+//     these edges and the ones across tile borders gives the filled height of every perimeter cell.
+//  2. Flooding each tile again from its perimeter at those heights fills it exactly. Distances across flats
+//     are exchanged through the perimeters in rounds until none changes; after the first round only the
+//     tiles with a flat that continues into a neighbor take part.
+//  3. The directions of each tile go to a tile store, and every perimeter cell records how many cells of its
+//     tile reach it first and which perimeter cell its flow reaches next. Accumulating that graph gives the
+//     flow entering every tile, and a last pass accumulates the tiles.
+// Every pass reads the grid tile by tile, a few tiles per worker at a time.
+
+// D8 codes (ESRI); north is the next grid row, rows run south to north
+constexpr int16_t flowNone = 0; // outlets
+constexpr int16_t flowEast = 1;
+constexpr int16_t flowSouthEast = 2;
+constexpr int16_t flowSouth = 4;
+constexpr int16_t flowSouthWest = 8;
+constexpr int16_t flowWest = 16;
+constexpr int16_t flowNorthWest = 32;
+constexpr int16_t flowNorth = 64;
+constexpr int16_t flowNorthEast = 128;
+
+struct FlowRoutingOptions {
+    int16_t seaBelow = 0; // cells below this are sea
+    std::size_t tileSize = 1024;
+    std::size_t maxTilesInFlight = 0; // 0: pool size + 1
+    // the directions for the accumulation pass if FlowRoutingOutput::directionTiles is empty, removed when
+    // done; default: the accumulation file + ".dir"
+    std::string tempFile;
+};
+
+// Tile stores covering the region; empty names are skipped
+struct FlowRoutingOutput {
+    std::string directionTiles;    // Int16 D8 codes
+    // Float32 number of cells draining through each cell, itself included; exact up to 2^24 (16.7M) cells,
+    // larger basins are rounded to 24 significant bits (FlowRoutingSummary::maxAccumulation stays exact)
+    std::string accumulationTiles;
+    std::string filledTiles;       // Int16 filled heights
+};
+
+struct FlowRoutingSummary {
+    std::size_t cells{};
+    std::size_t outletCells{};
+    std::size_t raisedCells{}; // filled above their height
+    std::size_t flatCells{};
+    std::size_t flatRounds{}; // passes over the tiles to settle the flats
+    double maxAccumulation{}; // exact, unlike the Float32 tiles
+};
+
+namespace flow_detail {
+
+struct Step {
+    int dx{};
+    int dy{};
+    int16_t code{};
+};
+
+constexpr Step d8[8] = {{1, 0, flowEast}, {1, -1, flowSouthEast}, {0, -1, flowSouth}, {-1, -1, flowSouthWest},
+                        {-1, 0, flowWest}, {-1, 1, flowNorthWest}, {0, 1, flowNorth}, {1, 1, flowNorthEast}};
+
+inline int stepOf(int16_t code) {
+    for(int k = 0; k < 8; ++k) {
+        if(d8[k].code == code) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+constexpr uint32_t none = notOnPerimeter;
+constexpr uint32_t unreached = std::numeric_limits<uint32_t>::max();
+
+// Cells by int16 level, lowest level first; a push must not go below the last popped level
+class LevelQueue {
+public:
+    explicit LevelQueue(std::size_t nCells) : _head(1 << 16, none), _next(nCells) {}
+
+    void push(uint32_t cell, int16_t level) {
+        const auto bucket = static_cast<std::size_t>(level + 32768);
+        _next[cell] = _head[bucket];
+        _head[bucket] = cell;
+        _lowest = std::min(_lowest, bucket);
+        ++_size;
+    }
+
+    bool pop(uint32_t& cell, int16_t& level) {
+        if(_size == 0) {
+            return false;
+        }
+        while(_head[_lowest] == none) {
+            ++_lowest;
+        }
+        cell = _head[_lowest];
+        _head[_lowest] = _next[cell];
+        level = static_cast<int16_t>(static_cast<int>(_lowest) - 32768);
+        --_size;
+        return true;
+    }
+
+private:
+    std::vector<uint32_t> _head;
+    std::vector<uint32_t> _next;
+    std::size_t _lowest = std::size_t{1} << 16;
+    std::size_t _size{};
+};
+
+struct LabelEdge {
+    uint32_t a{};
+    uint32_t b{};
+    int16_t height{};
+};
+
+// One tile filled, with its flat distances and a ring of the neighbors' perimeter cells around it
+struct SettledTile {
+    std::size_t w{};
+    std::size_t h{};
+    std::vector<int16_t> heights;
+    std::vector<uint8_t> outlet;
+    std::vector<uint8_t> flat;
+    // (w + 2) x (h + 2), the tile at (1, 1): filled heights (absent: outside the region) and flat distances
+    // (0 for outlets and cells with a lower neighbor)
+    std::vector<int32_t> filled;
+    std::vector<uint32_t> distance;
+    bool crossFlat = false; // a flat continues into a neighbor
+
+    static constexpr int32_t absent = std::numeric_limits<int32_t>::max();
+    std::size_t ring(std::size_t x, std::size_t y) const { return (y + 1) * (w + 2) + x + 1; }
+};
+
+} // namespace flow_detail
+
+inline FlowRoutingSummary route_flow(const NcFile& ncFile, const CropGrid& region, ThreadPool& pool,
+                                     const FlowRoutingOutput& output, const FlowRoutingOptions& options = {}) {
+    using namespace flow_detail;
+    FlowRoutingSummary summary;
+    if(region.rows() == 0 || region.cols() == 0) {
+        return summary;
+    }
+    RowBlockReader reader(ncFile);
+    const auto converter = GpsToOffsetConverter::forGrid(reader.width(), reader.height());
+    const auto rows = region.rows();
+    const auto cols = region.cols();
+    const bool wrapColumns = cols == reader.width();
+    const auto tileSize = options.tileSize;
+    const auto tilesAcross = (cols + tileSize - 1) / tileSize;
+    const auto tilesDown = (rows + tileSize - 1) / tileSize;
+    const auto nTiles = tilesAcross * tilesDown;
+    auto tileWidth = [&](std::size_t tileX) { return std::min(tileSize, cols - tileX * tileSize); };
+    auto tileHeight = [&](std::size_t tileY) { return std::min(tileSize, rows - tileY * tileSize); };
+
+    // graph nodes: the perimeter cells of every tile, then the sea
+    std::vector<uint32_t> nodeBase(nTiles + 1, 0);
+    for(std::size_t tileIx = 0; tileIx < nTiles; ++tileIx) {
+        nodeBase[tileIx + 1] = nodeBase[tileIx] + static_cast<uint32_t>(perimeterSize(tileWidth(tileIx % tilesAcross), tileHeight(tileIx / tilesAcross)));
+    }
+    const uint32_t seaNode = nodeBase[nTiles];
+    const std::size_t nNodes = seaNode;
+
+    // node of a region cell on a tile perimeter
+    auto nodeOf = [&](std::size_t row, std::size_t col) {
+        const auto tileX = col / tileSize;
+        const auto tileY = row / tileSize;
+        return nodeBase[tileY * tilesAcross + tileX]
+               + perimeterIndex(col - tileX * tileSize, row - tileY * tileSize, tileWidth(tileX), tileHeight(tileY));
+    };
+    auto isOutlet = [&](std::size_t row, std::size_t col, int16_t height) {
+        return height < options.seaBelow || row == 0 || row + 1 == rows || (!wrapColumns && (col == 0 || col + 1 == cols));
+    };
+    // the region cell one step away, around the globe for the full width; false outside the region
+    auto neighborCell = [&](std::size_t row, std::size_t col, const Step& step, std::size_t& nRow, std::size_t& nCol) {
+        const auto r = static_cast<std::ptrdiff_t>(row) + step.dy;
+        auto c = static_cast<std::ptrdiff_t>(col) + step.dx;
+        if(r < 0 || r >= static_cast<std::ptrdiff_t>(rows)) {
+            return false;
+        }
+        if(c < 0 || c >= static_cast<std::ptrdiff_t>(cols)) {
+            if(!wrapColumns) {
+                return false;
+            }
+            c = (c + static_cast<std::ptrdiff_t>(cols)) % static_cast<std::ptrdiff_t>(cols);
+        }
+        nRow = static_cast<std::size_t>(r);
+        nCol = static_cast<std::size_t>(c);
+        return true;
+    };
+    // ground distance of each step from a cell of the given row, in cell heights
+    auto stepLengths = [&](std::size_t row) {
+        const double lat = converter.convertBack(static_cast<double>(region.rowBegin + row) + 0.5, 0.0).lat();
+        const double dx = std::cos(lat * 3.14159265358979323846 / 180.0);
+        std::array<double, 8> lengths{};
+        for(int k = 0; k < 8; ++k) {
+            lengths[k] = d8[k].dx == 0 ? 1.0 : (d8[k].dy == 0 ? dx : std::sqrt(dx * dx + 1.0));
+        }
+        return lengths;
+    };
+
+    auto readTile = [&](std::size_t tileIx) {
+        const auto tileX = tileIx % tilesAcross;
+        const auto tileY = tileIx / tilesAcross;
+        std::vector<int16_t> heights(tileWidth(tileX) * tileHeight(tileY));
+        std::size_t offset[2] = {region.rowBegin + tileY * tileSize, region.colBegin + tileX * tileSize};
+        std::size_t count[2] = {tileHeight(tileY), tileWidth(tileX)};
+        ncFile.getInt64Data(heights.data(), reader.varId(), offset, count);
+        return heights;
+    };
+
+    // Runs process(tileIx) on the pool for the tiles, at most maxTilesInFlight at a time, and
+    // consume(tileIx, result) on this thread in order
+    const auto maxInFlight = options.maxTilesInFlight == 0 ? pool.size() + 1 : options.maxTilesInFlight;
+    auto forEachTile = [&](const std::vector<std::size_t>& tiles, auto&& process, auto&& consume) {
+        using Result = decltype(process(std::size_t{}));
+        std::deque<std::future<Result>> inFlight;
+        std::size_t next = 0;
+        try {
+            for(const auto tileIx : tiles) {
+                while(next < tiles.size() && inFlight.size() < maxInFlight) {
+                    inFlight.push_back(pool.submit([&process, ix = tiles[next++]]() { return process(ix); }));
+                }
+                auto result = inFlight.front().get();
+                inFlight.pop_front();
+                consume(tileIx, std::move(result));
+            }
+        } catch(...) {
+            // the queued tiles reference this frame
+            for(auto& tile : inFlight) {
+                tile.wait();
+            }
+            throw;
+        }
+    };
+    std::vector<std::size_t> allTiles(nTiles);
+    std::iota(allTiles.begin(), allTiles.end(), std::size_t{0});
+
+    std::vector<int16_t> nodeHeight(nNodes);
+    std::vector<uint8_t> nodeOutlet(nNodes);
+
+    // pass 1: spill heights between the labels of each tile
+    std::vector<LabelEdge> edges;
+    forEachTile(allTiles, [&](std::size_t tileIx) {
+        NCD_TRACE_SCOPE("flow_labels");
+        const auto w = tileWidth(tileIx % tilesAcross);
+        const auto h = tileHeight(tileIx / tilesAcross);
+        const auto row0 = (tileIx / tilesAcross) * tileSize;
+        const auto col0 = (tileIx % tilesAcross) * tileSize;
+        const auto heights = readTile(tileIx);
+        std::vector<uint32_t> label(w * h, none);
+        std::vector<int16_t> level(w * h);
+        std::vector<uint8_t> visited(w * h, 0);
+        LevelQueue queue(w * h);
+        for(std::size_t y = 0; y < h; ++y) {
+            for(std::size_t x = 0; x < w; ++x) {
+                const auto cell = y * w + x;
+                const auto border = perimeterIndex(x, y, w, h);
+                const bool outlet = isOutlet(row0 + y, col0 + x, heights[cell]);
+                if(border != notOnPerimeter) {
+                    // this tile's nodes only, so the writes don't race
+                    nodeHeight[nodeBase[tileIx] + border] = heights[cell];
+                    nodeOutlet[nodeBase[tileIx] + border] = outlet;
+                } else if(!outlet) {
+                    continue;
+                }
+                visited[cell] = 1;
+                level[cell] = heights[cell];
+                label[cell] = outlet ? seaNode : none;
+                queue.push(static_cast<uint32_t>(cell), heights[cell]);
+            }
+        }
+        std::unordered_map<uint64_t, int16_t> spill; // label pair -> lowest spill height
+        uint32_t cell = 0;
+        int16_t cellLevel = 0;
+        while(queue.pop(cell, cellLevel)) {
+            const std::size_t x = cell % w;
+            const std::size_t y = cell / w;
+            if(label[cell] == none) {
+                // only perimeter cells start unlabeled
+                label[cell] = nodeBase[tileIx] + perimeterIndex(x, y, w, h);
+            }
+            for(const auto& step : d8) {
+                const auto nx = static_cast<std::ptrdiff_t>(x) + step.dx;
+                const auto ny = static_cast<std::ptrdiff_t>(y) + step.dy;
+                if(nx < 0 || ny < 0 || nx >= static_cast<std::ptrdiff_t>(w) || ny >= static_cast<std::ptrdiff_t>(h)) {
+                    continue;
+                }
+                const auto neighbor = static_cast<uint32_t>(static_cast<std::size_t>(ny) * w + static_cast<std::size_t>(nx));
+                if(!visited[neighbor]) {
+                    visited[neighbor] = 1;
+                    label[neighbor] = label[cell];
+                    level[neighbor] = std::max(heights[neighbor], cellLevel);
+                    queue.push(neighbor, level[neighbor]);
+                } else if(label[neighbor] != none && label[neighbor] != label[cell]) {
+                    const auto a = std::min(label[cell], label[neighbor]);
+                    const auto b = std::max(label[cell], label[neighbor]);
+                    const auto height = std::max(cellLevel, level[neighbor]);
+                    auto [it, inserted] = spill.emplace((uint64_t{a} << 32) | b, height);
+                    if(!inserted) {
+                        it->second = std::min(it->second, height);
+                    }
+                }
+            }
+        }
+        std::vector<LabelEdge> tileEdges;
+        tileEdges.reserve(spill.size());
+        for(const auto& [key, height] : spill) {
+            tileEdges.push_back(LabelEdge{static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key), height});
+        }
+        return tileEdges;
+    }, [&](std::size_t, std::vector<LabelEdge> tileEdges) {
+        edges.insert(edges.end(), tileEdges.begin(), tileEdges.end());
+    });
+
+    // the edges across tile borders, from every perimeter cell to its neighbors in other tiles
+    auto forEachCrossing = [&](auto&& f) {
+        for(std::size_t tileIx = 0; tileIx < nTiles; ++tileIx) {
+            const auto w = tileWidth(tileIx % tilesAcross);
+            const auto h = tileHeight(tileIx / tilesAcross);
+            const auto row0 = (tileIx / tilesAcross) * tileSize;
+            const auto col0 = (tileIx % tilesAcross) * tileSize;
+            for(std::size_t border = 0; border < perimeterSize(w, h); ++border) {
+                const auto [x, y] = perimeterCell(border, w, h);
+                for(const auto& step : d8) {
+                    const auto nx = static_cast<std::ptrdiff_t>(x) + step.dx;
+                    const auto ny = static_cast<std::ptrdiff_t>(y) + step.dy;
+                    if(nx >= 0 && ny >= 0 && nx < static_cast<std::ptrdiff_t>(w) && ny < static_cast<std::ptrdiff_t>(h)) {
+                        continue;
+                    }
+                    std::size_t nRow = 0;
+                    std::size_t nCol = 0;
+                    if(neighborCell(row0 + y, col0 + x, step, nRow, nCol)) {
+                        f(nodeBase[tileIx] + static_cast<uint32_t>(border), nodeOf(nRow, nCol));
+                    }
+                }
+            }
+        }
+    };
+    forEachCrossing([&](uint32_t a, uint32_t b) {
+        if(b <= a) {
+            return; // every pair is seen from both sides
+        }
+        const auto labelA = nodeOutlet[a] ? seaNode : a;
+        const auto labelB = nodeOutlet[b] ? seaNode : b;
+        if(labelA != labelB) {
+            edges.push_back(LabelEdge{labelA, labelB, std::max(nodeHeight[a], nodeHeight[b])});
+        }
+    });
+
+    // Kruskal by spill height: the height at which each node joins the sea; members are circular lists spliced on union
+    std::vector<int16_t> nodeFilled(nNodes);
+    {
+        NCD_TRACE_SCOPE("flow_merge");
+        std::vector<std::size_t> bucketBegin((1 << 16) + 1, 0);
+        for(const auto& edge : edges) {
+            ++bucketBegin[static_cast<std::size_t>(edge.height + 32768) + 1];
+        }
+        std::partial_sum(bucketBegin.begin(), bucketBegin.end(), bucketBegin.begin());
+        std::vector<uint32_t> order(edges.size());
+        for(std::size_t edgeIx = 0; edgeIx < edges.size(); ++edgeIx) {
+            order[bucketBegin[static_cast<std::size_t>(edges[edgeIx].height + 32768)]++] = static_cast<uint32_t>(edgeIx);
+        }
+        constexpr int32_t neverJoined = std::numeric_limits<int32_t>::max();
+        std::vector<int32_t> joinHeight(nNodes + 1, neverJoined);
+        UnionFind nodes(nNodes + 1);
+        std::vector<uint32_t> nextMember(nNodes + 1);
+        std::iota(nextMember.begin(), nextMember.end(), uint32_t{0});
+        for(const auto edgeIx : order) {
+            const auto& edge = edges[edgeIx];
+            const auto rootA = nodes.find(edge.a);
+            const auto rootB = nodes.find(edge.b);
+            if(rootA == rootB) {
+                continue;
+            }
+            const auto seaRoot = nodes.find(seaNode);
+            if(rootA == seaRoot || rootB == seaRoot) {
+                const auto joined = rootA == seaRoot ? rootB : rootA;
+                auto member = joined;
+                do {
+                    joinHeight[member] = edge.height;
+                    member = nextMember[member];
+                } while(member != joined);
+            }
+            nodes.unite(rootA, rootB);
+            std::swap(nextMember[rootA], nextMember[rootB]);
+        }
+        for(std::size_t node = 0; node < nNodes; ++node) {
+            const bool drains = !nodeOutlet[node] && joinHeight[node] != neverJoined;
+            nodeFilled[node] = drains ? static_cast<int16_t>(std::max<int32_t>(nodeHeight[node], joinHeight[node])) : nodeHeight[node];
+        }
+    }
+    edges = {};
+
+    // pass 2: flood a tile from its perimeter's filled heights, then measure its flats, taking the distances
+    // of the neighbors' perimeter cells from haloDistance
+    auto settleTile = [&](std::size_t tileIx, const std::vector<uint32_t>& haloDistance) {
+        SettledTile tile;
+        const auto w = tile.w = tileWidth(tileIx % tilesAcross);
+        const auto h = tile.h = tileHeight(tileIx / tilesAcross);
+        const auto row0 = (tileIx / tilesAcross) * tileSize;
+        const auto col0 = (tileIx % tilesAcross) * tileSize;
+        tile.heights = readTile(tileIx);
+        tile.outlet.assign(w * h, 0);
+        tile.flat.assign(w * h, 0);
+        tile.filled.assign((w + 2) * (h + 2), SettledTile::absent);
+        tile.distance.assign((w + 2) * (h + 2), unreached);
+        // the ring: perimeter cells of the neighboring tiles
+        for(std::ptrdiff_t y = -1; y <= static_cast<std::ptrdiff_t>(h); ++y) {
+            for(std::ptrdiff_t x = -1; x <= static_cast<std::ptrdiff_t>(w); ++x) {
+                if(x >= 0 && y >= 0 && x < static_cast<std::ptrdiff_t>(w) && y < static_cast<std::ptrdiff_t>(h)) {
+                    continue;
+                }
+                const auto ringIx = static_cast<std::size_t>(y + 1) * (w + 2) + static_cast<std::size_t>(x + 1);
+                std::size_t nRow = 0;
+                std::size_t nCol = 0;
+                const Step offset{static_cast<int>(x), static_cast<int>(y), flowNone};
+                if(neighborCell(row0, col0, offset, nRow, nCol)) {
+                    const auto node = nodeOf(nRow, nCol);
+                    tile.filled[ringIx] = nodeFilled[node];
+                    tile.distance[ringIx] = haloDistance[node];
+                }
+            }
+        }
+
+        std::vector<uint8_t> visited(w * h, 0);
+        LevelQueue queue(w * h);
+        for(std::size_t y = 0; y < h; ++y) {
+            for(std::size_t x = 0; x < w; ++x) {
+                const auto cell = y * w + x;
+                tile.outlet[cell] = isOutlet(row0 + y, col0 + x, tile.heights[cell]);
+                const auto border = perimeterIndex(x, y, w, h);
+                if(border == notOnPerimeter && !tile.outlet[cell]) {
+                    continue;
+                }
+                const auto level = border == notOnPerimeter ? tile.heights[cell] : nodeFilled[nodeBase[tileIx] + border];
+                visited[cell] = 1;
+                tile.filled[tile.ring(x, y)] = level;
+                queue.push(static_cast<uint32_t>(cell), level);
+            }
+        }
+        uint32_t cell = 0;
+        int16_t level = 0;
+        while(queue.pop(cell, level)) {
+            const std::size_t x = cell % w;
+            const std::size_t y = cell / w;
+            for(const auto& step : d8) {
+                const auto nx = static_cast<std::ptrdiff_t>(x) + step.dx;
+                const auto ny = static_cast<std::ptrdiff_t>(y) + step.dy;
+                if(nx < 0 || ny < 0 || nx >= static_cast<std::ptrdiff_t>(w) || ny >= static_cast<std::ptrdiff_t>(h)) {
+                    continue;
+                }
+                const auto neighbor = static_cast<uint32_t>(static_cast<std::size_t>(ny) * w + static_cast<std::size_t>(nx));
+                if(!visited[neighbor]) {
+                    visited[neighbor] = 1;
+                    const auto filled = std::max(tile.heights[neighbor], level);
+                    tile.filled[tile.ring(static_cast<std::size_t>(nx), static_cast<std::size_t>(ny))] = filled;
+                    queue.push(neighbor, filled);
+                }
+            }
+        }
+
+        // flats, and the distance to their exits through equal neighbors, inside the tile or across its ring
+        const auto ringWidth = static_cast<std::ptrdiff_t>(w + 2);
+        using Candidate = std::pair<uint32_t, uint32_t>; // distance, cell
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> flats;
+        for(std::size_t y = 0; y < h; ++y) {
+            for(std::size_t x = 0; x < w; ++x) {
+                const auto cell = y * w + x;
+                const auto ringIx = tile.ring(x, y);
+                const auto filled = tile.filled[ringIx];
+                bool lower = false;
+                for(const auto& step : d8) {
+                    lower |= tile.filled[ringIx + step.dy * ringWidth + step.dx] < filled;
+                }
+                if(tile.outlet[cell] || lower) {
+                    tile.distance[ringIx] = 0;
+                } else {
+                    tile.flat[cell] = 1;
+                }
+            }
+        }
+        for(std::size_t y = 0; y < h; ++y) {
+            for(std::size_t x = 0; x < w; ++x) {
+                if(!tile.flat[y * w + x]) {
+                    continue;
+                }
+                const auto ringIx = tile.ring(x, y);
+                const bool onPerimeter = x == 0 || y == 0 || x + 1 == w || y + 1 == h;
+                uint32_t best = unreached;
+                for(const auto& step : d8) {
+                    const auto neighbor = ringIx + step.dy * ringWidth + step.dx;
+                    if(tile.filled[neighbor] != tile.filled[ringIx]) {
+                        continue;
+                    }
+                    const auto nx = static_cast<std::ptrdiff_t>(x) + step.dx;
+                    const auto ny = static_cast<std::ptrdiff_t>(y) + step.dy;
+                    const bool inRing = nx < 0 || ny < 0 || nx >= static_cast<std::ptrdiff_t>(w) || ny >= static_cast<std::ptrdiff_t>(h);
+                    tile.crossFlat |= onPerimeter && inRing;
+                    const auto distance = tile.distance[neighbor];
+                    if(distance != unreached && (inRing || distance == 0)) {
+                        best = std::min(best, distance + 1);
+                    }
+                }
+                if(best != unreached) {
+                    tile.distance[ringIx] = best;
+                    flats.emplace(best, static_cast<uint32_t>(y * w + x));
+                }
+            }
+        }
+        while(!flats.empty()) {
+            const auto [distance, flatCell] = flats.top();
+            flats.pop();
+            const std::size_t x = flatCell % w;
+            const std::size_t y = flatCell / w;
+            const auto ringIx = tile.ring(x, y);
+            if(tile.distance[ringIx] != distance) {
+                continue;
+            }
+            for(const auto& step : d8) {
+                const auto nx = static_cast<std::ptrdiff_t>(x) + step.dx;
+                const auto ny = static_cast<std::ptrdiff_t>(y) + step.dy;
+                if(nx < 0 || ny < 0 || nx >= static_cast<std::ptrdiff_t>(w) || ny >= static_cast<std::ptrdiff_t>(h)) {
+                    continue;
+                }
+                const auto neighbor = static_cast<std::size_t>(ny) * w + static_cast<std::size_t>(nx);
+                const auto neighborRing = tile.ring(static_cast<std::size_t>(nx), static_cast<std::size_t>(ny));
+                if(tile.flat[neighbor] && tile.filled[neighborRing] == tile.filled[ringIx] && tile.distance[neighborRing] > distance + 1) {
+                    tile.distance[neighborRing] = distance + 1;
+                    flats.emplace(distance + 1, static_cast<uint32_t>(neighbor));
+                }
+            }
+        }
+        return tile;
+    };
+
+    std::vector<uint32_t> nodeDistance(nNodes, unreached);
+    {
+        std::vector<uint8_t> crossFlat(nTiles, 0);
+        std::vector<std::size_t> active = allTiles;
+        while(!active.empty()) {
+            // every tile of a round sees the distances of the previous one
+            auto nextDistance = nodeDistance;
+            std::vector<uint8_t> changed(nTiles, 0);
+            forEachTile(active, [&](std::size_t tileIx) {
+                NCD_TRACE_SCOPE("flow_flats");
+                const auto tile = settleTile(tileIx, nodeDistance);
+                std::vector<uint32_t> perimeter(perimeterSize(tile.w, tile.h));
+                for(std::size_t border = 0; border < perimeter.size(); ++border) {
+                    const auto [x, y] = perimeterCell(border, tile.w, tile.h);
+                    perimeter[border] = tile.distance[tile.ring(x, y)];
+                }
+                return std::make_pair(std::move(perimeter), tile.crossFlat);
+            }, [&](std::size_t tileIx, std::pair<std::vector<uint32_t>, bool> result) {
+                crossFlat[tileIx] = result.second;
+                const auto base = nodeDistance.begin() + nodeBase[tileIx];
+                changed[tileIx] = !std::equal(result.first.begin(), result.first.end(), base);
+                std::copy(result.first.begin(), result.first.end(), nextDistance.begin() + nodeBase[tileIx]);
+            });
+            nodeDistance = std::move(nextDistance);
+            ++summary.flatRounds;
+            // tiles with a flat across their border, next to a tile whose perimeter changed
+            active.clear();
+            for(std::size_t tileIx = 0; tileIx < nTiles; ++tileIx) {
+                if(!crossFlat[tileIx]) {
+                    continue;
+                }
+                const auto tileX = static_cast<std::ptrdiff_t>(tileIx % tilesAcross);
+                const auto tileY = static_cast<std::ptrdiff_t>(tileIx / tilesAcross);
+                bool neighborChanged = false;
+                for(std::ptrdiff_t dy = -1; dy <= 1; ++dy) {
+                    for(std::ptrdiff_t dx = -1; dx <= 1; ++dx) {
+                        const auto ny = tileY + dy;
+                        auto nx = tileX + dx;
+                        if(ny < 0 || ny >= static_cast<std::ptrdiff_t>(tilesDown)) {
+                            continue;
+                        }
+                        if(nx < 0 || nx >= static_cast<std::ptrdiff_t>(tilesAcross)) {
+                            if(!wrapColumns) {
+                                continue;
+                            }
+                            nx = (nx + static_cast<std::ptrdiff_t>(tilesAcross)) % static_cast<std::ptrdiff_t>(tilesAcross);
+                        }
+                        neighborChanged |= changed[static_cast<std::size_t>(ny) * tilesAcross + static_cast<std::size_t>(nx)] != 0;
+                    }
+                }
+                if(neighborChanged) {
+                    active.push_back(tileIx);
+                }
+            }
+        }
+    }
+
+    // pass 3: directions, and the perimeter graph of the flow
+    TileStoreLayout layout;
+    layout.width = cols;
+    layout.height = rows;
+    layout.tileSize = tileSize;
+    const bool accumulate = !output.accumulationTiles.empty();
+    std::string directionFile = output.directionTiles;
+    if(directionFile.empty() && accumulate) {
+        directionFile = options.tempFile.empty() ? output.accumulationTiles + ".dir" : options.tempFile;
+    }
+    const bool tempDirections = output.directionTiles.empty() && accumulate;
+    std::unique_ptr<TileStoreWriter> directionWriter;
+    std::unique_ptr<TileStoreWriter> filledWriter;
+    if(!directionFile.empty()) {
+        directionWriter = std::make_unique<TileStoreWriter>(directionFile, layout);
+    }
+    if(!output.filledTiles.empty()) {
+        filledWriter = std::make_unique<TileStoreWriter>(output.filledTiles, layout);
+    }
+    std::vector<uint32_t> nodeCells(nNodes, 0);    // cells of the node's tile that reach it first, itself included
+    std::vector<uint32_t> nodeNext(nNodes, none);  // the next perimeter cell downstream
+    std::vector<uint8_t> nodeCrosses(nNodes, 0);   // ... in another tile
+
+    struct TileDirections {
+        std::vector<uint8_t> encodedDirections;
+        std::vector<uint8_t> encodedFilled;
+        std::vector<uint32_t> cells;
+        std::vector<uint32_t> next;
+        std::vector<uint8_t> crosses;
+        std::size_t outletCells{};
+        std::size_t raisedCells{};
+        std::size_t flatCells{};
+    };
+    // in-tile cells in upstream-to-downstream order, from the directions
+    auto flowOrder = [](const std::vector<uint32_t>& down) {
+        const auto nCells = down.size();
+        std::vector<uint32_t> upstream(nCells, 0);
+        for(const auto d : down) {
+            if(d != none) {
+                ++upstream[d];
+            }
+        }
+        std::vector<uint32_t> order;
+        order.reserve(nCells);
+        for(std::size_t cell = 0; cell < nCells; ++cell) {
+            if(upstream[cell] == 0) {
+                order.push_back(static_cast<uint32_t>(cell));
+            }
+        }
+        for(std::size_t ix = 0; ix < order.size(); ++ix) {
+            const auto d = down[order[ix]];
+            if(d != none && --upstream[d] == 0) {
+                order.push_back(d);
+            }
+        }
+        if(order.size() != nCells) {
+            throw std::logic_error("route_flow: the flow directions form a cycle");
+        }
+        return order;
+    };
+    // in-tile cell downstream of (x, y), none if the flow leaves the tile or ends
+    auto downstreamInTile = [](std::size_t x, std::size_t y, std::size_t w, std::size_t h, int16_t code) {
+        const auto k = stepOf(code);
+        if(k < 0) {
+            return none;
+        }
+        const auto nx = static_cast<std::ptrdiff_t>(x) + d8[k].dx;
+        const auto ny = static_cast<std::ptrdiff_t>(y) + d8[k].dy;
+        if(nx < 0 || ny < 0 || nx >= static_cast<std::ptrdiff_t>(w) || ny >= static_cast<std::ptrdiff_t>(h)) {
+            return none;
+        }
+        return static_cast<uint32_t>(static_cast<std::size_t>(ny) * w + static_cast<std::size_t>(nx));
+    };
+
+    forEachTile(allTiles, [&](std::size_t tileIx) {
+        NCD_TRACE_SCOPE("flow_directions");
+        const auto tileX = tileIx % tilesAcross;
+        const auto tileY = tileIx / tilesAcross;
+        const auto row0 = tileY * tileSize;
+        const auto col0 = tileX * tileSize;
+        const auto tile = settleTile(tileIx, nodeDistance);
+        const auto w = tile.w;
+        const auto h = tile.h;
+        const auto ringWidth = static_cast<std::ptrdiff_t>(w + 2);
+        TileDirections result;
+        std::vector<int16_t> directions(w * h, flowNone);
+        std::vector<uint32_t> down(w * h, none);
+        for(std::size_t y = 0; y < h; ++y) {
+            const auto lengths = stepLengths(row0 + y);
+            for(std::size_t x = 0; x < w; ++x) {
+                const auto cell = y * w + x;
+                const auto ringIx = tile.ring(x, y);
+                const auto filled = tile.filled[ringIx];
+                result.raisedCells += filled > tile.heights[cell];
+                if(tile.outlet[cell]) {
+                    ++result.outletCells;
+                    continue;
+                }
+                int best = -1;
+                if(!tile.flat[cell]) {
+                    double steepest = 0.0;
+                    for(int k = 0; k < 8; ++k) {
+                        const auto neighborFilled = tile.filled[ringIx + d8[k].dy * ringWidth + d8[k].dx];
+                        if(neighborFilled >= filled) {
+                            continue;
+                        }
+                        const double slope = (filled - neighborFilled) / lengths[k];
+                        if(slope > steepest) {
+                            steepest = slope;
+                            best = k;
+                        }
+                    }
+                } else {
+                    ++result.flatCells;
+                    uint32_t nearest = tile.distance[ringIx];
+                    for(int k = 0; k < 8; ++k) {
+                        const auto neighbor = ringIx + d8[k].dy * ringWidth + d8[k].dx;
+                        if(tile.filled[neighbor] == filled && tile.distance[neighbor] < nearest) {
+                            nearest = tile.distance[neighbor];
+                            best = k;
+                        }
+                    }
+                }
+                if(best < 0) {
+                    throw std::logic_error("route_flow: a cell without a way down");
+                }
+                directions[cell] = d8[best].code;
+                down[cell] = downstreamInTile(x, y, w, h, d8[best].code);
+            }
+        }
+
+        // the first perimeter cell at or below every cell
+        const auto order = flowOrder(down);
+        std::vector<uint32_t> firstBorder(w * h, none);
+        for(auto it = order.rbegin(); it != order.rend(); ++it) {
+            const auto cell = *it;
+            const auto border = perimeterIndex(cell % w, cell / w, w, h);
+            firstBorder[cell] = border != notOnPerimeter ? border : (down[cell] != none ? firstBorder[down[cell]] : none);
+        }
+        const auto nBorder = perimeterSize(w, h);
+        result.cells.assign(nBorder, 0);
+        result.next.assign(nBorder, none);
+        result.crosses.assign(nBorder, 0);
+        for(std::size_t cell = 0; cell < w * h; ++cell) {
+            if(firstBorder[cell] != none) {
+                ++result.cells[firstBorder[cell]];
+            }
+        }
+        for(std::size_t border = 0; border < nBorder; ++border) {
+            const auto [x, y] = perimeterCell(border, w, h);
+            const auto cell = y * w + x;
+            if(directions[cell] == flowNone) {
+                continue;
+            }
+            if(down[cell] != none) {
+                const auto next = firstBorder[down[cell]];
+                result.next[border] = next == none ? none : nodeBase[tileIx] + next;
+                continue;
+            }
+            std::size_t nRow = 0;
+            std::size_t nCol = 0;
+            neighborCell(row0 + y, col0 + x, d8[stepOf(directions[cell])], nRow, nCol);
+            result.next[border] = nodeOf(nRow, nCol);
+            result.crosses[border] = 1;
+        }
+        if(directionWriter) {
+            result.encodedDirections = directionWriter->encodeTile(tileX, tileY, directions.data());
+        }
+        if(filledWriter) {
+            std::vector<int16_t> filled(w * h);
+            for(std::size_t y = 0; y < h; ++y) {
+                for(std::size_t x = 0; x < w; ++x) {
+                    filled[y * w + x] = static_cast<int16_t>(tile.filled[tile.ring(x, y)]);
+                }
+            }
+            result.encodedFilled = filledWriter->encodeTile(tileX, tileY, filled.data());
+        }
+        return result;
+    }, [&](std::size_t tileIx, TileDirections result) {
+        std::copy(result.cells.begin(), result.cells.end(), nodeCells.begin() + nodeBase[tileIx]);
+        std::copy(result.next.begin(), result.next.end(), nodeNext.begin() + nodeBase[tileIx]);
+        std::copy(result.crosses.begin(), result.crosses.end(), nodeCrosses.begin() + nodeBase[tileIx]);
+        summary.outletCells += result.outletCells;
+        summary.raisedCells += result.raisedCells;
+        summary.flatCells += result.flatCells;
+        if(directionWriter) {
+            directionWriter->writeTile(tileIx % tilesAcross, tileIx / tilesAcross, result.encodedDirections);
+        }
+        if(filledWriter) {
+            filledWriter->writeTile(tileIx % tilesAcross, tileIx / tilesAcross, result.encodedFilled);
+        }
+    });
+    if(directionWriter) {
+        directionWriter->finish();
+    }
+    if(filledWriter) {
+        filledWriter->finish();
+    }
+    summary.cells = rows * cols;
+    if(!accumulate) {
+        return summary;
+    }
+
+    try {
+        // the perimeter graph, accumulated from its sources; inflow is what enters each tile at a node
+        std::vector<double> inflow(nNodes, 0.0);
+        {
+            NCD_TRACE_SCOPE("flow_graph");
+            std::vector<double> nodeAccumulation(nodeCells.begin(), nodeCells.end());
+            const auto order = flowOrder(nodeNext);
+            for(const auto node : order) {
+                const auto next = nodeNext[node];
+                if(next == none) {
+                    continue;
+                }
+                nodeAccumulation[next] += nodeAccumulation[node];
+                if(nodeCrosses[node]) {
+                    inflow[next] += nodeAccumulation[node];
+                }
+            }
+        }
+
+        // pass 4: accumulation of every tile with its inflow
+        TileStoreReader directionReader(directionFile);
+        TileStoreLayout accumulationLayout = layout;
+        accumulationLayout.sampleType = TileSampleType::Float32;
+        TileStoreWriter accumulationWriter(output.accumulationTiles, accumulationLayout);
+        struct TileAccumulation {
+            std::vector<uint8_t> encoded;
+            double maxAccumulation{};
+        };
+        forEachTile(allTiles, [&](std::size_t tileIx) {
+            NCD_TRACE_SCOPE("flow_accumulation");
+            const auto tileX = tileIx % tilesAcross;
+            const auto tileY = tileIx / tilesAcross;
+            const auto w = tileWidth(tileX);
+            const auto h = tileHeight(tileY);
+            std::vector<int16_t> directions(w * h);
+            directionReader.readTile(tileX, tileY, directions.data());
+            std::vector<uint32_t> down(w * h);
+            std::vector<double> accumulation(w * h, 1.0);
+            for(std::size_t y = 0; y < h; ++y) {
+                for(std::size_t x = 0; x < w; ++x) {
+                    down[y * w + x] = downstreamInTile(x, y, w, h, directions[y * w + x]);
+                }
+            }
+            for(std::size_t border = 0; border < perimeterSize(w, h); ++border) {
+                const auto [x, y] = perimeterCell(border, w, h);
+                accumulation[y * w + x] += inflow[nodeBase[tileIx] + border];
+            }
+            for(const auto cell : flowOrder(down)) {
+                if(down[cell] != none) {
+                    accumulation[down[cell]] += accumulation[cell];
+                }
+            }
+            TileAccumulation result;
+            std::vector<float> samples(accumulation.begin(), accumulation.end());
+            result.maxAccumulation = *std::max_element(accumulation.begin(), accumulation.end());
+            result.encoded = accumulationWriter.encodeTile(tileX, tileY, samples.data());
+            return result;
+        }, [&](std::size_t tileIx, TileAccumulation result) {
+            summary.maxAccumulation = std::max(summary.maxAccumulation, result.maxAccumulation);
+            accumulationWriter.writeTile(tileIx % tilesAcross, tileIx / tilesAcross, result.encoded);
+        });
+        accumulationWriter.finish();
+    } catch(...) {
+        if(tempDirections) {
+            std::remove(directionFile.c_str());
+        }
+        throw;
+    }
+    if(tempDirections) {
+        std::remove(directionFile.c_str());
+    }
+    return summary;
+}
+
+inline FlowRoutingSummary route_flow(const NcFile& ncFile, const GpsArea& area, ThreadPool& pool,
+                                     const FlowRoutingOutput& output, const FlowRoutingOptions& options = {}) {
+    RowBlockReader reader(ncFile);
+    const auto converter = GpsToOffsetConverter::forGrid(reader.width(), reader.height());
+    return route_flow(ncFile, cropGridForArea(converter, reader.width(), reader.height(), area), pool, output, options);
+}
+
+#endif //NETCDF_DANI_FLOW_ROUTING_H
@@ -3,6 +3,9 @@
 
 #include <cstdint>
 #include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 
 struct GPS {
     std::array<double,2> latLon;
@@ -45,6 +48,12 @@ struct GpsArea {
     double height() const { return max.lon() - min.lon(); }
 };
 
+// Ground distances on the mean-radius sphere, e.g. for latitude-correct cell sizes of a lat/lon grid
+constexpr double earthMeanRadiusMeters = 6371008.8;
+
+inline double metersPerDegreeLat() { return earthMeanRadiusMeters * 3.14159265358979323846 / 180.0; }
+inline double metersPerDegreeLon(double lat) { return metersPerDegreeLat() * std::cos(lat * 3.14159265358979323846 / 180.0); }
+
 class GpsToOffsetConverter {
 public:
     GpsToOffsetConverter(double stepPerDegree, std::size_t centerOffsetLat, std::size_t centerOffsetLon)
@@ -52,12 +61,31 @@ public:
             , _centerOffsetLat(centerOffsetLat)
             , _centerOffsetLon(centerOffsetLon) {}
 
+    // Converter for a global grid of width*height cells starting at (-90, -180)
+    static GpsToOffsetConverter forGrid(std::size_t width, std::size_t height) {
+        return GpsToOffsetConverter(static_cast<double>(width) / 360.0, height/2, width/2);
+    }
+
+    double stepPerDegree() const { return _stepPerDegree; }
+
     Offset2D convert(GPS gps) const {
         return {
                 static_cast<std::size_t>(_centerOffsetLat + static_cast<std::int64_t>(gps.lat() * _stepPerDegree)),
                 static_cast<std::size_t>(_centerOffsetLon + static_cast<std::int64_t>(gps.lon() * _stepPerDegree))
         };
     }
+
+    // convert() without truncation: integer offsets are south-west cell corners
+    double latOffset(double lat) const { return static_cast<double>(_centerOffsetLat) + lat * _stepPerDegree; }
+    double lonOffset(double lon) const { return static_cast<double>(_centerOffsetLon) + lon * _stepPerDegree; }
+
+    // Inverse of convert(), for fractional offsets. Integer offsets map to the south-west corner of the cell.
+    GPS convertBack(double latOffset, double lonOffset) const {
+        return GPS{{
+                (latOffset - static_cast<double>(_centerOffsetLat)) / _stepPerDegree,
+                (lonOffset - static_cast<double>(_centerOffsetLon)) / _stepPerDegree
+        }};
+    }
 private:
     double _stepPerDegree{};
     std::int64_t _centerOffsetLat{};
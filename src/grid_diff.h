@@ -0,0 +1,261 @@
+#ifndef NETCDF_DANI_GRID_DIFF_H
+#define NETCDF_DANI_GRID_DIFF_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "TileStore.h"
+#include "instrumentation.h"
+
+// Release-to-release diff of two elevation grids of the same size, e.g. GEBCO 2021 and 2023.
+// Both files are read in lockstep, in bands whose height is a multiple of the first file's chunk height.
+// Cells whose height changed by more than the tolerance are summarized per tile; only changed tiles go
+// to the change raster, so its tile index is the sparse index of what changed.
+
+struct GridDiffOptions {
+    std::size_t tileSize = 256; // rounded up to whole chunks of the first file
+    int16_t tolerance = 0;      // |after - before| above this is a change
+    std::size_t maxBandsInFlight = 0; // 0: pool size + 1
+};
+
+struct GridDiffOutput {
+    std::string changeTiles; // Int16 tile store of after - before (clamped), changed tiles only; empty to skip
+    std::string tileList;    // CSV of the changed tiles; empty to skip
+};
+
+struct TileChange {
+    std::size_t tileX{};
+    std::size_t tileY{};
+    std::size_t changedCells{};
+    int32_t minDelta{};
+    int32_t maxDelta{};
+    double meanAbsDelta{}; // over the changed cells
+    // bounding box of the changed cells in grid rows and columns, ends exclusive
+    std::size_t rowBegin{};
+    std::size_t rowEnd{};
+    std::size_t colBegin{};
+    std::size_t colEnd{};
+};
+
+struct GridDiffSummary {
+    std::size_t width{};
+    std::size_t height{};
+    std::size_t tileSize{};
+    int16_t tolerance{}; // changes up to this were not counted
+    std::vector<TileChange> changedTiles; // row-major tile order
+    std::vector<uint32_t> tileChangeIx;   // per tile: 1 + index into changedTiles, 0 if unchanged
+
+    std::size_t tilesAcross() const { return (width + tileSize - 1) / tileSize; }
+    std::size_t tilesDown() const { return (height + tileSize - 1) / tileSize; }
+
+    const TileChange* tileChange(std::size_t tileX, std::size_t tileY) const {
+        const auto ix = tileChangeIx.at(tileY * tilesAcross() + tileX);
+        return ix == 0 ? nullptr : &changedTiles[ix - 1];
+    }
+
+    std::size_t changedCells() const {
+        std::size_t cells = 0;
+        for(const auto& tile : changedTiles) {
+            cells += tile.changedCells;
+        }
+        return cells;
+    }
+
+    // Whether rows [rowBegin, rowEnd) x cols [colBegin, colEnd) may contain a changed cell (by the tiles' bounding boxes)
+    bool regionChanged(std::size_t rowBegin, std::size_t rowEnd, std::size_t colBegin, std::size_t colEnd) const {
+        if(rowBegin >= rowEnd || colBegin >= colEnd || changedTiles.empty()) {
+            return false;
+        }
+        for(auto tileY = rowBegin / tileSize; tileY <= std::min(rowEnd - 1, height - 1) / tileSize; ++tileY) {
+            for(auto tileX = colBegin / tileSize; tileX <= std::min(colEnd - 1, width - 1) / tileSize; ++tileX) {
+                const auto* tile = tileChange(tileX, tileY);
+                if(tile && tile->rowBegin < rowEnd && rowBegin < tile->rowEnd && tile->colBegin < colEnd && colBegin < tile->colEnd) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+inline GridDiffSummary diff_grids(const NcFile& before, const NcFile& after, ThreadPool& pool,
+                                  const GridDiffOutput& output = {}, const GridDiffOptions& options = {}) {
+    RowBlockReader beforeReader(before, "elevation", options.tileSize);
+    RowBlockReader afterReader(after);
+    if(beforeReader.width() != afterReader.width() || beforeReader.height() != afterReader.height()) {
+        throw std::runtime_error("diff_grids: the grids differ in size");
+    }
+    GridDiffSummary summary;
+    summary.width = beforeReader.width();
+    summary.height = beforeReader.height();
+    summary.tileSize = beforeReader.blockRows();
+    summary.tolerance = options.tolerance;
+    const auto tileSize = summary.tileSize;
+    const auto tilesAcross = summary.tilesAcross();
+    const auto tilesDown = summary.tilesDown();
+    summary.tileChangeIx.assign(tilesAcross * tilesDown, 0);
+
+    TileStoreLayout layout;
+    layout.width = summary.width;
+    layout.height = summary.height;
+    layout.tileSize = tileSize;
+    std::unique_ptr<TileStoreWriter> writer;
+    if(!output.changeTiles.empty()) {
+        writer = std::make_unique<TileStoreWriter>(output.changeTiles, layout);
+    }
+    const auto maxBandsInFlight = options.maxBandsInFlight == 0 ? pool.size() + 1 : options.maxBandsInFlight;
+
+    struct BandDiff {
+        std::vector<TileChange> changes;
+        std::vector<std::vector<uint8_t>> encoded; // per change
+    };
+    auto diffBand = [&](std::size_t tileY) {
+        NCD_TRACE_SCOPE("diff_band");
+        const auto firstRow = tileY * tileSize;
+        const auto beforeBand = beforeReader.read(firstRow, tileSize);
+        const auto afterBand = afterReader.read(firstRow, tileSize);
+        const auto nRows = beforeBand.nRows;
+        BandDiff band;
+        std::vector<int16_t> deltas;
+        for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+            const auto colBegin = tileX * tileSize;
+            const auto nCols = layout.tileWidth(tileX);
+            deltas.assign(nRows * nCols, 0);
+            TileChange change;
+            change.tileX = tileX;
+            change.tileY = tileY;
+            change.minDelta = std::numeric_limits<int32_t>::max();
+            change.maxDelta = std::numeric_limits<int32_t>::min();
+            change.rowBegin = change.colBegin = std::numeric_limits<std::size_t>::max();
+            double sumAbs = 0.0;
+            for(std::size_t y = 0; y < nRows; ++y) {
+                const int16_t* a = beforeBand.row(y) + colBegin;
+                const int16_t* b = afterBand.row(y) + colBegin;
+                int16_t* delta = deltas.data() + y * nCols;
+                std::size_t rowChanged = 0;
+                for(std::size_t x = 0; x < nCols; ++x) {
+                    const int32_t d = b[x] - a[x];
+                    delta[x] = static_cast<int16_t>(std::clamp<int32_t>(d, std::numeric_limits<int16_t>::min(), std::numeric_limits<int16_t>::max()));
+                    rowChanged += std::abs(d) > options.tolerance;
+                }
+                if(rowChanged == 0) {
+                    continue;
+                }
+                // only rows with changes pay for the statistics
+                change.changedCells += rowChanged;
+                change.rowBegin = std::min(change.rowBegin, firstRow + y);
+                change.rowEnd = firstRow + y + 1;
+                for(std::size_t x = 0; x < nCols; ++x) {
+                    const int32_t d = b[x] - a[x];
+                    if(std::abs(d) > options.tolerance) {
+                        change.minDelta = std::min(change.minDelta, d);
+                        change.maxDelta = std::max(change.maxDelta, d);
+                        change.colBegin = std::min(change.colBegin, colBegin + x);
+                        change.colEnd = std::max(change.colEnd, colBegin + x + 1);
+                        sumAbs += std::abs(d);
+                    }
+                }
+            }
+            if(change.changedCells == 0) {
+                continue;
+            }
+            change.meanAbsDelta = sumAbs / static_cast<double>(change.changedCells);
+            band.changes.push_back(change);
+            if(writer) {
+                band.encoded.push_back(writer->encodeTile(tileX, tileY, deltas.data()));
+            }
+        }
+        return band;
+    };
+
+    std::deque<std::future<BandDiff>> inFlight;
+    std::size_t nextBand = 0;
+    try {
+        for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+            while(nextBand < tilesDown && inFlight.size() < maxBandsInFlight) {
+                inFlight.push_back(pool.submit([&diffBand, bandIx = nextBand++]() { return diffBand(bandIx); }));
+            }
+            auto band = inFlight.front().get();
+            inFlight.pop_front();
+            for(std::size_t changeIx = 0; changeIx < band.changes.size(); ++changeIx) {
+                const auto& change = band.changes[changeIx];
+                summary.changedTiles.push_back(change);
+                summary.tileChangeIx[change.tileY * tilesAcross + change.tileX] = static_cast<uint32_t>(summary.changedTiles.size());
+                if(writer) {
+                    writer->writeTile(change.tileX, change.tileY, band.encoded[changeIx]);
+                }
+            }
+        }
+    } catch(...) {
+        // the queued bands reference this frame
+        for(auto& band : inFlight) {
+            band.wait();
+        }
+        throw;
+    }
+    if(writer) {
+        writer->finish();
+    }
+
+    if(!output.tileList.empty()) {
+        std::ofstream ofs(output.tileList);
+        if(!ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + output.tileList);
+        }
+        ofs << "tile_x,tile_y,changed_cells,min_delta,max_delta,mean_abs_delta,row_begin,row_end,col_begin,col_end\n";
+        for(const auto& tile : summary.changedTiles) {
+            ofs << tile.tileX << ',' << tile.tileY << ',' << tile.changedCells << ',' << tile.minDelta << ',' << tile.maxDelta << ','
+                << tile.meanAbsDelta << ',' << tile.rowBegin << ',' << tile.rowEnd << ',' << tile.colBegin << ',' << tile.colEnd << '\n';
+        }
+    }
+    return summary;
+}
+
+// A tile store of `after` (see transform_to_tile_store) from the one of the previous release: tiles the diff
+// doesn't touch are copied still encoded, only the changed ones are read and encoded again. The diff must
+// be exact (tolerance 0), or copied tiles could hold cells that moved within the tolerance.
+inline void refresh_tile_store(const std::string& previousStore, const NcFile& after, const GridDiffSummary& diff,
+                               const std::string& filename) {
+    TileStoreReader previous(previousStore);
+    const auto& layout = previous.layout();
+    if(layout.width != diff.width || layout.height != diff.height || layout.sampleType != TileSampleType::Int16) {
+        throw std::runtime_error("refresh_tile_store: the store doesn't match the diff");
+    }
+    if(diff.tolerance != 0) {
+        throw std::runtime_error("refresh_tile_store: the diff has a tolerance, unchanged tiles may still differ");
+    }
+    RowBlockReader reader(after);
+    TileStoreWriter writer(filename, layout);
+    std::vector<int16_t> tile(layout.tileSize * layout.tileSize);
+    for(std::size_t tileY = 0; tileY < layout.tilesDown(); ++tileY) {
+        const auto rowBegin = tileY * layout.tileSize;
+        const auto nRows = layout.tileHeight(tileY);
+        for(std::size_t tileX = 0; tileX < layout.tilesAcross(); ++tileX) {
+            const auto colBegin = tileX * layout.tileSize;
+            const auto nCols = layout.tileWidth(tileX);
+            if(!diff.regionChanged(rowBegin, rowBegin + nRows, colBegin, colBegin + nCols)) {
+                writer.writeTile(tileX, tileY, previous.readEncodedTile(tileX, tileY));
+                continue;
+            }
+            std::size_t offset[2] = {rowBegin, colBegin};
+            std::size_t count[2] = {nRows, nCols};
+            after.getInt64Data(tile.data(), reader.varId(), offset, count);
+            writer.writeTile(tileX, tileY, writer.encodeTile(tileX, tileY, tile.data()));
+        }
+    }
+    writer.finish();
+}
+
+#endif //NETCDF_DANI_GRID_DIFF_H
@@ -0,0 +1,373 @@
+#ifndef NETCDF_DANI_GRID_SINKS_H
+#define NETCDF_DANI_GRID_SINKS_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "GridPipeline.h"
+#include "ThreadPool.h"
+#include "TileStore.h"
+#include "bitpartition.h"
+#include "colors.h"
+#include "contour.h"
+#include "overview.h"
+
+// The products that used to re-read the whole grid each, as GridPipeline sinks
+
+// transform_to_raw: the grid as raw int16, rows south to north
+class RawDumpSink : public GridSink {
+public:
+    explicit RawDumpSink(std::string filename) : _filename(std::move(filename)) {}
+
+    std::string name() const override { return "raw " + _filename; }
+
+    void begin(std::size_t, std::size_t) override {
+        _ofs.open(_filename, std::ios::binary);
+        if(!_ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + _filename);
+        }
+    }
+
+    void consume(const std::shared_ptr<const RowBlock>& block) override {
+        _ofs.write(reinterpret_cast<const char*>(block->data.data()), block->data.size() * sizeof(int16_t));
+    }
+
+    void finish() override {
+        _ofs.flush();
+        if(!_ofs) {
+            throw std::runtime_error("write failed: " + _filename);
+        }
+    }
+
+private:
+    std::string _filename;
+    std::ofstream _ofs;
+};
+
+// transform_to_bitpartitioned_raw: every row as 16 bit planes (see bitPartitionRow)
+class BitPlaneSink : public GridSink {
+public:
+    explicit BitPlaneSink(std::string filename) : _filename(std::move(filename)) {}
+
+    std::string name() const override { return "bit planes " + _filename; }
+
+    void begin(std::size_t width, std::size_t) override {
+        if(width % 16 != 0) {
+            throw std::runtime_error("BitPlaneSink: width has to be a multiple of 16");
+        }
+        _ofs.open(_filename, std::ios::binary);
+        if(!_ofs.is_open()) {
+            throw std::runtime_error("couldn't open " + _filename);
+        }
+    }
+
+    void consume(const std::shared_ptr<const RowBlock>& block) override {
+        _partitioned.resize(block->width);
+        for(std::size_t y = 0; y < block->nRows; ++y) {
+            std::fill(_partitioned.begin(), _partitioned.end(), 0);
+            bitPartitionRow(block->row(y), block->width, _partitioned.data());
+            _ofs.write(reinterpret_cast<const char*>(_partitioned.data()), _partitioned.size() * sizeof(int16_t));
+        }
+    }
+
+    void finish() override {
+        _ofs.flush();
+        if(!_ofs) {
+            throw std::runtime_error("write failed: " + _filename);
+        }
+    }
+
+private:
+    std::string _filename;
+    std::ofstream _ofs;
+    std::vector<int16_t> _partitioned;
+};
+
+// transform_to_tile_store: collects tileSize rows, then encodes the band's tiles (on the pool if given)
+class TileStoreSink : public GridSink {
+public:
+    TileStoreSink(std::string filename, std::size_t tileSize = 256, ThreadPool* pool = nullptr)
+            : _filename(std::move(filename)), _tileSize(tileSize), _pool(pool) {}
+
+    std::string name() const override { return "tiles " + _filename; }
+
+    void begin(std::size_t width, std::size_t height) override {
+        TileStoreLayout layout;
+        layout.width = width;
+        layout.height = height;
+        layout.tileSize = _tileSize;
+        _writer = std::make_unique<TileStoreWriter>(_filename, layout);
+        _band.reserve(_tileSize * width);
+    }
+
+    void consume(const std::shared_ptr<const RowBlock>& block) override {
+        const auto width = _writer->layout().width;
+        for(std::size_t y = 0; y < block->nRows; ++y) {
+            _band.insert(_band.end(), block->row(y), block->row(y) + width);
+            if(_band.size() == _tileSize * width) {
+                _flushBand();
+            }
+        }
+    }
+
+    void finish() override {
+        if(!_band.empty()) {
+            _flushBand();
+        }
+        _writer->finish();
+    }
+
+private:
+    void _flushBand() {
+        const auto& layout = _writer->layout();
+        const auto nRows = _band.size() / layout.width;
+        std::vector<std::vector<uint8_t>> encoded(layout.tilesAcross());
+        auto encodeTiles = [&](std::size_t begin, std::size_t end) {
+            std::vector<int16_t> tile(_tileSize * _tileSize);
+            for(auto tileX = begin; tileX < end; ++tileX) {
+                const auto colBegin = tileX * _tileSize;
+                const auto nCols = layout.tileWidth(tileX);
+                for(std::size_t y = 0; y < nRows; ++y) {
+                    const int16_t* src = _band.data() + y * layout.width + colBegin;
+                    std::copy(src, src + nCols, tile.data() + y * nCols);
+                }
+                encoded[tileX] = _writer->encodeTile(tileX, _tileY, tile.data());
+            }
+        };
+        if(_pool) {
+            _pool->parallelFor(layout.tilesAcross(), 4, encodeTiles);
+        } else {
+            encodeTiles(0, layout.tilesAcross());
+        }
+        for(std::size_t tileX = 0; tileX < layout.tilesAcross(); ++tileX) {
+            _writer->writeTile(tileX, _tileY, encoded[tileX]);
+        }
+        ++_tileY;
+        _band.clear();
+    }
+
+private:
+    std::string _filename;
+    std::size_t _tileSize{};
+    ThreadPool* _pool{};
+    std::unique_ptr<TileStoreWriter> _writer;
+    std::vector<int16_t> _band;
+    std::size_t _tileY = 0;
+};
+
+// A downsampled level, see overview.h. With a file prefix it writes what transform_elevation_data
+// wrote: <prefix>_16.raw (int16), <prefix>.raw (8-bit) and <prefix>_whole_rgb.raw (heightToRgb colors).
+class OverviewSink : public GridSink {
+public:
+    explicit OverviewSink(std::size_t factor, std::string filePrefix = "")
+            : _filePrefix(std::move(filePrefix)) {
+        _overview.factor = factor;
+    }
+
+    std::string name() const override { return "overview 1:" + std::to_string(_overview.factor); }
+
+    void begin(std::size_t width, std::size_t height) override {
+        _overview.width = width / _overview.factor;
+        _overview.height = height / _overview.factor;
+        _overview.data.assign(_overview.width * _overview.height, 0);
+    }
+
+    void consume(const std::shared_ptr<const RowBlock>& block) override {
+        shrinkOverviewRows(*block, _overview);
+    }
+
+    void finish() override {
+        if(_filePrefix.empty()) {
+            return;
+        }
+        std::vector<uint8_t> gray(_overview.data.size());
+        std::vector<uint8_t> rgb(_overview.data.size() * 3);
+        for(std::size_t ix = 0; ix < _overview.data.size(); ++ix) {
+            auto avg = _overview.data[ix];
+            gray[ix] = static_cast<uint8_t>((avg >> 8) + 128);
+            auto color = heightToRgb(avg);
+            rgb[3*ix] = color[0];
+            rgb[3*ix+1] = color[1];
+            rgb[3*ix+2] = color[2];
+        }
+        _writeFile(_filePrefix + "_16.raw", _overview.data.data(), _overview.data.size() * sizeof(int16_t));
+        _writeFile(_filePrefix + ".raw", gray.data(), gray.size());
+        _writeFile(_filePrefix + "_whole_rgb.raw", rgb.data(), rgb.size());
+    }
+
+    // complete after the pipeline ran; range is not filled in, see HistogramSink
+    const Overview& overview() const { return _overview; }
+
+private:
+    static void _writeFile(const std::string& filename, const void* data, std::size_t size) {
+        std::ofstream ofs(filename, std::ios::binary);
+        ofs.write(static_cast<const char*>(data), size);
+        if(!ofs) {
+            throw std::runtime_error("write failed: " + filename);
+        }
+    }
+
+private:
+    std::string _filePrefix;
+    Overview _overview;
+};
+
+// Value histogram, exact range and mean of the grid
+class HistogramSink : public GridSink {
+public:
+    // with a filename, non-empty bins are written as "value,count" lines
+    explicit HistogramSink(std::string csvFilename = "") : _csvFilename(std::move(csvFilename)) {}
+
+    std::string name() const override { return "histogram"; }
+
+    void begin(std::size_t, std::size_t) override {
+        _counts.assign(1 << 16, 0);
+    }
+
+    void consume(const std::shared_ptr<const RowBlock>& block) override {
+        uint64_t* counts = _counts.data();
+        for(auto value : block->data) {
+            ++counts[static_cast<uint16_t>(value)];
+        }
+    }
+
+    void finish() override {
+        if(_csvFilename.empty()) {
+            return;
+        }
+        std::ofstream ofs(_csvFilename);
+        ofs << "value,count\n";
+        for(int value = std::numeric_limits<int16_t>::min(); value <= std::numeric_limits<int16_t>::max(); ++value) {
+            if(auto count = this->count(static_cast<int16_t>(value))) {
+                ofs << value << "," << count << "\n";
+            }
+        }
+        if(!ofs) {
+            throw std::runtime_error("write failed: " + _csvFilename);
+        }
+    }
+
+    uint64_t count(int16_t value) const { return _counts.at(static_cast<uint16_t>(value)); }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for(auto count : _counts) {
+            sum += count;
+        }
+        return sum;
+    }
+
+    ValueRange range() const {
+        ValueRange range{0.0, 0.0};
+        bool found = false;
+        for(int value = std::numeric_limits<int16_t>::min(); value <= std::numeric_limits<int16_t>::max(); ++value) {
+            if(count(static_cast<int16_t>(value))) {
+                range.max = value;
+                if(!found) {
+                    range.min = value;
+                    found = true;
+                }
+            }
+        }
+        return range;
+    }
+
+    double mean() const {
+        double sum = 0.0;
+        for(int value = std::numeric_limits<int16_t>::min(); value <= std::numeric_limits<int16_t>::max(); ++value) {
+            sum += static_cast<double>(value) * count(static_cast<int16_t>(value));
+        }
+        auto n = total();
+        return n ? sum / n : 0.0;
+    }
+
+private:
+    std::string _csvFilename;
+    std::vector<uint64_t> _counts;
+};
+
+// extract_contours on the shared stream. Each block is traced as its own band, plus a two-row band
+// across every seam; with a pool the bands are traced concurrently and assembled in order.
+class ContourSink : public GridSink {
+public:
+    ContourSink(ContourOptions options, PolylineSink& polylineSink, ThreadPool* pool = nullptr)
+            : _options(std::move(options)), _polylineSink(polylineSink), _pool(pool) {}
+
+    ~ContourSink() override {
+        // queued bands reference this sink
+        for(auto& band : _inFlight) {
+            band.wait();
+        }
+    }
+
+    std::string name() const override { return "contours"; }
+
+    void begin(std::size_t width, std::size_t height) override {
+        _width = width;
+        _height = height;
+        _assembler = std::make_unique<ContourAssembler>(width, height, _options.levels, _polylineSink);
+    }
+
+    void consume(const std::shared_ptr<const RowBlock>& block) override {
+        if(block->nRows == 0) {
+            return;
+        }
+        if(!_lastRow.empty()) {
+            auto seam = std::make_shared<std::vector<int16_t>>(std::move(_lastRow));
+            seam->insert(seam->end(), block->row(0), block->row(0) + _width);
+            const auto seamRow = block->firstRow - 1;
+            _trace([this, seam, seamRow]() {
+                return traceContourBand(seam->data(), 2, _width, seamRow, _height, _options.levels, _options.wrapLongitude);
+            });
+        }
+        _trace([this, block]() {
+            return traceContourBand(block->data.data(), block->nRows, _width, block->firstRow, _height,
+                                    _options.levels, _options.wrapLongitude);
+        });
+        _lastRow.assign(block->row(block->nRows - 1), block->row(block->nRows - 1) + _width);
+    }
+
+    void finish() override {
+        while(!_inFlight.empty()) {
+            _assembler->addBand(_inFlight.front().get());
+            _inFlight.pop_front();
+        }
+        _assembler->finish();
+    }
+
+private:
+    template<typename F>
+    void _trace(F&& traceBand) {
+        if(!_pool) {
+            _assembler->addBand(traceBand());
+            return;
+        }
+        const auto maxInFlight = _options.maxBandsInFlight ? _options.maxBandsInFlight : 2 * _pool->size();
+        while(_inFlight.size() >= maxInFlight) {
+            _assembler->addBand(_inFlight.front().get());
+            _inFlight.pop_front();
+        }
+        _inFlight.push_back(_pool->submit(std::forward<F>(traceBand)));
+    }
+
+private:
+    ContourOptions _options;
+    PolylineSink& _polylineSink;
+    ThreadPool* _pool{};
+    std::size_t _width{};
+    std::size_t _height{};
+    std::unique_ptr<ContourAssembler> _assembler;
+    std::deque<std::future<ContourBandResult>> _inFlight;
+    std::vector<int16_t> _lastRow;
+};
+
+#endif //NETCDF_DANI_GRID_SINKS_H
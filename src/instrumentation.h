@@ -0,0 +1,261 @@
+#ifndef NETCDF_DANI_INSTRUMENTATION_H
+#define NETCDF_DANI_INSTRUMENTATION_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Hot-path instrumentation: scoped stage timers, per-thread counters and a per-thread ring buffer
+// of trace events that can be exported as Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// Only the NCD_* macros belong in hot code. They compile to nothing unless NETCDF_DANI_STATS is
+// defined (CMake option NETCDF_DANI_ENABLE_STATS), the reporting functions then return empty results.
+
+#ifndef NETCDF_DANI_STATS
+#define NETCDF_DANI_STATS 0
+#endif
+
+namespace instrumentation {
+
+enum class Counter : std::size_t {
+    BytesRead,
+    ChunksTouched, // chunks intersected by hyperslab reads, i.e. decoded unless HDF5's chunk cache had them
+    PixelsShaded,
+    Count
+};
+
+inline const char* counterName(Counter counter) {
+    switch(counter) {
+        case Counter::BytesRead: return "bytes_read";
+        case Counter::ChunksTouched: return "chunks_touched";
+        case Counter::PixelsShaded: return "pixels_shaded";
+        default: return "?";
+    }
+}
+
+constexpr std::size_t nCounters = static_cast<std::size_t>(Counter::Count);
+
+struct StageStats {
+    const char* name{};
+    uint64_t totalNs{};
+    uint64_t count{};
+};
+
+struct TraceEvent {
+    const char* name{};
+    uint64_t startNs{};
+    uint64_t durationNs{};
+};
+
+struct Snapshot {
+    std::array<uint64_t, nCounters> counters{};
+    std::vector<StageStats> stages;
+
+    uint64_t counter(Counter c) const { return counters[static_cast<std::size_t>(c)]; }
+    const StageStats* stage(const char* name) const {
+        for(const auto& s : stages) {
+            if(std::strcmp(s.name, name) == 0) return &s;
+        }
+        return nullptr;
+    }
+};
+
+inline uint64_t nowNs() {
+    static const auto start = std::chrono::steady_clock::now();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// State owned and written by one thread only; other threads just read it when reporting.
+struct ThreadState {
+    static constexpr std::size_t traceCapacity = 1 << 14;
+    static constexpr std::size_t maxStages = 32;
+
+    uint32_t threadIx{};
+    std::array<std::atomic<uint64_t>, nCounters> counters{};
+    std::array<std::atomic<const char*>, maxStages> stageNames{};
+    std::array<std::atomic<uint64_t>, maxStages> stageNs{};
+    std::array<std::atomic<uint64_t>, maxStages> stageCount{};
+    std::vector<TraceEvent> trace = std::vector<TraceEvent>(traceCapacity);
+    std::atomic<uint64_t> nTraceEvents{0};
+
+    void add(Counter counter, uint64_t n) {
+        auto& c = counters[static_cast<std::size_t>(counter)];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void record(const char* name, uint64_t startNs, uint64_t durationNs) {
+        // stage names are string literals, so the pointer identifies the stage within a thread
+        for(std::size_t ix = 0; ix < maxStages; ++ix) {
+            auto stageName = stageNames[ix].load(std::memory_order_relaxed);
+            if(stageName == nullptr) {
+                stageNames[ix].store(name, std::memory_order_release);
+                stageName = name;
+            }
+            if(stageName == name) {
+                stageNs[ix].store(stageNs[ix].load(std::memory_order_relaxed) + durationNs, std::memory_order_relaxed);
+                stageCount[ix].store(stageCount[ix].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                break;
+            }
+        }
+        auto eventIx = nTraceEvents.load(std::memory_order_relaxed);
+        trace[eventIx % traceCapacity] = TraceEvent{name, startNs, durationNs};
+        nTraceEvents.store(eventIx + 1, std::memory_order_release);
+    }
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadState>> threads;
+
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+};
+
+inline ThreadState& threadState() {
+    thread_local std::shared_ptr<ThreadState> state = []() {
+        auto newState = std::make_shared<ThreadState>();
+        auto& registry = Registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        newState->threadIx = static_cast<uint32_t>(registry.threads.size());
+        registry.threads.push_back(newState);
+        return newState;
+    }();
+    return *state;
+}
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const char* name) : _name(name), _startNs(nowNs()) {}
+    ~ScopedTimer() {
+        threadState().record(_name, _startNs, nowNs() - _startNs);
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    const char* _name;
+    uint64_t _startNs;
+};
+
+constexpr bool enabled() { return NETCDF_DANI_STATS != 0; }
+
+// Sum of all threads' counters and stage timers since startup
+inline Snapshot snapshot() {
+    Snapshot result;
+    if(!enabled()) {
+        return result;
+    }
+    auto& registry = Registry::instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for(const auto& thread : registry.threads) {
+        for(std::size_t ix = 0; ix < nCounters; ++ix) {
+            result.counters[ix] += thread->counters[ix].load(std::memory_order_relaxed);
+        }
+        for(std::size_t ix = 0; ix < ThreadState::maxStages; ++ix) {
+            auto name = thread->stageNames[ix].load(std::memory_order_acquire);
+            if(name == nullptr) {
+                break;
+            }
+            auto ns = thread->stageNs[ix].load(std::memory_order_relaxed);
+            auto count = thread->stageCount[ix].load(std::memory_order_relaxed);
+            bool merged = false;
+            for(auto& stage : result.stages) {
+                if(std::strcmp(stage.name, name) == 0) {
+                    stage.totalNs += ns;
+                    stage.count += count;
+                    merged = true;
+                    break;
+                }
+            }
+            if(!merged) {
+                result.stages.push_back(StageStats{name, ns, count});
+            }
+        }
+    }
+    return result;
+}
+
+// What happened between two snapshots, e.g. during one viewer frame
+inline Snapshot difference(const Snapshot& after, const Snapshot& before) {
+    Snapshot result = after;
+    for(std::size_t ix = 0; ix < nCounters; ++ix) {
+        result.counters[ix] -= before.counters[ix];
+    }
+    for(auto& stage : result.stages) {
+        if(const auto* old = before.stage(stage.name)) {
+            stage.totalNs -= old->totalNs;
+            stage.count -= old->count;
+        }
+    }
+    return result;
+}
+
+inline void printSummary(std::ostream& os, const Snapshot& stats) {
+    if(!enabled()) {
+        os << "stats are compiled out, configure with -DNETCDF_DANI_ENABLE_STATS=ON\n";
+        return;
+    }
+    for(std::size_t ix = 0; ix < nCounters; ++ix) {
+        os << counterName(static_cast<Counter>(ix)) << ": " << stats.counters[ix] << "\n";
+    }
+    for(const auto& stage : stats.stages) {
+        os << stage.name << ": " << stage.count << " calls, " << (stage.totalNs / 1e6) << " ms\n";
+    }
+}
+
+// Trace events still in the threads' ring buffers, in Chrome's JSON trace event format.
+// Best called while the instrumented threads are idle.
+inline bool writeChromeTrace(const std::string& filename) {
+    if(!enabled()) {
+        return false;
+    }
+    std::ofstream ofs(filename);
+    if(!ofs.is_open()) {
+        return false;
+    }
+    // microseconds with nanosecond decimals; the default precision would round late events to milliseconds
+    ofs << std::fixed << std::setprecision(3);
+    ofs << "{\"traceEvents\":[";
+    bool isFirst = true;
+    auto& registry = Registry::instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for(const auto& thread : registry.threads) {
+        const auto nEvents = thread->nTraceEvents.load(std::memory_order_acquire);
+        const auto first = nEvents > ThreadState::traceCapacity ? nEvents - ThreadState::traceCapacity : 0;
+        for(auto eventIx = first; eventIx < nEvents; ++eventIx) {
+            const auto& event = thread->trace[eventIx % ThreadState::traceCapacity];
+            ofs << (isFirst ? "\n" : ",\n");
+            isFirst = false;
+            ofs << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->threadIx
+                << ",\"ts\":" << (event.startNs / 1000.0) << ",\"dur\":" << (event.durationNs / 1000.0) << "}";
+        }
+    }
+    ofs << "\n]}\n";
+    return true;
+}
+
+} // namespace instrumentation
+
+#define NCD_CONCAT_IMPL(a, b) a##b
+#define NCD_CONCAT(a, b) NCD_CONCAT_IMPL(a, b)
+
+#if NETCDF_DANI_STATS
+#define NCD_TRACE_SCOPE(name) ::instrumentation::ScopedTimer NCD_CONCAT(ncdTraceScope_, __LINE__)(name)
+#define NCD_COUNT(counter, n) ::instrumentation::threadState().add(::instrumentation::Counter::counter, (n))
+#else
+#define NCD_TRACE_SCOPE(name) ((void)0)
+#define NCD_COUNT(counter, n) ((void)0)
+#endif
+
+#endif //NETCDF_DANI_INSTRUMENTATION_H
@@ -0,0 +1,458 @@
+#ifndef NETCDF_DANI_INUNDATION_H
+#define NETCDF_DANI_INUNDATION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "TilePerimeter.h"
+#include "TileStore.h"
+#include "UnionFind.h"
+#include "crop_export.h"
+#include "gps.h"
+#include "instrumentation.h"
+
+// Sea-level-rise inundation: at water level L a cell floods if it is at or below L and connected to the
+// open ocean through 4-neighbors that are at or below L as well. Basins behind higher ground stay dry.
+//
+// The region is cut into tiles labeled independently on the pool with a union-find per tile, in two passes:
+//  1. Each tile sweeps its cells level by level (cells bucketed by the first level that wets them, the sorted
+//     index shared by all levels) and records when its border cells and ocean cells get connected. Only
+//     those events and the border wet levels are kept, so memory is bounded by the tile borders.
+//  2. The events and the edges across tile borders (and around the antimeridian for the full width) are
+//     merged level by level, giving the level at which every border cell joins the ocean. Then each tile
+//     is swept again and every cell gets the first level that floods it.
+// The grid is read twice, whatever the number of levels.
+
+struct InundationOptions {
+    int16_t oceanBelow = -100; // cells at or below this are open water at every level
+    std::size_t tileSize = 1024;
+    std::size_t maxTilesInFlight = 0; // 0: pool size + 1
+};
+
+// Flooded cells at one level, cumulative over the lower levels
+struct InundationLevelStats {
+    double level{};
+    std::size_t floodedCells{};
+    double floodedAreaKm2{};
+    std::size_t landCells{}; // flooded cells at or above 0 m, i.e. the newly flooded land
+    double landAreaKm2{};
+};
+
+// Written to InundationOutput::floodLevelTiles for cells no level floods; the mask of level k is 0 <= value <= k
+constexpr int16_t inundationNeverFlooded = -1;
+
+namespace inundation_detail {
+
+constexpr uint32_t noKey = notOnPerimeter;
+
+// Border cells and ocean cells of one tile joined at a level
+struct Event {
+    uint32_t a{};
+    uint32_t b{};
+    uint16_t level{};
+};
+
+// Level-by-level union-find over one tile. A component's key is the node that represents it in the
+// merge: the ocean, one of its border cells or none; the key nodes of a component are always joined
+// by the emitted events.
+class TileSweep {
+public:
+    TileSweep(const int16_t* heights, std::size_t width, std::size_t height, const std::vector<double>& levels,
+              int16_t oceanBelow, uint32_t nodeBase, uint32_t oceanNode)
+            : _heights(heights), _width(width), _height(height), _nLevels(levels.size()), _oceanBelow(oceanBelow)
+            , _nodeBase(nodeBase), _oceanNode(oceanNode), _union(width * height), _key(width * height, noKey)
+            , _wetLevel(width * height), _active(width * height, 0) {
+        const auto nCells = width * height;
+        // counting sort of the cells by the first level at or above them
+        _bucketBegin.assign(_nLevels + 2, 0);
+        for(std::size_t cell = 0; cell < nCells; ++cell) {
+            const double elevation = heights[cell];
+            _wetLevel[cell] = static_cast<uint16_t>(std::lower_bound(levels.begin(), levels.end(), elevation) - levels.begin());
+            ++_bucketBegin[_wetLevel[cell] + 1];
+        }
+        std::partial_sum(_bucketBegin.begin(), _bucketBegin.end(), _bucketBegin.begin());
+        _order.resize(nCells);
+        auto next = _bucketBegin;
+        for(std::size_t cell = 0; cell < nCells; ++cell) {
+            _order[next[_wetLevel[cell]]++] = static_cast<uint32_t>(cell);
+        }
+    }
+
+    std::size_t nLevels() const { return _nLevels; }
+    uint16_t wetLevel(std::size_t cell) const { return _wetLevel[cell]; }
+
+    // Wets the cells of each level and joins them to their wet neighbors, calling
+    // afterLevel(level, cells wetted at it) and emit(Event) for the joined keys
+    template<typename AfterLevel, typename Emit>
+    void run(AfterLevel&& afterLevel, Emit&& emit) {
+        for(std::size_t level = 0; level < _nLevels; ++level) {
+            const uint32_t* begin = _order.data() + _bucketBegin[level];
+            const uint32_t* end = _order.data() + _bucketBegin[level + 1];
+            for(const uint32_t* cell = begin; cell != end; ++cell) {
+                _wet(*cell, static_cast<uint16_t>(level), emit);
+            }
+            afterLevel(level, begin, end);
+        }
+    }
+
+    uint32_t key(uint32_t cell) { return _key[_union.find(cell)]; }
+
+private:
+    template<typename Emit>
+    void _wet(uint32_t cell, uint16_t level, Emit& emit) {
+        const std::size_t x = cell % _width;
+        const std::size_t y = cell / _width;
+        const auto border = perimeterIndex(x, y, _width, _height);
+        uint32_t key = border == noKey ? noKey : _nodeBase + border;
+        if(_heights[cell] <= _oceanBelow) {
+            if(key != noKey) {
+                emit(Event{key, _oceanNode, level});
+            }
+            key = _oceanNode;
+        }
+        _key[cell] = key;
+        _active[cell] = 1;
+        auto join = [&](uint32_t other) {
+            if(!_active[other]) {
+                return;
+            }
+            const auto rootA = _union.find(cell);
+            const auto rootB = _union.find(other);
+            if(rootA == rootB) {
+                return;
+            }
+            const auto keyA = _key[rootA];
+            const auto keyB = _key[rootB];
+            if(keyA != noKey && keyB != noKey && keyA != keyB) {
+                emit(Event{keyA, keyB, level});
+            }
+            _key[_union.unite(rootA, rootB)] = keyA != noKey ? keyA : keyB;
+        };
+        if(x > 0) {
+            join(cell - 1);
+        }
+        if(x + 1 < _width) {
+            join(cell + 1);
+        }
+        if(y > 0) {
+            join(static_cast<uint32_t>(cell - _width));
+        }
+        if(y + 1 < _height) {
+            join(static_cast<uint32_t>(cell + _width));
+        }
+    }
+
+private:
+    const int16_t* _heights;
+    std::size_t _width{};
+    std::size_t _height{};
+    std::size_t _nLevels{};
+    int16_t _oceanBelow{};
+    uint32_t _nodeBase{};
+    uint32_t _oceanNode{};
+    UnionFind _union;
+    std::vector<uint32_t> _key;
+    std::vector<uint16_t> _wetLevel;
+    std::vector<uint8_t> _active; // wetted so far
+    std::vector<uint32_t> _order;
+    std::vector<std::size_t> _bucketBegin;
+};
+
+struct TileSummary {
+    std::vector<uint16_t> borderWetLevel; // by perimeter index
+    std::vector<Event> events;
+};
+
+// Per first flooding level of one tile
+struct TileFloodCounts {
+    std::vector<std::size_t> cells;
+    std::vector<double> areaKm2;
+    std::vector<std::size_t> landCells;
+    std::vector<double> landAreaKm2;
+};
+
+} // namespace inundation_detail
+
+struct InundationOutput {
+    std::string floodLevelTiles; // tile store of the first flooding level index per cell, empty to skip
+};
+
+// Flooded cells of the region for each water level (meters, any order; the stats are sorted by level).
+// Regions spanning the whole grid width wrap around at the antimeridian.
+inline std::vector<InundationLevelStats> simulate_inundation(const NcFile& ncFile, const CropGrid& region, std::vector<double> levels,
+                                                             ThreadPool& pool, const InundationOutput& output = {},
+                                                             const InundationOptions& options = {}) {
+    using namespace inundation_detail;
+    std::sort(levels.begin(), levels.end());
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+    // level indices go to an Int16 tile store
+    if(levels.size() > static_cast<std::size_t>(std::numeric_limits<int16_t>::max())) {
+        throw std::runtime_error("simulate_inundation: more than 32767 levels");
+    }
+    std::vector<InundationLevelStats> stats(levels.size());
+    for(std::size_t levelIx = 0; levelIx < levels.size(); ++levelIx) {
+        stats[levelIx].level = levels[levelIx];
+    }
+    if(levels.empty() || region.rows() == 0 || region.cols() == 0) {
+        return stats;
+    }
+
+    RowBlockReader reader(ncFile);
+    const auto converter = GpsToOffsetConverter::forGrid(reader.width(), reader.height());
+    const bool wrapColumns = region.cols() == reader.width();
+    const auto nLevels = static_cast<uint16_t>(levels.size());
+    const auto tileSize = options.tileSize;
+    const auto tilesAcross = (region.cols() + tileSize - 1) / tileSize;
+    const auto tilesDown = (region.rows() + tileSize - 1) / tileSize;
+    const auto nTiles = tilesAcross * tilesDown;
+    auto tileWidth = [&](std::size_t tileX) { return std::min(tileSize, region.cols() - tileX * tileSize); };
+    auto tileHeight = [&](std::size_t tileY) { return std::min(tileSize, region.rows() - tileY * tileSize); };
+
+    // merge nodes: the perimeter cells of every tile, then the ocean
+    std::vector<uint32_t> nodeBase(nTiles + 1, 0);
+    for(std::size_t tileIx = 0; tileIx < nTiles; ++tileIx) {
+        nodeBase[tileIx + 1] = nodeBase[tileIx] + static_cast<uint32_t>(perimeterSize(tileWidth(tileIx % tilesAcross), tileHeight(tileIx / tilesAcross)));
+    }
+    const uint32_t oceanNode = nodeBase[nTiles];
+
+    auto readTile = [&](std::size_t tileIx) {
+        const auto tileX = tileIx % tilesAcross;
+        const auto tileY = tileIx / tilesAcross;
+        std::vector<int16_t> heights(tileWidth(tileX) * tileHeight(tileY));
+        std::size_t offset[2] = {region.rowBegin + tileY * tileSize, region.colBegin + tileX * tileSize};
+        std::size_t count[2] = {tileHeight(tileY), tileWidth(tileX)};
+        ncFile.getInt64Data(heights.data(), reader.varId(), offset, count);
+        return heights;
+    };
+
+    // Runs process(tileIx) on the pool for every tile, at most maxTilesInFlight at a time, and
+    // consume(tileIx, result) on this thread in tile order
+    const auto maxInFlight = options.maxTilesInFlight == 0 ? pool.size() + 1 : options.maxTilesInFlight;
+    auto forEachTile = [&](auto&& process, auto&& consume) {
+        using Result = decltype(process(std::size_t{}));
+        std::deque<std::future<Result>> inFlight;
+        std::size_t nextTile = 0;
+        try {
+            for(std::size_t tileIx = 0; tileIx < nTiles; ++tileIx) {
+                while(nextTile < nTiles && inFlight.size() < maxInFlight) {
+                    inFlight.push_back(pool.submit([&process, ix = nextTile++]() { return process(ix); }));
+                }
+                auto result = inFlight.front().get();
+                inFlight.pop_front();
+                consume(tileIx, std::move(result));
+            }
+        } catch(...) {
+            // the queued tiles reference this frame
+            for(auto& tile : inFlight) {
+                tile.wait();
+            }
+            throw;
+        }
+    };
+
+    // pass 1: border connectivity of each tile
+    std::vector<TileSummary> summaries(nTiles);
+    forEachTile([&](std::size_t tileIx) {
+        NCD_TRACE_SCOPE("inundation_label");
+        const auto w = tileWidth(tileIx % tilesAcross);
+        const auto h = tileHeight(tileIx / tilesAcross);
+        const auto heights = readTile(tileIx);
+        TileSweep sweep(heights.data(), w, h, levels, options.oceanBelow, nodeBase[tileIx], oceanNode);
+        TileSummary summary;
+        summary.borderWetLevel.resize(perimeterSize(w, h));
+        for(std::size_t y = 0; y < h; ++y) {
+            for(std::size_t x = 0; x < w; ++x) {
+                const auto border = perimeterIndex(x, y, w, h);
+                if(border != noKey) {
+                    summary.borderWetLevel[border] = sweep.wetLevel(y * w + x);
+                }
+            }
+        }
+        sweep.run([](std::size_t, const uint32_t*, const uint32_t*) {},
+                  [&summary](const Event& event) { summary.events.push_back(event); });
+        return summary;
+    }, [&](std::size_t tileIx, TileSummary summary) {
+        summaries[tileIx] = std::move(summary);
+    });
+
+    // the tile events plus the edges between neighboring tiles, bucketed by level
+    std::vector<std::vector<Event>> edgesByLevel(nLevels);
+    auto addEdge = [&](uint32_t a, uint32_t b, uint16_t level) {
+        if(level < nLevels) {
+            edgesByLevel[level].push_back(Event{a, b, level});
+        }
+    };
+    for(std::size_t tileIx = 0; tileIx < nTiles; ++tileIx) {
+        for(const auto& event : summaries[tileIx].events) {
+            addEdge(event.a, event.b, event.level);
+        }
+        summaries[tileIx].events = {};
+    }
+    for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+        for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+            const auto tileIx = tileY * tilesAcross + tileX;
+            const auto w = tileWidth(tileX);
+            const auto h = tileHeight(tileY);
+            const auto& wet = summaries[tileIx].borderWetLevel;
+            // eastern neighbor, around the globe from the last column
+            if(tileX + 1 < tilesAcross || wrapColumns) {
+                const auto eastIx = tileY * tilesAcross + (tileX + 1) % tilesAcross;
+                const auto eastW = tileWidth((tileX + 1) % tilesAcross);
+                const auto& eastWet = summaries[eastIx].borderWetLevel;
+                for(std::size_t y = 0; y < h; ++y) {
+                    const auto a = perimeterIndex(w - 1, y, w, h);
+                    const auto b = perimeterIndex(0, y, eastW, h);
+                    addEdge(nodeBase[tileIx] + a, nodeBase[eastIx] + b, std::max(wet[a], eastWet[b]));
+                }
+            }
+            if(tileY + 1 < tilesDown) {
+                const auto northIx = tileIx + tilesAcross;
+                const auto northH = tileHeight(tileY + 1);
+                const auto& northWet = summaries[northIx].borderWetLevel;
+                for(std::size_t x = 0; x < w; ++x) {
+                    const auto a = perimeterIndex(x, h - 1, w, h);
+                    const auto b = perimeterIndex(x, 0, w, northH);
+                    addEdge(nodeBase[tileIx] + a, nodeBase[northIx] + b, std::max(wet[a], northWet[b]));
+                }
+            }
+        }
+    }
+    summaries = {};
+
+    // the level at which every node joins the ocean; members are circular lists spliced on union
+    std::vector<uint16_t> oceanLevel(oceanNode + 1, nLevels);
+    oceanLevel[oceanNode] = 0;
+    {
+        NCD_TRACE_SCOPE("inundation_merge");
+        UnionFind nodes(oceanNode + 1);
+        std::vector<uint32_t> nextMember(oceanNode + 1);
+        std::iota(nextMember.begin(), nextMember.end(), uint32_t{0});
+        for(uint16_t level = 0; level < nLevels; ++level) {
+            for(const auto& edge : edgesByLevel[level]) {
+                const auto rootA = nodes.find(edge.a);
+                const auto rootB = nodes.find(edge.b);
+                if(rootA == rootB) {
+                    continue;
+                }
+                const auto oceanRoot = nodes.find(oceanNode);
+                if(rootA == oceanRoot || rootB == oceanRoot) {
+                    const auto flooded = rootA == oceanRoot ? rootB : rootA;
+                    auto member = flooded;
+                    do {
+                        oceanLevel[member] = level;
+                        member = nextMember[member];
+                    } while(member != flooded);
+                }
+                nodes.unite(rootA, rootB);
+                std::swap(nextMember[rootA], nextMember[rootB]);
+            }
+            edgesByLevel[level] = {};
+        }
+    }
+
+    // pass 2: the first flooding level of every cell
+    std::unique_ptr<TileStoreWriter> writer;
+    if(!output.floodLevelTiles.empty()) {
+        TileStoreLayout layout;
+        layout.width = region.cols();
+        layout.height = region.rows();
+        layout.tileSize = tileSize;
+        writer = std::make_unique<TileStoreWriter>(output.floodLevelTiles, layout);
+    }
+    struct FloodedTile {
+        TileFloodCounts counts;
+        std::vector<uint8_t> encoded;
+    };
+    const double cellKm = metersPerDegreeLat() / converter.stepPerDegree() / 1000.0;
+    TileFloodCounts totals{std::vector<std::size_t>(nLevels), std::vector<double>(nLevels),
+                           std::vector<std::size_t>(nLevels), std::vector<double>(nLevels)};
+    forEachTile([&](std::size_t tileIx) {
+        NCD_TRACE_SCOPE("inundation_flood");
+        const auto tileX = tileIx % tilesAcross;
+        const auto tileY = tileIx / tilesAcross;
+        const auto w = tileWidth(tileX);
+        const auto h = tileHeight(tileY);
+        const auto heights = readTile(tileIx);
+        std::vector<double> rowAreaKm2(h);
+        for(std::size_t y = 0; y < h; ++y) {
+            const double lat = converter.convertBack(static_cast<double>(region.rowBegin + tileY * tileSize + y) + 0.5, 0.0).lat();
+            rowAreaKm2[y] = cellKm * cellKm * std::cos(lat * 3.14159265358979323846 / 180.0);
+        }
+        FloodedTile result;
+        result.counts = TileFloodCounts{std::vector<std::size_t>(nLevels), std::vector<double>(nLevels),
+                                        std::vector<std::size_t>(nLevels), std::vector<double>(nLevels)};
+        std::vector<int16_t> floodLevel(w * h, inundationNeverFlooded);
+        std::vector<uint32_t> dry; // wet cells not connected to the ocean yet
+        TileSweep sweep(heights.data(), w, h, levels, options.oceanBelow, nodeBase[tileIx], oceanNode);
+        sweep.run([&](std::size_t level, const uint32_t* begin, const uint32_t* end) {
+            dry.insert(dry.end(), begin, end);
+            auto stillDry = std::remove_if(dry.begin(), dry.end(), [&](uint32_t cell) {
+                const auto key = sweep.key(cell);
+                if(key == noKey || oceanLevel[key] > level) {
+                    return false;
+                }
+                floodLevel[cell] = static_cast<int16_t>(level);
+                const double area = rowAreaKm2[cell / w];
+                ++result.counts.cells[level];
+                result.counts.areaKm2[level] += area;
+                if(heights[cell] >= 0) {
+                    ++result.counts.landCells[level];
+                    result.counts.landAreaKm2[level] += area;
+                }
+                return true;
+            });
+            dry.erase(stillDry, dry.end());
+        }, [](const Event&) {});
+        if(writer) {
+            result.encoded = writer->encodeTile(tileX, tileY, floodLevel.data());
+        }
+        return result;
+    }, [&](std::size_t tileIx, FloodedTile tile) {
+        for(std::size_t level = 0; level < nLevels; ++level) {
+            totals.cells[level] += tile.counts.cells[level];
+            totals.areaKm2[level] += tile.counts.areaKm2[level];
+            totals.landCells[level] += tile.counts.landCells[level];
+            totals.landAreaKm2[level] += tile.counts.landAreaKm2[level];
+        }
+        if(writer) {
+            writer->writeTile(tileIx % tilesAcross, tileIx / tilesAcross, tile.encoded);
+        }
+    });
+    if(writer) {
+        writer->finish();
+    }
+
+    InundationLevelStats cumulative;
+    for(std::size_t level = 0; level < nLevels; ++level) {
+        cumulative.floodedCells += totals.cells[level];
+        cumulative.floodedAreaKm2 += totals.areaKm2[level];
+        cumulative.landCells += totals.landCells[level];
+        cumulative.landAreaKm2 += totals.landAreaKm2[level];
+        cumulative.level = levels[level];
+        stats[level] = cumulative;
+    }
+    return stats;
+}
+
+inline std::vector<InundationLevelStats> simulate_inundation(const NcFile& ncFile, const GpsArea& area, std::vector<double> levels,
+                                                             ThreadPool& pool, const InundationOutput& output = {},
+                                                             const InundationOptions& options = {}) {
+    RowBlockReader reader(ncFile);
+    const auto converter = GpsToOffsetConverter::forGrid(reader.width(), reader.height());
+    return simulate_inundation(ncFile, cropGridForArea(converter, reader.width(), reader.height(), area), std::move(levels),
+                               pool, output, options);
+}
+
+#endif //NETCDF_DANI_INUNDATION_H
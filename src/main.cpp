@@ -7,12 +7,30 @@
 #include <string>
 #include <array>
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
 
 #include "NcFile.h"
 #include "colors.h"
 #include "gps.h"
 
 #include "bitpartition.h"
+#include "contour.h"
+#include "distance_transform.h"
+#include "flow_routing.h"
+#include "crop_export.h"
+#include "JobScheduler.h"
+#include "TileServer.h"
+#include "TileStore.h"
+#include "VirtualGrid.h"
+#include "grid_diff.h"
+#include "grid_sinks.h"
+#include "inundation.h"
+#include "overview.h"
+#include "point_enrichment.h"
+#include "render_kernel.h"
+#include "terrain_derivatives.h"
+#include "instrumentation.h"
 
 void handle_error(int status) {
     std::cout << "error " << status << std::endl;
@@ -49,23 +67,6 @@ int print_info(const NcFile& ncFile) {
     return 0;
 }
 
-std::array<uint8_t, 3> heightToRgb(int64_t height, int16_t max = 9000, int16_t min = -12000) {
-    auto range = max - min;
-    double t = 0.0;
-    double V = 100.0;
-    t = height / static_cast<double>(range);
-    if(height < 0) {
-        V = std::abs(height / (double)min) * 100.0;
-    } else {
-//        t = (height+min) / static_cast<double>(range);
-        t = (height-min) / static_cast<double>(max);
-        t = std::clamp(t, 0.0, 1.0);
-        V = 100.0 * (0.5 + 0.5 * (height / (double)max));
-    }
-    auto H = 240.0 + 90.0 * t;
-    return HSVtoRGB(H, 100.0f, V);
-}
-
 int transform_elevation_data(const NcFile& ncFile) {
     constexpr int scale = 40;
 
@@ -142,58 +143,93 @@ int transform_elevation_data(const NcFile& ncFile) {
 }
 
 
-int crop_from_elevation_data(const NcFile& ncFile, GpsArea area) {
+// The raw outputs of crop_from_elevation_data for one band: the heights biased to unsigned, their high byte
+// and the colored relief, rows south to north at the full width of the crop
+class RawCropJob : public GridJob {
+public:
+    std::string name() const override { return "raw_crop"; }
+    // the heights, then 2 + 1 + 3 output bytes
+    std::size_t bytesPerCell() const override { return sizeof(int16_t) + sizeof(uint16_t) + 1 + 3; }
+
+    void begin(const CropGrid& region) override {
+        _region = region;
+        _colors = ColorTable::build([](int16_t height) { return heightToRgb(height, 1800, -500); });
+        _ofs.open("out_hun.raw", std::ios::binary | std::ios::trunc);
+        _ofsU8.open("out_hun_u8.raw", std::ios::binary | std::ios::trunc);
+        _ofsColor.open("out_hun_rgb.raw", std::ios::binary | std::ios::trunc);
+        if(!_ofs.is_open() || !_ofsU8.is_open() || !_ofsColor.is_open()) {
+            throw std::runtime_error("couldn't open the crop outputs");
+        }
+    }
+
+    void process(GridBand& band) override {
+        const auto cells = band.nRows * band.nCols;
+        band.output.resize(cells * 6);
+        auto* biased = band.output.data();
+        auto* u8 = biased + cells * sizeof(uint16_t);
+        auto* color = u8 + cells;
+        const int16_t* heights = band.heights.data.data();
+        for(std::size_t ix = 0; ix < cells; ++ix) {
+            const auto val = static_cast<uint16_t>(heights[ix] + 32768);
+            std::memcpy(biased + ix * sizeof(uint16_t), &val, sizeof(val));
+            u8[ix] = static_cast<uint8_t>(val >> 8);
+        }
+        RenderOptions renderOptions;
+        renderOptions.format = PixelFormat::Rgb888;
+        render_heights(heights, band.nCols, band.nRows, _colors, renderOptions, color, band.nCols * 3);
+    }
+
+    void commit(GridBand& band) override {
+        const auto cells = band.nRows * band.nCols;
+        const auto* biased = band.output.data();
+        const auto* u8 = biased + cells * sizeof(uint16_t);
+        const auto* color = u8 + cells;
+        for(std::size_t y = 0; y < band.nRows; ++y) {
+            const auto cell = (band.firstRow + y - _region.rowBegin) * _region.cols() + band.colBegin - _region.colBegin;
+            _ofs.seekp(static_cast<std::streamoff>(cell * sizeof(uint16_t)));
+            _ofs.write(reinterpret_cast<const char*>(biased + y * band.nCols * sizeof(uint16_t)), band.nCols * sizeof(uint16_t));
+            _ofsU8.seekp(static_cast<std::streamoff>(cell));
+            _ofsU8.write(reinterpret_cast<const char*>(u8 + y * band.nCols), band.nCols);
+            _ofsColor.seekp(static_cast<std::streamoff>(cell * 3));
+            _ofsColor.write(reinterpret_cast<const char*>(color + y * band.nCols * 3), band.nCols * 3);
+        }
+    }
+
+    void finish() override {
+        _ofs.close();
+        _ofsU8.close();
+        _ofsColor.close();
+        if(!_ofs || !_ofsU8 || !_ofsColor) {
+            throw std::runtime_error("write failed: crop outputs");
+        }
+    }
+
+private:
+    CropGrid _region;
+    ColorTable _colors;
+    std::ofstream _ofs;
+    std::ofstream _ofsU8;
+    std::ofstream _ofsColor;
+};
+
+// Streams the crop through the job scheduler: only the bands in flight are held, within memoryBudget bytes
+int crop_from_elevation_data(const NcFile& ncFile, GpsArea area, std::size_t memoryBudget = std::size_t{256} << 20) {
     const auto w = ncFile.dims().at(0);
     const auto h = ncFile.dims().at(1);
-    int elevation_var_id = ncFile.getVarIdByName("elevation");
     const double stepPerDegree = static_cast<double>(w) / 360.0;
-    Offset2D center{static_cast<std::size_t>(90.0 * stepPerDegree), static_cast<std::size_t>(180.0 * stepPerDegree)};
-//    GpsToOffsetConverter gpsToOffsetConverter(stepPerDegree, center.latLon[0], center.latLon[1]);
     GpsToOffsetConverter gpsToOffsetConverter(stepPerDegree, h/2, w/2);
-    auto offsetMin = gpsToOffsetConverter.convert(area.min);
-    auto offsetMax = gpsToOffsetConverter.convert(area.max);
-//    std::swap(offsetMax.latLon[0], offsetMin.latLon[0]);
-    Offset2D areaSize = offsetMax - offsetMin;
-//    areaSize.latLon[0] *= 3;
-//    areaSize.latLon[1] *= 3;
-    std::cout << "area size: " << areaSize.latLon[0] << "*" << areaSize.latLon[1] << std::endl;
-
-    std::vector<int16_t> buf;
-    std::vector<uint8_t> buf_u8;
-    std::vector<uint8_t> buf_color;
-    auto bufSize = areaSize.latLon[0] * areaSize.latLon[1];
-    buf.resize(bufSize);
-    buf_u8.resize(bufSize);
-    buf_color.resize(bufSize * 3);
-    std::array<std::size_t, 2> offset{offsetMin.latLon[0], offsetMin.latLon[1]};
-    std::array<std::size_t, 2> count{areaSize.latLon[0], areaSize.latLon[1]};
-    ncFile.getInt64Data(buf.data(), elevation_var_id, offset.data(), count.data());
-
-    auto minMax16 = std::minmax_element(buf.begin(), buf.end());
-    auto min16 = *minMax16.first;
-    auto max16 = *minMax16.second;
-    auto range = max16 - min16;
-
-    for(size_t ix = 0; ix < bufSize; ++ix) {
-        int val = buf[ix];
-        auto rgb = heightToRgb(val, 1800, -500);
-        val += std::abs(std::numeric_limits<int16_t>::min());
-        auto val_u8 = val >> 8;
-        buf_u8[ix] = val_u8;
-//        auto t = ((buf[ix]-min16)/(double)range);
-//        auto H = 240.0 + 90.0 * t;
-//        auto rgb = HSVtoRGB(H, 100.0f, 100.0f);
-        buf_color[3*ix] = rgb[0];
-        buf_color[3*ix+1] = rgb[1];
-        buf_color[3*ix+2] = rgb[2];
-        buf[ix] = val;
-    }
-    std::ofstream ofs("out_hun.raw", std::ios::binary);
-    std::ofstream ofs_u8("out_hun_u8.raw", std::ios::binary);
-    std::ofstream ofs_color("out_hun_rgb.raw", std::ios::binary);
-    ofs.write((const char*)buf.data(), buf.size()*sizeof(int16_t));
-    ofs_u8.write((const char*)buf_u8.data(), buf_u8.size()*sizeof(uint8_t));
-    ofs_color.write((const char*)buf_color.data(), buf_color.size());
+    RowBlockReader reader(ncFile);
+    const auto grid = cropGridForArea(gpsToOffsetConverter, reader.width(), reader.height(), area);
+    std::cout << "area size: " << grid.rows() << "*" << grid.cols() << std::endl;
+
+    ThreadPool pool;
+    MemoryBudget budget(memoryBudget);
+    JobScheduler scheduler(ncFile, pool, budget);
+    RawCropJob job;
+    const auto plan = scheduler.plan(job, grid);
+    std::cout << "bands of " << plan.bandRows << " rows, " << plan.passes << " pass(es)" << std::endl;
+    scheduler.run(job, grid);
+    std::cout << "peak in flight: " << budget.peak() << " bytes" << std::endl;
     return 0;
 }
 
@@ -214,8 +250,203 @@ void transform_to_raw(NcFile& ncFile) {
     ofs.flush();
 }
 
+// transform_to_raw as a tile store: the whole grid in random-access tiles, compressed with the terrain codec
+void transform_to_tile_store(const NcFile& ncFile, const std::string& filename, std::size_t tileSize = 256) {
+    RowBlockReader reader(ncFile);
+    TileStoreLayout layout;
+    layout.width = reader.width();
+    layout.height = reader.height();
+    layout.tileSize = tileSize;
+    TileStoreWriter writer(filename, layout);
+    ThreadPool pool;
+    const auto tilesAcross = layout.tilesAcross();
+    const auto tilesDown = layout.tilesDown();
+
+    auto encodeBand = [&](std::size_t tileY) {
+        auto band = reader.read(tileY * tileSize, tileSize);
+        std::vector<std::vector<uint8_t>> encoded(tilesAcross);
+        std::vector<int16_t> tile(tileSize * tileSize);
+        for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+            const auto colBegin = tileX * tileSize;
+            const auto nCols = layout.tileWidth(tileX);
+            for(std::size_t y = 0; y < band.nRows; ++y) {
+                std::copy(band.row(y) + colBegin, band.row(y) + colBegin + nCols, tile.data() + y * nCols);
+            }
+            encoded[tileX] = writer.encodeTile(tileX, tileY, tile.data());
+        }
+        return encoded;
+    };
+
+    std::deque<std::future<std::vector<std::vector<uint8_t>>>> inFlight;
+    std::size_t nextBand = 0;
+    try {
+        for(std::size_t tileY = 0; tileY < tilesDown; ++tileY) {
+            while(nextBand < tilesDown && inFlight.size() < pool.size() + 1) {
+                inFlight.push_back(pool.submit([&encodeBand, bandIx = nextBand++]() { return encodeBand(bandIx); }));
+            }
+            auto encoded = inFlight.front().get();
+            inFlight.pop_front();
+            for(std::size_t tileX = 0; tileX < tilesAcross; ++tileX) {
+                writer.writeTile(tileX, tileY, encoded[tileX]);
+            }
+            std::cout << "tile row " << tileY + 1 << "/" << tilesDown << "\r" << std::flush;
+        }
+    } catch(...) {
+        // the queued bands reference this frame
+        for(auto& band : inFlight) {
+            band.wait();
+        }
+        throw;
+    }
+    writer.finish();
+    std::cout << std::endl;
+}
+
+// All full-grid products from a single decompression pass: raw dump, bit planes, tile store,
+// the 1:40 overview files, histogram/range (recorded in the metadata sidecar) and contours
+void generate_products(NcFile& ncFile) {
+    ThreadPool pool;
+    GridPipeline pipeline(ncFile);
+
+    RawDumpSink rawSink("D:/out_full_16.raw");
+    BitPlaneSink bitPlaneSink("D:/out_full_16_bit_partitioned.raw");
+    TileStoreSink tileSink("D:/out_full_16.tiles", 256, &pool);
+    OverviewSink overviewSink(40, "out");
+    HistogramSink histogramSink("histogram.csv");
+    ContourOptions contourOptions;
+    contourOptions.levels = {0.0, -200.0, -1000.0};
+    GeoJsonPolylineWriter geoJsonWriter("contours.geojson");
+    ContourSink contourSink(contourOptions, geoJsonWriter, &pool);
+
+    for(GridSink* sink : std::initializer_list<GridSink*>{&rawSink, &bitPlaneSink, &tileSink, &overviewSink, &histogramSink, &contourSink}) {
+        pipeline.addSink(*sink);
+    }
+    pipeline.run();
+
+    auto range = histogramSink.range();
+    std::cout << "elevation range " << range.min << " .. " << range.max << ", mean " << histogramSink.mean() << std::endl;
+    ncFile.setValueRange(pipeline.reader().varId(), range);
+    ncFile.saveMetadata();
+}
+
+void extract_contours_to_files(const NcFile& ncFile) {
+    ContourOptions options;
+    options.levels = {0.0, -200.0, -1000.0};
+    ThreadPool pool;
+    GeoJsonPolylineWriter geoJsonWriter("contours.geojson");
+    extract_contours(ncFile, options, geoJsonWriter, pool);
+//    BinaryPolylineWriter binaryWriter("contours.ncpl");
+//    extract_contours(ncFile, options, binaryWriter, pool);
+}
+
+// Slope, aspect and hillshade tile stores next to the NetCDF file; the viewer shades with the hillshade
+void compute_terrain_products(const NcFile& ncFile) {
+    ThreadPool pool;
+    const auto& filename = ncFile.filename();
+    TerrainProductFiles files{filename + ".slope.tiles", filename + ".aspect.tiles", hillshadePath(filename)};
+    compute_terrain_derivatives(ncFile, files, pool);
+}
+
+// Signed distance to the coastline of every cell, meters in a Float32 tile store
+void compute_coast_distance(const NcFile& ncFile) {
+    ThreadPool pool;
+    compute_distance_to_coast(ncFile, ncFile.filename() + ".coast_distance.tiles", pool);
+}
+
+// What changed between two releases, and the new release's tile store rebuilt only where it did
+void diff_releases(const NcFile& before, const NcFile& after, const std::string& beforeTileStore) {
+    ThreadPool pool;
+    auto diff = diff_grids(before, after, pool, {"out_diff.tiles", "out_diff_tiles.csv"});
+    std::cout << diff.changedTiles.size() << " of " << diff.tilesAcross() * diff.tilesDown() << " tiles changed, "
+              << diff.changedCells() << " cells" << std::endl;
+    refresh_tile_store(beforeTileStore, after, diff, after.filename() + ".tiles");
+}
+
+// Land flooded from the sea by water levels of 0 to 10 m, with the first flooding level of each cell
+void simulate_sea_level_rise(const NcFile& ncFile, GpsArea area) {
+    ThreadPool pool;
+    std::vector<double> levels;
+    for(int level = 0; level <= 10; ++level) {
+        levels.push_back(level);
+    }
+    auto stats = simulate_inundation(ncFile, area, levels, pool, {"out_inundation.tiles"});
+    for(const auto& levelStats : stats) {
+        std::cout << "level " << levelStats.level << " m: " << levelStats.landAreaKm2 << " km2 of land flooded" << std::endl;
+    }
+}
+
+// D8 flow directions and flow accumulation of the land, with the depressions filled
+void route_land_flow(const NcFile& ncFile, GpsArea area) {
+    ThreadPool pool;
+    const auto summary = route_flow(ncFile, area, pool, {"out_flow_dir.tiles", "out_flow_acc.tiles", "out_flow_filled.tiles"});
+    std::cout << summary.cells << " cells, " << summary.raisedCells << " raised, " << summary.flatCells << " on flats ("
+              << summary.flatRounds << " rounds), largest catchment " << summary.maxAccumulation << " cells" << std::endl;
+}
 
-int main() {
+// Appends the depth at every track point of a CSV with lat and lon columns
+void enrich_track_points(const NcFile& ncFile, const std::string& inputCsv, const std::string& outputCsv) {
+    ThreadPool pool;
+    PointEnrichmentOptions options;
+    options.sampling = PointSampling::Bilinear;
+    const auto records = enrich_csv(ncFile, inputCsv, outputCsv, pool, options);
+    std::cout << records << " points enriched" << std::endl;
+}
+
+// The area from the GEBCO sub-tiles with a regional grid on top, at the GEBCO resolution
+void crop_from_mosaic(const std::vector<std::string>& gebcoTiles, const std::string& regionalGrid, GpsArea area) {
+    VirtualGrid mosaic(240.0);
+    for(const auto& tile : gebcoTiles) {
+        mosaic.addFile(tile);
+    }
+    mosaic.addFile(regionalGrid, 1);
+    ThreadPool pool;
+    std::vector<int16_t> heights;
+    auto size = mosaic.readArea(area, heights, nullptr, &pool);
+    std::cout << "area size: " << size.latLon[0] << "*" << size.latLon[1] << std::endl;
+    std::ofstream ofs("out_mosaic.raw", std::ios::binary);
+    ofs.write((const char*)heights.data(), heights.size() * sizeof(int16_t));
+}
+
+void export_crop_geotiff(const NcFile& ncFile, GpsArea area, CropProjection projection = CropProjection::Geographic) {
+    ThreadPool pool;
+    std::vector<CropOutput> outputs = {
+            {"out_hun.tif", CropProduct::Elevation16},
+            {"out_hun_u8.tif", CropProduct::Gray8},
+            {"out_hun_rgb.tif", CropProduct::Rgb8},
+    };
+    export_crop(ncFile, area, outputs, pool, projection);
+}
+
+// Local tile server for web map clients until Enter is pressed, e.g.
+// http://127.0.0.1:8080/{z}/{x}/{y}.png, /hsv/..., /terrain-rgb/... or /raw/{z}/{x}/{y}.bin
+void serve_tiles(NcFile& ncFile, uint16_t port = 8080) {
+    {
+        ThreadPool pool;
+        ensure_cached_overview(ncFile, 40, pool);
+    }
+    TileServerOptions options;
+    options.port = port;
+    TileServer server(ncFile, options);
+    server.start();
+    std::cout << "serving tiles on http://127.0.0.1:" << server.port() << "/{z}/{x}/{y}.png, zoom 0-" << server.maxZoom()
+              << ", press Enter to stop" << std::endl;
+    std::cin.get();
+    server.stop();
+    auto hitsAndMisses = server.cacheHitsAndMisses();
+    std::cout << "tile cache hits " << hitsAndMisses.first << ", misses " << hitsAndMisses.second << std::endl;
+}
+
+
+int main(int argc, char** argv) {
+    bool printStats = false;
+    bool serve = false;
+    for(int argIx = 1; argIx < argc; ++argIx) {
+        if(std::string(argv[argIx]) == "--stats") {
+            printStats = true;
+        } else if(std::string(argv[argIx]) == "--serve") {
+            serve = true;
+        }
+    }
     try {
         GPS hunGps1{48.64698758285766, 14.999676527732783};
         GPS hunGps2{45.50885749858355, 23.417102803214963};
@@ -224,13 +455,33 @@ int main() {
         //const char* nc_datafile = "D:\\other\\data\\geo\\gebco_2023\\GEBCO_2023.nc";
         const char *nc_datafile = "C:\\dani\\other\\GEBCO_2023.nc";
         auto nc_file = NcFile::openForRead(nc_datafile);
+        if(serve) {
+            serve_tiles(nc_file);
+        } else {
 //    print_info(nc_file);
 //    transform_to_raw(nc_file);
-        transform_to_bitpartitioned_raw(nc_file);
+//    transform_to_tile_store(nc_file, "D:/out_full_16.tiles");
+            transform_to_bitpartitioned_raw(nc_file);
 //    transform_elevation_data(nc_file);
 //    crop_from_elevation_data(nc_file, hunArea);
+//    extract_contours_to_files(nc_file);
+//    generate_products(nc_file);
+//    export_crop_geotiff(nc_file, hunArea);
+//    compute_terrain_products(nc_file);
+//    compute_coast_distance(nc_file);
+//    diff_releases(NcFile::openForRead("C:\\dani\\other\\GEBCO_2021.nc"), nc_file, "D:/out_full_16_2021.tiles");
+//    simulate_sea_level_rise(nc_file, GpsArea::fromPoints(GPS{53.6, 3.3}, GPS{50.7, 7.3}));
+//    enrich_track_points(nc_file, "track.csv", "track_depth.csv");
+//    route_land_flow(nc_file, hunArea);
+        }
     } catch(const std::exception& e) {
         std::cout << "exception: " << e.what() << std::endl;
     }
+    if(printStats) {
+        instrumentation::printSummary(std::cout, instrumentation::snapshot());
+        if(instrumentation::writeChromeTrace("trace.json")) {
+            std::cout << "trace written to trace.json" << std::endl;
+        }
+    }
     return 0;
 }
@@ -0,0 +1,146 @@
+#ifndef NETCDF_DANI_OVERVIEW_H
+#define NETCDF_DANI_OVERVIEW_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+
+// The viewer's world overview: every factor-th row of the elevation grid, each sample the average of
+// factor consecutive columns. Rows run south to north, like the file.
+struct Overview {
+    std::size_t factor{};
+    std::size_t width{};
+    std::size_t height{};
+    std::vector<int16_t> data;
+    ValueRange range; // of the whole grid, not just of the overview
+};
+
+// Fills the overview rows whose sampled grid row lies in the block
+inline void shrinkOverviewRows(const RowBlock& block, Overview& overview) {
+    const auto factor = overview.factor;
+    const auto firstSampledRow = (block.firstRow + factor - 1) / factor * factor;
+    for(auto rowIx = firstSampledRow; rowIx < block.endRow(); rowIx += factor) {
+        const auto overviewRow = rowIx / factor;
+        if(overviewRow >= overview.height) {
+            break;
+        }
+        const int16_t* src = block.row(rowIx - block.firstRow);
+        int16_t* dst = overview.data.data() + overviewRow * overview.width;
+        for(std::size_t x = 0; x < overview.width; ++x) {
+            int64_t sum = 0;
+            for(std::size_t i = 0; i < factor; ++i) {
+                sum += src[x * factor + i];
+            }
+            dst[x] = static_cast<int16_t>(sum / static_cast<int64_t>(factor));
+        }
+    }
+}
+
+// Reads the grid in chunk-aligned blocks on the pool. Chunks are much taller than the sampled row
+// spacing, so reading every row decompresses nothing extra over reading only the sampled rows, and
+// buys the exact min/max of the grid for the metadata sidecar. Blocks are as short as the chunks allow,
+// and at most two per worker and maxBytesInFlight of them are read at once (one block at least).
+// Setting *cancel makes it throw instead of reading the remaining blocks.
+inline Overview build_overview(const NcFile& ncFile, std::size_t factor, ThreadPool& pool,
+                               const std::atomic<bool>* cancel = nullptr, std::size_t maxBytesInFlight = std::size_t{128} << 20) {
+    RowBlockReader reader(ncFile, "elevation", factor);
+    Overview overview;
+    overview.factor = factor;
+    overview.width = reader.width() / factor;
+    overview.height = reader.height() / factor;
+    overview.data.resize(overview.width * overview.height);
+    const auto blockBytes = std::max<std::size_t>(reader.blockRows() * reader.width() * sizeof(int16_t), 1);
+    const auto maxInFlight = std::clamp<std::size_t>(maxBytesInFlight / blockBytes, 1, 2 * pool.size());
+
+    auto shrinkBlock = [&reader, &overview](std::size_t blockIx) {
+        auto block = reader.readBlock(blockIx);
+        ValueRange range{std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest()};
+        if(block.data.empty()) {
+            return range;
+        }
+        auto minMax = std::minmax_element(block.data.begin(), block.data.end());
+        range.min = *minMax.first;
+        range.max = *minMax.second;
+        shrinkOverviewRows(block, overview);
+        return range;
+    };
+
+    overview.range = ValueRange{std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest()};
+    std::deque<std::future<ValueRange>> inFlight;
+    std::size_t nextBlock = 0;
+    try {
+        while(nextBlock < reader.nBlocks() || !inFlight.empty()) {
+            if(cancel && cancel->load()) {
+                throw std::runtime_error("overview build cancelled");
+            }
+            while(nextBlock < reader.nBlocks() && inFlight.size() < maxInFlight) {
+                inFlight.push_back(pool.submit([&shrinkBlock, blockIx = nextBlock++]() { return shrinkBlock(blockIx); }));
+            }
+            auto range = inFlight.front().get();
+            inFlight.pop_front();
+            overview.range.min = std::min(overview.range.min, range.min);
+            overview.range.max = std::max(overview.range.max, range.max);
+        }
+    } catch(...) {
+        // the queued blocks reference this frame
+        for(auto& block : inFlight) {
+            block.wait();
+        }
+        throw;
+    }
+    return overview;
+}
+
+// Writes the overview next to the NetCDF file and records it together with the elevation range in the
+// file's sidecar. Returns false if either couldn't be written.
+inline bool store_overview(NcFile& ncFile, const Overview& overview) {
+    // the viewer's background build and another process may store at the same time; each writes its own
+    // temporary file and renames it into place
+    const auto path = NcFileMetadata::overviewPath(ncFile.filename());
+    const auto tmpPath = NcFileMetadata::tempPath(path);
+    {
+        std::ofstream ofs(tmpPath, std::ios::binary);
+        if(!ofs.is_open()) {
+            return false;
+        }
+        ofs.write(reinterpret_cast<const char*>(overview.data.data()), overview.data.size() * sizeof(int16_t));
+        if(!ofs) {
+            ofs.close();
+            std::error_code ec;
+            std::filesystem::remove(tmpPath, ec);
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if(ec) {
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+    ncFile.setValueRange(ncFile.getVarIdByName("elevation"), overview.range);
+    ncFile.setOverview(OverviewMetadata{overview.factor, overview.width, overview.height});
+    return ncFile.saveMetadata();
+}
+
+// Builds and stores the overview unless the sidecar already has one with this factor
+inline bool ensure_cached_overview(NcFile& ncFile, std::size_t factor, ThreadPool& pool) {
+    if(ncFile.overview() && ncFile.overview()->factor == factor) {
+        return true;
+    }
+    return store_overview(ncFile, build_overview(ncFile, factor, pool));
+}
+
+#endif //NETCDF_DANI_OVERVIEW_H
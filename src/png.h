@@ -0,0 +1,64 @@
+#ifndef NETCDF_DANI_PNG_H
+#define NETCDF_DANI_PNG_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "zlib.h"
+
+// Minimal PNG encoder for 8-bit gray (1 channel), RGB (3) or RGBA (4) images, rows top to bottom.
+// Rows use the Sub filter, which suits smooth terrain and is cheap; level 1 deflate favors speed.
+inline std::vector<uint8_t> encodePng(const uint8_t* pixels, std::size_t width, std::size_t height, int channels,
+                                      int compressionLevel = 1) {
+    static const int colorTypes[] = {0, 0, 4, 2, 6};
+    if(channels != 1 && channels != 3 && channels != 4) {
+        throw std::runtime_error("encodePng: 1, 3 or 4 channels");
+    }
+    const std::size_t rowBytes = width * channels;
+
+    std::vector<uint8_t> filtered((rowBytes + 1) * height);
+    for(std::size_t y = 0; y < height; ++y) {
+        const uint8_t* src = pixels + y * rowBytes;
+        uint8_t* dst = filtered.data() + y * (rowBytes + 1);
+        dst[0] = 1; // Sub
+        for(std::size_t ix = 0; ix < rowBytes; ++ix) {
+            dst[1 + ix] = static_cast<uint8_t>(src[ix] - (ix >= static_cast<std::size_t>(channels) ? src[ix - channels] : 0));
+        }
+    }
+    uLongf compressedSize = compressBound(static_cast<uLong>(filtered.size()));
+    std::vector<uint8_t> compressed(compressedSize);
+    if(compress2(compressed.data(), &compressedSize, filtered.data(), static_cast<uLong>(filtered.size()), compressionLevel) != Z_OK) {
+        throw std::runtime_error("encodePng: deflate failed");
+    }
+    compressed.resize(compressedSize);
+
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    auto putU32 = [&png](uint32_t value) {
+        png.push_back(static_cast<uint8_t>(value >> 24));
+        png.push_back(static_cast<uint8_t>(value >> 16));
+        png.push_back(static_cast<uint8_t>(value >> 8));
+        png.push_back(static_cast<uint8_t>(value));
+    };
+    auto putChunk = [&png, &putU32](const char* type, const uint8_t* data, std::size_t size) {
+        putU32(static_cast<uint32_t>(size));
+        const auto typeOffset = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data, data + size);
+        putU32(static_cast<uint32_t>(crc32(0, png.data() + typeOffset, static_cast<uInt>(size + 4))));
+    };
+
+    uint8_t header[13] = {};
+    for(int ix = 0; ix < 4; ++ix) {
+        header[ix] = static_cast<uint8_t>(width >> (24 - 8 * ix));
+        header[4 + ix] = static_cast<uint8_t>(height >> (24 - 8 * ix));
+    }
+    header[8] = 8; // bit depth
+    header[9] = static_cast<uint8_t>(colorTypes[channels]);
+    putChunk("IHDR", header, sizeof(header));
+    putChunk("IDAT", compressed.data(), compressed.size());
+    putChunk("IEND", nullptr, 0);
+    return png;
+}
+
+#endif //NETCDF_DANI_PNG_H
@@ -0,0 +1,244 @@
+#ifndef NETCDF_DANI_POINT_ENRICHMENT_H
+#define NETCDF_DANI_POINT_ENRICHMENT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "NcFile.h"
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "gps.h"
+#include "instrumentation.h"
+
+// Elevation at many lat/lon points, e.g. ship tracks or survey points. The points are sorted by the Morton
+// code of their chunk, then of their cell within it, so every run of points in one chunk is a single
+// hyperslab read: the library decodes each chunk about once per batch instead of once per point.
+// Results come back in the original order.
+
+enum class PointSampling {
+    Nearest,  // the cell that contains the point
+    Bilinear, // between the four nearest cell centers, clamped at the grid edges
+};
+
+// Bits of x spread to the even bit positions
+inline uint64_t mortonSpread(uint32_t x) {
+    uint64_t v = x;
+    v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+    v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+    v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+    v = (v | (v << 2)) & 0x3333333333333333ull;
+    v = (v | (v << 1)) & 0x5555555555555555ull;
+    return v;
+}
+
+inline uint64_t morton_code(uint32_t row, uint32_t col) { return (mortonSpread(row) << 1) | mortonSpread(col); }
+
+// Elevation at each point in meters, NaN for points with invalid coordinates
+inline std::vector<float> sample_points(const NcFile& ncFile, const std::vector<GPS>& points, ThreadPool& pool,
+                                        PointSampling sampling = PointSampling::Nearest) {
+    RowBlockReader reader(ncFile);
+    const auto width = reader.width();
+    const auto height = reader.height();
+    const auto chunkSizes = ncFile.getChunkSizes(reader.varId());
+    const std::size_t chunkRows = reader.chunkRows();
+    const std::size_t chunkCols = chunkSizes.size() < 2 ? width : std::max<std::size_t>(1, chunkSizes[1]);
+    const auto converter = GpsToOffsetConverter::forGrid(width, height);
+    const bool bilinear = sampling == PointSampling::Bilinear;
+
+    std::vector<float> values(points.size(), std::numeric_limits<float>::quiet_NaN());
+    if(points.empty() || width == 0 || height == 0) {
+        return values;
+    }
+    // per point: the cell of its sample (for bilinear the south-west one of the four) and the weights
+    struct Sample {
+        uint64_t key{};
+        uint32_t pointIx{};
+        uint32_t row{};
+        uint32_t col{};
+        float fracRow{};
+        float fracCol{};
+    };
+    std::vector<Sample> samples;
+    samples.reserve(points.size());
+    {
+        NCD_TRACE_SCOPE("points_sort");
+        for(std::size_t pointIx = 0; pointIx < points.size(); ++pointIx) {
+            const auto& point = points[pointIx];
+            if(!std::isfinite(point.lat()) || !std::isfinite(point.lon()) || std::abs(point.lat()) > 90.0 || std::abs(point.lon()) > 180.0) {
+                continue;
+            }
+            // bilinear samples between cell centers, which sit half a cell from the corners
+            const double center = bilinear ? 0.5 : 0.0;
+            const double y = std::clamp(converter.latOffset(point.lat()) - center, 0.0, static_cast<double>(height - 1));
+            const double x = std::clamp(converter.lonOffset(point.lon()) - center, 0.0, static_cast<double>(width - 1));
+            Sample sample;
+            sample.pointIx = static_cast<uint32_t>(pointIx);
+            sample.row = static_cast<uint32_t>(std::floor(y));
+            sample.col = static_cast<uint32_t>(std::floor(x));
+            sample.fracRow = static_cast<float>(y - sample.row);
+            sample.fracCol = static_cast<float>(x - sample.col);
+            const auto chunkCode = morton_code(static_cast<uint32_t>(sample.row / chunkRows), static_cast<uint32_t>(sample.col / chunkCols));
+            const auto cellCode = morton_code(static_cast<uint32_t>(sample.row % chunkRows) & 0xffff, static_cast<uint32_t>(sample.col % chunkCols) & 0xffff);
+            sample.key = (chunkCode << 32) | cellCode;
+            samples.push_back(sample);
+        }
+        std::sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.key < b.key; });
+    }
+
+    // runs of samples in one chunk
+    std::vector<std::size_t> runBegin;
+    for(std::size_t ix = 0; ix < samples.size(); ++ix) {
+        if(ix == 0 || (samples[ix].key >> 32) != (samples[ix - 1].key >> 32)) {
+            runBegin.push_back(ix);
+        }
+    }
+    runBegin.push_back(samples.size());
+
+    pool.parallelFor(runBegin.size() - 1, 1, [&](std::size_t begin, std::size_t end) {
+        std::vector<int16_t> window;
+        for(std::size_t runIx = begin; runIx < end; ++runIx) {
+            NCD_TRACE_SCOPE("points_chunk");
+            const auto first = samples.begin() + static_cast<std::ptrdiff_t>(runBegin[runIx]);
+            const auto last = samples.begin() + static_cast<std::ptrdiff_t>(runBegin[runIx + 1]);
+            // the cells the run needs: within the chunk, and one row or column into the next chunk for
+            // bilinear samples on its northern or eastern border
+            std::size_t rowBegin = height;
+            std::size_t rowEnd = 0;
+            std::size_t colBegin = width;
+            std::size_t colEnd = 0;
+            for(auto it = first; it != last; ++it) {
+                rowBegin = std::min<std::size_t>(rowBegin, it->row);
+                colBegin = std::min<std::size_t>(colBegin, it->col);
+                rowEnd = std::max<std::size_t>(rowEnd, std::min<std::size_t>(it->row + (bilinear ? 2 : 1), height));
+                colEnd = std::max<std::size_t>(colEnd, std::min<std::size_t>(it->col + (bilinear ? 2 : 1), width));
+            }
+            const auto windowWidth = colEnd - colBegin;
+            window.resize((rowEnd - rowBegin) * windowWidth);
+            std::size_t offset[2] = {rowBegin, colBegin};
+            std::size_t count[2] = {rowEnd - rowBegin, windowWidth};
+            ncFile.getInt64Data(window.data(), reader.varId(), offset, count);
+            auto at = [&](std::size_t row, std::size_t col) {
+                row = std::min(row, rowEnd - 1);
+                col = std::min(col, colEnd - 1);
+                return static_cast<float>(window[(row - rowBegin) * windowWidth + (col - colBegin)]);
+            };
+            for(auto it = first; it != last; ++it) {
+                if(!bilinear) {
+                    values[it->pointIx] = at(it->row, it->col);
+                    continue;
+                }
+                const float south = at(it->row, it->col) + (at(it->row, it->col + 1) - at(it->row, it->col)) * it->fracCol;
+                const float north = at(it->row + 1, it->col) + (at(it->row + 1, it->col + 1) - at(it->row + 1, it->col)) * it->fracCol;
+                values[it->pointIx] = south + (north - south) * it->fracRow;
+            }
+        }
+    });
+    return values;
+}
+
+struct PointEnrichmentOptions {
+    PointSampling sampling = PointSampling::Nearest;
+    std::string latColumn = "lat";
+    std::string lonColumn = "lon";
+    std::string outputColumn = "elevation";
+    char delimiter = ',';
+    std::size_t batchPoints = std::size_t{1} << 22; // points sorted and sampled together
+};
+
+// Fields of one CSV line; delimiters inside double quotes don't split, quotes are kept
+inline void splitCsvLine(const std::string& line, char delimiter, std::vector<std::string>& fields) {
+    fields.clear();
+    fields.emplace_back();
+    bool quoted = false;
+    for(const char c : line) {
+        if(c == '"') {
+            quoted = !quoted;
+        }
+        if(c == delimiter && !quoted) {
+            fields.emplace_back();
+        } else {
+            fields.back() += c;
+        }
+    }
+}
+
+// Copies a CSV file with a header line and appends the elevation at each record's lat/lon columns, in the
+// original record order; empty where the coordinates don't parse. Returns the number of records.
+inline std::size_t enrich_csv(const NcFile& ncFile, const std::string& inputCsv, const std::string& outputCsv, ThreadPool& pool,
+                              const PointEnrichmentOptions& options = {}) {
+    std::ifstream ifs(inputCsv);
+    if(!ifs.is_open()) {
+        throw std::runtime_error("couldn't open " + inputCsv);
+    }
+    std::ofstream ofs(outputCsv);
+    if(!ofs.is_open()) {
+        throw std::runtime_error("couldn't open " + outputCsv);
+    }
+    std::string header;
+    if(!std::getline(ifs, header)) {
+        throw std::runtime_error("enrich_csv: empty file: " + inputCsv);
+    }
+    if(!header.empty() && header.back() == '\r') {
+        header.pop_back();
+    }
+    std::vector<std::string> fields;
+    splitCsvLine(header, options.delimiter, fields);
+    auto column = [&](const std::string& name) {
+        const auto it = std::find(fields.begin(), fields.end(), name);
+        if(it == fields.end()) {
+            throw std::runtime_error("enrich_csv: no column " + name + " in " + inputCsv);
+        }
+        return static_cast<std::size_t>(it - fields.begin());
+    };
+    const auto latColumn = column(options.latColumn);
+    const auto lonColumn = column(options.lonColumn);
+    ofs << header << options.delimiter << options.outputColumn << '\n';
+
+    auto parse = [](const std::string& field) {
+        const char* begin = field.c_str() + (field.size() > 1 && field.front() == '"');
+        char* end = nullptr;
+        const double value = std::strtod(begin, &end);
+        return end == begin ? std::numeric_limits<double>::quiet_NaN() : value;
+    };
+    std::size_t records = 0;
+    std::vector<std::string> lines;
+    std::vector<GPS> points;
+    std::string line;
+    bool more = true;
+    while(more) {
+        lines.clear();
+        points.clear();
+        while(lines.size() < options.batchPoints && (more = static_cast<bool>(std::getline(ifs, line)))) {
+            if(!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            splitCsvLine(line, options.delimiter, fields);
+            const auto nan = std::numeric_limits<double>::quiet_NaN();
+            points.push_back(GPS{{latColumn < fields.size() ? parse(fields[latColumn]) : nan,
+                                  lonColumn < fields.size() ? parse(fields[lonColumn]) : nan}});
+            lines.push_back(std::move(line));
+        }
+        const auto values = sample_points(ncFile, points, pool, options.sampling);
+        for(std::size_t ix = 0; ix < lines.size(); ++ix) {
+            ofs << lines[ix] << options.delimiter;
+            if(!std::isnan(values[ix])) {
+                ofs << values[ix];
+            }
+            ofs << '\n';
+        }
+        records += lines.size();
+    }
+    if(!ofs) {
+        throw std::runtime_error("write failed: " + outputCsv);
+    }
+    return records;
+}
+
+#endif //NETCDF_DANI_POINT_ENRICHMENT_H
@@ -0,0 +1,210 @@
+#ifndef NETCDF_DANI_RENDER_KERNEL_H
+#define NETCDF_DANI_RENDER_KERNEL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Heights to pixels. Every combination of pixel format, colormap type, overlay and row order is its own
+// instantiation of one row loop, so the inner loops carry no per-pixel mode checks; render_heights()
+// picks the instantiation once per image and spreads the rows over the pool.
+
+enum class PixelFormat {
+    Gray8,  // the red channel of the colormap, pair with a gray colormap
+    Rgb888, // bytes r, g, b
+    Argb32, // native 0xAARRGGBB words, opaque, like QImage::Format_ARGB32
+};
+
+enum class PixelOverlay {
+    None,
+    Edges, // brightens the red channel by the larger height step to the east or north neighbor
+    Shade, // scales all channels by a precomputed hillshade
+};
+
+struct RenderOptions {
+    PixelFormat format = PixelFormat::Rgb888;
+    PixelOverlay overlay = PixelOverlay::None;
+    bool flipRows = false; // heights south to north, the image north to south
+    int edgeGain = 10;
+    const int16_t* shade = nullptr; // PixelOverlay::Shade: same layout as the heights
+    int flatShade = 180;            // shade value that keeps the color unchanged
+};
+
+struct PixelRgb {
+    uint8_t r{};
+    uint8_t g{};
+    uint8_t b{};
+};
+
+// Any int16 colormap as a lookup table, built once per parameter set
+class ColorTable {
+public:
+    ColorTable() = default;
+
+    // colormap(int16_t) returns 3 bytes r, g, b, e.g. heightToBandedRgb with bound parameters
+    template<typename F>
+    static ColorTable build(F&& colormap, ThreadPool* pool = nullptr) {
+        ColorTable table;
+        table._colors.resize(1 << 16);
+        auto fill = [&](std::size_t begin, std::size_t end) {
+            for(std::size_t ix = begin; ix < end; ++ix) {
+                const auto rgb = colormap(static_cast<int16_t>(static_cast<int>(ix) - 32768));
+                table._colors[ix] = PixelRgb{rgb[0], rgb[1], rgb[2]};
+            }
+        };
+        if(pool) {
+            pool->parallelFor(table._colors.size(), 4096, fill);
+        } else {
+            fill(0, table._colors.size());
+        }
+        return table;
+    }
+
+    bool empty() const { return _colors.empty(); }
+    PixelRgb operator()(int16_t height) const { return _colors[static_cast<std::size_t>(height + 32768)]; }
+
+private:
+    std::vector<PixelRgb> _colors;
+};
+
+// heightToGray without a table
+struct GrayRamp {
+    int16_t min = -12000;
+    int16_t max = 9000;
+
+    PixelRgb operator()(int16_t height) const {
+        // like heightToGray: t is clamped rather than the height, so min > max inverts the ramp, and a
+        // zero-width ramp is a step at min
+        double t = max == min ? (height > min ? 1.0 : 0.0) : static_cast<double>(height - min) / (max - min);
+        t = std::clamp(t, 0.0, 1.0);
+        const auto gray = static_cast<uint8_t>(0.5 + t * 255);
+        return PixelRgb{gray, gray, gray};
+    }
+};
+
+namespace render_detail {
+
+template<PixelFormat Format>
+inline void putPixel(uint8_t* dst, std::size_t x, PixelRgb color) {
+    if constexpr(Format == PixelFormat::Gray8) {
+        dst[x] = color.r;
+    } else if constexpr(Format == PixelFormat::Rgb888) {
+        dst[3 * x] = color.r;
+        dst[3 * x + 1] = color.g;
+        dst[3 * x + 2] = color.b;
+    } else {
+        const uint32_t word = 0xff000000u | (uint32_t{color.r} << 16) | (uint32_t{color.g} << 8) | color.b;
+        std::memcpy(dst + 4 * x, &word, sizeof(word));
+    }
+}
+
+// One image row; north is the source row north of src, null where the edge overlay has no neighbor
+template<PixelFormat Format, PixelOverlay Overlay, typename Colormap>
+inline void renderRow(const int16_t* src, const int16_t* north, const int16_t* shade, std::size_t width,
+                      const Colormap& colormap, const RenderOptions& options, uint8_t* dst) {
+    if constexpr(Overlay == PixelOverlay::Edges) {
+        if(!north || width < 3) {
+            renderRow<Format, PixelOverlay::None>(src, nullptr, nullptr, width, colormap, options, dst);
+            return;
+        }
+        putPixel<Format>(dst, 0, colormap(src[0]));
+        const int gain = options.edgeGain;
+        for(std::size_t x = 1; x + 1 < width; ++x) {
+            auto color = colormap(src[x]);
+            const int delta = std::max(std::abs(src[x + 1] - src[x]), std::abs(north[x] - src[x]));
+            color.r = static_cast<uint8_t>(std::min(255, color.r + delta * gain));
+            putPixel<Format>(dst, x, color);
+        }
+        putPixel<Format>(dst, width - 1, colormap(src[width - 1]));
+    } else if constexpr(Overlay == PixelOverlay::Shade) {
+        const int flat = options.flatShade;
+        for(std::size_t x = 0; x < width; ++x) {
+            auto color = colormap(src[x]);
+            const int s = shade[x];
+            color.r = static_cast<uint8_t>(std::min(255, color.r * s / flat));
+            color.g = static_cast<uint8_t>(std::min(255, color.g * s / flat));
+            color.b = static_cast<uint8_t>(std::min(255, color.b * s / flat));
+            putPixel<Format>(dst, x, color);
+        }
+    } else {
+        for(std::size_t x = 0; x < width; ++x) {
+            putPixel<Format>(dst, x, colormap(src[x]));
+        }
+    }
+}
+
+template<PixelFormat Format, PixelOverlay Overlay, bool FlipRows, typename Colormap>
+inline void render(const int16_t* heights, std::size_t width, std::size_t height, const Colormap& colormap,
+                   const RenderOptions& options, uint8_t* dst, std::size_t dstStride, ThreadPool* pool) {
+    auto renderRows = [&](std::size_t begin, std::size_t end) {
+        for(std::size_t y = begin; y < end; ++y) {
+            const auto srcRow = FlipRows ? height - 1 - y : y;
+            // like the viewer's edge pass: no overlay on the outermost rows and columns
+            const bool interior = srcRow > 0 && srcRow + 1 < height;
+            const int16_t* src = heights + srcRow * width;
+            renderRow<Format, Overlay>(src, interior ? src + width : nullptr,
+                                       options.shade ? options.shade + srcRow * width : nullptr,
+                                       width, colormap, options, dst + y * dstStride);
+        }
+    };
+    if(pool) {
+        pool->parallelFor(height, 16, renderRows);
+    } else {
+        renderRows(0, height);
+    }
+}
+
+template<PixelFormat Format, PixelOverlay Overlay, typename Colormap>
+inline void dispatchRows(const int16_t* heights, std::size_t width, std::size_t height, const Colormap& colormap,
+                         const RenderOptions& options, uint8_t* dst, std::size_t dstStride, ThreadPool* pool) {
+    if(options.flipRows) {
+        render<Format, Overlay, true>(heights, width, height, colormap, options, dst, dstStride, pool);
+    } else {
+        render<Format, Overlay, false>(heights, width, height, colormap, options, dst, dstStride, pool);
+    }
+}
+
+template<PixelFormat Format, typename Colormap>
+inline void dispatchOverlay(const int16_t* heights, std::size_t width, std::size_t height, const Colormap& colormap,
+                            const RenderOptions& options, uint8_t* dst, std::size_t dstStride, ThreadPool* pool) {
+    // shading without a shade raster renders plain
+    const auto overlay = options.overlay == PixelOverlay::Shade && !options.shade ? PixelOverlay::None : options.overlay;
+    switch(overlay) {
+        case PixelOverlay::None:
+            dispatchRows<Format, PixelOverlay::None>(heights, width, height, colormap, options, dst, dstStride, pool);
+            break;
+        case PixelOverlay::Edges:
+            dispatchRows<Format, PixelOverlay::Edges>(heights, width, height, colormap, options, dst, dstStride, pool);
+            break;
+        case PixelOverlay::Shade:
+            dispatchRows<Format, PixelOverlay::Shade>(heights, width, height, colormap, options, dst, dstStride, pool);
+            break;
+    }
+}
+
+} // namespace render_detail
+
+// Renders width x height heights into dst (dstStride bytes per row). Colormap: ColorTable, GrayRamp or any
+// type with PixelRgb operator()(int16_t) const. The pool must not be the caller's own.
+template<typename Colormap>
+inline void render_heights(const int16_t* heights, std::size_t width, std::size_t height, const Colormap& colormap,
+                           const RenderOptions& options, uint8_t* dst, std::size_t dstStride, ThreadPool* pool = nullptr) {
+    using namespace render_detail;
+    switch(options.format) {
+        case PixelFormat::Gray8:
+            dispatchOverlay<PixelFormat::Gray8>(heights, width, height, colormap, options, dst, dstStride, pool);
+            break;
+        case PixelFormat::Rgb888:
+            dispatchOverlay<PixelFormat::Rgb888>(heights, width, height, colormap, options, dst, dstStride, pool);
+            break;
+        case PixelFormat::Argb32:
+            dispatchOverlay<PixelFormat::Argb32>(heights, width, height, colormap, options, dst, dstStride, pool);
+            break;
+    }
+}
+
+#endif //NETCDF_DANI_RENDER_KERNEL_H
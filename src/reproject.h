@@ -0,0 +1,115 @@
+#ifndef NETCDF_DANI_REPROJECT_H
+#define NETCDF_DANI_REPROJECT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "LruCache.h"
+#include "gps.h"
+
+// Reprojection of the plate carrée grid to Web Mercator (EPSG:3857).
+//
+// Mercator is separable: an output row has a single latitude and an output column a single longitude.
+// So a raster is reprojected through two lookup tables, the fractional grid row of every output row and
+// the grid column of every output column, computed once per raster (or per tile row/column, cached).
+// Every output pixel is then an indexed bilinear gather (see resample_bilinear with ResampleAxis),
+// with no trigonometry per pixel.
+
+namespace webMercator {
+
+constexpr double earthRadius = 6378137.0;
+constexpr double pi = 3.14159265358979323846;
+// latitude where the square world map ends, y = +-pi * earthRadius
+constexpr double maxLatitude = 85.051128779806592;
+constexpr double worldSize = 2.0 * pi * earthRadius;
+
+inline double xFromLon(double lon) { return earthRadius * lon * pi / 180.0; }
+inline double lonFromX(double x) { return x / earthRadius * 180.0 / pi; }
+
+inline double yFromLat(double lat) {
+    lat = std::clamp(lat, -maxLatitude, maxLatitude);
+    return earthRadius * std::log(std::tan(pi / 4.0 + lat * pi / 360.0));
+}
+
+inline double latFromY(double y) { return (2.0 * std::atan(std::exp(y / earthRadius)) - pi / 2.0) * 180.0 / pi; }
+
+} // namespace webMercator
+
+// Fractional grid sample coordinates (cell centers at integers) for latitudes/longitudes
+inline double gridRowForLat(const GpsToOffsetConverter& converter, double lat) { return converter.latOffset(lat) - 0.5; }
+inline double gridColForLon(const GpsToOffsetConverter& converter, double lon) { return converter.lonOffset(lon) - 0.5; }
+
+// Grid row of each of nRows output rows spaced pixelSize meters apart, row 0 centered half a pixel below
+// Mercator y = yTop (north to south); pixelSize < 0 runs south to north from yTop.
+inline std::vector<double> mercatorRowMap(const GpsToOffsetConverter& converter, double yTop, double pixelSize, std::size_t nRows) {
+    std::vector<double> rows(nRows);
+    for(std::size_t ix = 0; ix < nRows; ++ix) {
+        const double y = yTop - (static_cast<double>(ix) + 0.5) * pixelSize;
+        rows[ix] = gridRowForLat(converter, webMercator::latFromY(y));
+    }
+    return rows;
+}
+
+// Grid column of each of nCols output columns spaced pixelSize meters apart from Mercator x = xLeft
+inline std::vector<double> mercatorColMap(const GpsToOffsetConverter& converter, double xLeft, double pixelSize, std::size_t nCols) {
+    std::vector<double> cols(nCols);
+    for(std::size_t ix = 0; ix < nCols; ++ix) {
+        const double x = xLeft + (static_cast<double>(ix) + 0.5) * pixelSize;
+        cols[ix] = gridColForLon(converter, webMercator::lonFromX(x));
+    }
+    return cols;
+}
+
+// Lookup tables of standard XYZ tiles: zoom z has 2^z x 2^z tiles, tile (0, 0) is the north-west corner.
+// A tile's rows only depend on (z, y) and its columns on (z, x), so neighbors share the tables.
+class MercatorTileMaps {
+public:
+    using Map = std::shared_ptr<const std::vector<double>>;
+
+    MercatorTileMaps(const GpsToOffsetConverter& converter, std::size_t tileSize, std::size_t cachedMaps = 4096)
+            : _converter(converter), _tileSize(tileSize), _rows(cachedMaps), _cols(cachedMaps) {}
+
+    std::size_t tileSize() const { return _tileSize; }
+    static std::size_t tilesPerSide(int z) { return std::size_t{1} << z; }
+
+    double pixelSize(int z) const { return webMercator::worldSize / static_cast<double>(tilesPerSide(z) * _tileSize); }
+
+    // Grid row of each tile row, north to south
+    Map rows(int z, uint32_t tileY) {
+        return _get(_rows, z, tileY, [&]() {
+            const double yTop = webMercator::worldSize / 2.0 - static_cast<double>(tileY) * _tileSize * pixelSize(z);
+            return mercatorRowMap(_converter, yTop, pixelSize(z), _tileSize);
+        });
+    }
+
+    // Grid column of each tile column, west to east
+    Map cols(int z, uint32_t tileX) {
+        return _get(_cols, z, tileX, [&]() {
+            const double xLeft = -webMercator::worldSize / 2.0 + static_cast<double>(tileX) * _tileSize * pixelSize(z);
+            return mercatorColMap(_converter, xLeft, pixelSize(z), _tileSize);
+        });
+    }
+
+private:
+    template<typename F>
+    static Map _get(LruCache<uint64_t, Map>& cache, int z, uint32_t ix, F&& compute) {
+        const uint64_t key = (static_cast<uint64_t>(z) << 32) | ix;
+        if(auto map = cache.get(key)) {
+            return *map;
+        }
+        auto map = std::make_shared<const std::vector<double>>(compute());
+        cache.put(key, map);
+        return map;
+    }
+
+private:
+    GpsToOffsetConverter _converter;
+    std::size_t _tileSize{};
+    LruCache<uint64_t, Map> _rows;
+    LruCache<uint64_t, Map> _cols;
+};
+
+#endif //NETCDF_DANI_REPROJECT_H
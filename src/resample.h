@@ -0,0 +1,103 @@
+#ifndef NETCDF_DANI_RESAMPLE_H
+#define NETCDF_DANI_RESAMPLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "instrumentation.h"
+
+// Bilinear resampling of int16 rasters in 8-bit fixed point.
+//
+// Output pixel (x, y) samples the source at (srcX0 + x * stepX, srcY0 + y * stepY), or at per-row/per-column
+// coordinates from lookup tables for reprojection; coordinates are clamped to the source. The work is split
+// into a vertical pass producing one contiguous interpolated source row and a horizontal pass over
+// precomputed column indices/weights; both inner loops are plain integer multiply-adds the compiler
+// vectorizes, and output rows are spread over the pool.
+
+struct ResampleAxis {
+    std::vector<int32_t> index;  // left/lower source sample
+    std::vector<int32_t> weight; // weight of index + 1, 0..256
+
+    ResampleAxis(std::size_t n, double src0, double step, std::size_t srcSize) : index(n), weight(n) {
+        for(std::size_t ix = 0; ix < n; ++ix) {
+            _set(ix, src0 + static_cast<double>(ix) * step, srcSize);
+        }
+    }
+
+    // Arbitrary (e.g. reprojected) source coordinates: output pixel ix samples (coords[ix] - origin) / scale
+    ResampleAxis(const double* coords, std::size_t n, double origin, double scale, std::size_t srcSize) : index(n), weight(n) {
+        for(std::size_t ix = 0; ix < n; ++ix) {
+            _set(ix, (coords[ix] - origin) / scale, srcSize);
+        }
+    }
+
+private:
+    void _set(std::size_t ix, double coord, std::size_t srcSize) {
+        const int32_t maxLower = srcSize >= 2 ? static_cast<int32_t>(srcSize - 2) : 0;
+        coord = std::clamp(coord, 0.0, static_cast<double>(srcSize - 1));
+        auto lower = std::min(static_cast<int32_t>(coord), maxLower);
+        index[ix] = lower;
+        weight[ix] = static_cast<int32_t>(std::lround((coord - lower) * 256.0));
+    }
+};
+
+// Output pixel (x, y) samples the source at column xAxis[x] and row yAxis[y]; the axes decide the output size
+inline void resample_bilinear(const int16_t* src, std::size_t srcWidth, std::size_t srcHeight,
+                              const ResampleAxis& xAxis, const ResampleAxis& yAxis, int16_t* dst, ThreadPool* pool = nullptr) {
+    const std::size_t dstWidth = xAxis.index.size();
+    const std::size_t dstHeight = yAxis.index.size();
+    if(srcWidth == 0 || srcHeight == 0 || dstWidth == 0 || dstHeight == 0) {
+        return;
+    }
+    // only the source columns actually referenced go through the vertical pass
+    const std::size_t colBegin = *std::min_element(xAxis.index.begin(), xAxis.index.end());
+    const std::size_t colEnd = std::min(srcWidth, static_cast<std::size_t>(*std::max_element(xAxis.index.begin(), xAxis.index.end())) + 2);
+
+    auto resampleRows = [&](std::size_t yBegin, std::size_t yEnd) {
+        NCD_TRACE_SCOPE("resample");
+        std::vector<int32_t> verticalRow(srcWidth + 1);
+        for(std::size_t y = yBegin; y < yEnd; ++y) {
+            const auto sy = static_cast<std::size_t>(yAxis.index[y]);
+            const int32_t wy = yAxis.weight[y];
+            const int16_t* row0 = src + sy * srcWidth;
+            const int16_t* row1 = src + std::min(sy + 1, srcHeight - 1) * srcWidth;
+            int32_t* vr = verticalRow.data();
+            for(std::size_t x = colBegin; x < colEnd; ++x) {
+                vr[x] = row0[x] * (256 - wy) + row1[x] * wy;
+            }
+            vr[colEnd] = vr[colEnd - 1];
+
+            int16_t* out = dst + y * dstWidth;
+            const int32_t* xIndex = xAxis.index.data();
+            const int32_t* xWeight = xAxis.weight.data();
+            for(std::size_t x = 0; x < dstWidth; ++x) {
+                const int32_t a = vr[xIndex[x]];
+                const int32_t b = vr[xIndex[x] + 1];
+                const int32_t value = a * (256 - xWeight[x]) + b * xWeight[x];
+                // 16 fractional bits, rounded to nearest (arithmetic shift floors negative values)
+                out[x] = static_cast<int16_t>((value + (1 << 15)) >> 16);
+            }
+        }
+    };
+
+    if(pool) {
+        pool->parallelFor(dstHeight, 16, resampleRows);
+    } else {
+        resampleRows(0, dstHeight);
+    }
+}
+
+inline void resample_bilinear(const int16_t* src, std::size_t srcWidth, std::size_t srcHeight,
+                              double srcX0, double srcY0, double stepX, double stepY,
+                              int16_t* dst, std::size_t dstWidth, std::size_t dstHeight, ThreadPool* pool = nullptr) {
+    if(srcWidth == 0 || srcHeight == 0 || dstWidth == 0 || dstHeight == 0) {
+        return;
+    }
+    resample_bilinear(src, srcWidth, srcHeight, ResampleAxis(dstWidth, srcX0, stepX, srcWidth),
+                      ResampleAxis(dstHeight, srcY0, stepY, srcHeight), dst, pool);
+}
+
+#endif //NETCDF_DANI_RESAMPLE_H
@@ -0,0 +1,270 @@
+#ifndef NETCDF_DANI_TERRAIN_DERIVATIVES_H
+#define NETCDF_DANI_TERRAIN_DERIVATIVES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "RowBlockReader.h"
+#include "ThreadPool.h"
+#include "TileStore.h"
+#include "gps.h"
+#include "instrumentation.h"
+
+// Slope, aspect and multi-directional hillshade of the elevation grid.
+//
+// Gradients use Horn's 3x3 operator with latitude-correct cell sizes: a cell is the same height in
+// meters everywhere, its width shrinks with cos(latitude). The hillshade blends four light azimuths
+// (225, 270, 315 and 360 degrees) weighted by how square each one hits the aspect, so no slope
+// direction is lost in shadow. Everything per pixel is computed from the gradient with multiply-adds,
+// square roots and selects, which the compiler vectorizes; only slope and aspect need atan.
+//
+// Stored quantized in int16 tile stores (TileStoreLayout::scale): slope in 0.01 degrees, aspect in
+// 0.1 degrees clockwise from north, -1 for flat cells, hillshade 0..255.
+
+struct TerrainDerivativeOptions {
+    double zenithDegrees = 45.0;
+    double zFactor = 1.0; // vertical exaggeration
+    std::size_t tileSize = 256;
+};
+
+// Geometry of a lat/lon raster: row 0 is the southernmost row
+struct TerrainGrid {
+    std::size_t width{};
+    std::size_t height{};
+    double cellsPerDegree{};
+    double southLat = -90.0;
+    bool wrapColumns = true; // the columns go around the globe
+
+    static TerrainGrid global(std::size_t width, std::size_t height) {
+        return TerrainGrid{width, height, static_cast<double>(width) / 360.0, -90.0, true};
+    }
+
+    double rowLat(std::size_t row) const { return southLat + (static_cast<double>(row) + 0.5) / cellsPerDegree; }
+};
+
+constexpr double terrainSlopeScale = 0.01;
+constexpr double terrainAspectScale = 0.1;
+constexpr int16_t terrainAspectFlat = -10;
+// hillshade of flat ground at the default 45 degree zenith
+constexpr int terrainFlatShade = 180;
+
+// Products of one row from the rows south and north of it (the row itself at the grid's edges).
+// Any of slope, aspect and hillshade may be null.
+inline void derive_terrain_row(const int16_t* south, const int16_t* row, const int16_t* north, std::size_t width,
+                               double dxMeters, double dyMeters, bool wrapColumns, const TerrainDerivativeOptions& options,
+                               int16_t* slope, int16_t* aspect, int16_t* hillshade) {
+    thread_local std::vector<float> gxRow;
+    thread_local std::vector<float> gyRow;
+    gxRow.resize(width);
+    gyRow.resize(width);
+    float* gx = gxRow.data();
+    float* gy = gyRow.data();
+    const float invDx8 = static_cast<float>(options.zFactor / (8.0 * dxMeters));
+    const float invDy8 = static_cast<float>(options.zFactor / (8.0 * dyMeters));
+
+    auto horn = [&](std::size_t x, std::size_t west, std::size_t east) {
+        const int32_t dzdx = (north[east] + 2 * row[east] + south[east]) - (north[west] + 2 * row[west] + south[west]);
+        const int32_t dzdy = (north[west] + 2 * north[x] + north[east]) - (south[west] + 2 * south[x] + south[east]);
+        gx[x] = static_cast<float>(dzdx) * invDx8;
+        gy[x] = static_cast<float>(dzdy) * invDy8;
+    };
+    for(std::size_t x = 1; x + 1 < width; ++x) {
+        horn(x, x - 1, x + 1);
+    }
+    if(width >= 2) {
+        horn(0, wrapColumns ? width - 1 : 0, 1);
+        horn(width - 1, width - 2, wrapColumns ? 0 : width - 1);
+    } else if(width == 1) {
+        horn(0, 0, 0);
+    }
+
+    if(hillshade) {
+        constexpr float halfSqrt2 = 0.70710678f;
+        const float cosZ = static_cast<float>(std::cos(options.zenithDegrees * 3.14159265358979323846 / 180.0));
+        const float sinZ = static_cast<float>(std::sin(options.zenithDegrees * 3.14159265358979323846 / 180.0));
+        for(std::size_t x = 0; x < width; ++x) {
+            const float p = gx[x];
+            const float q = gy[x];
+            const float g2 = p * p + q * q;
+            const float invNorm = 1.0f / std::sqrt(1.0f + g2);
+            const float invG2 = g2 > 0.0f ? 1.0f / g2 : 0.0f;
+            // p * sin(azimuth) + q * cos(azimuth) for 225, 270, 315 and 360 degrees
+            const float t[4] = {-halfSqrt2 * (p + q), -p, halfSqrt2 * (q - p), q};
+            float shade = 0.0f;
+            for(float tk : t) {
+                // sin^2(aspect - azimuth), or an even split on flat ground; the four weights sum to 2
+                const float weight = g2 > 0.0f ? 1.0f - tk * tk * invG2 : 0.5f;
+                shade += weight * std::max(0.0f, (cosZ - sinZ * tk) * invNorm);
+            }
+            hillshade[x] = static_cast<int16_t>(std::min(255.0f, 127.5f * shade + 0.5f));
+        }
+    }
+    if(slope || aspect) {
+        constexpr double toDegrees = 180.0 / 3.14159265358979323846;
+        for(std::size_t x = 0; x < width; ++x) {
+            const double p = gx[x];
+            const double q = gy[x];
+            if(slope) {
+                slope[x] = static_cast<int16_t>(std::lround(std::atan(std::sqrt(p * p + q * q)) * toDegrees / terrainSlopeScale));
+            }
+            if(aspect) {
+                // downslope direction, clockwise from north
+                double degrees = std::atan2(-p, -q) * toDegrees;
+                degrees = degrees < 0.0 ? degrees + 360.0 : degrees;
+                aspect[x] = (p == 0.0 && q == 0.0) ? terrainAspectFlat
+                                                   : static_cast<int16_t>(std::lround(degrees / terrainAspectScale) % 3600);
+            }
+        }
+    }
+}
+
+// Products of rows [firstRow, firstRow + nRows). heights holds the grid rows [heightsFirstRow,
+// heightsFirstRow + heightsRows), which must include the one-row halo on each side where the grid has it.
+inline void derive_terrain_rows(const int16_t* heights, std::size_t heightsFirstRow, std::size_t heightsRows,
+                                std::size_t firstRow, std::size_t nRows, const TerrainGrid& grid,
+                                const TerrainDerivativeOptions& options, int16_t* slope, int16_t* aspect, int16_t* hillshade) {
+    NCD_TRACE_SCOPE("terrain_derive");
+    NCD_COUNT(PixelsShaded, nRows * grid.width);
+    const double dyMeters = metersPerDegreeLat() / grid.cellsPerDegree;
+    auto heightsRow = [&](std::size_t row) {
+        row = std::clamp(row, heightsFirstRow, heightsFirstRow + heightsRows - 1);
+        return heights + (row - heightsFirstRow) * grid.width;
+    };
+    for(std::size_t y = 0; y < nRows; ++y) {
+        const auto row = firstRow + y;
+        // never 0, the row centers stay half a cell away from the poles
+        const double dxMeters = metersPerDegreeLon(grid.rowLat(row)) / grid.cellsPerDegree;
+        const auto offset = y * grid.width;
+        derive_terrain_row(heightsRow(row == 0 ? 0 : row - 1), heightsRow(row), heightsRow(std::min(row + 1, grid.height - 1)),
+                           grid.width, dxMeters, dyMeters, grid.wrapColumns, options,
+                           slope ? slope + offset : nullptr, aspect ? aspect + offset : nullptr, hillshade ? hillshade + offset : nullptr);
+    }
+}
+
+// Hillshade of a whole in-memory raster, e.g. the viewer's overview
+inline std::vector<int16_t> hillshade_raster(const int16_t* heights, const TerrainGrid& grid, ThreadPool* pool = nullptr,
+                                             const TerrainDerivativeOptions& options = {}) {
+    std::vector<int16_t> shade(grid.width * grid.height);
+    auto deriveRows = [&](std::size_t begin, std::size_t end) {
+        derive_terrain_rows(heights, 0, grid.height, begin, end - begin, grid, options, nullptr, nullptr, shade.data() + begin * grid.width);
+    };
+    if(pool) {
+        pool->parallelFor(grid.height, 16, deriveRows);
+    } else {
+        deriveRows(0, grid.height);
+    }
+    return shade;
+}
+
+// Where the viewer looks for the full-resolution hillshade of a NetCDF file
+inline std::string hillshadePath(const std::string& ncFilename) { return ncFilename + ".hillshade.tiles"; }
+
+// Output tile stores, an empty name skips the product
+struct TerrainProductFiles {
+    std::string slope;
+    std::string aspect;
+    std::string hillshade;
+};
+
+// Streams the grid in bands of tileSize rows plus a one-row halo on each side, derives the products
+// of each band and encodes its tiles on the pool, at most maxBandsInFlight bands at a time, and
+// writes each product as its own tile store. Bands are handed out to whichever worker is free.
+inline void compute_terrain_derivatives(const NcFile& ncFile, const TerrainProductFiles& files, ThreadPool& pool,
+                                        const TerrainDerivativeOptions& options = {}, std::size_t maxBandsInFlight = 0) {
+    RowBlockReader reader(ncFile);
+    const auto grid = TerrainGrid::global(reader.width(), reader.height());
+    const auto tileSize = options.tileSize;
+
+    struct Product {
+        std::unique_ptr<TileStoreWriter> writer;
+        int kind{}; // 0 slope, 1 aspect, 2 hillshade
+    };
+    std::vector<Product> products;
+    const std::pair<const std::string*, double> outputs[3] = {
+            {&files.slope, terrainSlopeScale}, {&files.aspect, terrainAspectScale}, {&files.hillshade, 1.0}};
+    for(int kind = 0; kind < 3; ++kind) {
+        if(outputs[kind].first->empty()) {
+            continue;
+        }
+        TileStoreLayout layout;
+        layout.width = grid.width;
+        layout.height = grid.height;
+        layout.tileSize = tileSize;
+        layout.scale = outputs[kind].second;
+        products.push_back(Product{std::make_unique<TileStoreWriter>(*outputs[kind].first, layout), kind});
+    }
+    if(products.empty()) {
+        return;
+    }
+    const auto& layout = products.front().writer->layout();
+    if(maxBandsInFlight == 0) {
+        maxBandsInFlight = pool.size() + 1;
+    }
+
+    // encoded[productIx][tileX]
+    using EncodedBand = std::vector<std::vector<std::vector<uint8_t>>>;
+    auto processBand = [&](std::size_t tileY) {
+        const auto firstRow = tileY * tileSize;
+        const auto nRows = layout.tileHeight(tileY);
+        const auto haloFirstRow = firstRow == 0 ? 0 : firstRow - 1;
+        const auto block = reader.read(haloFirstRow, firstRow + nRows + 1 - haloFirstRow);
+
+        std::vector<std::vector<int16_t>> bands(3);
+        for(const auto& product : products) {
+            bands[product.kind].resize(nRows * grid.width);
+        }
+        auto bandData = [&bands](int kind) { return bands[kind].empty() ? nullptr : bands[kind].data(); };
+        derive_terrain_rows(block.data.data(), block.firstRow, block.nRows, firstRow, nRows, grid, options,
+                            bandData(0), bandData(1), bandData(2));
+
+        EncodedBand encoded(products.size(), std::vector<std::vector<uint8_t>>(layout.tilesAcross()));
+        std::vector<int16_t> tile(tileSize * tileSize);
+        for(std::size_t productIx = 0; productIx < products.size(); ++productIx) {
+            const auto& band = bands[products[productIx].kind];
+            for(std::size_t tileX = 0; tileX < layout.tilesAcross(); ++tileX) {
+                const auto colBegin = tileX * tileSize;
+                const auto nCols = layout.tileWidth(tileX);
+                for(std::size_t y = 0; y < nRows; ++y) {
+                    const int16_t* src = band.data() + y * grid.width + colBegin;
+                    std::copy(src, src + nCols, tile.data() + y * nCols);
+                }
+                encoded[productIx][tileX] = products[productIx].writer->encodeTile(tileX, tileY, tile.data());
+            }
+        }
+        return encoded;
+    };
+
+    std::deque<std::future<EncodedBand>> inFlight;
+    std::size_t nextBand = 0;
+    try {
+        for(std::size_t tileY = 0; tileY < layout.tilesDown(); ++tileY) {
+            while(nextBand < layout.tilesDown() && inFlight.size() < maxBandsInFlight) {
+                inFlight.push_back(pool.submit([&processBand, bandIx = nextBand++]() { return processBand(bandIx); }));
+            }
+            auto encoded = inFlight.front().get();
+            inFlight.pop_front();
+            for(std::size_t productIx = 0; productIx < products.size(); ++productIx) {
+                for(std::size_t tileX = 0; tileX < layout.tilesAcross(); ++tileX) {
+                    products[productIx].writer->writeTile(tileX, tileY, encoded[productIx][tileX]);
+                }
+            }
+        }
+    } catch(...) {
+        // the queued bands reference this frame
+        for(auto& band : inFlight) {
+            band.wait();
+        }
+        throw;
+    }
+    for(auto& product : products) {
+        product.writer->finish();
+    }
+}
+
+#endif //NETCDF_DANI_TERRAIN_DERIVATIVES_H